@@ -45,6 +45,7 @@ const char *gengetopt_args_info_help[] = {
   "  -c, --cert-pem=filename       HTTPS/DTLS certificate",
   "  -k, --cert-key=filename       HTTPS/DTLS certificate key",
   "  -S, --stun-server=filename    STUN server(:port) to use, if needed (e.g., \n                                  gateway behind NAT, default=none)",
+  "  -d, --debug-level=0-7         Debug/logging level (0=disable debugging, \n                                  7=maximum debug level; default=4)",
     0
 };
 
@@ -83,6 +84,7 @@ void clear_given (struct gengetopt_args_info *args_info)
   args_info->cert_pem_given = 0 ;
   args_info->cert_key_given = 0 ;
   args_info->stun_server_given = 0 ;
+  args_info->debug_level_given = 0 ;
 }
 
 static
@@ -108,6 +110,7 @@ void clear_args (struct gengetopt_args_info *args_info)
   args_info->cert_key_orig = NULL;
   args_info->stun_server_arg = NULL;
   args_info->stun_server_orig = NULL;
+  args_info->debug_level_orig = NULL;
   
 }
 
@@ -129,6 +132,7 @@ void init_args_info(struct gengetopt_args_info *args_info)
   args_info->cert_pem_help = gengetopt_args_info_help[10] ;
   args_info->cert_key_help = gengetopt_args_info_help[11] ;
   args_info->stun_server_help = gengetopt_args_info_help[12] ;
+  args_info->debug_level_help = gengetopt_args_info_help[13] ;
   
 }
 
@@ -227,6 +231,7 @@ cmdline_parser_release (struct gengetopt_args_info *args_info)
   free_string_field (&(args_info->cert_key_orig));
   free_string_field (&(args_info->stun_server_arg));
   free_string_field (&(args_info->stun_server_orig));
+  free_string_field (&(args_info->debug_level_orig));
   
   
 
@@ -283,6 +288,8 @@ cmdline_parser_dump(FILE *outfile, struct gengetopt_args_info *args_info)
     write_into_file(outfile, "cert-key", args_info->cert_key_orig, 0);
   if (args_info->stun_server_given)
     write_into_file(outfile, "stun-server", args_info->stun_server_orig, 0);
+  if (args_info->debug_level_given)
+    write_into_file(outfile, "debug-level", args_info->debug_level_orig, 0);
   
 
   i = EXIT_SUCCESS;
@@ -550,10 +557,11 @@ cmdline_parser_internal (
         { "cert-pem",	1, NULL, 'c' },
         { "cert-key",	1, NULL, 'k' },
         { "stun-server",	1, NULL, 'S' },
+        { "debug-level",	1, NULL, 'd' },
         { 0,  0, 0, 0 }
       };
 
-      c = getopt_long (argc, argv, "hVi:p:s:nb:P:C:F:c:k:S:", long_options, &option_index);
+      c = getopt_long (argc, argv, "hVi:p:s:nb:P:C:F:c:k:S:d:", long_options, &option_index);
 
       if (c == -1) break;	/* Exit from `while (1)' loop.  */
 
@@ -699,6 +707,18 @@ cmdline_parser_internal (
             goto failure;
         
           break;
+        case 'd':	/* Debug/logging level (0=disable debugging, 7=maximum debug level; default=4).  */
+        
+        
+          if (update_arg( (void *)&(args_info->debug_level_arg), 
+               &(args_info->debug_level_orig), &(args_info->debug_level_given),
+              &(local_args_info.debug_level_given), optarg, 0, 0, ARG_INT,
+              check_ambiguity, override, 0, 0,
+              "debug-level", 'd',
+              additional_error))
+            goto failure;
+        
+          break;
 
         case 0:	/* Long option with no short option */
         case '?':	/* Invalid option.  */
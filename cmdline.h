@@ -71,6 +71,9 @@ struct gengetopt_args_info
   char * stun_server_arg;	/**< @brief STUN server(:port) to use, if needed (e.g., gateway behind NAT, default=none).  */
   char * stun_server_orig;	/**< @brief STUN server(:port) to use, if needed (e.g., gateway behind NAT, default=none) original value given at command line.  */
   const char *stun_server_help; /**< @brief STUN server(:port) to use, if needed (e.g., gateway behind NAT, default=none) help description.  */
+  int debug_level_arg;	/**< @brief Debug/logging level (0=disable debugging, 7=maximum debug level; default=4).  */
+  char * debug_level_orig;	/**< @brief Debug/logging level (0=disable debugging, 7=maximum debug level; default=4) original value given at command line.  */
+  const char *debug_level_help; /**< @brief Debug/logging level (0=disable debugging, 7=maximum debug level; default=4) help description.  */
   
   unsigned int help_given ;	/**< @brief Whether help was given.  */
   unsigned int version_given ;	/**< @brief Whether version was given.  */
@@ -85,6 +88,7 @@ struct gengetopt_args_info
   unsigned int cert_pem_given ;	/**< @brief Whether cert-pem was given.  */
   unsigned int cert_key_given ;	/**< @brief Whether cert-key was given.  */
   unsigned int stun_server_given ;	/**< @brief Whether stun-server was given.  */
+  unsigned int debug_level_given ;	/**< @brief Whether debug-level was given.  */
 
 } ;
 
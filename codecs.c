@@ -0,0 +1,334 @@
+/*! \file    codecs.c
+ * \author   Lorenzo Miniero <lorenzo@meetecho.com>
+ * \copyright GNU Affero General Public License v3
+ * \brief    Codecs negotiation
+ * \details  Implementation of a simple codec table, to keep track of the
+ * codecs (payload type, rtpmap, fmtp and rtcp-fb attributes) that have
+ * been negotiated for a stream. SDPs are parsed as plain text, one line
+ * at a time, as this code is used by plugins as well.
+ *
+ * \ingroup protocols
+ * \ref protocols
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "codecs.h"
+#include "debug.h"
+
+
+/* Static payload types that may be negotiated without an rtpmap attribute */
+static janus_codec *janus_codec_static(int pt) {
+	switch(pt) {
+		case 0:
+			return janus_codec_new(pt, "PCMU", 8000, 1);
+		case 8:
+			return janus_codec_new(pt, "PCMA", 8000, 1);
+		case 9:
+			return janus_codec_new(pt, "G722", 8000, 1);
+		default:
+			break;
+	}
+	return NULL;
+}
+
+
+janus_codec *janus_codec_new(int pt, const char *name, int rate, int channels) {
+	if(pt < 0 || pt > 127 || name == NULL)
+		return NULL;
+	janus_codec *codec = calloc(1, sizeof(janus_codec));
+	if(codec == NULL) {
+		JANUS_DEBUG("Memory error!\n");
+		return NULL;
+	}
+	codec->pt = pt;
+	codec->name = g_strdup(name);
+	codec->rate = rate;
+	codec->channels = channels;
+	codec->fmtp = NULL;
+	codec->rtcp_fb = NULL;
+	return codec;
+}
+
+void janus_codec_set_fmtp(janus_codec *codec, const char *fmtp) {
+	if(codec == NULL)
+		return;
+	g_free(codec->fmtp);
+	codec->fmtp = fmtp ? g_strdup(fmtp) : NULL;
+}
+
+void janus_codec_add_feedback(janus_codec *codec, const char *rtcp_fb) {
+	if(codec == NULL || rtcp_fb == NULL || janus_codec_has_feedback(codec, rtcp_fb))
+		return;
+	codec->rtcp_fb = g_list_append(codec->rtcp_fb, g_strdup(rtcp_fb));
+}
+
+gboolean janus_codec_has_feedback(janus_codec *codec, const char *rtcp_fb) {
+	if(codec == NULL || rtcp_fb == NULL)
+		return FALSE;
+	GList *fb = codec->rtcp_fb;
+	while(fb) {
+		if(!g_ascii_strcasecmp((const char *)fb->data, rtcp_fb))
+			return TRUE;
+		fb = fb->next;
+	}
+	return FALSE;
+}
+
+void janus_codec_free(janus_codec *codec) {
+	if(codec == NULL)
+		return;
+	g_free(codec->name);
+	g_free(codec->fmtp);
+	g_list_free_full(codec->rtcp_fb, g_free);
+	free(codec);
+}
+
+
+/* Helper to split an SDP in lines, getting rid of the trailing \r */
+static gchar **janus_codecs_split(const char *sdp) {
+	gchar **lines = g_strsplit(sdp, "\n", -1);
+	if(lines == NULL)
+		return NULL;
+	int i = 0;
+	for(i=0; lines[i] != NULL; i++) {
+		size_t len = strlen(lines[i]);
+		if(len > 0 && lines[i][len-1] == '\r')
+			lines[i][len-1] = '\0';
+	}
+	return lines;
+}
+
+/* Helper to find the lines of the first audio or video m-line: returns the index of the m= line, or -1 */
+static int janus_codecs_find_mline(gchar **lines, gboolean video, int *end) {
+	const char *prefix = video ? "m=video " : "m=audio ";
+	int i = 0, start = -1;
+	for(i=0; lines[i] != NULL; i++) {
+		if(start < 0) {
+			if(!strncmp(lines[i], prefix, strlen(prefix)))
+				start = i;
+		} else if(!strncmp(lines[i], "m=", 2)) {
+			break;
+		}
+	}
+	*end = i;
+	return start;
+}
+
+/* Helper to parse the payload type an attribute refers to (-1 for a wildcard, -2 on errors), returning what follows it */
+static const char *janus_codecs_attribute_pt(const char *line, const char *attribute, int *pt) {
+	size_t len = strlen(attribute);
+	if(strncmp(line, attribute, len))
+		return NULL;
+	line += len;
+	if(*line == '*') {
+		*pt = -1;
+		line++;
+	} else {
+		char *end = NULL;
+		long value = strtol(line, &end, 10);
+		if(end == line || value < 0 || value > 127) {
+			*pt = -2;
+			return NULL;
+		}
+		*pt = value;
+		line = end;
+	}
+	while(*line == ' ')
+		line++;
+	return line;
+}
+
+static janus_codec *janus_codecs_find_pt(GList *codecs, int pt) {
+	while(codecs) {
+		janus_codec *codec = (janus_codec *)codecs->data;
+		if(codec->pt == pt)
+			return codec;
+		codecs = codecs->next;
+	}
+	return NULL;
+}
+
+GList *janus_codecs_parse(const char *sdp, gboolean video) {
+	if(sdp == NULL)
+		return NULL;
+	gchar **lines = janus_codecs_split(sdp);
+	if(lines == NULL)
+		return NULL;
+	int end = 0;
+	int start = janus_codecs_find_mline(lines, video, &end);
+	if(start < 0) {
+		g_strfreev(lines);
+		return NULL;
+	}
+	/* First of all, the rtpmap attributes */
+	GList *rtpmaps = NULL;
+	int i = 0, pt = 0;
+	for(i=start+1; i<end; i++) {
+		const char *value = janus_codecs_attribute_pt(lines[i], "a=rtpmap:", &pt);
+		if(value == NULL || pt < 0)
+			continue;
+		/* <encoding name>/<clock rate>[/<encoding parameters>] */
+		gchar **parts = g_strsplit(value, "/", 3);
+		if(parts && parts[0] && parts[1]) {
+			janus_codec *codec = janus_codec_new(pt, parts[0], atoi(parts[1]), parts[2] ? atoi(parts[2]) : 0);
+			if(codec != NULL)
+				rtpmaps = g_list_append(rtpmaps, codec);
+		}
+		g_strfreev(parts);
+	}
+	/* Then the formats, in the order they appear in the m-line */
+	GList *codecs = NULL;
+	gchar **formats = g_strsplit(lines[start], " ", -1);
+	/* m=<media> <port> <proto> <fmt> ...: broken m-lines (e.g., "m=audio 9") may have less tokens than that */
+	int tokens = g_strv_length(formats);
+	for(i=3; i<tokens; i++) {
+		if(*formats[i] == '\0')
+			continue;
+		pt = atoi(formats[i]);
+		janus_codec *codec = janus_codecs_find_pt(rtpmaps, pt);
+		if(codec != NULL) {
+			rtpmaps = g_list_remove(rtpmaps, codec);
+		} else {
+			codec = janus_codec_static(pt);
+			if(codec == NULL)
+				continue;
+		}
+		codecs = g_list_append(codecs, codec);
+	}
+	g_strfreev(formats);
+	janus_codecs_free(rtpmaps);
+	/* Finally fmtp and rtcp-fb */
+	for(i=start+1; i<end; i++) {
+		const char *value = janus_codecs_attribute_pt(lines[i], "a=fmtp:", &pt);
+		if(value != NULL && pt >= 0) {
+			janus_codec_set_fmtp(janus_codecs_find_pt(codecs, pt), value);
+			continue;
+		}
+		value = janus_codecs_attribute_pt(lines[i], "a=rtcp-fb:", &pt);
+		if(value == NULL || *value == '\0')
+			continue;
+		if(pt >= 0) {
+			janus_codec_add_feedback(janus_codecs_find_pt(codecs, pt), value);
+		} else {
+			/* Wildcard, applies to all payload types */
+			GList *c = codecs;
+			while(c) {
+				janus_codec_add_feedback((janus_codec *)c->data, value);
+				c = c->next;
+			}
+		}
+	}
+	g_strfreev(lines);
+	return codecs;
+}
+
+janus_codec *janus_codecs_find(GList *codecs, const char *name) {
+	if(name == NULL)
+		return NULL;
+	while(codecs) {
+		janus_codec *codec = (janus_codec *)codecs->data;
+		if(codec->name && !g_ascii_strcasecmp(codec->name, name))
+			return codec;
+		codecs = codecs->next;
+	}
+	return NULL;
+}
+
+GList *janus_codecs_copy(GList *codecs) {
+	GList *copy = NULL;
+	for(; codecs; codecs = codecs->next) {
+		janus_codec *codec = (janus_codec *)codecs->data;
+		janus_codec *c = janus_codec_new(codec->pt, codec->name, codec->rate, codec->channels);
+		if(c == NULL)
+			continue;
+		janus_codec_set_fmtp(c, codec->fmtp);
+		GList *fb = NULL;
+		for(fb = codec->rtcp_fb; fb; fb = fb->next)
+			janus_codec_add_feedback(c, (const char *)fb->data);
+		copy = g_list_append(copy, c);
+	}
+	return copy;
+}
+
+void janus_codecs_free(GList *codecs) {
+	g_list_free_full(codecs, (GDestroyNotify)janus_codec_free);
+}
+
+
+/* Helper to check whether an RTCP feedback is in a NULL-terminated list (no list means all are allowed):
+ * an entry with no parameters (e.g., "nack") allows that feedback type with any of them ("nack pli") */
+static gboolean janus_codecs_feedback_allowed(const char *rtcp_fb, const char **allowed) {
+	if(allowed == NULL)
+		return TRUE;
+	size_t type = strcspn(rtcp_fb, " ");
+	int i = 0;
+	for(i=0; allowed[i] != NULL; i++) {
+		if(!g_ascii_strcasecmp(rtcp_fb, allowed[i]))
+			return TRUE;
+		if(strchr(allowed[i], ' ') == NULL && strlen(allowed[i]) == type && !g_ascii_strncasecmp(rtcp_fb, allowed[i], type))
+			return TRUE;
+	}
+	return FALSE;
+}
+
+char *janus_codecs_force(const char *sdp, gboolean video, const char *name, const char **rtcp_fb) {
+	if(sdp == NULL || name == NULL)
+		return NULL;
+	GList *codecs = janus_codecs_parse(sdp, video);
+	GList *keep = NULL, *c = codecs;
+	while(c) {
+		janus_codec *codec = (janus_codec *)c->data;
+		if(!g_ascii_strcasecmp(codec->name, name))
+			keep = g_list_append(keep, GINT_TO_POINTER(codec->pt));
+		c = c->next;
+	}
+	janus_codecs_free(codecs);
+	if(keep == NULL) {
+		JANUS_LOG(LOG_VERB, "No %s payload type in the %s m-line\n", name, video ? "video" : "audio");
+		return NULL;
+	}
+	gchar **lines = janus_codecs_split(sdp);
+	int end = 0;
+	int start = janus_codecs_find_mline(lines, video, &end);
+	GString *result = g_string_sized_new(strlen(sdp));
+	int i = 0, pt = 0;
+	for(i=0; lines[i] != NULL; i++) {
+		if(*lines[i] == '\0')
+			continue;
+		if(i == start) {
+			/* m=<media> <port> <proto> <fmt> ...: only keep the formats we want */
+			gchar **formats = g_strsplit(lines[i], " ", -1);
+			int j = 0;
+			for(j=0; formats[j] != NULL; j++) {
+				if(j < 3) {
+					g_string_append_printf(result, "%s%s", j ? " " : "", formats[j]);
+				} else if(g_list_find(keep, GINT_TO_POINTER(atoi(formats[j]))) != NULL) {
+					g_string_append_printf(result, " %s", formats[j]);
+				}
+			}
+			g_strfreev(formats);
+			g_string_append(result, "\r\n");
+			continue;
+		} else if(i > start && i < end) {
+			const char *value = janus_codecs_attribute_pt(lines[i], "a=rtpmap:", &pt);
+			if(value == NULL)
+				value = janus_codecs_attribute_pt(lines[i], "a=fmtp:", &pt);
+			if(value != NULL && pt >= 0 && g_list_find(keep, GINT_TO_POINTER(pt)) == NULL)
+				continue;
+			value = janus_codecs_attribute_pt(lines[i], "a=rtcp-fb:", &pt);
+			if(value != NULL) {
+				if(pt >= 0 && g_list_find(keep, GINT_TO_POINTER(pt)) == NULL)
+					continue;
+				if(!janus_codecs_feedback_allowed(value, rtcp_fb))
+					continue;
+			}
+		}
+		g_string_append_printf(result, "%s\r\n", lines[i]);
+	}
+	g_strfreev(lines);
+	g_list_free(keep);
+	return g_string_free(result, FALSE);
+}
@@ -0,0 +1,107 @@
+/*! \file    codecs.h
+ * \author   Lorenzo Miniero <lorenzo@meetecho.com>
+ * \copyright GNU Affero General Public License v3
+ * \brief    Codecs negotiation (headers)
+ * \details  Implementation of a simple codec table, to keep track of the
+ * codecs (payload type, rtpmap, fmtp and rtcp-fb attributes) that have
+ * been negotiated for a stream. The gateway fills a table for each
+ * stream when parsing the SDP of a peer, while plugins can use the same
+ * helpers to parse the SDPs they receive, to look for a specific codec,
+ * and to restrict an SDP to a single codec (and a subset of its RTCP
+ * feedback) before they use it, so that media can always be forwarded
+ * as it is to all the peers interested in it.
+ *
+ * \note This code is used by plugins as well, so it must not depend
+ * on any other part of the gateway core (e.g., Sofia-SDP).
+ *
+ * \ingroup protocols
+ * \ref protocols
+ */
+
+#ifndef _JANUS_CODECS_H
+#define _JANUS_CODECS_H
+
+#include <glib.h>
+
+
+/*! \brief Negotiated codec */
+typedef struct janus_codec {
+	/*! \brief RTP payload type */
+	int pt;
+	/*! \brief Codec name (e.g., VP8 or opus), as in the rtpmap attribute */
+	char *name;
+	/*! \brief Clock rate */
+	int rate;
+	/*! \brief Number of channels, if any (audio only, 0 otherwise) */
+	int channels;
+	/*! \brief Format parameters (fmtp attribute), if any */
+	char *fmtp;
+	/*! \brief RTCP feedback the peer supports for this codec (e.g., "nack" or "ccm fir"), as a list of strings */
+	GList *rtcp_fb;
+} janus_codec;
+
+/** @name Janus codecs helpers
+ */
+///@{
+/*! \brief Method to create a new codec
+ * @param[in] pt The RTP payload type
+ * @param[in] name The codec name
+ * @param[in] rate The clock rate
+ * @param[in] channels The number of channels (0 if not relevant)
+ * @returns A new janus_codec instance in case of success, NULL otherwise */
+janus_codec *janus_codec_new(int pt, const char *name, int rate, int channels);
+/*! \brief Method to set the format parameters of a codec
+ * @param[in] codec The codec to update
+ * @param[in] fmtp The format parameters */
+void janus_codec_set_fmtp(janus_codec *codec, const char *fmtp);
+/*! \brief Method to add an RTCP feedback to a codec, if not there already
+ * @param[in] codec The codec to update
+ * @param[in] rtcp_fb The RTCP feedback (e.g., "nack pli") */
+void janus_codec_add_feedback(janus_codec *codec, const char *rtcp_fb);
+/*! \brief Method to check whether a codec supports an RTCP feedback
+ * @param[in] codec The codec to check
+ * @param[in] rtcp_fb The RTCP feedback (e.g., "goog-remb")
+ * @returns TRUE if the feedback is supported, FALSE otherwise */
+gboolean janus_codec_has_feedback(janus_codec *codec, const char *rtcp_fb);
+/*! \brief Method to free a codec
+ * @param[in] codec The codec to free */
+void janus_codec_free(janus_codec *codec);
+///@}
+
+/** @name Janus codec tables
+ */
+///@{
+/*! \brief Method to parse the codecs of the first audio or video m-line of an SDP
+ * @param[in] sdp The SDP to parse
+ * @param[in] video Whether the video (TRUE) or audio (FALSE) m-line should be parsed
+ * @returns A list of janus_codec instances, in order of preference (to be freed with janus_codecs_free), or NULL if there are none */
+GList *janus_codecs_parse(const char *sdp, gboolean video);
+/*! \brief Method to look for a codec in a list, by name
+ * @param[in] codecs The list of janus_codec instances
+ * @param[in] name The codec name (case insensitive)
+ * @returns The first janus_codec with that name, or NULL if there's none */
+janus_codec *janus_codecs_find(GList *codecs, const char *name);
+/*! \brief Method to copy a list of codecs
+ * @param[in] codecs The list of janus_codec instances to copy
+ * @returns A new list of janus_codec instances (to be freed with janus_codecs_free) */
+GList *janus_codecs_copy(GList *codecs);
+/*! \brief Method to free a list of codecs
+ * @param[in] codecs The list of janus_codec instances to free */
+void janus_codecs_free(GList *codecs);
+/*! \brief Method to restrict the first audio or video m-line of an SDP to a single codec
+ * \details All the payload types with a different codec name are removed
+ * from the m-line, along with their rtpmap, fmtp and rtcp-fb attributes.
+ * If a list of RTCP feedback is provided, any rtcp-fb attribute not in the
+ * list is removed as well: an entry with no parameters (e.g., "nack")
+ * keeps that feedback type with any parameters too (e.g., "nack pli"),
+ * while one with parameters only keeps that exact feedback. Other m-lines
+ * are left untouched.
+ * @param[in] sdp The SDP to restrict
+ * @param[in] video Whether the video (TRUE) or audio (FALSE) m-line should be restricted
+ * @param[in] name The codec name to keep (case insensitive)
+ * @param[in] rtcp_fb NULL-terminated array of RTCP feedback to keep (e.g., "nack", "goog-remb"), or NULL to keep them all
+ * @returns A new SDP (to be freed with g_free) in case of success, NULL if the codec is not in the SDP */
+char *janus_codecs_force(const char *sdp, gboolean video, const char *name, const char **rtcp_fb);
+///@}
+
+#endif
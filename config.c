@@ -3,6 +3,7 @@
 #include <string.h>
 #include <ctype.h>
 #include <errno.h>
+#include <unistd.h>
 
 #include "config.h"
 #include "debug.h"
@@ -383,6 +384,82 @@ janus_config_item *janus_config_add_item(janus_config *config, const char *categ
 	return item;
 }
 
+/* Helper to free the items of a list */
+static void janus_config_items_free(janus_config_item *i) {
+	janus_config_item *tmp = NULL;
+	while(i) {
+		if(i->name)
+			g_free((gpointer)i->name);
+		if(i->value)
+			g_free((gpointer)i->value);
+		tmp = i;
+		i = i->next;
+		g_free((gpointer)tmp);
+	}
+}
+
+int janus_config_remove_category(janus_config *config, const char *name) {
+	if(config == NULL || name == NULL)
+		return -1;
+	janus_config_category *c = config->categories, *prev = NULL;
+	while(c) {
+		if(c->name && !strcasecmp(name, c->name)) {
+			if(prev == NULL)
+				config->categories = c->next;
+			else
+				prev->next = c->next;
+			janus_config_items_free(c->items);
+			g_free((gpointer)c->name);
+			g_free((gpointer)c);
+			return 0;
+		}
+		prev = c;
+		c = c->next;
+	}
+	return -1;
+}
+
+int janus_config_save(janus_config *config, const char *config_file) {
+	if(config == NULL || config_file == NULL)
+		return -1;
+	char *temp = g_strdup_printf("%s.tmp", config_file);
+	FILE *file = fopen(temp, "w");
+	if(file == NULL) {
+		JANUS_DEBUG("Couldn't open %s for writing: %d (%s)\n", temp, errno, strerror(errno));
+		g_free(temp);
+		return -1;
+	}
+	fprintf(file, "; Saved by the gateway: comments in the original file have been removed\n");
+	janus_config_item *i = config->items;
+	while(i) {
+		fprintf(file, "%s = %s\n", i->name ? i->name : "", i->value ? i->value : "");
+		i = i->next;
+	}
+	janus_config_category *c = config->categories;
+	while(c) {
+		fprintf(file, "\n[%s]\n", c->name ? c->name : "");
+		i = c->items;
+		while(i) {
+			fprintf(file, "%s = %s\n", i->name ? i->name : "", i->value ? i->value : "");
+			i = i->next;
+		}
+		c = c->next;
+	}
+	int res = 0;
+	if(fflush(file) != 0 || fsync(fileno(file)) < 0)
+		res = -1;
+	if(fclose(file) != 0)
+		res = -1;
+	if(res == 0 && rename(temp, config_file) < 0)
+		res = -1;
+	if(res < 0) {
+		JANUS_DEBUG("Couldn't save the configuration to %s: %d (%s)\n", config_file, errno, strerror(errno));
+		unlink(temp);
+	}
+	g_free(temp);
+	return res;
+}
+
 void janus_config_print(janus_config *config) {
 	if(config == NULL)
 		return;
@@ -85,6 +85,19 @@ janus_config_item *janus_config_get_item_drilldown(janus_config *config, const c
  * @param[in] value The value of the item
  * @returns A pointer to the janus_config_item instance if successful, NULL otherwise */ 
 janus_config_item *janus_config_add_item(janus_config *config, const char *category, const char *name, const char *value);
+/*! \brief Remove a category, and all its items, from a configuration
+ * @param[in] config The configuration container
+ * @param[in] name The name of the category to remove
+ * @returns 0 if the category was removed, a negative integer otherwise (e.g., if it doesn't exist) */
+int janus_config_remove_category(janus_config *config, const char *name);
+/*! \brief Method to save a configuration to an INI file
+ * \note The file is written to a temporary file first, and then renamed,
+ * so that a failure never leaves a broken configuration behind. Comments
+ * in the original file, if any, are not preserved
+ * @param[in] config The configuration to save
+ * @param[in] config_file Path to the configuration file
+ * @returns 0 in case of success, a negative integer otherwise */
+int janus_config_save(janus_config *config, const char *config_file);
 /*! \brief Helper method to print a configuration on the standard output
  * @param[in] config The configuration to print */
 void janus_config_print(janus_config *config);
@@ -2,7 +2,12 @@
  * \author   Lorenzo Miniero <lorenzo@meetecho.com>
  * \brief    Logging and Debugging
  * \details  Implementation of a wrapper on printf (or g_print) to either log or debug.
- * \todo     Improve this wrappers to add levels of debugging and optionally saving logs on file
+ * Lines are associated with a level, and only printed if the current
+ * log level (as set in the configuration or on the command line) is
+ * at least as verbose: disabled levels only cost an integer comparison,
+ * as no formatting takes place at all. Enabled lines are passed to the
+ * buffered logger in log.h, which writes them on a dedicated thread.
+ * \todo     Improve this wrappers to optionally save logs on file
  * 
  * \ingroup core
  * \ref core
@@ -14,12 +19,50 @@
 #ifndef _JANUS_DEBUG_H
 #define _JANUS_DEBUG_H
 
-/* FIXME */
-#define JANUS_PRINT g_print
+#include "log.h"
+
+/*! \brief Current log level */
+extern int janus_log_level;
+
+/** @name Janus log levels
+ */
+///@{
+/*! \brief No debugging */
+#define LOG_NONE     (0)
+/*! \brief Fatal error */
+#define LOG_FATAL    (1)
+/*! \brief Non-fatal error */
+#define LOG_ERR      (2)
+/*! \brief Warning */
+#define LOG_WARN     (3)
+/*! \brief Informational message */
+#define LOG_INFO     (4)
+/*! \brief Verbose message */
+#define LOG_VERB     (5)
+/*! \brief Overly verbose message (e.g., per-packet stuff) */
+#define LOG_HUGE     (6)
+/*! \brief Debug message (includes .c filename, function and line number) */
+#define LOG_DBG      (7)
+/*! \brief Maximum level of debugging: anything above this is compiled out */
+#define LOG_MAX LOG_DBG
+///@}
+
+/*! \brief Simple wrapper to g_print/printf, only printing if the level is enabled */
+#define JANUS_LOG(level, ...) \
+	do { \
+		if(level > LOG_NONE && level <= LOG_MAX && level <= janus_log_level) { \
+			janus_log_printf(level >= LOG_DBG ? __FILE__ : NULL, __FUNCTION__, __LINE__, __VA_ARGS__); \
+		} \
+	} while(0)
+
+/*! \brief Informational message (LOG_INFO) */
+#define JANUS_PRINT(...) JANUS_LOG(LOG_INFO, __VA_ARGS__)
+/*! \brief Warning or error, prefixed by the filename, function and line number (LOG_WARN) */
 #define JANUS_DEBUG(...) \
 	do { \
-		g_print("[%s:%s:%d:] ", __FILE__, __FUNCTION__, __LINE__); \
-		g_print(__VA_ARGS__); \
-	} while(0);
+		if(LOG_WARN <= janus_log_level) { \
+			janus_log_printf(__FILE__, __FUNCTION__, __LINE__, __VA_ARGS__); \
+		} \
+	} while(0)
 	
 #endif
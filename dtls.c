@@ -87,11 +87,29 @@ const gchar *janus_get_dtls_srtp_role(janus_dtls_role role) {
 
 /* DTLS stuff */
 #define DTLS_CIPHERS	"ALL:NULL:eNULL:aNULL"
+/* When using an ECDSA certificate, ECDHE-ECDSA suites are preferred (GCM ones are only available in DTLS 1.2) */
+#define DTLS_CIPHERS_ECDSA	"ECDHE-ECDSA-AES128-GCM-SHA256:ECDHE-ECDSA-AES256-GCM-SHA384:ECDHE-ECDSA-AES128-SHA:ECDHE-ECDSA-AES256-SHA"
 
 /* SRTP stuff (http://tools.ietf.org/html/rfc3711) */
 #define SRTP_MASTER_KEY_LENGTH	16
 #define SRTP_MASTER_SALT_LENGTH	14
 #define SRTP_MASTER_LENGTH (SRTP_MASTER_KEY_LENGTH + SRTP_MASTER_SALT_LENGTH)
+/* AES-GCM stuff (http://tools.ietf.org/html/rfc7714) */
+#define SRTP_AESGCM128_MASTER_KEY_LENGTH	16
+#define SRTP_AESGCM256_MASTER_KEY_LENGTH	32
+#define SRTP_AESGCM_MASTER_SALT_LENGTH	12
+#define SRTP_MAX_MASTER_LENGTH (SRTP_AESGCM256_MASTER_KEY_LENGTH + SRTP_MASTER_SALT_LENGTH)
+
+/* DTLS-SRTP profiles we offer, in order of preference: AES-GCM (RFC7714)
+ * needs a single pass on the packet (and is accelerated by AES-NI), while
+ * AES-CM+HMAC-SHA1 needs two, but it's what most browsers support right now.
+ * The 128 bit variant comes first, as it's the cheaper of the two: GCM is
+ * only available if the Makefile found libsrtp to support it, see there */
+#if defined(HAVE_SRTP_AESGCM) && defined(SRTP_AEAD_AES_256_GCM)
+#define DTLS_SRTP_PROFILES	"SRTP_AEAD_AES_128_GCM:SRTP_AEAD_AES_256_GCM:SRTP_AES128_CM_SHA1_80"
+#else
+#define DTLS_SRTP_PROFILES	"SRTP_AES128_CM_SHA1_80"
+#endif
 
 
 static SSL_CTX *ssl_ctx = NULL;
@@ -103,52 +121,15 @@ gchar *janus_dtls_get_local_fingerprint() {
 	return (gchar *)local_fingerprint;
 }
 
-/* DTLS-SRTP initialization */
-gint janus_dtls_srtp_init(gchar *server_pem, gchar *server_key) {
-	ssl_ctx = SSL_CTX_new(DTLSv1_method());
-	if(!ssl_ctx) {
-		JANUS_DEBUG("Ops, error creating DTLS context?\n");
+/* Helper to compute the SHA-256 fingerprint of our certificate, as advertised in SDPs */
+static gint janus_dtls_compute_fingerprint(X509 *cert) {
+	if(cert == NULL)
 		return -1;
-	}
-	SSL_CTX_set_verify(ssl_ctx, SSL_VERIFY_PEER | SSL_VERIFY_FAIL_IF_NO_PEER_CERT, janus_dtls_verify_callback);
-	SSL_CTX_set_tlsext_use_srtp(ssl_ctx, "SRTP_AES128_CM_SHA1_80");	/* FIXME Should we support something else as well? */
-	if(!server_pem || !SSL_CTX_use_certificate_file(ssl_ctx, server_pem, SSL_FILETYPE_PEM)) {
-		JANUS_DEBUG("Certificate error, does it exist?\n");
-		JANUS_DEBUG("  %s\n", server_pem);
-		return -2;
-	}
-	if(!server_key || !SSL_CTX_use_PrivateKey_file(ssl_ctx, server_key, SSL_FILETYPE_PEM)) {
-		JANUS_DEBUG("Certificate key error, does it exist?\n");
-		JANUS_DEBUG("  %s\n", server_key);
-		return -3;
-	}
-	if(!SSL_CTX_check_private_key(ssl_ctx)) {
-		JANUS_DEBUG("Certificate check error...\n");
-		return -4;
-	}
-	BIO *certbio = BIO_new(BIO_s_file());
-	if(certbio == NULL) {
-		JANUS_DEBUG("Certificate BIO error...\n");
-		return -5;
-	}
-	if(BIO_read_filename(certbio, server_pem) == 0) {
-		JANUS_DEBUG("Error reading certificate...\n");
-		BIO_free_all(certbio);
-		return -6;
-	}
-	X509 *cert = PEM_read_bio_X509(certbio, NULL, 0, NULL);
-	if(cert == NULL) {
-		JANUS_DEBUG("Error reading certificate...\n");
-		BIO_free_all(certbio);
-		return -7;
-	}
 	unsigned int size;
 	unsigned char fingerprint[EVP_MAX_MD_SIZE];
 	if(X509_digest(cert, EVP_sha256(), (unsigned char *)fingerprint, &size) == 0) {
 		JANUS_DEBUG("Error converting X509 structure...\n");
-		X509_free(cert);
-		BIO_free_all(certbio);
-		return -7;
+		return -1;
 	}
 	char *lfp = (char *)&local_fingerprint;
 	int i = 0;
@@ -158,9 +139,186 @@ gint janus_dtls_srtp_init(gchar *server_pem, gchar *server_key) {
 	}
 	*(lfp-1) = 0;
 	JANUS_PRINT("Fingerprint of our certificate is %s\n", local_fingerprint);
+	return 0;
+}
+
+/* Helper to generate an ephemeral ECDSA (P-256) certificate in memory */
+static gint janus_dtls_generate_ecdsa_certificate(void) {
+	JANUS_PRINT("Generating ephemeral ECDSA (P-256) certificate for DTLS...\n");
+	EVP_PKEY *pkey = NULL;
+	X509 *cert = NULL;
+	EC_KEY *ecdsa = EC_KEY_new_by_curve_name(NID_X9_62_prime256v1);
+	if(ecdsa == NULL) {
+		JANUS_DEBUG("Error creating ECDSA key...\n");
+		goto error;
+	}
+	/* Make sure the named curve is used, browsers don't like explicit parameters */
+	EC_KEY_set_asn1_flag(ecdsa, OPENSSL_EC_NAMED_CURVE);
+	if(!EC_KEY_generate_key(ecdsa)) {
+		JANUS_DEBUG("Error generating ECDSA key...\n");
+		EC_KEY_free(ecdsa);
+		goto error;
+	}
+	pkey = EVP_PKEY_new();
+	if(pkey == NULL || !EVP_PKEY_assign_EC_KEY(pkey, ecdsa)) {
+		JANUS_DEBUG("Error wrapping ECDSA key...\n");
+		EC_KEY_free(ecdsa);
+		goto error;
+	}
+	cert = X509_new();
+	if(cert == NULL) {
+		JANUS_DEBUG("Error creating certificate...\n");
+		goto error;
+	}
+	X509_set_version(cert, 2);
+	ASN1_INTEGER_set(X509_get_serialNumber(cert), g_random_int_range(1, G_MAXINT32));
+	/* Browsers don't check validity, but let's be nice anyway: valid from yesterday, for a year */
+	X509_gmtime_adj(X509_get_notBefore(cert), -24*60*60);
+	X509_gmtime_adj(X509_get_notAfter(cert), 365*24*60*60);
+	if(!X509_set_pubkey(cert, pkey)) {
+		JANUS_DEBUG("Error setting public key in certificate...\n");
+		goto error;
+	}
+	X509_NAME *name = X509_get_subject_name(cert);
+	X509_NAME_add_entry_by_txt(name, "CN", MBSTRING_ASC, (const unsigned char *)"Janus", -1, -1, 0);
+	X509_set_issuer_name(cert, name);
+	if(!X509_sign(cert, pkey, EVP_sha256())) {
+		JANUS_DEBUG("Error signing certificate...\n");
+		goto error;
+	}
+	if(!SSL_CTX_use_certificate(ssl_ctx, cert) || !SSL_CTX_use_PrivateKey(ssl_ctx, pkey)) {
+		JANUS_DEBUG("Error using the ECDSA certificate...\n");
+		goto error;
+	}
+	if(!SSL_CTX_check_private_key(ssl_ctx)) {
+		JANUS_DEBUG("Certificate check error...\n");
+		goto error;
+	}
+	if(janus_dtls_compute_fingerprint(cert) < 0)
+		goto error;
+	/* The context holds its own references now */
 	X509_free(cert);
-	BIO_free_all(certbio);
-	SSL_CTX_set_cipher_list(ssl_ctx, DTLS_CIPHERS);
+	EVP_PKEY_free(pkey);
+	return 0;
+
+error:
+	if(cert != NULL)
+		X509_free(cert);
+	if(pkey != NULL)
+		EVP_PKEY_free(pkey);
+	return -1;
+}
+
+/* Helper to (re)schedule the retransmission timer, according to what OpenSSL says */
+static void janus_dtls_schedule_retransmission(janus_dtls_srtp *dtls);
+
+/* DTLS workers: when enabled, incoming DTLS messages are processed by a
+ * bounded pool of threads, rather than by the ICE thread that received them */
+static GThreadPool *dtls_workers = NULL;
+/* Maximum number of DTLS messages a stack can have waiting for a worker */
+#define DTLS_MAX_PENDING	64
+typedef struct janus_dtls_packet {
+	char *data;
+	uint16_t len;
+} janus_dtls_packet;
+static gint janus_dtls_srtp_process_msg(janus_dtls_srtp *dtls, char *buf, uint16_t len);
+static void janus_dtls_srtp_notify(janus_dtls_srtp *dtls, gint result);
+static void janus_dtls_srtp_unref(janus_dtls_srtp *dtls);
+static void janus_dtls_worker(gpointer data, gpointer user_data);
+
+/* SRTP and SRTCP crypto policies matching a negotiated DTLS-SRTP profile */
+void janus_dtls_srtp_set_crypto_policy(srtp_policy_t *policy, unsigned long profile) {
+	switch(profile) {
+#if defined(HAVE_SRTP_AESGCM) && defined(SRTP_AEAD_AES_256_GCM)
+		case SRTP_AEAD_AES_128_GCM:
+			crypto_policy_set_aes_gcm_128_16_auth(&(policy->rtp));
+			crypto_policy_set_aes_gcm_128_16_auth(&(policy->rtcp));
+			break;
+		case SRTP_AEAD_AES_256_GCM:
+			crypto_policy_set_aes_gcm_256_16_auth(&(policy->rtp));
+			crypto_policy_set_aes_gcm_256_16_auth(&(policy->rtcp));
+			break;
+#endif
+		case SRTP_AES128_CM_SHA1_80:
+		default:
+			crypto_policy_set_rtp_default(&(policy->rtp));
+			crypto_policy_set_rtcp_default(&(policy->rtcp));
+			break;
+	}
+}
+
+/* DTLS-SRTP initialization */
+gint janus_dtls_srtp_init(gchar *server_pem, gchar *server_key, gboolean ecdsa) {
+#if OPENSSL_VERSION_NUMBER >= 0x10002000L
+	/* DTLS 1.2 is available: negotiate the best version the peer supports */
+	ssl_ctx = SSL_CTX_new(DTLS_method());
+#else
+	ssl_ctx = SSL_CTX_new(DTLSv1_method());
+#endif
+	if(!ssl_ctx) {
+		JANUS_DEBUG("Ops, error creating DTLS context?\n");
+		return -1;
+	}
+	SSL_CTX_set_verify(ssl_ctx, SSL_VERIFY_PEER | SSL_VERIFY_FAIL_IF_NO_PEER_CERT, janus_dtls_verify_callback);
+	if(SSL_CTX_set_tlsext_use_srtp(ssl_ctx, DTLS_SRTP_PROFILES) != 0) {
+		JANUS_DEBUG("Error setting the DTLS-SRTP profiles (%s)...\n", DTLS_SRTP_PROFILES);
+		return -1;
+	}
+	JANUS_PRINT("DTLS-SRTP profiles: %s\n", DTLS_SRTP_PROFILES);
+	/* Enable ECDHE (P-256), which is much cheaper than DHE or RSA key exchange */
+	EC_KEY *ecdh = EC_KEY_new_by_curve_name(NID_X9_62_prime256v1);
+	if(ecdh == NULL) {
+		JANUS_DEBUG("Error creating ECDH group...\n");
+		return -1;
+	}
+	SSL_CTX_set_options(ssl_ctx, SSL_OP_SINGLE_ECDH_USE);
+	SSL_CTX_set_tmp_ecdh(ssl_ctx, ecdh);
+	EC_KEY_free(ecdh);
+	if(ecdsa) {
+		/* Don't use the certificate on file for DTLS, generate a new one */
+		if(janus_dtls_generate_ecdsa_certificate() < 0)
+			return -2;
+		SSL_CTX_set_cipher_list(ssl_ctx, DTLS_CIPHERS_ECDSA);
+	} else {
+		if(!server_pem || !SSL_CTX_use_certificate_file(ssl_ctx, server_pem, SSL_FILETYPE_PEM)) {
+			JANUS_DEBUG("Certificate error, does it exist?\n");
+			JANUS_DEBUG("  %s\n", server_pem);
+			return -2;
+		}
+		if(!server_key || !SSL_CTX_use_PrivateKey_file(ssl_ctx, server_key, SSL_FILETYPE_PEM)) {
+			JANUS_DEBUG("Certificate key error, does it exist?\n");
+			JANUS_DEBUG("  %s\n", server_key);
+			return -3;
+		}
+		if(!SSL_CTX_check_private_key(ssl_ctx)) {
+			JANUS_DEBUG("Certificate check error...\n");
+			return -4;
+		}
+		BIO *certbio = BIO_new(BIO_s_file());
+		if(certbio == NULL) {
+			JANUS_DEBUG("Certificate BIO error...\n");
+			return -5;
+		}
+		if(BIO_read_filename(certbio, server_pem) == 0) {
+			JANUS_DEBUG("Error reading certificate...\n");
+			BIO_free_all(certbio);
+			return -6;
+		}
+		X509 *cert = PEM_read_bio_X509(certbio, NULL, 0, NULL);
+		if(cert == NULL) {
+			JANUS_DEBUG("Error reading certificate...\n");
+			BIO_free_all(certbio);
+			return -7;
+		}
+		if(janus_dtls_compute_fingerprint(cert) < 0) {
+			X509_free(cert);
+			BIO_free_all(certbio);
+			return -7;
+		}
+		X509_free(cert);
+		BIO_free_all(certbio);
+		SSL_CTX_set_cipher_list(ssl_ctx, DTLS_CIPHERS);
+	}
 
 	/* Initialize libsrtp */
 	if(srtp_init() != err_status_ok) {
@@ -195,8 +353,14 @@ janus_dtls_srtp *janus_dtls_srtp_create(void *ice_component, janus_dtls_role rol
 	}
 	/* Create SSL context, at last */
 	dtls->srtp_valid = 0;
-	dtls->dtls_last_msg = NULL;
-	dtls->dtls_last_len = 0;
+	dtls->srtp_profile = 0;
+	dtls->retransmit_timer = NULL;
+	dtls->incoming = g_queue_new();
+	dtls->scheduled = 0;
+	dtls->alert = FALSE;
+	dtls->destroyed = FALSE;
+	dtls->ref = 1;
+	janus_mutex_init(&dtls->mutex);
 	dtls->ssl = SSL_new(janus_dtls_get_ssl_ctx());
 	if(!dtls->ssl) {
 		JANUS_DEBUG("[%"SCNu64"]     No component DTLS SSL session??\n", handle->handle_id);
@@ -204,6 +368,7 @@ janus_dtls_srtp *janus_dtls_srtp_create(void *ice_component, janus_dtls_role rol
 		return NULL;
 	}
 	SSL_set_ex_data(dtls->ssl, 0, handle);
+	SSL_set_ex_data(dtls->ssl, 1, dtls);
 	SSL_set_info_callback(dtls->ssl, janus_dtls_callback);
 	dtls->read_bio = BIO_new(BIO_s_mem());
 	if(!dtls->read_bio) {
@@ -236,10 +401,16 @@ janus_dtls_srtp *janus_dtls_srtp_create(void *ice_component, janus_dtls_role rol
 void janus_dtls_srtp_handshake(janus_dtls_srtp *dtls) {
 	if(dtls == NULL || dtls->ssl == NULL)
 		return;
+	janus_mutex_lock(&dtls->mutex);
 	if(dtls->dtls_state == JANUS_DTLS_STATE_CREATED)
 		dtls->dtls_state = JANUS_DTLS_STATE_TRYING;
 	SSL_do_handshake(dtls->ssl);
 	janus_dtls_fd_bridge(dtls);
+	janus_dtls_schedule_retransmission(dtls);
+	gint result = dtls->alert ? -1 : 0;
+	dtls->alert = FALSE;
+	janus_mutex_unlock(&dtls->mutex);
+	janus_dtls_srtp_notify(dtls, result);
 }
 
 void janus_dtls_srtp_incoming_msg(janus_dtls_srtp *dtls, char *buf, uint16_t len) {
@@ -247,30 +418,143 @@ void janus_dtls_srtp_incoming_msg(janus_dtls_srtp *dtls, char *buf, uint16_t len
 		JANUS_DEBUG("No DTLS-SRTP stack, no incoming message...\n");
 		return;
 	}
+	if(dtls_workers == NULL) {
+		/* No workers, process the message right away */
+		janus_mutex_lock(&dtls->mutex);
+		gint result = janus_dtls_srtp_process_msg(dtls, buf, len);
+		janus_mutex_unlock(&dtls->mutex);
+		janus_dtls_srtp_notify(dtls, result);
+		return;
+	}
+	/* Queue a copy of the message for this stack, and wake a worker up if needed */
+	janus_mutex_lock(&dtls->mutex);
+	if(dtls->destroyed) {
+		janus_mutex_unlock(&dtls->mutex);
+		return;
+	}
+	if(g_queue_get_length(dtls->incoming) >= DTLS_MAX_PENDING) {
+		janus_mutex_unlock(&dtls->mutex);
+		JANUS_DEBUG("Too many DTLS messages waiting for a worker, dropping this one\n");
+		return;
+	}
+	janus_dtls_packet *packet = calloc(1, sizeof(janus_dtls_packet));
+	if(packet == NULL || (packet->data = calloc(len, sizeof(char))) == NULL) {
+		janus_mutex_unlock(&dtls->mutex);
+		JANUS_DEBUG("Memory error!\n");
+		if(packet != NULL)
+			free(packet);
+		return;
+	}
+	memcpy(packet->data, buf, len);
+	packet->len = len;
+	g_queue_push_tail(dtls->incoming, packet);
+	if(!dtls->scheduled) {
+		/* The stack is handled by a single worker at a time, so that messages are
+		 * processed in order: the worker holds a reference until it's done */
+		dtls->scheduled = 1;
+		g_atomic_int_inc(&dtls->ref);
+		g_thread_pool_push(dtls_workers, dtls, NULL);
+	}
+	janus_mutex_unlock(&dtls->mutex);
+}
+
+/* DTLS worker: processes all the messages waiting for a stack */
+static void janus_dtls_worker(gpointer data, gpointer user_data) {
+	janus_dtls_srtp *dtls = (janus_dtls_srtp *)data;
+	if(dtls == NULL)
+		return;
+	while(TRUE) {
+		janus_mutex_lock(&dtls->mutex);
+		janus_dtls_packet *packet = dtls->destroyed ? NULL : g_queue_pop_head(dtls->incoming);
+		if(packet == NULL) {
+			dtls->scheduled = 0;
+			janus_mutex_unlock(&dtls->mutex);
+			break;
+		}
+		gint result = janus_dtls_srtp_process_msg(dtls, packet->data, packet->len);
+		janus_mutex_unlock(&dtls->mutex);
+		/* Completing the handshake may take a while (e.g., plugins replaying media), don't keep the stack locked */
+		janus_dtls_srtp_notify(dtls, result);
+		free(packet->data);
+		free(packet);
+	}
+	janus_dtls_srtp_unref(dtls);
+}
+
+gint janus_dtls_workers_init(gint workers) {
+	if(workers < 1) {
+		JANUS_PRINT("DTLS messages will be processed by the ICE threads\n");
+		return 0;
+	}
+	GError *error = NULL;
+	dtls_workers = g_thread_pool_new(janus_dtls_worker, NULL, workers, FALSE, &error);
+	if(error != NULL) {
+		JANUS_DEBUG("Got error %d (%s) trying to launch the DTLS workers...\n", error->code, error->message ? error->message : "??");
+		dtls_workers = NULL;
+		return -1;
+	}
+	JANUS_PRINT("DTLS messages will be processed by %d workers\n", workers);
+	return 0;
+}
+
+void janus_dtls_workers_deinit(void) {
+	if(dtls_workers == NULL)
+		return;
+	g_thread_pool_free(dtls_workers, TRUE, TRUE);
+	dtls_workers = NULL;
+}
+
+/* Helper to tell the core (and so the plugin) how a message changed the state of a
+ * stack: 1 means the handshake completed, -1 that it failed or an alert was received.
+ * This is never called with the stack locked, as it may take a while */
+static void janus_dtls_srtp_notify(janus_dtls_srtp *dtls, gint result) {
+	if(result == 0)
+		return;
+	janus_ice_component *component = (janus_ice_component *)dtls->component;
+	janus_ice_stream *stream = component ? component->stream : NULL;
+	janus_ice_handle *handle = stream ? stream->handle : NULL;
+	/* Destroying a stack waits for its worker to be done (see janus_dtls_srtp_destroy),
+	 * and the component, stream and handle are only freed after that */
+	if(handle == NULL || handle->stop)
+		return;
+	if(result > 0) {
+		/* Handshake successfully completed */
+		janus_ice_dtls_handshake_done(handle, component);
+		return;
+	}
+	/* Something went wrong in either DTLS or SRTP... tell the plugin about it */
+	JANUS_PRINT("[%"SCNu64"] DTLS alert received, closing...\n", handle->handle_id);
+	handle->stop = 1;
+	janus_plugin *plugin = (janus_plugin *)handle->app;
+	if(plugin != NULL) {
+		JANUS_PRINT("[%"SCNu64"] Telling the plugin about it (%s)\n", handle->handle_id, plugin->get_name());
+		if(plugin && plugin->hangup_media)
+			plugin->hangup_media(handle->app_handle);
+	}
+}
+
+/* Actual processing of an incoming message (called with the stack locked): returns
+ * what janus_dtls_srtp_notify should be told, once the stack has been unlocked */
+static gint janus_dtls_srtp_process_msg(janus_dtls_srtp *dtls, char *buf, uint16_t len) {
+	gint result = 0;
 	janus_ice_component *component = (janus_ice_component *)dtls->component;
 	if(component == NULL) {
 		JANUS_DEBUG("No component, no DTLS...\n");
-		return;
+		return 0;
 	}
 	janus_ice_stream *stream = component->stream;
 	if(!stream) {
 		JANUS_DEBUG("No stream, no DTLS...\n");
-		return;
+		return 0;
 	}
 	janus_ice_handle *handle = stream->handle;
 	if(!handle || !handle->agent) {
 		JANUS_DEBUG("No handle/agent, no DTLS...\n");
-		return;
+		return 0;
 	}
 	if(!dtls->ssl || !dtls->read_bio) {
 		JANUS_DEBUG("[%"SCNu64"] No DTLS stuff for component %d in stream %d??\n", handle->handle_id, component->component_id, stream->stream_id);
-		return;
-	}
-	/* We just got a message, can we get rid of the last sent message? */
-	if(dtls->dtls_last_msg != NULL) {
-		g_free(dtls->dtls_last_msg);
-		dtls->dtls_last_msg = NULL;
-		dtls->dtls_last_len = 0;
+		return 0;
 	}
 	janus_dtls_fd_bridge(dtls);
 	//~ int written =
@@ -281,11 +565,18 @@ void janus_dtls_srtp_incoming_msg(janus_dtls_srtp *dtls, char *buf, uint16_t len
 		SSL_read(dtls->ssl, buf, len);
 	//~ JANUS_PRINT("    ...and read %d of them from SSL...\n", read);
 	janus_dtls_fd_bridge(dtls);
+	/* A message may have moved the handshake on, or completed it */
+	janus_dtls_schedule_retransmission(dtls);
+	if(dtls->alert) {
+		/* DTLS alert received while reading the message */
+		dtls->alert = FALSE;
+		result = -1;
+	}
 	if(handle->stop || janus_is_stopping()) {
 		/* DTLS alert received, we should end it here */
 		JANUS_PRINT("[%"SCNu64"] Forced to stop it here...\n", handle->handle_id);
 		//~ g_main_loop_quit(iceloop);
-		return;
+		return result;
 	}
 	if(SSL_is_init_finished(dtls->ssl)) {
 		JANUS_PRINT("[%"SCNu64"] DTLS established, yay!\n", handle->handle_id);
@@ -323,11 +614,33 @@ void janus_dtls_srtp_incoming_msg(janus_dtls_srtp *dtls, char *buf, uint16_t len
 				goto done;
 			}
 			if(dtls->dtls_state == JANUS_DTLS_STATE_CONNECTED) {
-				/* Complete with SRTP setup */
-				unsigned char material[SRTP_MASTER_LENGTH*2];
+				/* Complete with SRTP setup: check which profile was negotiated first */
+				int key_length = SRTP_MASTER_KEY_LENGTH, salt_length = SRTP_MASTER_SALT_LENGTH;
+				SRTP_PROTECTION_PROFILE *srtp_profile = SSL_get_selected_srtp_profile(dtls->ssl);
+				dtls->srtp_profile = srtp_profile ? srtp_profile->id : SRTP_AES128_CM_SHA1_80;
+				switch(dtls->srtp_profile) {
+					case SRTP_AES128_CM_SHA1_80:
+						break;
+#if defined(HAVE_SRTP_AESGCM) && defined(SRTP_AEAD_AES_256_GCM)
+					case SRTP_AEAD_AES_128_GCM:
+						key_length = SRTP_AESGCM128_MASTER_KEY_LENGTH;
+						salt_length = SRTP_AESGCM_MASTER_SALT_LENGTH;
+						break;
+					case SRTP_AEAD_AES_256_GCM:
+						key_length = SRTP_AESGCM256_MASTER_KEY_LENGTH;
+						salt_length = SRTP_AESGCM_MASTER_SALT_LENGTH;
+						break;
+#endif
+					default:
+						JANUS_DEBUG("[%"SCNu64"] Unsupported SRTP profile %lu for component %d in stream %d\n", handle->handle_id, dtls->srtp_profile, component->component_id, stream->stream_id);
+						goto done;
+				}
+				JANUS_PRINT("[%"SCNu64"] Negotiated SRTP profile for component %d in stream %d: %s\n", handle->handle_id,
+					component->component_id, stream->stream_id, srtp_profile ? srtp_profile->name : "SRTP_AES128_CM_SHA1_80");
+				unsigned char material[SRTP_MAX_MASTER_LENGTH*2];
 				unsigned char *local_key, *local_salt, *remote_key, *remote_salt;
 				/* Export keying material for SRTP */
-				if (!SSL_export_keying_material(dtls->ssl, material, SRTP_MASTER_LENGTH*2, "EXTRACTOR-dtls_srtp", 19, NULL, 0, 0)) {
+				if (!SSL_export_keying_material(dtls->ssl, material, (key_length+salt_length)*2, "EXTRACTOR-dtls_srtp", 19, NULL, 0, 0)) {
 					/* Oops... */
 					JANUS_DEBUG("[%"SCNu64"] Oops, couldn't extract SRTP keying material for component %d in stream %d??\n", handle->handle_id, component->component_id, stream->stream_id);
 					goto done;
@@ -335,41 +648,39 @@ void janus_dtls_srtp_incoming_msg(janus_dtls_srtp *dtls, char *buf, uint16_t len
 				/* Key derivation (http://tools.ietf.org/html/rfc5764#section-4.2) */
 				if(dtls->dtls_role == JANUS_DTLS_ROLE_CLIENT) {
 					local_key = material;
-					remote_key = local_key + SRTP_MASTER_KEY_LENGTH;
-					local_salt = remote_key + SRTP_MASTER_KEY_LENGTH;
-					remote_salt = local_salt + SRTP_MASTER_SALT_LENGTH;
+					remote_key = local_key + key_length;
+					local_salt = remote_key + key_length;
+					remote_salt = local_salt + salt_length;
 				} else {
 					remote_key = material;
-					local_key = remote_key + SRTP_MASTER_KEY_LENGTH;
-					remote_salt = local_key + SRTP_MASTER_KEY_LENGTH;
-					local_salt = remote_salt + SRTP_MASTER_SALT_LENGTH;
+					local_key = remote_key + key_length;
+					remote_salt = local_key + key_length;
+					local_salt = remote_salt + salt_length;
 				}
 				/* Build master keys and set SRTP policies */
 					/* Remote (inbound) */
-				crypto_policy_set_rtp_default(&(dtls->remote_policy.rtp));
-				crypto_policy_set_rtcp_default(&(dtls->remote_policy.rtcp));
+				janus_dtls_srtp_set_crypto_policy(&(dtls->remote_policy), dtls->srtp_profile);
 				dtls->remote_policy.ssrc.type = ssrc_any_inbound;
-				dtls->remote_policy.key = calloc(1, SRTP_MASTER_LENGTH);
+				dtls->remote_policy.key = calloc(1, key_length+salt_length);
 				if(dtls->remote_policy.key == NULL) {
 					JANUS_DEBUG("Memory error!\n");
 					goto done;
 				}
-				memcpy(dtls->remote_policy.key, remote_key, SRTP_MASTER_KEY_LENGTH);
-				memcpy(dtls->remote_policy.key + SRTP_MASTER_KEY_LENGTH, remote_salt, SRTP_MASTER_SALT_LENGTH);
+				memcpy(dtls->remote_policy.key, remote_key, key_length);
+				memcpy(dtls->remote_policy.key + key_length, remote_salt, salt_length);
 				dtls->remote_policy.window_size = 128;
 				dtls->remote_policy.allow_repeat_tx = 0;
 				dtls->remote_policy.next = NULL;
 					/* Local (outbound) */
-				crypto_policy_set_rtp_default(&(dtls->local_policy.rtp));
-				crypto_policy_set_rtcp_default(&(dtls->local_policy.rtcp));
+				janus_dtls_srtp_set_crypto_policy(&(dtls->local_policy), dtls->srtp_profile);
 				dtls->local_policy.ssrc.type = ssrc_any_outbound;
-				dtls->local_policy.key = calloc(1, SRTP_MASTER_LENGTH);
+				dtls->local_policy.key = calloc(1, key_length+salt_length);
 				if(dtls->local_policy.key == NULL) {
 					JANUS_DEBUG("Memory error!\n");
 					goto done;
 				}
-				memcpy(dtls->local_policy.key, local_key, SRTP_MASTER_KEY_LENGTH);
-				memcpy(dtls->local_policy.key + SRTP_MASTER_KEY_LENGTH, local_salt, SRTP_MASTER_SALT_LENGTH);
+				memcpy(dtls->local_policy.key, local_key, key_length);
+				memcpy(dtls->local_policy.key + key_length, local_salt, salt_length);
 				dtls->local_policy.window_size = 128;
 				dtls->local_policy.allow_repeat_tx = 0;
 				dtls->local_policy.next = NULL;
@@ -419,23 +730,80 @@ void janus_dtls_srtp_incoming_msg(janus_dtls_srtp *dtls, char *buf, uint16_t len
 				}
 			}
 done:
-			if(dtls->srtp_valid) {
-				/* Handshake successfully completed */
-				janus_ice_dtls_handshake_done(handle, component);
-			} else {
-				/* Something went wrong in either DTLS or SRTP... tell the plugin about it */
-				janus_dtls_callback(dtls->ssl, SSL_CB_ALERT, 0);
-			}
+			/* Either way, the core and the plugin are told once the stack is unlocked */
+			result = dtls->srtp_valid ? 1 : -1;
 		}
 	}
+	return result;
 }
 
 void janus_dtls_srtp_destroy(janus_dtls_srtp *dtls) {
 	if(dtls == NULL)
 		return;
-	/* TODO Actually destroy DTLS stack and free resources */
-	g_free(dtls);
-	dtls = NULL;
+	/* Get rid of what's still waiting: if a worker is handling this stack,
+	 * it will notice and stop, and the last reference will free the stack */
+	janus_mutex_lock(&dtls->mutex);
+	dtls->destroyed = TRUE;
+	janus_dtls_packet *packet = NULL;
+	while((packet = g_queue_pop_head(dtls->incoming)) != NULL) {
+		free(packet->data);
+		free(packet);
+	}
+	if(dtls->retransmit_timer != NULL) {
+		g_source_destroy(dtls->retransmit_timer);
+		g_source_unref(dtls->retransmit_timer);
+		dtls->retransmit_timer = NULL;
+	}
+	gint scheduled = dtls->scheduled;
+	janus_mutex_unlock(&dtls->mutex);
+	/* The worker may still be notifying the core about the last message it
+	 * processed, which uses the component, stream and handle of the stack:
+	 * they're freed right after this returns, so wait for it to be done */
+	while(scheduled) {
+		g_usleep(1000);
+		janus_mutex_lock(&dtls->mutex);
+		scheduled = dtls->scheduled;
+		janus_mutex_unlock(&dtls->mutex);
+	}
+	janus_dtls_srtp_unref(dtls);
+}
+
+static void janus_dtls_srtp_unref(janus_dtls_srtp *dtls) {
+	if(!g_atomic_int_dec_and_test(&dtls->ref))
+		return;
+	g_queue_free(dtls->incoming);
+	dtls->incoming = NULL;
+	janus_mutex_destroy(&dtls->mutex);
+	dtls->srtp_valid = 0;
+	/* The BIOs are owned by the SSL session, and freed along with it */
+	if(dtls->ssl != NULL) {
+		SSL_free(dtls->ssl);
+		dtls->ssl = NULL;
+	} else {
+		if(dtls->read_bio != NULL)
+			BIO_free(dtls->read_bio);
+		if(dtls->write_bio != NULL)
+			BIO_free(dtls->write_bio);
+	}
+	dtls->read_bio = NULL;
+	dtls->write_bio = NULL;
+	if(dtls->srtp_in != NULL) {
+		srtp_dealloc(dtls->srtp_in);
+		dtls->srtp_in = NULL;
+	}
+	if(dtls->srtp_out != NULL) {
+		srtp_dealloc(dtls->srtp_out);
+		dtls->srtp_out = NULL;
+	}
+	if(dtls->remote_policy.key != NULL) {
+		free(dtls->remote_policy.key);
+		dtls->remote_policy.key = NULL;
+	}
+	if(dtls->local_policy.key != NULL) {
+		free(dtls->local_policy.key);
+		dtls->local_policy.key = NULL;
+	}
+	free(dtls);
 }
 
 /* DTLS alert callback */
@@ -444,17 +812,10 @@ void janus_dtls_callback(const SSL *ssl, int where, int ret) {
 	if (!(where & SSL_CB_ALERT)) {
 		return;
 	}
-	janus_ice_handle *handle = SSL_get_ex_data(ssl, 0);
-	JANUS_PRINT("[%"SCNu64"] DTLS alert received, closing...\n", handle->handle_id);
-	if(handle && !handle->stop) {
-		handle->stop = 1;
-		janus_plugin *plugin = (janus_plugin *)handle->app;
-		if(plugin != NULL) {
-			JANUS_PRINT("[%"SCNu64"] Telling the plugin about it (%s)\n", handle->handle_id, plugin->get_name());
-			if(plugin && plugin->hangup_media)
-				plugin->hangup_media(handle->app_handle);
-		}
-	}
+	/* We're called by OpenSSL with the stack locked: the plugin is told later */
+	janus_dtls_srtp *dtls = SSL_get_ex_data(ssl, 1);
+	if(dtls != NULL)
+		dtls->alert = TRUE;
 }
 
 /* DTLS certificate verification callback */
@@ -494,51 +855,77 @@ void janus_dtls_fd_bridge(janus_dtls_srtp *dtls) {
 		//~ int bytes =
 			nice_agent_send(handle->agent, component->stream_id, component->component_id, out, outgoing);
 		//~ JANUS_PRINT("[%"SCNu64"] >> >> ... and sent %d of those bytes on the socket\n", handle->handle_id, bytes);
+	}
+}
 
-		/* Take note of the last sent message */
-		if(dtls->dtls_last_msg != NULL) {
-			g_free(dtls->dtls_last_msg);
-			dtls->dtls_last_msg = NULL;
-			dtls->dtls_last_len = 0;
-		}
-		dtls->dtls_last_msg = calloc(pending, sizeof(char));
-		if(dtls->dtls_last_msg == NULL) {
-			JANUS_DEBUG("Memory error!\n");
-			return;
-		}
-		memcpy(dtls->dtls_last_msg, &outgoing, out);
-		dtls->dtls_last_len = out;
+/* Helper to (re)schedule the retransmission timer, according to what OpenSSL says */
+static void janus_dtls_schedule_retransmission(janus_dtls_srtp *dtls) {
+	if(dtls == NULL)
+		return;
+	/* Get rid of the previous timer, if any */
+	if(dtls->retransmit_timer != NULL) {
+		g_source_destroy(dtls->retransmit_timer);
+		g_source_unref(dtls->retransmit_timer);
+		dtls->retransmit_timer = NULL;
 	}
+	janus_ice_component *component = (janus_ice_component *)dtls->component;
+	if(component == NULL || component->stream == NULL)
+		return;
+	janus_ice_handle *handle = component->stream->handle;
+	if(!handle || handle->stop || !handle->icectx || !dtls->ssl)
+		return;
+	if(dtls->dtls_state == JANUS_DTLS_STATE_CONNECTED || dtls->dtls_state == JANUS_DTLS_STATE_FAILED)
+		return;
+	struct timeval timeout;
+	if(DTLSv1_get_timeout(dtls->ssl, &timeout) <= 0) {
+		/* No timer running in OpenSSL, so nothing to retransmit */
+		return;
+	}
+	guint ms = timeout.tv_sec*1000 + timeout.tv_usec/1000;
+	if(ms == 0)
+		ms = 1;
+	dtls->retransmit_timer = g_timeout_source_new(ms);
+	g_source_set_callback(dtls->retransmit_timer, janus_dtls_retry, dtls, NULL);
+	g_source_attach(dtls->retransmit_timer, handle->icectx);
 }
 
 gboolean janus_dtls_retry(gpointer stack) {
 	janus_dtls_srtp *dtls = (janus_dtls_srtp *)stack;
 	if(dtls == NULL)
 		return FALSE;
-	janus_ice_component *component = (janus_ice_component *)dtls->component;
-	if(component == NULL)
-		return FALSE;
-	janus_ice_stream *stream = component->stream;
-	if(!stream)
-		return FALSE;
-	janus_ice_handle *handle = stream->handle;
-	if(!handle)
+	janus_mutex_lock(&dtls->mutex);
+	GSource *source = g_main_current_source();
+	if(source != NULL && g_source_is_destroyed(source)) {
+		/* A worker replaced this timer while we were waiting for the lock */
+		janus_mutex_unlock(&dtls->mutex);
 		return FALSE;
-	if(handle->stop)
+	}
+	/* This is a one-shot timer: GLib will destroy it when we return */
+	if(dtls->retransmit_timer != NULL && dtls->retransmit_timer == source) {
+		g_source_unref(dtls->retransmit_timer);
+		dtls->retransmit_timer = NULL;
+	}
+	janus_ice_component *component = (janus_ice_component *)dtls->component;
+	janus_ice_stream *stream = component ? component->stream : NULL;
+	janus_ice_handle *handle = stream ? stream->handle : NULL;
+	if(!handle || handle->stop) {
+		janus_mutex_unlock(&dtls->mutex);
 		return FALSE;
-	//~ struct timeval timeout;
-	//~ DTLSv1_get_timeout(dtls->ssl, &timeout);
-	//~ JANUS_PRINT("[%"SCNu64"] DTLSv1_get_timeout: %"SCNu64"\n", handle->handle_id, timeout.tv_sec*1000000+timeout.tv_usec);
-	//~ DTLSv1_handle_timeout(dtls->ssl);
-	//~ janus_dtls_fd_bridge(dtls);
-	JANUS_PRINT("[%"SCNu64"] A second has passed on component %d of stream %d\n", handle->handle_id, component->component_id, stream->stream_id);
+	}
 	if(dtls->dtls_state == JANUS_DTLS_STATE_CONNECTED) {
 		JANUS_PRINT("[%"SCNu64"]  DTLS already set up, disabling retransmission timer!\n", handle->handle_id);
+		janus_mutex_unlock(&dtls->mutex);
 		return FALSE;
 	}
-	if(dtls->dtls_last_msg != NULL) {
-		JANUS_PRINT("[%"SCNu64"]  Retransmitting last message (len=%d)\n", handle->handle_id, dtls->dtls_last_len);
-		nice_agent_send(handle->agent, component->stream_id, component->component_id, dtls->dtls_last_len, dtls->dtls_last_msg);
-	}
-	return TRUE;
+	/* Let OpenSSL retransmit what it needs to (doubling its timeout), and send it */
+	if(DTLSv1_handle_timeout(dtls->ssl) > 0) {
+		JANUS_PRINT("[%"SCNu64"]  Retransmitting DTLS message on component %d of stream %d\n", handle->handle_id, component->component_id, stream->stream_id);
+		janus_dtls_fd_bridge(dtls);
+	}
+	janus_dtls_schedule_retransmission(dtls);
+	gint result = dtls->alert ? -1 : 0;
+	dtls->alert = FALSE;
+	janus_mutex_unlock(&dtls->mutex);
+	janus_dtls_srtp_notify(dtls, result);
+	return FALSE;
 }
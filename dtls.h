@@ -21,12 +21,31 @@
 #include <openssl/ssl.h>
 #include <srtp/srtp.h>
 
+#include "mutex.h"
+
 
 /*! \brief DTLS stuff initialization
+ * \note When \c ecdsa is TRUE, the certificate and key on file are not
+ * used for DTLS (they're still used for HTTPS, though): an ephemeral ECDSA
+ * (P-256) certificate is generated in memory instead, which makes handshakes
+ * much cheaper than with RSA certificates
  * @param[in] server_pem Path to the certificate to use
  * @param[in] server_key Path to the key to use
+ * @param[in] ecdsa Whether an ephemeral ECDSA certificate should be generated and used for DTLS
+ * @returns 0 in case of success, a negative integer on errors */
+gint janus_dtls_srtp_init(gchar *server_pem, gchar *server_key, gboolean ecdsa);
+/*! \brief DTLS workers initialization
+ * \details DTLS handshakes are expensive, and so processing them on the ICE
+ * threads means that, during a mass join, a lot of CPU is contended by
+ * handshakes at the same time. When workers are enabled, incoming DTLS
+ * messages are queued instead, and processed by a bounded pool of threads
+ * (each stack being handled by a single worker at a time, in order to
+ * preserve ordering): outgoing flights are still sent via janus_dtls_fd_bridge.
+ * @param[in] workers Number of workers to start (0 means messages are processed by the ICE threads)
  * @returns 0 in case of success, a negative integer on errors */
-gint janus_dtls_srtp_init(gchar *server_pem, gchar *server_key);
+gint janus_dtls_workers_init(gint workers);
+/*! \brief DTLS workers deinitialization */
+void janus_dtls_workers_deinit(void);
 /*! \brief Method to return the shared SSL_CTX instance */
 SSL_CTX *janus_dtls_get_ssl_ctx(void);
 /*! \brief Method to return a string representation (SHA-256) of the certificate fingerprint */
@@ -64,6 +83,8 @@ typedef struct janus_dtls_srtp {
 	BIO *write_bio;
 	/*! \brief Whether SRTP has been correctly set up for this component or not */
 	gint srtp_valid;
+	/*! \brief DTLS-SRTP protection profile negotiated for this component (e.g., SRTP_AES128_CM_SHA1_80), 0 if none yet */
+	unsigned long srtp_profile;
 	/*! \brief libsrtp context for incoming SRTP packets */
 	srtp_t srtp_in;
 	/*! \brief libsrtp context for outgoing SRTP packets */
@@ -72,10 +93,21 @@ typedef struct janus_dtls_srtp {
 	srtp_policy_t remote_policy;
 	/*! \brief libsrtp policy for outgoing SRTP packets */
 	srtp_policy_t local_policy;
-	/*! \brief Buffer of the last message the DTLS client tried to send (needed for retransmissions) */
-	char *dtls_last_msg;
-	/*! \brief Length of the last message the DTLS client tried to send (needed for retransmissions) */
-	gint dtls_last_len;
+	/*! \brief Retransmission timer, attached to the handle loop only while a handshake is pending */
+	GSource *retransmit_timer;
+	/*! \brief Incoming DTLS messages waiting for a worker, if DTLS workers are enabled */
+	GQueue *incoming;
+	/*! \brief Whether this stack has been handed to a worker already */
+	gint scheduled;
+	/*! \brief Whether a DTLS alert was received while processing a message, and the plugin should be told */
+	gboolean alert;
+	/*! \brief Whether this stack has been destroyed (the worker handling it, if any, frees it when done) */
+	gboolean destroyed;
+	/*! \brief Reference counter: the owner holds one, and so does the worker the stack is scheduled on (until it has cleared scheduled) */
+	volatile gint ref;
+	/*! \brief Mutex to lock/unlock this stack, as workers, timers and ICE threads may all access it
+	 * \note The mutex is never held when calling into the core or plugins (e.g., when the handshake completes) */
+	janus_mutex mutex;
 } janus_dtls_srtp;
 
 
@@ -93,10 +125,14 @@ void janus_dtls_srtp_handshake(janus_dtls_srtp *dtls);
  * @param[in] len The DTLS message data lenght */
 void janus_dtls_srtp_incoming_msg(janus_dtls_srtp *dtls, char *buf, uint16_t len);
 /*! \brief Destroy a janus_dtls_srtp instance
+ * \note If a DTLS worker is still handling the instance, this waits for it to be done, as it may be
+ * using the component, stream and handle the instance belongs to: must not be called by a DTLS worker
  * @param[in] dtls The janus_dtls_srtp instance to destroy */
 void janus_dtls_srtp_destroy(janus_dtls_srtp *dtls);
 
 /*! \brief DTLS alert callback (http://www.openssl.org/docs/ssl/SSL_CTX_set_info_callback.html)
+ * \note OpenSSL invokes this with the stack locked, so the alert is only marked here, and
+ * the plugin is told about it once the stack is unlocked
  * @param[in] ssl SSL instance where the alert occurred
  * @param[in] where The context where the event occurred
  * @param[in] ret The error code */
@@ -113,11 +149,18 @@ int janus_dtls_verify_callback(int preverify_ok, X509_STORE_CTX *ctx);
  * @param[in] dtls The janus_dtls_srtp instance to use */
 void janus_dtls_fd_bridge(janus_dtls_srtp *dtls);
 
+/*! \brief Set the SRTP and SRTCP crypto policies matching a DTLS-SRTP profile
+ * @param[in] policy The libsrtp policy to update
+ * @param[in] profile The DTLS-SRTP profile (e.g., SRTP_AES128_CM_SHA1_80) */
+void janus_dtls_srtp_set_crypto_policy(srtp_policy_t *policy, unsigned long profile);
+
 /*! \brief DTLS retransmission timer
  * \details As libnice is going to actually send and receive data, OpenSSL cannot handle retransmissions by itself: this timed callback (g_source_set_callback) deals with this.
- * \todo Improve the rough mechanics implemented here by using DTLSv1_get_timeout() and DTLSv1_handle_timeout() to handle timeout and re-transmissions.
+ * The timer is a one-shot source, scheduled on the handle loop according to DTLSv1_get_timeout() (which
+ * implements the exponential backoff) whenever the handshake moves on: when it fires, DTLSv1_handle_timeout()
+ * makes OpenSSL retransmit its last flight, and the timer is scheduled again until the handshake is over.
  * @param[in] stack Opaque pointer to the janus_dtls_srtp instance to use
- * @returns true if a retransmission is still needed, false otherwise */
+ * @returns Always false, as the timer is re-scheduled explicitly if needed */
 gboolean janus_dtls_retry(gpointer stack);
 
 
@@ -0,0 +1,227 @@
+/*! \file    gop.c
+ * \author   Lorenzo Miniero <lorenzo@meetecho.com>
+ * \copyright GNU Affero General Public License v3
+ * \brief    VP8 keyframe cache
+ * \details  Implementation of a simple cache of the latest group of
+ * pictures (GOP) of a VP8 stream, that plugins can replay to new peers
+ * so that they don't have to wait for the next keyframe. Keyframes are
+ * detected by looking at the VP8 payload descriptor and payload header
+ * (http://tools.ietf.org/html/rfc7741).
+ *
+ * \ingroup protocols
+ * \ref protocols
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "gop.h"
+#include "rtp.h"
+#include "debug.h"
+
+
+/* Buffers for the cache are allocated this many packets at a time */
+#define JANUS_GOP_CHUNK		64
+
+
+/* Helper to get to the payload of an RTP packet, skipping CSRCs and extensions */
+static const unsigned char *janus_gop_payload(const char *buf, int len, int *plen) {
+	if(buf == NULL || len < RTP_HEADER_SIZE)
+		return NULL;
+	rtp_header *header = (rtp_header *)buf;
+	int offset = RTP_HEADER_SIZE + header->csrccount*4;
+	if(header->extension) {
+		if(len < offset+4)
+			return NULL;
+		const unsigned char *ext = (const unsigned char *)buf+offset;
+		offset += 4 + ((ext[2] << 8) | ext[3])*4;
+	}
+	if(len <= offset)
+		return NULL;
+	*plen = len - offset;
+	return (const unsigned char *)buf+offset;
+}
+
+gboolean janus_gop_is_keyframe(const char *buf, int len) {
+	int plen = 0;
+	const unsigned char *payload = janus_gop_payload(buf, len, &plen);
+	if(payload == NULL)
+		return FALSE;
+	/* Payload descriptor: we need the start of partition 0 (S=1, PID=0) */
+	if(!(payload[0] & 0x10) || (payload[0] & 0x07))
+		return FALSE;
+	int offset = 1;
+	if(payload[0] & 0x80) {
+		/* Extended control bits */
+		if(plen < 2)
+			return FALSE;
+		unsigned char x = payload[1];
+		offset++;
+		if(x & 0x80) {
+			/* PictureID, one or two bytes */
+			if(plen <= offset)
+				return FALSE;
+			offset += (payload[offset] & 0x80) ? 2 : 1;
+		}
+		if(x & 0x40)	/* TL0PICIDX */
+			offset++;
+		if(x & 0x30)	/* TID/KEYIDX */
+			offset++;
+	}
+	if(plen <= offset)
+		return FALSE;
+	/* Payload header: the inverse key frame flag must be 0 */
+	return !(payload[offset] & 0x01);
+}
+
+
+janus_gop *janus_gop_new(void) {
+	janus_gop *gop = calloc(1, sizeof(janus_gop));
+	if(gop == NULL) {
+		JANUS_DEBUG("Memory error!\n");
+		return NULL;
+	}
+	gop->packets = NULL;
+	gop->count = 0;
+	gop->size = 0;
+	gop->valid = FALSE;
+	janus_mutex_init(&gop->mutex);
+	return gop;
+}
+
+void janus_gop_add(janus_gop *gop, const char *buf, int len) {
+	if(gop == NULL || buf == NULL || len < RTP_HEADER_SIZE)
+		return;
+	if(janus_gop_is_keyframe(buf, len)) {
+		/* New GOP: the buffers are reused */
+		gop->count = 0;
+		gop->valid = TRUE;
+	}
+	if(!gop->valid)
+		return;
+	if(len > JANUS_GOP_MAX_PACKET) {
+		gop->valid = FALSE;
+		return;
+	}
+	if(gop->count > 0) {
+		/* A lost (or reordered) packet would make the replay useless */
+		rtp_header *last = (rtp_header *)gop->packets[gop->count-1].data;
+		if((uint16_t)(ntohs(((rtp_header *)buf)->seq_number) - ntohs(last->seq_number)) != 1) {
+			gop->valid = FALSE;
+			return;
+		}
+	}
+	if(gop->count == gop->size) {
+		if(gop->size >= JANUS_GOP_MAX_PACKETS) {
+			/* Too long, we'll wait for the next keyframe */
+			gop->valid = FALSE;
+			return;
+		}
+		janus_gop_packet *packets = realloc(gop->packets, (gop->size+JANUS_GOP_CHUNK)*sizeof(janus_gop_packet));
+		if(packets == NULL) {
+			JANUS_DEBUG("Memory error!\n");
+			gop->valid = FALSE;
+			return;
+		}
+		gop->packets = packets;
+		gop->size += JANUS_GOP_CHUNK;
+	}
+	janus_gop_packet *packet = &gop->packets[gop->count++];
+	memcpy(packet->data, buf, len);
+	packet->length = len;
+}
+
+void janus_gop_reset(janus_gop *gop) {
+	if(gop == NULL)
+		return;
+	gop->count = 0;
+	gop->valid = FALSE;
+}
+
+janus_gop_copy *janus_gop_copy_new(janus_gop *gop) {
+	if(gop == NULL || !gop->valid || gop->count == 0)
+		return NULL;
+	if(gop->count > JANUS_GOP_REPLAY_MAX) {
+		JANUS_LOG(LOG_VERB, "GOP too long to be replayed (%u packets)\n", gop->count);
+		return NULL;
+	}
+	janus_gop_copy *copy = calloc(1, sizeof(janus_gop_copy));
+	if(copy != NULL)	/* Room for the live packets that will be queued, too */
+		copy->packets = malloc((gop->count+JANUS_GOP_REPLAY_BURST)*sizeof(janus_gop_packet));
+	if(copy == NULL || copy->packets == NULL) {
+		JANUS_DEBUG("Memory error!\n");
+		free(copy);
+		return NULL;
+	}
+	copy->size = gop->count+JANUS_GOP_REPLAY_BURST;
+	copy->first = 0;
+	copy->count = gop->count;
+	/* How many frames (i.e., different timestamps) are there? */
+	guint frames = 1, i = 0;
+	for(i=1; i<gop->count; i++) {
+		if(((rtp_header *)gop->packets[i].data)->timestamp != ((rtp_header *)gop->packets[i-1].data)->timestamp)
+			frames++;
+	}
+	rtp_header *last = (rtp_header *)gop->packets[gop->count-1].data;
+	uint16_t last_seq = ntohs(last->seq_number);
+	uint32_t last_ts = ntohl(last->timestamp);
+	/* The last frame keeps its timestamp, the previous ones are squeezed right before it */
+	guint frame = 0;
+	for(i=0; i<gop->count; i++) {
+		janus_gop_packet *packet = &gop->packets[i];
+		if(i > 0 && ((rtp_header *)packet->data)->timestamp != ((rtp_header *)gop->packets[i-1].data)->timestamp)
+			frame++;
+		janus_gop_packet *replayed = &copy->packets[i];
+		memcpy(replayed->data, packet->data, packet->length);
+		replayed->length = packet->length;
+		rtp_header *header = (rtp_header *)replayed->data;
+		header->seq_number = htons(last_seq - (gop->count-1-i));
+		header->timestamp = htonl(last_ts - (frames-1-frame)*JANUS_GOP_REPLAY_STEP);
+	}
+	return copy;
+}
+
+gboolean janus_gop_copy_relay(janus_gop_copy *copy, char *buf, int len, void (*send)(char *buf, int len, gpointer user_data), gpointer user_data) {
+	if(copy == NULL)
+		return TRUE;
+	/* As we send more packets than we queue, there's always room, unless the packet is too large */
+	gboolean queued = FALSE;
+	if(buf != NULL && len > 0 && len <= JANUS_GOP_MAX_PACKET && copy->count < copy->size) {
+		janus_gop_packet *packet = &copy->packets[(copy->first+copy->count) % copy->size];
+		memcpy(packet->data, buf, len);
+		packet->length = len;
+		copy->count++;
+		queued = TRUE;
+	}
+	/* Don't flood the peer (and the network) with the whole GOP at once:
+	 * if the live packet wasn't queued, though, we have to catch up now */
+	guint burst = queued ? JANUS_GOP_REPLAY_BURST : copy->count;
+	while(copy->count > 0 && burst > 0) {
+		janus_gop_packet *packet = &copy->packets[copy->first];
+		if(send != NULL)
+			send(packet->data, packet->length, user_data);
+		copy->first = (copy->first+1) % copy->size;
+		copy->count--;
+		burst--;
+	}
+	if(!queued && buf != NULL && len > 0 && send != NULL)
+		send(buf, len, user_data);
+	return copy->count == 0;
+}
+
+void janus_gop_copy_free(janus_gop_copy *copy) {
+	if(copy == NULL)
+		return;
+	free(copy->packets);
+	free(copy);
+}
+
+void janus_gop_free(janus_gop *gop) {
+	if(gop == NULL)
+		return;
+	free(gop->packets);
+	gop->packets = NULL;
+	janus_mutex_destroy(&gop->mutex);
+	free(gop);
+}
@@ -0,0 +1,137 @@
+/*! \file    gop.h
+ * \author   Lorenzo Miniero <lorenzo@meetecho.com>
+ * \copyright GNU Affero General Public License v3
+ * \brief    VP8 keyframe cache (headers)
+ * \details  Implementation of a simple cache of the latest group of
+ * pictures (GOP) of a VP8 stream, that is all the packets received since
+ * the most recent keyframe. Plugins relaying video to several peers
+ * (e.g., Streaming mountpoints and VideoRoom publishers) can replay the
+ * cache to a new peer before it joins the live flow: this way the peer
+ * can start decoding right away, rather than waiting for the next
+ * keyframe (which may take seconds, or which the source may not be able
+ * to send on demand at all).
+ *
+ * Replayed packets get sequence numbers that end right before the next
+ * live packet, and timestamps squeezed in the few milliseconds before
+ * the latest frame: the live flow then continues as it is, with no need
+ * to fix the packets each peer gets from then on.
+ *
+ * The cache is copied while the owner holds its mutex, at the same time
+ * the peer is added to the live flow, and the copy is then sent by the
+ * thread relaying the live packets, as part of the live flow itself:
+ * each live packet for the peer is queued behind the copy, and a few
+ * queued packets (\c JANUS_GOP_REPLAY_BURST) are sent in its place, until
+ * the peer has caught up. This way the peer gets all packets in order,
+ * and they're always sent by the same thread (which is what SRTP needs).
+ * GOPs longer than \c JANUS_GOP_REPLAY_MAX packets are not replayed at
+ * all, as that's more than a new peer would be able to digest anyway.
+ *
+ * \note This code is used by plugins as well, so it must not depend
+ * on any other part of the gateway core.
+ *
+ * \ingroup protocols
+ * \ref protocols
+ */
+
+#ifndef _JANUS_GOP_H
+#define _JANUS_GOP_H
+
+#include <glib.h>
+
+#include "mutex.h"
+
+
+/*! \brief Maximum size of a packet in the cache */
+#define JANUS_GOP_MAX_PACKET	1500
+/*! \brief Maximum number of packets in the cache: longer GOPs are not cached */
+#define JANUS_GOP_MAX_PACKETS	2048
+/*! \brief Timestamp difference (90kHz units) between frames when replaying the cache */
+#define JANUS_GOP_REPLAY_STEP	90
+/*! \brief Maximum number of packets to replay: longer GOPs are not replayed */
+#define JANUS_GOP_REPLAY_MAX	512
+/*! \brief Number of queued packets sent for each live packet, while replaying */
+#define JANUS_GOP_REPLAY_BURST	32
+
+/*! \brief Packet in the cache */
+typedef struct janus_gop_packet {
+	/*! \brief The RTP packet */
+	char data[JANUS_GOP_MAX_PACKET];
+	/*! \brief Length of the packet */
+	guint16 length;
+} janus_gop_packet;
+
+/*! \brief Cache of the latest group of pictures of a VP8 stream */
+typedef struct janus_gop {
+	/*! \brief Packets since the latest keyframe (buffers are reused from one GOP to the next) */
+	janus_gop_packet *packets;
+	/*! \brief Number of packets in the cache */
+	guint count;
+	/*! \brief Number of packets the buffers have room for */
+	guint size;
+	/*! \brief Whether the cache starts with a keyframe and has no holes */
+	gboolean valid;
+	/*! \brief Mutex to lock/unlock the cache: the owner should also hold it while relaying live packets, so that the cache can be copied right when a peer is added to the live flow */
+	janus_mutex mutex;
+} janus_gop;
+
+/*! \brief Copy of a cache, ready to be replayed */
+typedef struct janus_gop_copy {
+	/*! \brief Packets to send (a ring), with sequence numbers and timestamps already rewritten: live packets are queued behind the copy */
+	janus_gop_packet *packets;
+	/*! \brief Number of packets the ring has room for */
+	guint size;
+	/*! \brief Index of the next packet to send */
+	guint first;
+	/*! \brief Number of packets still to send */
+	guint count;
+} janus_gop_copy;
+
+
+/** @name Janus VP8 keyframe cache
+ */
+///@{
+/*! \brief Method to check whether an RTP packet contains the beginning of a VP8 keyframe
+ * @param[in] buf The RTP packet
+ * @param[in] len The length of the packet
+ * @returns TRUE if this is the first packet of a keyframe, FALSE otherwise */
+gboolean janus_gop_is_keyframe(const char *buf, int len);
+/*! \brief Method to create a new (empty) cache
+ * @returns A new janus_gop instance in case of success, NULL otherwise */
+janus_gop *janus_gop_new(void);
+/*! \brief Method to add a VP8 packet to the cache: a keyframe resets it
+ * \note The caller must hold the cache mutex
+ * @param[in] gop The cache to update
+ * @param[in] buf The RTP packet
+ * @param[in] len The length of the packet */
+void janus_gop_add(janus_gop *gop, const char *buf, int len);
+/*! \brief Method to empty the cache (e.g., because the source changed)
+ * \note The caller must hold the cache mutex
+ * @param[in] gop The cache to empty */
+void janus_gop_reset(janus_gop *gop);
+/*! \brief Method to copy the cache for a new peer, to replay it later
+ * \note The caller must hold the cache mutex, and should add the peer to
+ * the live flow before releasing it
+ * @param[in] gop The cache to copy
+ * @returns A new janus_gop_copy instance, or NULL if the cache is empty, not valid or too long to be replayed */
+janus_gop_copy *janus_gop_copy_new(janus_gop *gop);
+/*! \brief Method to relay a live packet to a peer that is still being sent a copy
+ * of the cache: the live packet is queued behind the copy, and a few queued
+ * packets are sent in its place
+ * \note This must be called by the thread relaying live packets, with the
+ * cache mutex held, in place of sending the live packet to the peer
+ * @param[in] copy The copy being replayed
+ * @param[in] buf The live packet (as it would be sent to the peer)
+ * @param[in] len The length of the live packet
+ * @param[in] send Callback to invoke for each packet to send (the packet can be modified)
+ * @param[in] user_data Opaque pointer to pass to the callback
+ * @returns TRUE if the peer has caught up (the copy can be freed), FALSE otherwise */
+gboolean janus_gop_copy_relay(janus_gop_copy *copy, char *buf, int len, void (*send)(char *buf, int len, gpointer user_data), gpointer user_data);
+/*! \brief Method to free a copy of a cache, whether it was replayed or not
+ * @param[in] copy The copy to free */
+void janus_gop_copy_free(janus_gop_copy *copy);
+/*! \brief Method to free a cache
+ * @param[in] gop The cache to free */
+void janus_gop_free(janus_gop *gop);
+///@}
+
+#endif
@@ -81,6 +81,10 @@ $(document).ready(function() {
 												$('#status').removeClass('hide').text("Starting, please wait...").show();
 											else if(status === 'started')
 												$('#status').removeClass('hide').text("Started").show();
+											else if(status === 'inactive')
+												$('#status').removeClass('hide').text("The stream is not available at the moment, please wait...").show();
+											else if(status === 'active')
+												$('#status').removeClass('hide').text("Started").show();
 											else if(status === 'stopped')
 												stopStream();
 										}
@@ -24,6 +24,8 @@
 #include "rtp.h"
 #include "rtcp.h"
 #include "apierror.h"
+#include "metrics.h"
+#include "queue.h"
 
 
 /* STUN server/port, if any */
@@ -66,6 +68,182 @@ gint janus_ice_init(gchar *stun_server, uint16_t stun_port) {
 	return 0;
 }
 
+/* RTP relay workers: when enabled, outgoing RTP packets are protected and
+ * sent by a fixed set of threads rather than by the thread relaying them
+ * (e.g., the ICE thread of a VideoRoom publisher). Each handle always goes
+ * through the same worker, which preserves ordering and keeps its SRTP
+ * context hot in the cache of the core that worker runs on, while the
+ * fan-out to many listeners is spread on more cores. Queues are bounded: a
+ * worker that can't keep up drops the oldest packets, rather than adding
+ * latency and eating memory forever. */
+#define JANUS_ICE_RELAY_QUEUE_MAX	8192
+/* Packets are copied in buffers each worker keeps in a pool, rather than
+ * allocated (and freed) one by one: only larger than usual packets are */
+#define JANUS_ICE_RELAY_POOL_SIZE	512
+#define JANUS_ICE_RELAY_PACKET_SIZE	(1500+SRTP_MAX_TRAILER_LEN)
+typedef struct janus_ice_relay_packet {
+	janus_ice_handle *handle;
+	int video;
+	int len;
+	/* Whether this buffer can go back to the pool when done */
+	gboolean pooled;
+	/* Next unused buffer, when in the pool */
+	struct janus_ice_relay_packet *next;
+	/* Allocated with room for the SRTP trailer too, as we protect in place */
+	char data[];
+} janus_ice_relay_packet;
+typedef struct janus_ice_relay_worker {
+	GThread *thread;
+	GAsyncQueue *queue;
+	/* Unused buffers: only accessed with the lock of the queue held */
+	janus_ice_relay_packet *pool;
+	guint pool_size;
+} janus_ice_relay_worker;
+static janus_ice_relay_packet janus_ice_relay_exit;
+static gint relay_workers_num = 0;
+static janus_ice_relay_worker *relay_workers = NULL;
+static void *janus_ice_relay_thread(void *data);
+static void janus_ice_relay_packet_drop(gpointer data);
+static void janus_ice_relay_rtp_protect(janus_ice_handle *handle, int video, char *sbuf, int len);
+
+/* Get a buffer for a packet from the pool of a worker (queue lock held) */
+static janus_ice_relay_packet *janus_ice_relay_packet_get(janus_ice_relay_worker *worker, int len) {
+	janus_ice_relay_packet *packet = NULL;
+	if(len+SRTP_MAX_TRAILER_LEN > JANUS_ICE_RELAY_PACKET_SIZE) {
+		packet = malloc(sizeof(janus_ice_relay_packet)+len+SRTP_MAX_TRAILER_LEN);
+		if(packet != NULL)
+			packet->pooled = FALSE;
+		return packet;
+	}
+	if(worker->pool != NULL) {
+		packet = worker->pool;
+		worker->pool = packet->next;
+		worker->pool_size--;
+		return packet;
+	}
+	/* The worker is lagging behind, the pool will grow back when it catches up */
+	packet = malloc(sizeof(janus_ice_relay_packet)+JANUS_ICE_RELAY_PACKET_SIZE);
+	if(packet != NULL)
+		packet->pooled = TRUE;
+	return packet;
+}
+
+/* Give a buffer back to the pool of a worker, if there's room (queue lock held) */
+static void janus_ice_relay_packet_put(janus_ice_relay_worker *worker, janus_ice_relay_packet *packet) {
+	if(packet == NULL)
+		return;
+	if(!packet->pooled || worker->pool_size >= JANUS_ICE_RELAY_POOL_SIZE) {
+		free(packet);
+		return;
+	}
+	packet->next = worker->pool;
+	worker->pool = packet;
+	worker->pool_size++;
+}
+
+gint janus_ice_relay_workers_init(gint workers) {
+	if(workers < 1) {
+		JANUS_PRINT("RTP packets will be relayed by the threads sending them\n");
+		return 0;
+	}
+	relay_workers = calloc(workers, sizeof(janus_ice_relay_worker));
+	if(relay_workers == NULL) {
+		JANUS_DEBUG("Memory error!\n");
+		return -1;
+	}
+	gint i = 0;
+	for(i=0; i<workers; i++) {
+		janus_ice_relay_worker *worker = &relay_workers[i];
+		worker->queue = g_async_queue_new_full(janus_ice_relay_packet_drop);
+		guint j = 0;
+		for(j=0; j<JANUS_ICE_RELAY_POOL_SIZE; j++) {
+			janus_ice_relay_packet *packet = malloc(sizeof(janus_ice_relay_packet)+JANUS_ICE_RELAY_PACKET_SIZE);
+			if(packet == NULL)
+				break;
+			packet->pooled = TRUE;
+			janus_ice_relay_packet_put(worker, packet);
+		}
+		GError *error = NULL;
+		worker->thread = g_thread_try_new("janus relay", janus_ice_relay_thread, worker, &error);
+		if(error != NULL) {
+			JANUS_DEBUG("Got error %d (%s) trying to launch the RTP relay workers...\n", error->code, error->message ? error->message : "??");
+			relay_workers_num = i+1;
+			janus_ice_relay_workers_deinit();
+			return -1;
+		}
+	}
+	relay_workers_num = workers;
+	JANUS_PRINT("RTP packets will be relayed by %d workers\n", workers);
+	return 0;
+}
+
+void janus_ice_relay_workers_deinit(void) {
+	gint workers = relay_workers_num, i = 0;
+	/* From now on, packets are relayed right away again */
+	relay_workers_num = 0;
+	for(i=0; i<workers; i++) {
+		janus_ice_relay_worker *worker = &relay_workers[i];
+		if(worker->thread != NULL) {
+			/* Packets still queued after the exit one are dropped when the queue is unreferenced */
+			g_async_queue_push(worker->queue, &janus_ice_relay_exit);
+			g_thread_join(worker->thread);
+		}
+		g_async_queue_unref(worker->queue);
+		while(worker->pool != NULL) {
+			janus_ice_relay_packet *packet = worker->pool;
+			worker->pool = packet->next;
+			free(packet);
+		}
+	}
+	free(relay_workers);
+	relay_workers = NULL;
+}
+
+static void *janus_ice_relay_thread(void *data) {
+	janus_ice_relay_worker *worker = (janus_ice_relay_worker *)data;
+	janus_ice_relay_packet *packet = NULL, *done = NULL;
+	while(TRUE) {
+		/* The buffer of the previous packet goes back to the pool while we wait for the next one */
+		g_async_queue_lock(worker->queue);
+		janus_ice_relay_packet_put(worker, done);
+		packet = g_async_queue_pop_unlocked(worker->queue);
+		g_async_queue_unlock(worker->queue);
+		if(packet == &janus_ice_relay_exit)
+			break;
+		janus_ice_handle *handle = packet->handle;
+		if(!handle->stop)
+			janus_ice_relay_rtp_protect(handle, packet->video, packet->data, packet->len);
+		g_atomic_int_add(&handle->relay_pending, -1);
+		done = packet;
+	}
+	return NULL;
+}
+
+/* Packets dropped by a full queue (or left in it at shutdown) still count as handled */
+static void janus_ice_relay_packet_drop(gpointer data) {
+	janus_ice_relay_packet *packet = (janus_ice_relay_packet *)data;
+	if(packet == NULL || packet == &janus_ice_relay_exit)
+		return;
+	g_atomic_int_add(&packet->handle->relay_pending, -1);
+	free(packet);
+}
+
+/* Stop relaying packets for a handle: as the stop flag is set with the lock
+ * of the relay queue of the handle held, no packet can be queued for it after
+ * this returns, and relay_pending can only go down */
+static void janus_ice_relay_stop(janus_ice_handle *handle) {
+	gint workers = relay_workers_num;
+	if(workers < 1) {
+		handle->stop = 1;
+		return;
+	}
+	GAsyncQueue *queue = relay_workers[handle->handle_id % workers].queue;
+	g_async_queue_lock(queue);
+	handle->stop = 1;
+	g_async_queue_unlock(queue);
+}
+
+
 /* ICE stuff */
 static const gchar *janus_ice_state_name[] = 
 {
@@ -83,33 +261,64 @@ const gchar *janus_get_ice_state_name(gint state) {
 }
 
 /* ICE Handless */
+/* Retired WebRTC setups and plugin handles are only freed after a few seconds (see janus_ice_free_destroyed_handles) */
+#define JANUS_ICE_HANDLE_GRACE	5
+/* Handles are freed by the sessions watchdog as soon as their last reference
+ * is gone, as that may happen on a thread freeing them would have to join
+ * (e.g., their own ICE thread, relaying media for an echo) */
+static GList *old_handles = NULL;
+/* What plugins get as their handle: it's detached from the ICE handle when
+ * that is destroyed, but plugins may keep on using it for a while (e.g., relay
+ * threads going through their old lists of peers) and have no way to tell the
+ * core when they're done, so it's only freed after a grace period */
+typedef struct janus_ice_app_handle {
+	janus_pluginession app_handle;	/* Must be the first member, this is what plugins get */
+	volatile gint users;	/* Callbacks getting the ICE handle out of this right now */
+	gint64 retired;
+} janus_ice_app_handle;
+static GList *old_app_handles = NULL;
+static janus_mutex old_handles_mutex = JANUS_MUTEX_INITIALIZER;
+
 janus_ice_handle *janus_ice_handle_create(void *gateway_session) {
 	if(gateway_session == NULL)
 		return NULL;
 	janus_session *session = (janus_session *)gateway_session;
-	guint64 handle_id = 0;
-	while(handle_id == 0) {
-		handle_id = g_random_int();
-		if(janus_ice_handle_find(gateway_session, handle_id) != NULL) {
-			/* Handle ID already taken, try another one */
-			handle_id = 0;
-		}
-	}
-	JANUS_PRINT("Creating new handle in session %"SCNu64": %"SCNu64"\n", session->session_id, handle_id);
 	janus_ice_handle *handle = (janus_ice_handle *)calloc(1, sizeof(janus_ice_handle));
 	if(handle == NULL) {
 		JANUS_DEBUG("Memory error!\n");
 		return NULL;
 	}
 	handle->session = gateway_session;
-	handle->handle_id = handle_id;
 	handle->app = NULL;
 	handle->app_handle = NULL;
+	handle->ref = 2;	/* One for the session, one for the caller */
+	handle->trace = janus_trace_create();
 	janus_mutex_init(&handle->mutex);
-		/* Setup other stuff */
+	janus_mutex_lock(&session->mutex);
+	if(session->destroy) {
+		/* Too late, the session is going away */
+		janus_mutex_unlock(&session->mutex);
+		janus_trace_destroy(handle->trace);
+		janus_mutex_destroy(&handle->mutex);
+		free(handle);
+		return NULL;
+	}
 	if(session->ice_handles == NULL)
 		session->ice_handles = g_hash_table_new(NULL, NULL);
+	guint64 handle_id = 0;
+	while(handle_id == 0) {
+		handle_id = g_random_int();
+		if(g_hash_table_lookup(session->ice_handles, GUINT_TO_POINTER(handle_id)) != NULL) {
+			/* Handle ID already taken, try another one */
+			handle_id = 0;
+		}
+	}
+	handle->handle_id = handle_id;
 	g_hash_table_insert(session->ice_handles, GUINT_TO_POINTER(handle_id), handle);
+	/* The session can't be freed before its handles */
+	janus_session_ref(session);
+	janus_mutex_unlock(&session->mutex);
+	JANUS_PRINT("Creating new handle in session %"SCNu64": %"SCNu64"\n", session->session_id, handle_id);
 	return handle;
 }
 
@@ -117,7 +326,39 @@ janus_ice_handle *janus_ice_handle_find(void *gateway_session, guint64 handle_id
 	if(gateway_session == NULL)
 		return NULL;
 	janus_session *session = (janus_session *)gateway_session;
-	return session->ice_handles ? g_hash_table_lookup(session->ice_handles, GUINT_TO_POINTER(handle_id)) : NULL;
+	janus_mutex_lock(&session->mutex);
+	janus_ice_handle *handle = session->ice_handles ? g_hash_table_lookup(session->ice_handles, GUINT_TO_POINTER(handle_id)) : NULL;
+	if(handle != NULL)
+		janus_ice_handle_ref(handle);
+	janus_mutex_unlock(&session->mutex);
+	return handle;
+}
+
+void janus_ice_handle_ref(janus_ice_handle *handle) {
+	if(handle == NULL)
+		return;
+	g_atomic_int_inc(&handle->ref);
+}
+
+void janus_ice_handle_unref(janus_ice_handle *handle) {
+	if(handle == NULL || !g_atomic_int_dec_and_test(&handle->ref))
+		return;
+	/* Nobody is using the handle anymore: the sessions watchdog will free it */
+	janus_mutex_lock(&old_handles_mutex);
+	old_handles = g_list_append(old_handles, handle);
+	janus_mutex_unlock(&old_handles_mutex);
+}
+
+janus_ice_handle *janus_ice_handle_from_app(janus_pluginession *app_handle) {
+	if(app_handle == NULL)
+		return NULL;
+	/* Destroying the handle waits for us before it releases its reference */
+	janus_ice_app_handle *app = (janus_ice_app_handle *)app_handle;
+	g_atomic_int_inc(&app->users);
+	janus_ice_handle *handle = (janus_ice_handle *)g_atomic_pointer_get(&app_handle->gateway_handle);
+	janus_ice_handle_ref(handle);
+	g_atomic_int_add(&app->users, -1);
+	return handle;
 }
 
 gint janus_ice_handle_attach_plugin(void *gateway_session, guint64 handle_id, janus_plugin *plugin) {
@@ -130,20 +371,26 @@ gint janus_ice_handle_attach_plugin(void *gateway_session, guint64 handle_id, ja
 	if(handle == NULL)
 		return JANUS_ERROR_HANDLE_NOT_FOUND;
 	int error = 0;
-	janus_pluginession *session_handle = calloc(1, sizeof(janus_pluginession));
-	if(session_handle == NULL) {
+	janus_ice_app_handle *app = calloc(1, sizeof(janus_ice_app_handle));
+	if(app == NULL) {
 		JANUS_DEBUG("Memory error!\n");
+		janus_ice_handle_unref(handle);
 		return JANUS_ERROR_UNKNOWN;	/* FIXME Do we need something like "Internal Server Error"? */
 	}
+	janus_pluginession *session_handle = &app->app_handle;
 	session_handle->gateway_handle = handle;
 	session_handle->plugin_handle = NULL;
 	plugin->create_session(session_handle, &error);
 	if(error) {
 		/* TODO Make error struct to pass verbose information */
+		free(app);
+		janus_ice_handle_unref(handle);
 		return error;
 	}
 	handle->app = plugin;
 	handle->app_handle = session_handle;
+	janus_metrics_handle_attached(plugin->get_package());
+	janus_ice_handle_unref(handle);
 	return 0;
 }
 
@@ -151,21 +398,292 @@ gint janus_ice_handle_destroy(void *gateway_session, guint64 handle_id) {
 	if(gateway_session == NULL)
 		return JANUS_ERROR_SESSION_NOT_FOUND;
 	janus_session *session = (janus_session *)gateway_session;
-	janus_ice_handle *handle = janus_ice_handle_find(session, handle_id);
+	/* Whoever removes the handle from the session gets the reference of the session */
+	janus_mutex_lock(&session->mutex);
+	janus_ice_handle *handle = session->ice_handles ? g_hash_table_lookup(session->ice_handles, GUINT_TO_POINTER(handle_id)) : NULL;
+	if(handle != NULL)
+		g_hash_table_remove(session->ice_handles, GUINT_TO_POINTER(handle_id));
+	janus_mutex_unlock(&session->mutex);
 	if(handle == NULL)
 		return JANUS_ERROR_HANDLE_NOT_FOUND;
 	handle->stop = 1;
-	janus_plugin *plugin_t = (janus_plugin *)handle->app;
-	JANUS_PRINT("Detaching handle from %s\n", plugin_t->get_name());
-	/* TODO Actually detach handle... */
+	/* Stop the ICE loop right away: we'll free the WebRTC stuff later */
+	if(handle->iceloop != NULL)
+		g_main_loop_quit(handle->iceloop);
 	int error = 0;
-	handle->app_handle->gateway_handle = NULL;
-	plugin_t->destroy_session(handle->app_handle, &error);
-	g_hash_table_remove(session->ice_handles, GUINT_TO_POINTER(handle_id));
-	/* TODO Actually destroy handle */
+	janus_plugin *plugin_t = (janus_plugin *)handle->app;
+	if(plugin_t != NULL && handle->app_handle != NULL) {
+		JANUS_PRINT("Detaching handle from %s\n", plugin_t->get_name());
+		/* From now on plugins can't get to the handle, wait for those that just did */
+		janus_ice_app_handle *app = (janus_ice_app_handle *)handle->app_handle;
+		g_atomic_pointer_set(&handle->app_handle->gateway_handle, NULL);
+		while(g_atomic_int_get(&app->users) > 0)
+			g_usleep(100);
+		plugin_t->destroy_session(handle->app_handle, &error);
+		janus_metrics_handle_detached(plugin_t->get_package());
+		app->retired = g_get_monotonic_time();
+		janus_mutex_lock(&old_handles_mutex);
+		old_app_handles = g_list_append(old_app_handles, app);
+		janus_mutex_unlock(&old_handles_mutex);
+	}
+	janus_trace_save_chrome(handle->trace, session->session_id, handle_id);
+	janus_ice_handle_unref(handle);
 	return error;
 }
 
+static void janus_ice_component_free(janus_ice_component *component) {
+	if(component == NULL)
+		return;
+	if(component->dtls != NULL) {
+		janus_dtls_srtp_destroy(component->dtls);
+		component->dtls = NULL;
+	}
+	GSList *candidates = component->candidates;
+	while(candidates) {
+		nice_candidate_free((NiceCandidate *)candidates->data);
+		candidates = candidates->next;
+	}
+	g_slist_free(component->candidates);
+	component->candidates = NULL;
+	janus_mutex_destroy(&component->mutex);
+	free(component);
+}
+
+static void janus_ice_stream_free(janus_ice_stream *stream) {
+	if(stream == NULL)
+		return;
+	if(stream->components != NULL)
+		g_hash_table_destroy(stream->components);
+	stream->components = NULL;
+	janus_ice_component_free(stream->rtp_component);
+	stream->rtp_component = NULL;
+	janus_ice_component_free(stream->rtcp_component);
+	stream->rtcp_component = NULL;
+	janus_codecs_free(stream->codecs);
+	stream->codecs = NULL;
+	janus_recorder_close(stream->recorder);
+	stream->recorder = NULL;
+	janus_mutex_destroy(&stream->mutex);
+	free(stream);
+}
+
+/* WebRTC resources taken away from a handle, e.g., because a renegotiation
+ * replaced them: as for destroyed handles, they're only freed after a while */
+typedef struct janus_ice_webrtc_setup {
+	NiceAgent *agent;
+	GHashTable *streams;
+	janus_ice_stream *audio_stream, *video_stream;
+	GMainLoop *iceloop;
+	GMainContext *icectx;
+	gchar *remote_hashing, *remote_fingerprint;
+	gint64 retired;
+} janus_ice_webrtc_setup;
+static GList *old_setups = NULL;
+
+/* Helper to stop and join the ICE thread of a handle */
+static void janus_ice_thread_stop(janus_ice_handle *handle) {
+	if(handle->icethread == NULL)
+		return;
+	/* The thread may not be looping yet, so we may need to ask more than once */
+	while(!g_atomic_int_get(&handle->icethread_done)) {
+		g_main_loop_quit(handle->iceloop);
+		g_usleep(10000);
+	}
+	g_thread_join(handle->icethread);
+	handle->icethread = NULL;
+}
+
+/* Helper to move the WebRTC resources of a handle to a setup instance, resetting the handle */
+static void janus_ice_webrtc_take(janus_ice_handle *handle, janus_ice_webrtc_setup *setup) {
+	janus_mutex_lock(&handle->mutex);
+	setup->agent = handle->agent;
+	handle->agent = NULL;
+	setup->streams = handle->streams;
+	handle->streams = NULL;
+	setup->audio_stream = handle->audio_stream;
+	handle->audio_stream = NULL;
+	setup->video_stream = handle->video_stream;
+	handle->video_stream = NULL;
+	setup->iceloop = handle->iceloop;
+	handle->iceloop = NULL;
+	setup->icectx = handle->icectx;
+	handle->icectx = NULL;
+	setup->remote_hashing = handle->remote_hashing;
+	handle->remote_hashing = NULL;
+	setup->remote_fingerprint = handle->remote_fingerprint;
+	handle->remote_fingerprint = NULL;
+	handle->audio_id = 0;
+	handle->video_id = 0;
+	handle->streams_num = 0;
+	handle->cdone = 0;
+	janus_mutex_unlock(&handle->mutex);
+}
+
+static void janus_ice_webrtc_release(janus_ice_webrtc_setup *setup) {
+	if(setup->agent != NULL)
+		g_object_unref(setup->agent);
+	setup->agent = NULL;
+	if(setup->streams != NULL)
+		g_hash_table_destroy(setup->streams);
+	setup->streams = NULL;
+	janus_ice_stream_free(setup->audio_stream);
+	setup->audio_stream = NULL;
+	janus_ice_stream_free(setup->video_stream);
+	setup->video_stream = NULL;
+	if(setup->iceloop != NULL)
+		g_main_loop_unref(setup->iceloop);
+	setup->iceloop = NULL;
+	if(setup->icectx != NULL)
+		g_main_context_unref(setup->icectx);
+	setup->icectx = NULL;
+	g_free(setup->remote_hashing);
+	setup->remote_hashing = NULL;
+	g_free(setup->remote_fingerprint);
+	setup->remote_fingerprint = NULL;
+}
+
+void janus_ice_webrtc_free(janus_ice_handle *handle) {
+	if(handle == NULL)
+		return;
+	janus_ice_relay_stop(handle);
+	/* Wait for the relay workers to get rid of any packet still queued for us */
+	while(g_atomic_int_get(&handle->relay_pending) > 0)
+		g_usleep(1000);
+	janus_ice_thread_stop(handle);
+	janus_ice_webrtc_setup setup;
+	janus_ice_webrtc_take(handle, &setup);
+	janus_ice_webrtc_release(&setup);
+}
+
+/* Renegotiations replace the WebRTC resources of a handle that is still in
+ * use: plugins and relay workers may be sending on the old streams right now,
+ * so we only stop the old ICE thread and free the rest after a grace period */
+static void janus_ice_webrtc_retire(janus_ice_handle *handle) {
+	janus_ice_webrtc_setup *setup = calloc(1, sizeof(janus_ice_webrtc_setup));
+	if(setup == NULL) {
+		JANUS_DEBUG("Memory error!\n");
+		return;
+	}
+	janus_ice_thread_stop(handle);
+	janus_ice_webrtc_take(handle, setup);
+	setup->retired = g_get_monotonic_time();
+	janus_mutex_lock(&old_handles_mutex);
+	old_setups = g_list_append(old_setups, setup);
+	janus_mutex_unlock(&old_handles_mutex);
+}
+
+static void janus_ice_handle_free(janus_ice_handle *handle) {
+	if(handle == NULL)
+		return;
+	JANUS_PRINT("[%"SCNu64"] Freeing handle\n", handle->handle_id);
+	janus_ice_webrtc_free(handle);
+	/* The plugin handle, if any, is freed on its own (see janus_ice_handle_destroy) */
+	handle->app_handle = NULL;
+	janus_session_unref((janus_session *)handle->session);
+	handle->session = NULL;
+	janus_trace_destroy(handle->trace);
+	handle->trace = NULL;
+	g_free(handle->local_sdp);
+	handle->local_sdp = NULL;
+	janus_mutex_destroy(&handle->mutex);
+	free(handle);
+}
+
+/* Helper to describe the codecs of a stream in a recording (e.g., "111 opus/48000/2;0 PCMU/8000") */
+static char *janus_ice_stream_codecs(janus_ice_stream *stream) {
+	if(stream->codecs == NULL)
+		return NULL;
+	GString *codecs = g_string_new(NULL);
+	GList *c = stream->codecs;
+	while(c) {
+		janus_codec *codec = (janus_codec *)c->data;
+		g_string_append_printf(codecs, "%s%d %s/%d", codecs->len ? ";" : "", codec->pt, codec->name, codec->rate);
+		if(codec->channels > 0)
+			g_string_append_printf(codecs, "/%d", codec->channels);
+		c = c->next;
+	}
+	return g_string_free(codecs, FALSE);
+}
+
+/* Helper to start or stop the recording of a stream */
+static void janus_ice_stream_record(janus_ice_stream *stream, gboolean record) {
+	if(stream == NULL)
+		return;
+	janus_ice_handle *handle = stream->handle;
+	gboolean video = (stream->stream_id == handle->video_id);
+	janus_recorder *recorder = NULL;
+	if(record) {
+		if(stream->recorder != NULL)
+			return;
+		janus_session *session = (janus_session *)handle->session;
+		char *filename = g_strdup_printf("janus-%"SCNu64"-%"SCNu64"-%s.jrtp",
+			session ? session->session_id : 0, handle->handle_id, video ? "video" : "audio");
+		char *codecs = janus_ice_stream_codecs(stream);
+		recorder = janus_recorder_create(filename, video, codecs);
+		g_free(codecs);
+		g_free(filename);
+	}
+	janus_mutex_lock(&stream->mutex);
+	janus_recorder *old = stream->recorder;
+	stream->recorder = recorder;
+	janus_mutex_unlock(&stream->mutex);
+	janus_recorder_close(old);
+}
+
+gint janus_ice_handle_record(janus_ice_handle *handle, gboolean record) {
+	if(handle == NULL)
+		return JANUS_ERROR_HANDLE_NOT_FOUND;
+	if(record && !janus_recorder_is_enabled())
+		return JANUS_ERROR_UNKNOWN;
+	handle->record = record;
+	janus_mutex_lock(&handle->mutex);
+	janus_ice_stream_record(handle->audio_stream, record);
+	janus_ice_stream_record(handle->video_stream, record);
+	janus_mutex_unlock(&handle->mutex);
+	return 0;
+}
+
+void janus_ice_free_destroyed_handles(gboolean all) {
+	gint64 now = g_get_monotonic_time();
+	GList *expired = NULL;
+	GList *setups = NULL, *apps = NULL;
+	janus_mutex_lock(&old_handles_mutex);
+	GList *l = old_setups;
+	while(l) {
+		GList *next = l->next;
+		janus_ice_webrtc_setup *setup = (janus_ice_webrtc_setup *)l->data;
+		if(all || now-setup->retired >= JANUS_ICE_HANDLE_GRACE*G_USEC_PER_SEC) {
+			old_setups = g_list_delete_link(old_setups, l);
+			setups = g_list_prepend(setups, setup);
+		}
+		l = next;
+	}
+	/* Handles are only here once they're not used anymore, whatever their age */
+	expired = old_handles;
+	old_handles = NULL;
+	l = old_app_handles;
+	while(l) {
+		GList *next = l->next;
+		janus_ice_app_handle *app = (janus_ice_app_handle *)l->data;
+		if(all || now-app->retired >= JANUS_ICE_HANDLE_GRACE*G_USEC_PER_SEC) {
+			old_app_handles = g_list_delete_link(old_app_handles, l);
+			apps = g_list_prepend(apps, app);
+		}
+		l = next;
+	}
+	janus_mutex_unlock(&old_handles_mutex);
+	/* Free them out of the lock, as joining the ICE threads may take a while */
+	for(l = setups; l; l = l->next) {
+		janus_ice_webrtc_release((janus_ice_webrtc_setup *)l->data);
+		free(l->data);
+	}
+	g_list_free(setups);
+	for(l = expired; l; l = l->next)
+		janus_ice_handle_free((janus_ice_handle *)l->data);
+	g_list_free(expired);
+	g_list_free_full(apps, free);
+}
+
 
 /* Callbacks */
 void janus_ice_cb_candidate_gathering_done(NiceAgent *agent, guint stream_id, gpointer user_data) {
@@ -177,7 +695,6 @@ void janus_ice_cb_candidate_gathering_done(NiceAgent *agent, guint stream_id, gp
 	janus_ice_stream *stream = g_hash_table_lookup(handle->streams, GUINT_TO_POINTER(stream_id));
 	if(!stream) {
 		JANUS_DEBUG("[%"SCNu64"]  No stream %d??\n", handle->handle_id, stream_id);
-		janus_mutex_unlock(&handle->mutex);
 		return;
 	}
 	stream->cdone = 1;
@@ -189,6 +706,7 @@ void janus_ice_cb_component_state_changed(NiceAgent *agent, guint stream_id, gui
 	if(!handle)
 		return;
 	if(state == NICE_COMPONENT_STATE_READY) {
+		janus_trace_mark(handle->trace, JANUS_TRACE_COMPONENT_READY, stream_id, component_id);
 		/* Now we can start the DTLS handshake */
 		JANUS_PRINT("[%"SCNu64"]   Component is ready, starting DTLS handshake...\n", handle->handle_id);
 		janus_ice_stream *stream = g_hash_table_lookup(handle->streams, GUINT_TO_POINTER(stream_id));
@@ -207,15 +725,7 @@ void janus_ice_cb_component_state_changed(NiceAgent *agent, guint stream_id, gui
 			JANUS_DEBUG("[%"SCNu64"]     No component DTLS-SRTP session??\n", handle->handle_id);
 			return;
 		}
-		/* Create retransmission timer */
-		//~ SSL_set_mode(component->ssl, SSL_MODE_AUTO_RETRY);
-		//~ SSL_set_read_ahead(component->ssl, 1);
-		//~ guint id = g_timeout_add_seconds(1, janus_dtls_retry, component);
-		GSource *source = g_timeout_source_new_seconds(1);
-		g_source_set_callback(source, janus_dtls_retry, component->dtls, NULL);
-		guint id = g_source_attach(source, handle->icectx);
-		JANUS_PRINT("[%"SCNu64"] Creating retransmission timer with ID %u\n", handle->handle_id, id);
-		/* Do DTLS handshake */
+		/* Do DTLS handshake (this also takes care of scheduling retransmissions, if needed) */
 		janus_dtls_srtp_handshake(component->dtls);
 	} else if(state == NICE_COMPONENT_STATE_FAILED) {
 		if(handle && !handle->stop) {
@@ -262,10 +772,13 @@ void janus_ice_cb_nice_recv(NiceAgent *agent, guint stream_id, guint component_i
 	if(component_id == 1) {
 		/* TODO Actually check if this is RTP or RTCP: right now we assume the first component is RTP */
 		if(!component->dtls || !component->dtls->srtp_valid) {
-			JANUS_DEBUG("[%"SCNu64"]     Missing valid SRTP session, skipping...\n", handle->handle_id);
+			JANUS_LOG(LOG_HUGE, "[%"SCNu64"]     Missing valid SRTP session, skipping...\n", handle->handle_id);
 		} else {
 			int buflen = len;
+			gint64 before = janus_metrics_is_enabled() ? g_get_monotonic_time() : 0;
 			err_status_t res = srtp_unprotect(component->dtls->srtp_in, buf, &buflen);
+			if(before > 0)
+				janus_metrics_histogram_observe(&janus_metrics_srtp_unprotect, g_get_monotonic_time()-before);
 			if(res != err_status_ok) {
 				JANUS_DEBUG("[%"SCNu64"]     SRTP unprotect error: %s (len=%d-->%d)\n", handle->handle_id, janus_get_srtp_error(res), len, buflen);
 			} else {
@@ -274,6 +787,11 @@ void janus_ice_cb_nice_recv(NiceAgent *agent, guint stream_id, guint component_i
 					stream->ssrc_peer = ntohl(header->ssrc);
 					JANUS_PRINT("[%"SCNu64"]     Peer %s SSRC: %u\n", handle->handle_id, stream->stream_id == handle->audio_id ? "audio" : "video", stream->ssrc_peer);
 				}
+				if(stream->recorder != NULL) {
+					janus_mutex_lock(&stream->mutex);
+					janus_recorder_save_frame(stream->recorder, buf, buflen);
+					janus_mutex_unlock(&stream->mutex);
+				}
 				/* TODO Should we store the packet in a circular buffer, in case we get a NACK we can handle ourselves without relaying? */
 				janus_plugin *plugin = (janus_plugin *)handle->app;
 				if(plugin && plugin->incoming_rtp)
@@ -284,26 +802,32 @@ void janus_ice_cb_nice_recv(NiceAgent *agent, guint stream_id, guint component_i
 	}
 	if(component_id == 2) {
 		/* TODO Actually check if this is RTP or RTCP: right now we assume the second component is RTCP */
-		JANUS_PRINT("[%"SCNu64"]  Got an RTCP packet (%s stream)!\n", handle->handle_id, stream->stream_id == handle->audio_id ? "audio" : "video");
+		JANUS_LOG(LOG_HUGE, "[%"SCNu64"]  Got an RTCP packet (%s stream)!\n", handle->handle_id, stream->stream_id == handle->audio_id ? "audio" : "video");
 		if(!component->dtls || !component->dtls->srtp_valid) {
-			JANUS_DEBUG("[%"SCNu64"]     Missing valid SRTP session, skipping...\n", handle->handle_id);
+			JANUS_LOG(LOG_HUGE, "[%"SCNu64"]     Missing valid SRTP session, skipping...\n", handle->handle_id);
 		} else {
 			int buflen = len;
+			gint64 before = janus_metrics_is_enabled() ? g_get_monotonic_time() : 0;
 			err_status_t res = srtp_unprotect_rtcp(component->dtls->srtp_in, buf, &buflen);
+			if(before > 0)
+				janus_metrics_histogram_observe(&janus_metrics_srtp_unprotect, g_get_monotonic_time()-before);
 			if(res != err_status_ok) {
 				JANUS_DEBUG("[%"SCNu64"]     SRTCP unprotect error: %s (len=%d-->%d)\n", handle->handle_id, janus_get_srtp_error(res), len, buflen);
 			} else {
 				GSList *nacks = janus_rtcp_get_nacks(buf, buflen);
 				if(nacks != NULL) {
 					/* TODO Actually handle NACK */
-					JANUS_PRINT("[%"SCNu64"]     Just got some NACKS we should probably handle...\n", handle->handle_id);
-					JANUS_PRINT("           >>");
-					GSList *list = nacks;
-					while(list->next) {
-						JANUS_PRINT(" %u", GPOINTER_TO_UINT(list->data));
-						list = list->next;
+					if(LOG_HUGE <= janus_log_level) {
+						GString *seqs = g_string_new(NULL);
+						GSList *list = nacks;
+						while(list) {
+							g_string_append_printf(seqs, " %u", GPOINTER_TO_UINT(list->data));
+							list = list->next;
+						}
+						JANUS_LOG(LOG_HUGE, "[%"SCNu64"]     Just got some NACKS we should probably handle:%s\n", handle->handle_id, seqs->str);
+						g_string_free(seqs, TRUE);
 					}
-					JANUS_PRINT("\n");
+					g_slist_free(nacks);
 				}
 				janus_plugin *plugin = (janus_plugin *)handle->app;
 				if(plugin && plugin->incoming_rtcp)
@@ -319,15 +843,17 @@ void *janus_ice_thread(void *data) {
 	JANUS_PRINT("[%"SCNu64"] ICE thread started, looping...\n", handle->handle_id);
 	GMainLoop *loop = handle->iceloop;
 	g_usleep (100000);
-	g_main_loop_run (loop);
+	if(!handle->stop)
+		g_main_loop_run (loop);
 	if(handle->cdone == 0)
 		handle->cdone = -1;
 	JANUS_PRINT("[%"SCNu64"] ICE thread ended!\n", handle->handle_id);
+	g_atomic_int_set(&handle->icethread_done, 1);
 	return NULL;
 }
 
 /* Helper: candidates */
-void janus_ice_setup_candidate(janus_ice_handle *handle, char *sdp, guint stream_id, guint component_id)
+void janus_ice_setup_candidate(janus_ice_handle *handle, GString *sdp, guint stream_id, guint component_id)
 {
 	if(!handle || !handle->agent || !sdp)
 		return;
@@ -359,10 +885,11 @@ void janus_ice_setup_candidate(janus_ice_handle *handle, char *sdp, guint stream
 		JANUS_PRINT("[%"SCNu64"]   Priority:   %d\n", handle->handle_id, c->priority);
 		JANUS_PRINT("[%"SCNu64"]   Foundation: %s\n", handle->handle_id, c->foundation);
 		/* SDP time */
-		gchar buffer[100];
+		gchar buffer[200];
+		buffer[0] = '\0';
 		if(c->type == NICE_CANDIDATE_TYPE_HOST) {
 			/* 'host' candidate */
-			g_sprintf(buffer,
+			g_snprintf(buffer, sizeof(buffer),
 				"a=candidate:%s %d %s %d %s %d typ host\r\n", 
 					c->foundation,
 					c->component_id,
@@ -374,7 +901,7 @@ void janus_ice_setup_candidate(janus_ice_handle *handle, char *sdp, guint stream
 			/* 'srflx' candidate */
 			nice_address_to_string(&(c->base_addr), (gchar *)&base_address);
 			gint base_port = nice_address_get_port(&(c->base_addr));
-			g_sprintf(buffer,
+			g_snprintf(buffer, sizeof(buffer),
 				"a=candidate:%s %d %s %d %s %d typ srflx raddr %s rport %d\r\n", 
 					c->foundation,
 					c->component_id,
@@ -386,7 +913,7 @@ void janus_ice_setup_candidate(janus_ice_handle *handle, char *sdp, guint stream
 					base_port);
 		} else if(c->type == NICE_CANDIDATE_TYPE_PEER_REFLEXIVE) {
 			/* 'prflx' candidate */
-			g_sprintf(buffer,
+			g_snprintf(buffer, sizeof(buffer),
 				"a=candidate:%s %d %s %d %s %d typ prflx raddr %s rport %d\r\n", 
 					c->foundation,
 					c->component_id,
@@ -398,7 +925,7 @@ void janus_ice_setup_candidate(janus_ice_handle *handle, char *sdp, guint stream
 					base_port);
 		} else if(c->type == NICE_CANDIDATE_TYPE_RELAYED) {
 			/* 'relay' candidate */
-			g_sprintf(buffer,
+			g_snprintf(buffer, sizeof(buffer),
 				"a=candidate:%s %d %s %d %s %d typ relay raddr %s rport %d\r\n", 
 					c->foundation,
 					c->component_id,
@@ -409,36 +936,23 @@ void janus_ice_setup_candidate(janus_ice_handle *handle, char *sdp, guint stream
 					base_address,
 					base_port);
 		}
-		g_strlcat(sdp, buffer, BUFSIZE);
+		g_string_append(sdp, buffer);
 		JANUS_PRINT("[%"SCNu64"]     %s\n", handle->handle_id, buffer);
-		/* RTP or RTCP? */
-		gchar *search = NULL, replace[6];
-		g_sprintf(replace, "%d", port);
-		if(stream_id == handle->audio_id) {
-			if(component_id == 1) {
-				/* Audio RTP */
-				search = "ARTPP";
-			} else {
-				/* Audio RTCP */
-				search = "ARTCP";
-			}
-		} else {	/* FIXME We assume this is video: there's nothing else right now */
-			if(component_id == 1) {
-				/* Video RTP */
-				search = "VRTPP";
-			} else {
-				/* Video RTCP */
-				search = "VRTCP";
-			}
-		}
-		/* FIXME This is a VERY ugly way to set ports in m-lines! */
-		gchar *index = g_strstr_len(sdp, BUFSIZE, search);
-		if(index) {
-			int j=0;
-			for(j=0; j<5; j++)
-				index[j] = replace[j];
-		}
 	}
+	g_slist_free_full(candidates, (GDestroyNotify)&nice_candidate_free);
+}
+
+guint16 janus_ice_get_local_port(janus_ice_handle *handle, guint stream_id, guint component_id) {
+	if(!handle || !handle->agent)
+		return 0;
+	guint16 port = 0;
+	GSList *candidates = nice_agent_get_local_candidates(handle->agent, stream_id, component_id);
+	if(candidates != NULL) {
+		NiceCandidate *c = (NiceCandidate *)candidates->data;
+		port = nice_address_get_port(&(c->addr));
+	}
+	g_slist_free_full(candidates, (GDestroyNotify)&nice_candidate_free);
+	return port;
 }
 
 void janus_ice_setup_remote_candidate(janus_ice_handle *handle, guint stream_id, guint component_id) {
@@ -498,7 +1012,13 @@ int janus_ice_setup_local(janus_ice_handle *handle, int offer, int audio, int vi
 	if(!handle)
 		return -1;
 	JANUS_PRINT("[%"SCNu64"] Setting ICE locally: got %s (%d audios, %d videos)\n", handle->handle_id, offer ? "OFFER" : "ANSWER", audio, video);
+	if(handle->agent != NULL) {
+		/* Get rid of the previous ICE setup first */
+		JANUS_PRINT("[%"SCNu64"] Retiring previous ICE setup\n", handle->handle_id);
+		janus_ice_webrtc_retire(handle);
+	}
 	handle->stop = 0;	/* FIXME Reset handle */
+	handle->icethread_done = 0;
 	handle->icectx = g_main_context_new();
 	handle->iceloop = g_main_loop_new(handle->icectx, FALSE);
 	handle->icethread = g_thread_new("ice thread", &janus_ice_thread, handle);
@@ -537,7 +1057,8 @@ int janus_ice_setup_local(janus_ice_handle *handle, int offer, int audio, int vi
 		audio_stream->stream_id = handle->audio_id;
 		audio_stream->handle = handle;
 		audio_stream->cdone = 0;
-		audio_stream->payload_type = -1;
+		audio_stream->codecs = NULL;
+		audio_stream->recorder = NULL;
 		/* FIXME By default, if we're being called we're DTLS clients, but this may be changed by ICE... */
 		audio_stream->dtls_role = offer ? JANUS_DTLS_ROLE_CLIENT : JANUS_DTLS_ROLE_ACTPASS;
 		audio_stream->ssrc = 12345;	/* FIXME Should we make this dynamic? */
@@ -582,7 +1103,8 @@ int janus_ice_setup_local(janus_ice_handle *handle, int offer, int audio, int vi
 		video_stream->handle = handle;
 		video_stream->stream_id = handle->video_id;
 		video_stream->cdone = 0;
-		video_stream->payload_type = -1;
+		video_stream->codecs = NULL;
+		video_stream->recorder = NULL;
 		/* FIXME By default, if we're being called we're DTLS clients, but this may be changed by ICE... */
 		video_stream->dtls_role = offer ? JANUS_DTLS_ROLE_CLIENT : JANUS_DTLS_ROLE_ACTPASS;
 		video_stream->ssrc = 54321;	/* FIXME Should we make this dynamic? */
@@ -644,13 +1166,63 @@ void janus_ice_relay_rtp(janus_ice_handle *handle, int video, char *buf, int len
 		return;
 	}
 	component->noerrorlog = 0;
-	/* FIXME Copy in a buffer and fix SSRC */
+	if(len < 12 || len > BUFSIZE-SRTP_MAX_TRAILER_LEN) {
+		JANUS_DEBUG("[%"SCNu64"] Invalid RTP packet length %d, not relaying it\n", handle->handle_id, len);
+		return;
+	}
+	gint workers = relay_workers_num;
+	if(workers > 0) {
+		/* Hand a copy of the packet to the worker taking care of this handle:
+		 * check whether the handle is being torn down with the queue locked,
+		 * as janus_ice_relay_stop does, or we might queue a packet for it
+		 * right after janus_ice_webrtc_free has stopped waiting for them */
+		janus_ice_relay_worker *worker = &relay_workers[handle->handle_id % workers];
+		g_async_queue_lock(worker->queue);
+		if(handle->stop) {
+			g_async_queue_unlock(worker->queue);
+			return;
+		}
+		janus_ice_relay_packet *packet = janus_ice_relay_packet_get(worker, len);
+		if(packet == NULL) {
+			g_async_queue_unlock(worker->queue);
+			JANUS_DEBUG("Memory error!\n");
+			return;
+		}
+		packet->handle = handle;
+		packet->video = video;
+		packet->len = len;
+		memcpy(packet->data, buf, len);
+		g_atomic_int_inc(&handle->relay_pending);
+		guint dropped = janus_queue_push_bounded_unlocked(worker->queue, packet, JANUS_ICE_RELAY_QUEUE_MAX, janus_ice_relay_packet_drop);
+		g_async_queue_unlock(worker->queue);
+		if(dropped > 0) {
+			JANUS_LOG(LOG_HUGE, "[%"SCNu64"] Relay worker can't keep up, dropped %u packets\n", handle->handle_id, dropped);
+		}
+		return;
+	}
+	/* Copy in a buffer we can fix and protect in place */
 	char sbuf[BUFSIZE];
 	memcpy(&sbuf, buf, len);
-	rtp_header *header = (rtp_header *)&sbuf;
+	janus_ice_relay_rtp_protect(handle, video, sbuf, len);
+}
+
+/* Fix the SSRC, protect and send an RTP packet: sbuf must have room for the SRTP trailer */
+static void janus_ice_relay_rtp_protect(janus_ice_handle *handle, int video, char *sbuf, int len) {
+	/* A renegotiation may retire the stream in the meanwhile: the lock pins it */
+	janus_mutex_lock(&handle->mutex);
+	janus_ice_stream *stream = video ? handle->video_stream : handle->audio_stream;
+	if(!stream || !stream->rtp_component || !stream->rtp_component->dtls || !stream->rtp_component->dtls->srtp_valid) {
+		janus_mutex_unlock(&handle->mutex);
+		return;
+	}
+	janus_ice_component *component = stream->rtp_component;
+	rtp_header *header = (rtp_header *)sbuf;
 	header->ssrc = htonl(stream->ssrc);
 	int protected = len;
-	int res = srtp_protect(component->dtls->srtp_out, &sbuf, &protected);
+	gint64 before = janus_metrics_is_enabled() ? g_get_monotonic_time() : 0;
+	int res = srtp_protect(component->dtls->srtp_out, sbuf, &protected);
+	if(before > 0)
+		janus_metrics_histogram_observe(&janus_metrics_srtp_protect, g_get_monotonic_time()-before);
 	//~ JANUS_PRINT("[%"SCNu64"] ... SRTP protect %s (len=%d-->%d)...\n", handle->handle_id, janus_get_srtp_error(res), len, protected);
 	if(res != err_status_ok) {
 		JANUS_DEBUG("[%"SCNu64"] ... SRTP protect error... %s (len=%d-->%d)...\n", handle->handle_id, janus_get_srtp_error(res), len, protected);
@@ -658,10 +1230,11 @@ void janus_ice_relay_rtp(janus_ice_handle *handle, int video, char *buf, int len
 		/* Shoot! */
 		//~ JANUS_PRINT("[%"SCNu64"] ... Sending SRTP packet (pt=%u, ssrc=%u, seq=%u, ts=%u)...\n", handle->handle_id,
 			//~ header->type, ntohl(header->ssrc), ntohs(header->seq_number), ntohl(header->timestamp));
-		int sent = nice_agent_send(handle->agent, stream->stream_id, component->component_id, protected, (const gchar *)&sbuf);
+		int sent = nice_agent_send(handle->agent, stream->stream_id, component->component_id, protected, (const gchar *)sbuf);
 		if(sent < protected)
 			JANUS_DEBUG("[%"SCNu64"] ... only sent %d bytes? (was %d)\n", handle->handle_id, sent, protected);
 	}
+	janus_mutex_unlock(&handle->mutex);
 }
 
 void janus_ice_relay_rtcp(janus_ice_handle *handle, int video, char *buf, int len) {
@@ -689,14 +1262,22 @@ void janus_ice_relay_rtcp(janus_ice_handle *handle, int video, char *buf, int le
 		return;
 	}
 	component->noerrorlog = 0;
+	/* SRTCP adds the SRTCP index (4 bytes) to the authentication tag: make sure both fit */
+	if(len < 8 || len > BUFSIZE-SRTP_MAX_TRAILER_LEN-4) {
+		JANUS_DEBUG("[%"SCNu64"] Invalid RTCP packet length %d, not relaying it\n", handle->handle_id, len);
+		return;
+	}
 	/* FIXME Copy in a buffer and fix SSRC */
 	char sbuf[BUFSIZE];
 	memcpy(&sbuf, buf, len);
 	/* Fix all SSRCs! */
-	JANUS_PRINT("[%"SCNu64"] Fixing SSRCs (local %u, peer %u)\n", handle->handle_id, stream->ssrc, stream->ssrc_peer);
+	JANUS_LOG(LOG_HUGE, "[%"SCNu64"] Fixing SSRCs (local %u, peer %u)\n", handle->handle_id, stream->ssrc, stream->ssrc_peer);
 	janus_rtcp_fix_ssrc((char *)&sbuf, len, 1, stream->ssrc, stream->ssrc_peer);
 	int protected = len;
+	gint64 before = janus_metrics_is_enabled() ? g_get_monotonic_time() : 0;
 	int res = srtp_protect_rtcp(component->dtls->srtp_out, &sbuf, &protected);
+	if(before > 0)
+		janus_metrics_histogram_observe(&janus_metrics_srtp_protect, g_get_monotonic_time()-before);
 	//~ JANUS_PRINT("[%"SCNu64"] ... SRTCP protect %s (len=%d-->%d)...\n", handle->handle_id, janus_get_srtp_error(res), len, protected);
 	if(res != err_status_ok) {
 		JANUS_DEBUG("[%"SCNu64"] ... SRTCP protect error... %s (len=%d-->%d)...\n", handle->handle_id, janus_get_srtp_error(res), len, protected);
@@ -715,6 +1296,7 @@ void janus_ice_dtls_handshake_done(janus_ice_handle *handle, janus_ice_component
 		return;
 	JANUS_PRINT("[%"SCNu64"] The DTLS handshake for the component %d in stream %d has been completed\n",
 		handle->handle_id, component->component_id, component->stream_id);
+	janus_trace_mark(handle->trace, JANUS_TRACE_DTLS_DONE, component->stream_id, component->component_id);
 	/* Check if all components are ready */
 	if(handle->audio_stream) {
 		if(handle->audio_stream->rtp_component &&  handle->audio_stream->rtp_component->dtls &&
@@ -20,6 +20,9 @@
 #include <glib.h>
 #include <agent.h>
 
+#include "trace.h"
+#include "codecs.h"
+#include "record.h"
 #include "plugins/plugin.h"
 
 
@@ -28,6 +31,18 @@
  * @param[in] stun_port STUN port to use, if any
  * @returns 0 in case of success, a negative integer on errors */
 gint janus_ice_init(gchar *stun_server, uint16_t stun_port);
+/*! \brief RTP relay workers initialization
+ * \details By default, outgoing RTP packets are protected and sent by the
+ * thread relaying them: for a VideoRoom publisher with many listeners, this
+ * means its ICE thread does an SRTP protect per listener per packet. When
+ * workers are enabled, packets are queued instead, and each handle is always
+ * served by the same worker, which keeps the packets in order and its SRTP
+ * context hot in the cache, while spreading the fan-out on more cores.
+ * @param[in] workers Number of workers to start (0 means packets are relayed right away)
+ * @returns 0 in case of success, a negative integer on errors */
+gint janus_ice_relay_workers_init(gint workers);
+/*! \brief RTP relay workers deinitialization */
+void janus_ice_relay_workers_deinit(void);
 /*! \brief Method to get the STUN server IP address
  * @returns The currently used STUN server IP address, if available, or NULL if not */
 char *janus_ice_get_stun_server(void);
@@ -69,6 +84,10 @@ struct janus_ice_handle {
 	GMainLoop *iceloop;
 	/*! \brief GLib thread for libnice */
 	GThread *icethread;
+	/*! \brief Whether the GLib thread for libnice is done looping */
+	volatile gint icethread_done;
+	/*! \brief Number of outgoing RTP packets queued for this handle in the relay workers, if enabled */
+	volatile gint relay_pending;
 	/*! \brief libnice ICE agent */
 	NiceAgent *agent;
 	/*! \brief libnice ICE audio ID */
@@ -87,6 +106,17 @@ struct janus_ice_handle {
 	gchar *remote_hashing;
 	/*! \brief Hashed fingerprint of the peer's certificate, as parsed in SDP */
 	gchar *remote_fingerprint;
+	/*! \brief Trace of the setup phases, if tracing is enabled (NULL otherwise) */
+	janus_trace *trace;
+	/*! \brief Whether the media the peer sends should be recorded */
+	gboolean record;
+	/*! \brief Latest SDP we rendered for the peer, minus the v= and o= lines (to tell whether the next one changed) */
+	gchar *local_sdp;
+	/*! \brief Session version in the o= line of the latest SDP we rendered for the peer */
+	guint64 local_sdp_version;
+	/*! \brief Reference counter: the session holds one until the handle is destroyed, and so does whoever uses the handle out of the lock of the session
+	 * \note The ICE thread, relay workers and DTLS workers don't hold any, as freeing the handle waits for them */
+	volatile gint ref;
 	/*! \brief Mutex to lock/unlock the ICE session */
 	janus_mutex mutex;
 };
@@ -103,8 +133,8 @@ struct janus_ice_stream {
 	guint32 ssrc;
 	/*! \brief SSRC of the peer */
 	guint32 ssrc_peer;
-	/*! \brief RTP payload type of this stream */
-	gint payload_type;
+	/*! \brief Codecs the peer negotiated for this stream (list of janus_codec instances, in order of preference) */
+	GList *codecs;
 	/*! \brief DTLS role of the gateway for this stream */
 	janus_dtls_role dtls_role;
 	/*! \brief GLib hash table of components (IDs are the keys) */
@@ -113,6 +143,8 @@ struct janus_ice_stream {
 	janus_ice_component *rtp_component;
 	/*! \brief RTCP component */
 	janus_ice_component *rtcp_component;
+	/*! \brief Recording of the RTP packets the peer sends, if any */
+	janus_recorder *recorder;
 	/*! \brief Helper flag to avoid flooding the console with the same error all over again */
 	gint noerrorlog:1;
 	/*! \brief Mutex to lock/unlock this stream */
@@ -142,13 +174,25 @@ struct janus_ice_component {
 ///@{
 /*! \brief Method to create a new Janus ICE handle
  * @param[in] gateway_session The gateway/peer session this ICE handle will belong to
- * @returns The created Janus ICE handle if successful, NULL otherwise */
+ * @returns The created Janus ICE handle if successful, with a reference the caller must release with janus_ice_handle_unref, NULL otherwise */
 janus_ice_handle *janus_ice_handle_create(void *gateway_session);
 /*! \brief Method to find an existing Janus ICE handle from its ID
  * @param[in] gateway_session The gateway/peer session this ICE handle belongs to
  * @param[in] handle_id The Janus ICE handle ID
- * @returns The created Janus ICE handle if successful, NULL otherwise */
+ * @returns The Janus ICE handle if found, with a reference the caller must release with janus_ice_handle_unref, NULL otherwise */
 janus_ice_handle *janus_ice_handle_find(void *gateway_session, guint64 handle_id);
+/*! \brief Method to get a reference to a Janus ICE handle
+ * @param[in] handle The Janus ICE handle, which the caller must already hold a reference to */
+void janus_ice_handle_ref(janus_ice_handle *handle);
+/*! \brief Method to release a reference to a Janus ICE handle
+ * \note The last reference doesn't free the handle right away, as that may involve the
+ * thread releasing it (e.g., its ICE thread): the sessions watchdog does, see janus_ice_free_destroyed_handles
+ * @param[in] handle The Janus ICE handle */
+void janus_ice_handle_unref(janus_ice_handle *handle);
+/*! \brief Method to get the Janus ICE handle a plugin handle refers to, e.g., when the plugin invokes a callback
+ * @param[in] app_handle The plugin handle
+ * @returns The Janus ICE handle, with a reference the caller must release with janus_ice_handle_unref, or NULL if it was destroyed */
+janus_ice_handle *janus_ice_handle_from_app(janus_pluginession *app_handle);
 /*! \brief Method to attach a Janus ICE handle to a plugin
  * \details This method is very important, as it allows plugins to send/receive media (RTP/RTCP) to/from a WebRTC peer.
  * @param[in] gateway_session The gateway/peer session this ICE handle belongs to
@@ -157,10 +201,34 @@ janus_ice_handle *janus_ice_handle_find(void *gateway_session, guint64 handle_id
  * @returns 0 in case of success, a negative integer otherwise */
 gint janus_ice_handle_attach_plugin(void *gateway_session, guint64 handle_id, janus_plugin *plugin);
 /*! \brief Method to destroy a Janus ICE handle
+ * \details The handle is removed from its session and detached from its plugin,
+ * and is then freed as soon as nobody is using it anymore
  * @param[in] gateway_session The gateway/peer session this ICE handle belongs to
  * @param[in] handle_id The Janus ICE handle ID to destroy
  * @returns 0 in case of success, a negative integer otherwise */
 gint janus_ice_handle_destroy(void *gateway_session, guint64 handle_id);
+/*! \brief Method to free the WebRTC related resources of a Janus ICE handle (libnice agent
+ * and thread, streams, components and their DTLS-SRTP contexts)
+ * \note This is only called when a handle is freed: when a new ICE setup replaces an old one,
+ * the old resources are kept around for a while instead, as they may still be in use
+ * @param[in] handle The Janus ICE handle instance whose resources need to be freed */
+void janus_ice_webrtc_free(janus_ice_handle *handle);
+/*! \brief Method to actually free the Janus ICE handles that have been destroyed
+ * \details Handles nobody holds a reference to anymore are freed right away. Plugin
+ * handles, on the other hand, are only freed after a grace period, as plugins may
+ * still be using them right after they've been destroyed (e.g., a plugin relaying
+ * media), and so are the WebRTC resources a renegotiation replaced. This method is
+ * periodically invoked by the sessions watchdog in the core.
+ * @param[in] all Whether all plugin handles and WebRTC resources should be freed, whatever their age (e.g., when shutting down) */
+void janus_ice_free_destroyed_handles(gboolean all);
+/*! \brief Method to start or stop recording the media a peer sends
+ * \details Recordings are started for the streams that have been
+ * negotiated already: if the handle has no streams yet, they're started
+ * as soon as the peer SDP has been parsed.
+ * @param[in] handle The Janus ICE handle whose media should be recorded
+ * @param[in] record Whether recording should be started (TRUE) or stopped (FALSE)
+ * @returns 0 in case of success, a negative integer otherwise */
+gint janus_ice_handle_record(janus_ice_handle *handle, gboolean record);
 ///@}
 
 
@@ -228,7 +296,13 @@ int janus_ice_setup_local(janus_ice_handle *handle, int offer, int audio, int vi
  * @param[in,out] sdp The handle description the gateway is preparing
  * @param[in] stream_id The stream ID of the candidate to add to the SDP
  * @param[in] component_id The component ID of the candidate to add to the SDP */
-void janus_ice_setup_candidate(janus_ice_handle *handle, char *sdp, guint stream_id, guint component_id);
+void janus_ice_setup_candidate(janus_ice_handle *handle, GString *sdp, guint stream_id, guint component_id);
+/*! \brief Method to get the port to advertise in the gateway SDP for a component (the one of its first local candidate)
+ * @param[in] handle The Janus ICE handle this method refers to
+ * @param[in] stream_id The stream ID of the component
+ * @param[in] component_id The component ID
+ * @returns The port of the first local candidate, or 0 if there's none */
+guint16 janus_ice_get_local_port(janus_ice_handle *handle, guint stream_id, guint component_id);
 /*! \brief Method to handle remote candidates and start the connectivity checks
  * @param[in] handle The Janus ICE handle this method refers to
  * @param[in] stream_id The stream ID of the candidate to add to the SDP
@@ -27,6 +27,10 @@
 #include "apierror.h"
 #include "rtcp.h"
 #include "sdp.h"
+#include "metrics.h"
+#include "trace.h"
+#include "record.h"
+#include "queue.h"
 
 
 static janus_config *config = NULL;
@@ -38,6 +42,7 @@ static GHashTable *plugins_so = NULL;
 
 static struct MHD_Daemon *ws = NULL, *sws = NULL;
 static char *ws_path = NULL;
+static char *metrics_path = NULL;
 
 /* Certificates */
 static char *server_pem = NULL;
@@ -79,74 +84,191 @@ void janus_handle_signal(int signum)
  */
 ///@{
 int janus_push_event(janus_pluginession *handle, janus_plugin *plugin, char *transaction, char *message, char *sdp_type, char *sdp);
-json_t *janus_handle_sdp(janus_pluginession *handle, janus_plugin *plugin, char *sdp_type, char *sdp);
+int janus_push_event_template(janus_pluginession *handle, janus_plugin *plugin, char *transaction, char *message, char *sdp_type, janus_sdp_template *sdp_template);
+static int janus_push_event_common(janus_pluginession *handle, janus_plugin *plugin, char *transaction, char *message, char *sdp_type, char *sdp, janus_sdp_template *sdp_template);
+static int janus_push_event_handle(janus_ice_handle *ice_handle, janus_plugin *plugin, char *transaction, char *message, char *sdp_type, char *sdp, janus_sdp_template *sdp_template);
+json_t *janus_handle_sdp(janus_ice_handle *ice_handle, janus_plugin *plugin, char *sdp_type, char *sdp, janus_sdp_template *sdp_template);
 void janus_relay_rtp(janus_pluginession *handle, int video, char *buf, int len);
 void janus_relay_rtcp(janus_pluginession *handle, int video, char *buf, int len);
+janus_sdp_template *janus_create_sdp_template(const char *sdp);
+void janus_destroy_sdp_template(janus_sdp_template *sdp_template);
+GList *janus_get_codecs(janus_pluginession *handle, int video);
 static janus_callbacks janus_handler_plugin =
 	{
 		.push_event = janus_push_event,
 		.relay_rtp = janus_relay_rtp,
 		.relay_rtcp = janus_relay_rtcp,
+		.create_sdp_template = janus_create_sdp_template,
+		.destroy_sdp_template = janus_destroy_sdp_template,
+		.push_event_template = janus_push_event_template,
+		.get_codecs = janus_get_codecs,
 	}; 
 ///@}
 
 
 /* Gateway Sessions */
 static GHashTable *sessions = NULL;
+static janus_mutex sessions_mutex = JANUS_MUTEX_INITIALIZER;
+/* Sessions with no activity for longer than this (in seconds) are destroyed, 0 disables the check */
+static gint session_timeout = 60;
+/* Maximum number of events waiting in a session queue: older events are dropped when exceeded */
+static gint max_session_events = 500;
+static void janus_session_free(janus_session *session);
+
 janus_session *janus_session_create(void) {
+	janus_session *session = (janus_session *)calloc(1, sizeof(janus_session));
+	if(session == NULL) {
+		JANUS_DEBUG("Memory error!\n");
+		return NULL;
+	}
+	session->messages = g_async_queue_new();
+	session->last_activity = g_get_monotonic_time();
+	session->destroy = 0;
+	session->ref = 2;	/* One for the sessions table, one for the caller */
+	janus_mutex_init(&session->mutex);
 	guint64 session_id = 0;
+	janus_mutex_lock(&sessions_mutex);
 	while(session_id == 0) {
 		session_id = g_random_int();
-		if(janus_session_find(session_id) != NULL) {
+		if(g_hash_table_lookup(sessions, GUINT_TO_POINTER(session_id)) != NULL) {
 			/* Session ID already taken, try another one */
 			session_id = 0;
 		}
 	}
-	JANUS_PRINT("Creating new session: %"SCNu64"\n", session_id);
-	janus_session *session = (janus_session *)calloc(1, sizeof(janus_session));
-	if(session == NULL) {
-		JANUS_DEBUG("Memory error!\n");
-		return NULL;
-	}
 	session->session_id = session_id;
-	session->messages = g_queue_new();
-	session->destroy = 0;
-	janus_mutex_init(&session->mutex);
 	g_hash_table_insert(sessions, GUINT_TO_POINTER(session_id), session);
+	janus_mutex_unlock(&sessions_mutex);
+	JANUS_PRINT("Creating new session: %"SCNu64"\n", session_id);
 	return session;
 }
 
 janus_session *janus_session_find(guint64 session_id) {
-	return g_hash_table_lookup(sessions, GUINT_TO_POINTER(session_id));
+	janus_mutex_lock(&sessions_mutex);
+	janus_session *session = g_hash_table_lookup(sessions, GUINT_TO_POINTER(session_id));
+	/* Any lookup (i.e., a request or a long poll) keeps the session alive */
+	if(session != NULL) {
+		session->last_activity = g_get_monotonic_time();
+		janus_session_ref(session);
+	}
+	janus_mutex_unlock(&sessions_mutex);
+	return session;
 }
 
-gint janus_session_destroy(guint64 session_id) {
-	janus_session *session = janus_session_find(session_id);
+void janus_session_ref(janus_session *session) {
 	if(session == NULL)
+		return;
+	g_atomic_int_inc(&session->ref);
+}
+
+void janus_session_unref(janus_session *session) {
+	if(session == NULL || !g_atomic_int_dec_and_test(&session->ref))
+		return;
+	janus_session_free(session);
+}
+
+gint janus_session_destroy(guint64 session_id) {
+	janus_mutex_lock(&sessions_mutex);
+	janus_session *session = g_hash_table_lookup(sessions, GUINT_TO_POINTER(session_id));
+	if(session == NULL || session->destroy) {
+		janus_mutex_unlock(&sessions_mutex);
 		return -1;
+	}
 	session->destroy = 1;
-	/* TODO Remove all handles */
-	//~ if(handle->app == NULL) {
-		//~ ret = janus_ws_error(connection, msg, transaction_text, JANUS_ERROR_PLUGIN_NOT_FOUND, "No plugin to detach from");
-		//~ goto jsondone;
-	//~ }
-	//~ janus_plugin *plugin_t = (janus_plugin *)handle->app;
-	//~ JANUS_PRINT("Detaching handle from %s\n", plugin_t->get_name());
-	//~ /* TODO Actually detach session... */
-	//~ int error = 0;
-	//~ plugin_t->destroy_session(handle, &error);
-	//~ if(error) {	/* TODO Make error struct to pass verbose information */
-		//~ g_hash_table_remove(session->ice_handles, GUINT_TO_POINTER(handle_id));
-		//~ ret = janus_ws_error(connection, msg, transaction_text, JANUS_ERROR_PLUGIN_DETACH, "Couldn't detach from plugin: error '%d'", error);
-		//~ /* TODO Delete handle instance */
-		//~ goto jsondone;
-	//~ }
-	//~ g_hash_table_remove(session, handle);
 	g_hash_table_remove(sessions, GUINT_TO_POINTER(session_id));
-	/* TODO Actually destroy session */
+	janus_mutex_unlock(&sessions_mutex);
+	JANUS_PRINT("Destroying session %"SCNu64"\n", session_id);
+	/* Remove all handles (this also detaches them from their plugins): no new one can be added from now on */
+	janus_mutex_lock(&session->mutex);
+	GList *handles = session->ice_handles ? g_hash_table_get_keys(session->ice_handles) : NULL;
+	janus_mutex_unlock(&session->mutex);
+	GList *h = handles;
+	while(h) {
+		janus_ice_handle_destroy(session, GPOINTER_TO_UINT(h->data));
+		h = h->next;
+	}
+	g_list_free(handles);
+	/* The session is freed as soon as nobody is using it anymore (e.g., a long poll) */
+	janus_session_unref(session);
 	return 0;
 }
 
+static void janus_http_event_free(janus_http_event *event) {
+	if(event == NULL)
+		return;
+	if(event->payload && event->allocated)
+		g_free(event->payload);
+	g_free(event);
+}
+
+/* Helper to queue an event in a session: if the queue is full (e.g., the
+ * browser stopped polling), the oldest events are dropped to make room */
+static void janus_session_push_event(janus_session *session, janus_http_event *event) {
+	if(session == NULL || session->messages == NULL || event == NULL)
+		return;
+	guint dropped = janus_queue_push_bounded(session->messages, event, max_session_events, (GDestroyNotify)janus_http_event_free);
+	janus_metrics_event_queued();
+	if(dropped > 0) {
+		janus_metrics_events_dropped(dropped);
+		JANUS_DEBUG("Too many events waiting in session %"SCNu64", dropped %u\n", session->session_id, dropped);
+	}
+}
+
+static void janus_session_free(janus_session *session) {
+	if(session == NULL)
+		return;
+	JANUS_PRINT("Freeing session %"SCNu64"\n", session->session_id);
+	if(session->ice_handles != NULL)
+		g_hash_table_destroy(session->ice_handles);
+	session->ice_handles = NULL;
+	if(session->messages != NULL) {
+		janus_http_event *event = NULL;
+		while((event = g_async_queue_try_pop(session->messages)) != NULL) {
+			janus_metrics_event_dequeued();
+			janus_http_event_free(event);
+		}
+		g_async_queue_unref(session->messages);
+	}
+	session->messages = NULL;
+	janus_mutex_destroy(&session->mutex);
+	free(session);
+}
+
+void *janus_sessions_watchdog(void *data) {
+	JANUS_PRINT("Sessions watchdog started\n");
+	while(!stop) {
+		/* Check once per second */
+		int i = 0;
+		for(i=0; i<4 && !stop; i++)
+			g_usleep(250000);
+		if(stop)
+			break;
+		if(session_timeout > 0) {
+			gint64 now = g_get_monotonic_time();
+			GList *expired = NULL;
+			janus_mutex_lock(&sessions_mutex);
+			GHashTableIter iter;
+			gpointer value = NULL;
+			g_hash_table_iter_init(&iter, sessions);
+			while(g_hash_table_iter_next(&iter, NULL, &value)) {
+				janus_session *session = (janus_session *)value;
+				if(!session->destroy && now-session->last_activity >= (gint64)session_timeout*G_USEC_PER_SEC)
+					expired = g_list_prepend(expired, GUINT_TO_POINTER(session->session_id));
+			}
+			janus_mutex_unlock(&sessions_mutex);
+			GList *l = expired;
+			while(l) {
+				JANUS_PRINT("Session %"SCNu64" timed out (no activity for %d seconds)\n", (guint64)GPOINTER_TO_UINT(l->data), session_timeout);
+				janus_session_destroy(GPOINTER_TO_UINT(l->data));
+				l = l->next;
+			}
+			g_list_free(expired);
+		}
+		janus_ice_free_destroyed_handles(FALSE);
+	}
+	JANUS_PRINT("Sessions watchdog stopped\n");
+	return NULL;
+}
+
 
 /* WebServer requests handler */
 int janus_ws_handler(void *cls, struct MHD_Connection *connection, const char *url, const char *method, const char *version, const char *upload_data, size_t *upload_data_size, void **ptr)
@@ -154,6 +276,9 @@ int janus_ws_handler(void *cls, struct MHD_Connection *connection, const char *u
 	char *payload = NULL;
 	struct MHD_Response *response = NULL;
 	int ret = MHD_NO;
+	/* References we hold while handling the request, released when done */
+	janus_session *session = NULL;
+	janus_ice_handle *handle = NULL;
 
 	JANUS_PRINT("Got a HTTP %s request on %s...\n", method, url);
 	/* Is this the first round? */
@@ -201,6 +326,12 @@ int janus_ws_handler(void *cls, struct MHD_Connection *connection, const char *u
 		ret = MHD_queue_response(connection, MHD_HTTP_OK, response);
 		MHD_destroy_response(response);
 	}
+	/* Is this a scrape of our metrics? */
+	if(metrics_path != NULL && !strcasecmp(method, "GET") && !strcasecmp(url, metrics_path)) {
+		if(firstround)
+			return ret;
+		return janus_ws_metrics(connection, msg);
+	}
 	/* Get path components */
 	gchar **basepath = NULL, **path = NULL;
 	if(strcasecmp(url, ws_path)) {
@@ -341,7 +472,7 @@ int janus_ws_handler(void *cls, struct MHD_Connection *connection, const char *u
 			goto done;
 		}
 		/* Handle it */
-		janus_session *session = janus_session_create();
+		session = janus_session_create();
 		if(session == NULL) {
 			ret = janus_ws_error(connection, msg, transaction_text, JANUS_ERROR_UNKNOWN, "Memory error");
 			json_decref(root);
@@ -410,7 +541,7 @@ int janus_ws_handler(void *cls, struct MHD_Connection *connection, const char *u
 			MHD_destroy_response(response);
 			goto done;
 		}
-		janus_session *session = janus_session_find(session_id);
+		session = janus_session_find(session_id);
 		if(!session) {
 			JANUS_DEBUG("Couldn't find any session %"SCNu64"...\n", session_id);
 			response = MHD_create_response_from_data(0, NULL, MHD_NO, MHD_NO);
@@ -425,9 +556,13 @@ int janus_ws_handler(void *cls, struct MHD_Connection *connection, const char *u
 		}
 		JANUS_PRINT("Session %"SCNu64" found... returning message\n", session->session_id);
 		/* Handle GET, taking the first message from the list */
-		janus_http_event *event = g_queue_pop_head(session->messages);
+		janus_http_event *event = g_async_queue_try_pop(session->messages);
 		if(event != NULL) {
+			janus_metrics_event_dequeued();
+			janus_metrics_histogram_observe(&janus_metrics_longpoll_wait, 0);
+			/* The payload is freed by the web server */
 			ret = janus_ws_success(connection, msg, "application/json", event->payload);
+			g_free(event);
 		} else {
 			/* Still no message, wait */
 			ret = janus_ws_notifier(connection, msg);
@@ -459,13 +594,12 @@ int janus_ws_handler(void *cls, struct MHD_Connection *connection, const char *u
 	const gchar *message_text = json_string_value(message);
 
 	/* If we got here, it's a POST, make sure we have a session (and a handle) */
-	janus_session *session = janus_session_find(session_id);
+	session = janus_session_find(session_id);
 	if(!session) {
 		JANUS_DEBUG("Couldn't find any session %"SCNu64"...\n", session_id);
 		ret = janus_ws_error(connection, msg, transaction_text, JANUS_ERROR_SESSION_NOT_FOUND, "No such session %"SCNu64"", session_id);
 		goto done;
 	}
-	janus_ice_handle *handle = NULL;
 	if(handle_id > 0) {
 		handle = janus_ice_handle_find(session, handle_id);
 		if(!handle) {
@@ -573,6 +707,7 @@ int janus_ws_handler(void *cls, struct MHD_Connection *connection, const char *u
 			ret = janus_ws_error(connection, msg, transaction_text, JANUS_ERROR_PLUGIN_MESSAGE, "No plugin to handle this message");
 			goto jsondone;
 		}
+		janus_trace_mark(handle->trace, JANUS_TRACE_MESSAGE_RECEIVED, 0, 0);
 		janus_plugin *plugin_t = (janus_plugin *)handle->app;
 		JANUS_PRINT("There's a message for %s\n", plugin_t->get_name());
 		json_t *body = json_object_get(root, "body");
@@ -649,6 +784,10 @@ int janus_ws_handler(void *cls, struct MHD_Connection *connection, const char *u
 			}
 			janus_sdp_parse(handle, parsed_sdp);
 			janus_sdp_free(parsed_sdp);
+			if(handle->record) {
+				/* Now that we know the codecs, start recording any new stream */
+				janus_ice_handle_record(handle, TRUE);
+			}
 			if(!offer) {
 				JANUS_PRINT("Done! Sending connectivity checks...\n");
 				/* Set remote candidates now */
@@ -675,7 +814,9 @@ int janus_ws_handler(void *cls, struct MHD_Connection *connection, const char *u
 		}
 		char *body_text = json_dumps(body, JSON_INDENT(3));
 		//~ json_decref(body);
+		janus_trace_mark(handle->trace, JANUS_TRACE_PLUGIN_MESSAGE, 0, 0);
 		plugin_t->handle_message(handle->app_handle, (char *)transaction_text, body_text, jsep_type, jsep_sdp_stripped);
+		janus_trace_mark(handle->trace, JANUS_TRACE_PLUGIN_MESSAGE_DONE, 0, 0);
 		/* We reply right away, not to block the web server... */
 		json_t *reply = json_object();
 		json_object_set(reply, "janus", json_string("ack"));
@@ -685,6 +826,55 @@ int janus_ws_handler(void *cls, struct MHD_Connection *connection, const char *u
 		json_decref(reply);
 		/* Send the success reply */
 		ret = janus_ws_success(connection, msg, "application/json", reply_text);
+	} else if(!strcasecmp(message_text, "trace")) {
+		if(handle == NULL) {
+			/* Query is an handle-level command */
+			ret = janus_ws_error(connection, msg, transaction_text, JANUS_ERROR_INVALID_REQUEST_PATH, "Unhandled request '%s' at this path", message_text);
+			goto jsondone;
+		}
+		/* Prepare JSON reply (the trace is empty if tracing is disabled) */
+		json_t *reply = json_object();
+		json_object_set_new(reply, "janus", json_string("success"));
+		json_object_set_new(reply, "transaction", json_string(transaction_text));
+		json_t *data = json_object();
+		json_object_set_new(data, "id", json_integer(handle_id));
+		json_object_set_new(data, "trace", janus_trace_to_json(handle->trace));
+		json_object_set_new(reply, "data", data);
+		/* Convert to a string */
+		char *reply_text = json_dumps(reply, JSON_INDENT(3));
+		json_decref(reply);
+		/* Send the success reply */
+		ret = janus_ws_success(connection, msg, "application/json", reply_text);
+	} else if(!strcasecmp(message_text, "record")) {
+		if(handle == NULL) {
+			/* Query is an handle-level command */
+			ret = janus_ws_error(connection, msg, transaction_text, JANUS_ERROR_INVALID_REQUEST_PATH, "Unhandled request '%s' at this path", message_text);
+			goto jsondone;
+		}
+		json_t *record = json_object_get(root, "record");
+		if(!record || !json_is_boolean(record)) {
+			ret = janus_ws_error(connection, msg, transaction_text, JANUS_ERROR_INVALID_JSON_OBJECT, "JSON error: missing or invalid element (record)");
+			goto jsondone;
+		}
+		gboolean start = json_is_true(record);
+		if(start && !janus_recorder_is_enabled()) {
+			ret = janus_ws_error(connection, msg, transaction_text, JANUS_ERROR_UNKNOWN, "Recordings are disabled");
+			goto jsondone;
+		}
+		janus_ice_handle_record(handle, start);
+		/* Prepare JSON reply */
+		json_t *reply = json_object();
+		json_object_set_new(reply, "janus", json_string("success"));
+		json_object_set_new(reply, "transaction", json_string(transaction_text));
+		json_t *data = json_object();
+		json_object_set_new(data, "id", json_integer(handle_id));
+		json_object_set_new(data, "record", start ? json_true() : json_false());
+		json_object_set_new(reply, "data", data);
+		/* Convert to a string */
+		char *reply_text = json_dumps(reply, JSON_INDENT(3));
+		json_decref(reply);
+		/* Send the success reply */
+		ret = janus_ws_success(connection, msg, "application/json", reply_text);
 	} else {
 		ret = janus_ws_error(connection, msg, transaction_text, JANUS_ERROR_UNKNOWN_REQUEST, "Unknown request '%s'", message_text);
 	}
@@ -693,6 +883,10 @@ jsondone:
 	json_decref(root);
 	
 done:
+	if(handle != NULL)
+		janus_ice_handle_unref(handle);
+	if(session != NULL)
+		janus_session_unref(session);
 	g_strfreev(path);
 	g_free(session_path);
 	g_free(handle_path);
@@ -701,7 +895,7 @@ done:
 
 int janus_ws_headers(void *cls, enum MHD_ValueKind kind, const char *key, const char *value) {
 	janus_http_msg *request = cls;
-	JANUS_PRINT("%s: %s\n", key, value);
+	JANUS_LOG(LOG_VERB, "%s: %s\n", key, value);
 	if(!strcasecmp(key, MHD_HTTP_HEADER_CONTENT_TYPE)) {
 		if(request)
 			request->contenttype = strdup(value);
@@ -758,15 +952,19 @@ int janus_ws_notifier(struct MHD_Connection *connection, janus_http_msg *msg) {
 	gint64 end = 0;
 	/* We have a timeout for the long poll: 30 seconds */
 	while(end-start < 30*G_USEC_PER_SEC) {
-		event = g_queue_pop_head(session->messages);
-		if(stop || event != NULL) {
+		/* Wait up to 100ms for an event: we'll be woken up as soon as one is pushed */
+		event = g_async_queue_timeout_pop(session->messages, 100000);
+		if(stop || event != NULL || session->destroy) {
 			/* Gotcha! */
 			break;
 		}
-		/* Sleep 100ms */
-		g_usleep(100000);
+		/* A pending long poll keeps the session alive */
+		session->last_activity = g_get_monotonic_time();
 		end = g_get_monotonic_time();
 	}
+	if(event != NULL)
+		janus_metrics_event_dequeued();
+	janus_metrics_histogram_observe(&janus_metrics_longpoll_wait, g_get_monotonic_time()-start);
 	if(event == NULL || event->payload == NULL) {
 		JANUS_PRINT("Long poll time out for session %"SCNu64"...\n", session_id);
 		event = (janus_http_event *)calloc(1, sizeof(janus_http_event));
@@ -774,6 +972,7 @@ int janus_ws_notifier(struct MHD_Connection *connection, janus_http_msg *msg) {
 			JANUS_DEBUG("Memory error!\n");
 			ret = MHD_queue_response(connection, MHD_HTTP_INTERNAL_SERVER_ERROR, response);
 			MHD_destroy_response(response);
+			janus_session_unref(session);
 			return ret;
 		}
 		event->code = 200;
@@ -794,6 +993,7 @@ int janus_ws_notifier(struct MHD_Connection *connection, janus_http_msg *msg) {
 		JANUS_DEBUG("Memory error!\n");
 		ret = MHD_queue_response(connection, MHD_HTTP_INTERNAL_SERVER_ERROR, response);
 		MHD_destroy_response(response);
+		janus_session_unref(session);
 		return ret;
 	}
 	ret = janus_ws_success(connection, msg, NULL, payload);
@@ -802,6 +1002,7 @@ int janus_ws_notifier(struct MHD_Connection *connection, janus_http_msg *msg) {
 		event->payload = NULL;
 	}
 	g_free(event);
+	janus_session_unref(session);
 	return ret;
 }
 
@@ -826,6 +1027,51 @@ int janus_ws_success(struct MHD_Connection *connection, janus_http_msg *msg, con
 	return ret;
 }
 
+int janus_ws_metrics(struct MHD_Connection *connection, janus_http_msg *msg)
+{
+	if(!connection || !msg)
+		return MHD_NO;
+	janus_mutex_lock(&sessions_mutex);
+	guint sessions_num = sessions ? g_hash_table_size(sessions) : 0;
+	janus_mutex_unlock(&sessions_mutex);
+	char *payload = janus_metrics_export(sessions_num);
+	if(payload == NULL) {
+		JANUS_DEBUG("Memory error!\n");
+		struct MHD_Response *response = MHD_create_response_from_data(0, NULL, MHD_NO, MHD_NO);
+		int ret = MHD_queue_response(connection, MHD_HTTP_INTERNAL_SERVER_ERROR, response);
+		MHD_destroy_response(response);
+		return ret;
+	}
+	/* Let plugins add their own metrics, if they export any */
+	if(plugins != NULL) {
+		GString *output = g_string_new(payload);
+		g_free(payload);
+		GHashTableIter iter;
+		gpointer value = NULL;
+		g_hash_table_iter_init(&iter, plugins);
+		while(g_hash_table_iter_next(&iter, NULL, &value)) {
+			janus_plugin *plugin = (janus_plugin *)value;
+			if(plugin == NULL || plugin->get_metrics == NULL)
+				continue;
+			char *plugin_metrics = plugin->get_metrics();
+			if(plugin_metrics != NULL) {
+				g_string_append(output, plugin_metrics);
+				g_free(plugin_metrics);
+			}
+		}
+		payload = g_string_free(output, FALSE);
+	}
+	struct MHD_Response *response = MHD_create_response_from_data(
+		strlen(payload),
+		(void*) payload,
+		MHD_YES,
+		MHD_NO);
+	MHD_add_response_header(response, "Content-Type", "text/plain; version=0.0.4");
+	int ret = MHD_queue_response(connection, MHD_HTTP_OK, response);
+	MHD_destroy_response(response);
+	return ret;
+}
+
 int janus_ws_error(struct MHD_Connection *connection, janus_http_msg *msg, const char *transaction, gint error, const char *format, ...)
 {
 	if(!connection || !msg)
@@ -908,11 +1154,28 @@ janus_plugin *janus_plugin_find(const gchar *package) {
 
 /* Plugin callback interface */
 int janus_push_event(janus_pluginession *handle, janus_plugin *plugin, char *transaction, char *message, char *sdp_type, char *sdp) {
+	return janus_push_event_common(handle, plugin, transaction, message, sdp_type, sdp, NULL);
+}
+
+int janus_push_event_template(janus_pluginession *handle, janus_plugin *plugin, char *transaction, char *message, char *sdp_type, janus_sdp_template *sdp_template) {
+	if(sdp_template == NULL)
+		return JANUS_ERROR_JSEP_INVALID_SDP;
+	return janus_push_event_common(handle, plugin, transaction, message, sdp_type, NULL, sdp_template);
+}
+
+static int janus_push_event_common(janus_pluginession *handle, janus_plugin *plugin, char *transaction, char *message, char *sdp_type, char *sdp, janus_sdp_template *sdp_template) {
 	if(!handle || !plugin || !message)
 		return -1;
-	janus_ice_handle *ice_handle = (janus_ice_handle *)handle->gateway_handle;
+	/* Keep the handle (and so its session) around while we use it, even if it's destroyed meanwhile */
+	janus_ice_handle *ice_handle = janus_ice_handle_from_app(handle);
 	if(!ice_handle)
 		return JANUS_ERROR_SESSION_NOT_FOUND;
+	int res = janus_push_event_handle(ice_handle, plugin, transaction, message, sdp_type, sdp, sdp_template);
+	janus_ice_handle_unref(ice_handle);
+	return res;
+}
+
+static int janus_push_event_handle(janus_ice_handle *ice_handle, janus_plugin *plugin, char *transaction, char *message, char *sdp_type, char *sdp, janus_sdp_template *sdp_template) {
 	janus_session *session = ice_handle->session;
 	if(!session)
 		return JANUS_ERROR_SESSION_NOT_FOUND;
@@ -929,8 +1192,8 @@ int janus_push_event(janus_pluginession *handle, janus_plugin *plugin, char *tra
 	}
 	/* Attach JSEP if possible? */
 	json_t *jsep = NULL;
-	if(sdp_type != NULL && sdp != NULL) {
-		jsep = janus_handle_sdp(handle, plugin, sdp_type, sdp);
+	if(sdp_type != NULL && (sdp != NULL || sdp_template != NULL)) {
+		jsep = janus_handle_sdp(ice_handle, plugin, sdp_type, sdp, sdp_template);
 		if(jsep == NULL) {
 			JANUS_DEBUG("[%"SCNu64"] Cannot push event (JSON error: problem with the SDP)\n", ice_handle->handle_id);
 			return JANUS_ERROR_JSEP_INVALID_SDP;
@@ -965,12 +1228,12 @@ int janus_push_event(janus_pluginession *handle, janus_plugin *plugin, char *tra
 	notification->code = 200;
 	notification->payload = reply_text;
 	notification->allocated = 1;
-	g_queue_push_tail(session->messages, notification);
+	janus_session_push_event(session, notification);
 	return JANUS_OK;
 }
 
-json_t *janus_handle_sdp(janus_pluginession *handle, janus_plugin *plugin, char *sdp_type, char *sdp) {
-	if(handle == NULL || plugin == NULL || sdp_type == NULL || sdp == NULL)
+json_t *janus_handle_sdp(janus_ice_handle *ice_handle, janus_plugin *plugin, char *sdp_type, char *sdp, janus_sdp_template *sdp_template) {
+	if(ice_handle == NULL || plugin == NULL || sdp_type == NULL || (sdp == NULL && sdp_template == NULL))
 		return NULL;
 	int offer = 0;
 	if(!strcasecmp(sdp_type, "offer")) {
@@ -982,11 +1245,17 @@ json_t *janus_handle_sdp(janus_pluginession *handle, janus_plugin *plugin, char
 		/* TODO Handle other messages */
 		return NULL;
 	}
-	janus_ice_handle *ice_handle = (janus_ice_handle *)handle->gateway_handle;
-	/* Is this valid SDP? */
 	int audio = 0, video = 0;
-	if(janus_sdp_preparse(sdp, &audio, &video) < 0) {
-		return NULL;
+	if(sdp_template != NULL) {
+		/* The template has been validated and stripped already */
+		audio = sdp_template->audio;
+		video = sdp_template->video;
+	} else {
+		/* Is this valid SDP? */
+		janus_sdp *parsed_sdp = janus_sdp_preparse(sdp, &audio, &video);
+		if(parsed_sdp == NULL)
+			return NULL;
+		janus_sdp_free(parsed_sdp);
 	}
 	if(offer) {
 		/* We still don't have a local ICE setup */
@@ -1006,18 +1275,27 @@ json_t *janus_handle_sdp(janus_pluginession *handle, janus_plugin *plugin, char
 			return NULL;
 		}
 	}
-	/* Anonymize SDP */
-	char *sdp_stripped = janus_sdp_anonymize(sdp);
-	if(sdp_stripped == NULL) {
-		/* Invalid SDP */
-		return NULL;
-	}
-	/* Add our details */
-	char *sdp_merged = janus_sdp_merge(ice_handle, sdp_stripped);
-	if(sdp_merged == NULL) {
-		/* Couldn't merge SDP */
+	janus_trace_mark(ice_handle->trace, JANUS_TRACE_GATHERING_DONE, 0, 0);
+	char *sdp_merged = NULL;
+	if(sdp_template != NULL) {
+		/* Just add our details to the template */
+		sdp_merged = janus_sdp_template_render(ice_handle, sdp_template);
+		if(sdp_merged == NULL)
+			return NULL;
+	} else {
+		/* Anonymize SDP */
+		char *sdp_stripped = janus_sdp_anonymize(sdp);
+		if(sdp_stripped == NULL) {
+			/* Invalid SDP */
+			return NULL;
+		}
+		/* Add our details */
+		sdp_merged = janus_sdp_merge(ice_handle, sdp_stripped);
 		g_free(sdp_stripped);
-		return NULL;
+		if(sdp_merged == NULL) {
+			/* Couldn't merge SDP */
+			return NULL;
+		}
 	}
 
 	if(!offer) {
@@ -1037,27 +1315,54 @@ json_t *janus_handle_sdp(janus_pluginession *handle, janus_plugin *plugin, char
 	json_t *jsep = json_object();
 	json_object_set(jsep, "type", json_string(sdp_type));
 	json_object_set(jsep, "sdp", json_string(sdp_merged));
-	g_free(sdp_stripped);
 	g_free(sdp_merged);
 	return jsep;
 }
 
+janus_sdp_template *janus_create_sdp_template(const char *sdp) {
+	return janus_sdp_template_create(sdp);
+}
+
+void janus_destroy_sdp_template(janus_sdp_template *sdp_template) {
+	janus_sdp_template_free(sdp_template);
+}
+
 void janus_relay_rtp(janus_pluginession *handle, int video, char *buf, int len) {
 	if(!handle)
 		return;
-	janus_ice_handle *session = (janus_ice_handle *)handle->gateway_handle;
+	janus_ice_handle *session = janus_ice_handle_from_app(handle);
 	if(!session)
 		return;
 	janus_ice_relay_rtp(session, video, buf, len);
+	janus_ice_handle_unref(session);
 }
 
 void janus_relay_rtcp(janus_pluginession *handle, int video, char *buf, int len) {
 	if(!handle)
 		return;
-	janus_ice_handle *session = (janus_ice_handle *)handle->gateway_handle;
+	janus_ice_handle *session = janus_ice_handle_from_app(handle);
 	if(!session)
 		return;
 	janus_ice_relay_rtcp(session, video, buf, len);
+	janus_ice_handle_unref(session);
+}
+
+GList *janus_get_codecs(janus_pluginession *handle, int video) {
+	if(!handle)
+		return NULL;
+	janus_ice_handle *session = janus_ice_handle_from_app(handle);
+	if(!session)
+		return NULL;
+	/* The table is replaced when the peer renegotiates: hand out a copy */
+	GList *codecs = NULL;
+	janus_mutex_lock(&session->mutex);
+	guint stream_id = video ? session->video_id : session->audio_id;
+	janus_ice_stream *stream = session->streams ? g_hash_table_lookup(session->streams, GUINT_TO_POINTER(stream_id)) : NULL;
+	if(stream != NULL)
+		codecs = janus_codecs_copy(stream->codecs);
+	janus_mutex_unlock(&session->mutex);
+	janus_ice_handle_unref(session);
+	return codecs;
 }
 
 
@@ -1073,6 +1378,14 @@ gint main(int argc, char *argv[])
 	/* Let's call our cmdline parser */
 	if(cmdline_parser(argc, argv, &args_info) != 0)
 		exit(1);
+	/* Any debug level from the command line we should honour right away? */
+	if(args_info.debug_level_given) {
+		if(args_info.debug_level_arg < LOG_NONE)
+			args_info.debug_level_arg = LOG_NONE;
+		else if(args_info.debug_level_arg > LOG_MAX)
+			args_info.debug_level_arg = LOG_MAX;
+		janus_log_level = args_info.debug_level_arg;
+	}
 	
 	JANUS_PRINT("----------------------------------------\n");
 	JANUS_PRINT("Starting Meetecho Janus (WebRTC Gateway)\n");
@@ -1126,6 +1439,11 @@ gint main(int argc, char *argv[])
 	janus_config_print(config);
 	/* Any command line argument that should overwrite the configuration? */
 	JANUS_PRINT("Checking command line arguments...\n");
+	if(args_info.debug_level_given) {
+		char debug[5];
+		sprintf(debug, "%d", args_info.debug_level_arg);
+		janus_config_add_item(config, "general", "debug_level", debug);
+	}
 	if(args_info.interface_given) {
 		janus_config_add_item(config, "general", "interface", args_info.interface_arg);
 	}
@@ -1173,9 +1491,25 @@ gint main(int argc, char *argv[])
 	}
 	janus_config_print(config);
 
+	/* Logging level (default=4, i.e., LOG_INFO) */
+	janus_config_item *item = janus_config_get_item_drilldown(config, "general", "debug_level");
+	if(item && item->value) {
+		int level = atoi(item->value);
+		if(level < LOG_NONE)
+			level = LOG_NONE;
+		else if(level > LOG_MAX)
+			level = LOG_MAX;
+		janus_log_level = level;
+	}
+	JANUS_PRINT("Debug/log level is %d\n", janus_log_level);
+	/* From now on, lines are written by a dedicated thread */
+	if(janus_log_init() < 0) {
+		JANUS_DEBUG("Error starting the logger thread, logging synchronously\n");
+	}
+
 	/* What is the local public IP? */
 	JANUS_PRINT("Available interfaces:\n");
-	janus_config_item *item = janus_config_get_item_drilldown(config, "general", "interface");
+	item = janus_config_get_item_drilldown(config, "general", "interface");
 	if(item && item->value)
 		JANUS_PRINT("  -- Will try to use %s\n", item->value);
 	struct ifaddrs *myaddrs, *ifa;
@@ -1236,6 +1570,43 @@ gint main(int argc, char *argv[])
 		}
 	}
 	
+	/* Are metrics enabled? If so, on which path should we serve them? */
+	gboolean metrics = FALSE;
+	item = janus_config_get_item_drilldown(config, "webserver", "metrics");
+	if(item && item->value && !strcasecmp(item->value, "yes"))
+		metrics = TRUE;
+	if(metrics) {
+		metrics_path = "/metrics";
+		item = janus_config_get_item_drilldown(config, "webserver", "metrics_path");
+		if(item && item->value) {
+			if(item->value[0] != '/') {
+				JANUS_DEBUG("Invalid metrics path %s (it should start with a /, e.g., /metrics\n", item->value);
+				exit(1);
+			}
+			metrics_path = g_strdup(item->value);
+		}
+		if(!strcasecmp(metrics_path, ws_path)) {
+			JANUS_DEBUG("The metrics path can't be the same as the base path (%s)\n", ws_path);
+			exit(1);
+		}
+		JANUS_PRINT("Metrics will be available on %s\n", metrics_path);
+	}
+	janus_metrics_init(metrics);
+
+	/* Should we trace the setup phases of handles? */
+	gboolean trace = FALSE;
+	item = janus_config_get_item_drilldown(config, "general", "trace");
+	if(item && item->value && !strcasecmp(item->value, "yes"))
+		trace = TRUE;
+	item = janus_config_get_item_drilldown(config, "general", "trace_folder");
+	if(janus_trace_init(trace, item ? item->value : NULL) < 0)
+		exit(1);
+
+	/* Should we allow peers' media to be recorded? */
+	item = janus_config_get_item_drilldown(config, "general", "recordings_folder");
+	if(janus_recorder_init(item ? item->value : NULL) < 0)
+		exit(1);
+
 	/* Setup ICE stuff (e.g., checking if the provided STUN server is correct) */
 	char *stun_server = NULL;
 	uint16_t stun_port = 0;
@@ -1249,6 +1620,13 @@ gint main(int argc, char *argv[])
 		JANUS_DEBUG("Invalid STUN address %s:%u\n", stun_server, stun_port);
 		exit(1);
 	}
+	gint rtp_workers = 0;
+	item = janus_config_get_item_drilldown(config, "general", "rtp_workers");
+	if(item && item->value)
+		rtp_workers = atoi(item->value);
+	if(janus_ice_relay_workers_init(rtp_workers) < 0) {
+		exit(1);
+	}
 	
 	/* Setup OpenSSL stuff */
 	item = janus_config_get_item_drilldown(config, "certificates", "cert_pem");
@@ -1266,7 +1644,18 @@ gint main(int argc, char *argv[])
 	SSL_load_error_strings();
 	OpenSSL_add_all_algorithms();
 	/* ... and DTLS-SRTP in particular */
-	if(janus_dtls_srtp_init(server_pem, server_key) < 0) {
+	gboolean dtls_ecdsa = FALSE;
+	item = janus_config_get_item_drilldown(config, "certificates", "dtls_ecdsa");
+	if(item && item->value && !strcasecmp(item->value, "yes"))
+		dtls_ecdsa = TRUE;
+	if(janus_dtls_srtp_init(server_pem, server_key, dtls_ecdsa) < 0) {
+		exit(1);
+	}
+	gint dtls_workers = 4;
+	item = janus_config_get_item_drilldown(config, "general", "dtls_workers");
+	if(item && item->value)
+		dtls_workers = atoi(item->value);
+	if(janus_dtls_workers_init(dtls_workers) < 0) {
 		exit(1);
 	}
 
@@ -1343,12 +1732,43 @@ gint main(int argc, char *argv[])
 			if(plugins_so == NULL)
 				plugins_so = g_hash_table_new(g_str_hash, g_str_equal);
 			g_hash_table_insert(plugins_so, (gpointer)janus_plugin->get_package(), plugin);
+			janus_metrics_plugin_register(janus_plugin->get_package());
 		}
 	}
 	closedir(dir);
 
-	/* Start web server */
+	/* Sessions, and the watchdog that takes care of the inactive ones */
 	sessions = g_hash_table_new(NULL, NULL);
+	item = janus_config_get_item_drilldown(config, "general", "session_timeout");
+	if(item && item->value) {
+		session_timeout = atoi(item->value);
+		if(session_timeout < 0)
+			session_timeout = 0;
+	}
+	item = janus_config_get_item_drilldown(config, "general", "max_session_events");
+	if(item && item->value) {
+		max_session_events = atoi(item->value);
+		if(max_session_events < 0)
+			max_session_events = 0;
+	}
+	if(max_session_events > 0) {
+		JANUS_PRINT("Sessions will queue up to %d events\n", max_session_events);
+	} else {
+		JANUS_PRINT("Sessions will queue an unlimited number of events\n");
+	}
+	if(session_timeout > 0) {
+		JANUS_PRINT("Sessions will expire after %d seconds of inactivity\n", session_timeout);
+	} else {
+		JANUS_PRINT("Sessions will never expire\n");
+	}
+	GError *error = NULL;
+	GThread *watchdog = g_thread_try_new("sessions watchdog", &janus_sessions_watchdog, NULL, &error);
+	if(error != NULL) {
+		JANUS_DEBUG("Got error %d (%s) trying to launch the sessions watchdog...\n", error->code, error->message ? error->message : "??");
+		exit(1);
+	}
+
+	/* Start web server */
 	item = janus_config_get_item_drilldown(config, "webserver", "http");
 	if(item && item->value && !strcasecmp(item->value, "no")) {
 		JANUS_PRINT("HTTP webserver disabled\n");
@@ -1470,7 +1890,21 @@ gint main(int argc, char *argv[])
 	if(cert_key_bytes != NULL)
 		g_free((gpointer)cert_key_bytes);
 	cert_key_bytes = NULL;
+	g_thread_join(watchdog);
+	/* Get rid of all the sessions (and handles) that are still around */
+	janus_mutex_lock(&sessions_mutex);
+	GList *ids = g_hash_table_get_keys(sessions);
+	janus_mutex_unlock(&sessions_mutex);
+	GList *id = ids;
+	while(id) {
+		janus_session_destroy(GPOINTER_TO_UINT(id->data));
+		id = id->next;
+	}
+	g_list_free(ids);
+	janus_ice_free_destroyed_handles(TRUE);
 	g_hash_table_destroy(sessions);
+	janus_dtls_workers_deinit();
+	janus_ice_relay_workers_deinit();
 	SSL_CTX_free(janus_dtls_get_ssl_ctx());
 	EVP_cleanup();
 	ERR_free_strings();
@@ -1485,7 +1919,11 @@ gint main(int argc, char *argv[])
 		g_hash_table_foreach(plugins_so, janus_pluginso_close, NULL);
 	}
 	g_hash_table_destroy(plugins_so);
+	janus_metrics_deinit();
+	janus_trace_deinit();
+	janus_recorder_deinit();
 	JANUS_PRINT("Bye!\n");
+	janus_log_destroy();
 	
 	exit(0);
 }
@@ -56,17 +56,34 @@ typedef struct janus_http_event {
 typedef struct janus_session {
 	guint64 session_id;
 	GHashTable *ice_handles;
-	/* HTTP */
-	GQueue *messages;
+	/* HTTP: events are pushed by plugin threads and popped by long polls */
+	GAsyncQueue *messages;
+	/* Monotonic time of the last request (or long poll) for this session */
+	gint64 last_activity;
+	/* Reference counter: the sessions table holds one until the session is
+	 * destroyed, and so do its handles and whoever uses it out of the table lock */
+	volatile gint ref;
 	gint destroy:1;
+	/* Protects the handles table */
 	janus_mutex mutex;
 } janus_session;
 
 
-/* Gateway Sessions */
+/* Gateway Sessions: create and find return a reference the caller must release */
 janus_session *janus_session_create(void);
 janus_session *janus_session_find(guint64 session_id);
+void janus_session_ref(janus_session *session);
+void janus_session_unref(janus_session *session);
 gint janus_session_destroy(guint64 session_id);
+/*! \brief Sessions watchdog thread
+ * \details Sessions that see no activity (requests or long polls) for
+ * longer than the configured timeout are destroyed, together with all their
+ * handles: this is what takes care of browsers that just went away. This
+ * thread also frees the handles nobody is using anymore, and the plugin
+ * handles and WebRTC resources that were retired a while ago (see ice.h).
+ * @param[in] data Unused
+ * @returns NULL when the gateway is stopping */
+void *janus_sessions_watchdog(void *data);
 
 
 /** @name Janus web server
@@ -115,6 +132,11 @@ int janus_ws_error(struct MHD_Connection *connection, janus_http_msg *msg, const
  * @param[in] msg The original request, which also manages the request state
  * @returns MHD_YES on success, MHD_NO otherwise */
 int janus_ws_notifier(struct MHD_Connection *connection, janus_http_msg *msg);
+/*! \brief Method to return the gateway and plugins metrics (Prometheus text format) to a scraper
+ * @param[in] connection The libmicrohttpd MHD_Connection connection instance that is handling the request
+ * @param[in] msg The original request
+ * @returns MHD_YES on success, MHD_NO otherwise */
+int janus_ws_metrics(struct MHD_Connection *connection, janus_http_msg *msg);
 ///@}
 
 
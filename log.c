@@ -0,0 +1,195 @@
+/*! \file    log.c
+ * \author   Lorenzo Miniero <lorenzo@meetecho.com>
+ * \copyright GNU Affero General Public License v3
+ * \brief    Buffered logging
+ * \details  Implementation of a simple buffered logger, meant to keep
+ * threads handling media (or anything else time-sensitive) from blocking
+ * on the console. Lines are formatted by the caller in a slot of a
+ * lock-free ring buffer, and a dedicated thread takes care of writing
+ * them out: if the ring is full, lines are dropped (and the number of
+ * dropped lines reported) rather than waiting for room to be available.
+ * Before the logger thread is started (and after it has been stopped)
+ * lines are written synchronously instead.
+ *
+ * \ingroup core
+ * \ref core
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "log.h"
+#include "debug.h"
+
+
+/* Current log level: can be changed at runtime */
+int janus_log_level = LOG_INFO;
+
+/* Ring buffer: must be a power of 2 */
+#define JANUS_LOG_SLOTS		1024
+/* Lines longer than this are allocated (e.g., SDPs) */
+#define JANUS_LOG_LINE_SIZE	512
+
+typedef struct janus_log_slot {
+	/* Sequence number, used to know whether the slot is free or ready (see Vyukov's bounded queue) */
+	volatile gint sequence;
+	/* Line, if it fits the slot */
+	char line[JANUS_LOG_LINE_SIZE];
+	/* Line, if it didn't fit the slot */
+	char *long_line;
+} janus_log_slot;
+
+static janus_log_slot *slots = NULL;
+static volatile gint tail = 0;	/* Producers (any thread) */
+static gint head = 0;			/* Consumer (logger thread) */
+static volatile gint dropped = 0;
+static volatile gint running = 0, stopping = 0;
+static GThread *log_thread = NULL;
+
+
+/* Helper to write the optional location prefix and the line itself in a buffer */
+static int janus_log_format(char *buffer, size_t size, const char *file, const char *function, int line, const char *format, va_list ap) {
+	int offset = 0;
+	if(file != NULL) {
+		offset = g_snprintf(buffer, size, "[%s:%s:%d:] ", file, function, line);
+		if(offset < 0)
+			offset = 0;
+		if((size_t)offset >= size)
+			offset = size-1;
+	}
+	int len = g_vsnprintf(buffer+offset, size-offset, format, ap);
+	return len < 0 ? offset : offset+len;
+}
+
+void janus_log_printf(const char *file, const char *function, int line, const char *format, ...) {
+	va_list ap;
+	if(!g_atomic_int_get(&running)) {
+		/* No logger thread (yet?), just print synchronously */
+		char buffer[JANUS_LOG_LINE_SIZE];
+		va_start(ap, format);
+		int len = janus_log_format(buffer, sizeof(buffer), file, function, line, format, ap);
+		va_end(ap);
+		if(len < JANUS_LOG_LINE_SIZE) {
+			fputs(buffer, stdout);
+		} else {
+			/* Too long for the buffer, format again */
+			if(file != NULL)
+				fprintf(stdout, "[%s:%s:%d:] ", file, function, line);
+			va_start(ap, format);
+			vfprintf(stdout, format, ap);
+			va_end(ap);
+		}
+		return;
+	}
+	/* Reserve a slot in the ring */
+	janus_log_slot *slot = NULL;
+	gint position = g_atomic_int_get(&tail);
+	while(TRUE) {
+		slot = &slots[position & (JANUS_LOG_SLOTS-1)];
+		gint diff = g_atomic_int_get(&slot->sequence) - position;
+		if(diff == 0) {
+			if(g_atomic_int_compare_and_exchange(&tail, position, position+1))
+				break;
+		} else if(diff < 0) {
+			/* The ring is full: drop the line, we never block the caller */
+			g_atomic_int_inc(&dropped);
+			return;
+		}
+		position = g_atomic_int_get(&tail);
+	}
+	/* Format the line in the slot (or a separate buffer if it's too long) */
+	slot->long_line = NULL;
+	va_start(ap, format);
+	int len = janus_log_format(slot->line, JANUS_LOG_LINE_SIZE, file, function, line, format, ap);
+	va_end(ap);
+	if(len >= JANUS_LOG_LINE_SIZE) {
+		va_start(ap, format);
+		char *text = g_strdup_vprintf(format, ap);
+		va_end(ap);
+		if(file != NULL) {
+			slot->long_line = g_strdup_printf("[%s:%s:%d:] %s", file, function, line, text);
+			g_free(text);
+		} else {
+			slot->long_line = text;
+		}
+	}
+	/* Done: let the logger thread know the slot is ready */
+	g_atomic_int_set(&slot->sequence, position+1);
+}
+
+
+/* Thread writing the lines out */
+static void *janus_log_thread(void *data) {
+	gboolean written = FALSE;
+	while(TRUE) {
+		janus_log_slot *slot = &slots[head & (JANUS_LOG_SLOTS-1)];
+		if(g_atomic_int_get(&slot->sequence) != head+1) {
+			/* Nothing to write */
+			if(written) {
+				fflush(stdout);
+				written = FALSE;
+			}
+			gint lost = g_atomic_int_get(&dropped);
+			if(lost > 0) {
+				g_atomic_int_add(&dropped, -lost);
+				fprintf(stdout, "[log] %d lines dropped (log buffer full)\n", lost);
+				fflush(stdout);
+			}
+			if(g_atomic_int_get(&stopping))
+				break;
+			g_usleep(5000);
+			continue;
+		}
+		if(slot->long_line != NULL) {
+			fputs(slot->long_line, stdout);
+			g_free(slot->long_line);
+			slot->long_line = NULL;
+		} else {
+			fputs(slot->line, stdout);
+		}
+		written = TRUE;
+		/* Make the slot available again */
+		g_atomic_int_set(&slot->sequence, head+JANUS_LOG_SLOTS);
+		head++;
+	}
+	return NULL;
+}
+
+
+gint janus_log_init(void) {
+	if(g_atomic_int_get(&running))
+		return 0;
+	if(slots == NULL)
+		slots = calloc(JANUS_LOG_SLOTS, sizeof(janus_log_slot));
+	if(slots == NULL) {
+		JANUS_DEBUG("Memory error!\n");
+		return -1;
+	}
+	int i = 0;
+	for(i=0; i<JANUS_LOG_SLOTS; i++)
+		slots[i].sequence = i;
+	head = 0;
+	tail = 0;
+	GError *error = NULL;
+	log_thread = g_thread_try_new("janus log", janus_log_thread, NULL, &error);
+	if(error != NULL) {
+		JANUS_DEBUG("Got error %d (%s) trying to launch the log thread...\n", error->code, error->message ? error->message : "??");
+		return -1;
+	}
+	g_atomic_int_set(&running, 1);
+	return 0;
+}
+
+void janus_log_destroy(void) {
+	if(!g_atomic_int_get(&running))
+		return;
+	/* New lines will be written synchronously from now on */
+	g_atomic_int_set(&running, 0);
+	g_atomic_int_set(&stopping, 1);
+	if(log_thread != NULL)
+		g_thread_join(log_thread);
+	log_thread = NULL;
+	/* We don't free the ring, as other threads may still be completing a line in there */
+	g_atomic_int_set(&stopping, 0);
+}
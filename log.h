@@ -0,0 +1,41 @@
+/*! \file    log.h
+ * \author   Lorenzo Miniero <lorenzo@meetecho.com>
+ * \copyright GNU Affero General Public License v3
+ * \brief    Buffered logging (headers)
+ * \details  Implementation of a simple buffered logger, meant to keep
+ * threads handling media (or anything else time-sensitive) from blocking
+ * on the console. Lines are formatted by the caller in a slot of a
+ * lock-free ring buffer, and a dedicated thread takes care of writing
+ * them out: if the ring is full, lines are dropped (and the number of
+ * dropped lines reported) rather than waiting for room to be available.
+ * Before the logger thread is started (and after it has been stopped)
+ * lines are written synchronously instead.
+ *
+ * \ingroup core
+ * \ref core
+ */
+
+#ifndef _JANUS_LOG_H
+#define _JANUS_LOG_H
+
+#include <stdarg.h>
+#include <glib.h>
+
+
+/*! \brief Log initialization, which starts the logger thread
+ * @returns 0 in case of success, a negative integer otherwise */
+gint janus_log_init(void);
+/*! \brief Log deinitialization, which flushes pending lines and stops the logger thread */
+void janus_log_destroy(void);
+
+/*! \brief Method to queue a new log line
+ * \note You should not invoke this directly, but use the JANUS_LOG macro
+ * (or JANUS_PRINT and JANUS_DEBUG) defined in debug.h instead, as they
+ * make sure no formatting takes place at all for disabled levels
+ * @param[in] file The source file the line comes from, if a location prefix is needed (NULL otherwise)
+ * @param[in] function The function the line comes from, if a location prefix is needed
+ * @param[in] line The line number the line comes from, if a location prefix is needed
+ * @param[in] format The printf format of the line, followed by a variable number of arguments */
+void janus_log_printf(const char *file, const char *function, int line, const char *format, ...) G_GNUC_PRINTF(4, 5);
+
+#endif
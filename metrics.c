@@ -0,0 +1,172 @@
+/*! \file    metrics.c
+ * \author   Lorenzo Miniero <lorenzo@meetecho.com>
+ * \copyright GNU Affero General Public License v3
+ * \brief    Metrics export
+ * \details  Implementation of a simple set of counters, gauges and
+ * histograms the gateway keeps track of internally, and that can be
+ * exported in the Prometheus text exposition format on a dedicated path
+ * (\c /metrics by default) of the existing web server. All updates are
+ * based on GLib atomic operations, in order to keep the impact on the
+ * hot paths (e.g., SRTP protect/unprotect) as small as possible: when
+ * metrics are disabled in the configuration, no timing is done at all.
+ *
+ * \ingroup core
+ * \ref core
+ */
+
+#include "metrics.h"
+#include "debug.h"
+
+
+static gint metrics_enabled = 0;
+
+/* Buckets: the SRTP ones are in the microseconds range, long polls may last up to 30 seconds */
+static const gint64 srtp_bounds[JANUS_METRICS_BUCKETS] =
+	{ 1, 2, 5, 10, 20, 50, 100, 200, 500, 1000 };
+static const gint64 longpoll_bounds[JANUS_METRICS_BUCKETS] =
+	{ 1000, 10000, 50000, 100000, 500000, 1000000, 5000000, 10000000, 20000000, 30000000 };
+
+janus_metrics_histogram janus_metrics_srtp_protect = {
+	.name = "janus_srtp_protect_seconds",
+	.help = "Time spent protecting outgoing RTP/RTCP packets",
+	.bounds = srtp_bounds,
+};
+janus_metrics_histogram janus_metrics_srtp_unprotect = {
+	.name = "janus_srtp_unprotect_seconds",
+	.help = "Time spent unprotecting incoming RTP/RTCP packets",
+	.bounds = srtp_bounds,
+};
+janus_metrics_histogram janus_metrics_longpoll_wait = {
+	.name = "janus_longpoll_wait_seconds",
+	.help = "Time long poll requests waited before an event (or a keep-alive) was returned",
+	.bounds = longpoll_bounds,
+};
+
+/* Events waiting in the session queues, and events dropped because the queues were full */
+static volatile gint events_queued = 0;
+static volatile gint events_dropped = 0;
+/* Handles per plugin (package name -> gint counter) */
+static GHashTable *plugin_handles = NULL;
+
+
+gint janus_metrics_init(gboolean enabled) {
+	metrics_enabled = enabled ? 1 : 0;
+	plugin_handles = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, g_free);
+	JANUS_PRINT("Metrics %s\n", metrics_enabled ? "enabled" : "disabled");
+	return 0;
+}
+
+void janus_metrics_deinit(void) {
+	metrics_enabled = 0;
+	if(plugin_handles != NULL)
+		g_hash_table_destroy(plugin_handles);
+	plugin_handles = NULL;
+}
+
+gboolean janus_metrics_is_enabled(void) {
+	return metrics_enabled;
+}
+
+
+void janus_metrics_histogram_observe(janus_metrics_histogram *histogram, gint64 value) {
+	if(!metrics_enabled || histogram == NULL)
+		return;
+	if(value < 0)
+		value = 0;
+	int i = 0;
+	while(i < JANUS_METRICS_BUCKETS && value > histogram->bounds[i])
+		i++;
+	/* Buckets are not cumulative here: we sum them when exporting */
+	g_atomic_int_inc(&histogram->buckets[i]);
+	g_atomic_int_inc(&histogram->count);
+	__sync_fetch_and_add(&histogram->sum, (guint64)value);
+}
+
+void janus_metrics_plugin_register(const char *package) {
+	if(package == NULL || plugin_handles == NULL)
+		return;
+	if(g_hash_table_lookup(plugin_handles, package) != NULL)
+		return;
+	gint *handles = g_malloc0(sizeof(gint));
+	g_hash_table_insert(plugin_handles, g_strdup(package), handles);
+}
+
+void janus_metrics_handle_attached(const char *package) {
+	if(package == NULL || plugin_handles == NULL)
+		return;
+	gint *handles = g_hash_table_lookup(plugin_handles, package);
+	if(handles != NULL)
+		g_atomic_int_inc(handles);
+}
+
+void janus_metrics_handle_detached(const char *package) {
+	if(package == NULL || plugin_handles == NULL)
+		return;
+	gint *handles = g_hash_table_lookup(plugin_handles, package);
+	if(handles != NULL)
+		g_atomic_int_add(handles, -1);
+}
+
+void janus_metrics_event_queued(void) {
+	g_atomic_int_inc(&events_queued);
+}
+
+void janus_metrics_event_dequeued(void) {
+	g_atomic_int_add(&events_queued, -1);
+}
+
+void janus_metrics_events_dropped(gint dropped) {
+	g_atomic_int_add(&events_queued, -dropped);
+	g_atomic_int_add(&events_dropped, dropped);
+}
+
+
+void janus_metrics_print_gauge(GString *output, const char *name, const char *help, gint64 value) {
+	if(output == NULL || name == NULL)
+		return;
+	g_string_append_printf(output, "# HELP %s %s\n", name, help ? help : name);
+	g_string_append_printf(output, "# TYPE %s gauge\n", name);
+	g_string_append_printf(output, "%s %"G_GINT64_FORMAT"\n", name, value);
+}
+
+void janus_metrics_print_histogram(GString *output, janus_metrics_histogram *histogram) {
+	if(output == NULL || histogram == NULL)
+		return;
+	g_string_append_printf(output, "# HELP %s %s\n", histogram->name, histogram->help);
+	g_string_append_printf(output, "# TYPE %s histogram\n", histogram->name);
+	gint64 cumulative = 0;
+	int i = 0;
+	for(i=0; i<JANUS_METRICS_BUCKETS; i++) {
+		cumulative += g_atomic_int_get(&histogram->buckets[i]);
+		g_string_append_printf(output, "%s_bucket{le=\"%g\"} %"G_GINT64_FORMAT"\n",
+			histogram->name, (double)histogram->bounds[i]/G_USEC_PER_SEC, cumulative);
+	}
+	cumulative += g_atomic_int_get(&histogram->buckets[JANUS_METRICS_BUCKETS]);
+	g_string_append_printf(output, "%s_bucket{le=\"+Inf\"} %"G_GINT64_FORMAT"\n", histogram->name, cumulative);
+	g_string_append_printf(output, "%s_sum %g\n", histogram->name, (double)__sync_fetch_and_add(&histogram->sum, 0)/G_USEC_PER_SEC);
+	g_string_append_printf(output, "%s_count %d\n", histogram->name, g_atomic_int_get(&histogram->count));
+}
+
+char *janus_metrics_export(guint sessions) {
+	GString *output = g_string_new(NULL);
+	janus_metrics_print_gauge(output, "janus_sessions", "Number of active gateway sessions", sessions);
+	if(plugin_handles != NULL) {
+		g_string_append(output, "# HELP janus_plugin_handles Number of handles attached to each plugin\n");
+		g_string_append(output, "# TYPE janus_plugin_handles gauge\n");
+		GHashTableIter iter;
+		gpointer key = NULL, value = NULL;
+		g_hash_table_iter_init(&iter, plugin_handles);
+		while(g_hash_table_iter_next(&iter, &key, &value)) {
+			g_string_append_printf(output, "janus_plugin_handles{plugin=\"%s\"} %d\n",
+				(char *)key, g_atomic_int_get((gint *)value));
+		}
+	}
+	janus_metrics_print_gauge(output, "janus_session_events_queued", "Number of events waiting in the session queues", g_atomic_int_get(&events_queued));
+	g_string_append(output, "# HELP janus_session_events_dropped_total Number of events dropped because a session queue was full\n");
+	g_string_append(output, "# TYPE janus_session_events_dropped_total counter\n");
+	g_string_append_printf(output, "janus_session_events_dropped_total %d\n", g_atomic_int_get(&events_dropped));
+	janus_metrics_print_histogram(output, &janus_metrics_longpoll_wait);
+	janus_metrics_print_histogram(output, &janus_metrics_srtp_protect);
+	janus_metrics_print_histogram(output, &janus_metrics_srtp_unprotect);
+	return g_string_free(output, FALSE);
+}
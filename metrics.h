@@ -0,0 +1,118 @@
+/*! \file    metrics.h
+ * \author   Lorenzo Miniero <lorenzo@meetecho.com>
+ * \copyright GNU Affero General Public License v3
+ * \brief    Metrics export (headers)
+ * \details  Implementation of a simple set of counters, gauges and
+ * histograms the gateway keeps track of internally, and that can be
+ * exported in the Prometheus text exposition format on a dedicated path
+ * (\c /metrics by default) of the existing web server. All updates are
+ * based on GLib atomic operations, in order to keep the impact on the
+ * hot paths (e.g., SRTP protect/unprotect) as small as possible: when
+ * metrics are disabled in the configuration, no timing is done at all.
+ *
+ * Plugins can export their own metrics too, by implementing the optional
+ * \c get_metrics() method of the \c janus_plugin interface.
+ *
+ * \ingroup core
+ * \ref core
+ */
+
+#ifndef _JANUS_METRICS_H
+#define _JANUS_METRICS_H
+
+#include <glib.h>
+
+
+/*! \brief Number of buckets (excluding +Inf) in a Janus histogram */
+#define JANUS_METRICS_BUCKETS	10
+
+/*! \brief Janus histogram (values are in microseconds, exported as seconds) */
+typedef struct janus_metrics_histogram {
+	/*! \brief Name of the metric */
+	const char *name;
+	/*! \brief Description of the metric */
+	const char *help;
+	/*! \brief Upper bounds of the buckets, in microseconds */
+	const gint64 *bounds;
+	/*! \brief Observations per bucket (the last one is +Inf) */
+	volatile gint buckets[JANUS_METRICS_BUCKETS+1];
+	/*! \brief Sum of all the observed values, in microseconds */
+	volatile guint64 sum;
+	/*! \brief Number of observed values */
+	volatile gint count;
+} janus_metrics_histogram;
+
+
+/** @name Janus metrics setup
+ */
+///@{
+/*! \brief Metrics initialization
+ * @param[in] enabled Whether metrics should be collected at all
+ * @returns 0 in case of success, a negative integer on errors */
+gint janus_metrics_init(gboolean enabled);
+/*! \brief Metrics deinitialization */
+void janus_metrics_deinit(void);
+/*! \brief Helper method to check whether metrics are being collected
+ * \note This is what the hot paths check before timing anything
+ * @returns TRUE if metrics are enabled, FALSE otherwise */
+gboolean janus_metrics_is_enabled(void);
+///@}
+
+
+/** @name Janus metrics updates
+ */
+///@{
+/*! \brief Method to add an observation to a histogram
+ * @param[in] histogram The histogram to update
+ * @param[in] value The observed value, in microseconds */
+void janus_metrics_histogram_observe(janus_metrics_histogram *histogram, gint64 value);
+/*! \brief Method to register a plugin, in order to count the handles attached to it
+ * \note This must be done before the web server is started, as the map is read without locking later
+ * @param[in] package The unique package name of the plugin */
+void janus_metrics_plugin_register(const char *package);
+/*! \brief Method to notify a new handle has been attached to a plugin
+ * @param[in] package The unique package name of the plugin */
+void janus_metrics_handle_attached(const char *package);
+/*! \brief Method to notify a handle has been detached from a plugin
+ * @param[in] package The unique package name of the plugin */
+void janus_metrics_handle_detached(const char *package);
+/*! \brief Method to notify an event has been queued in a session */
+void janus_metrics_event_queued(void);
+/*! \brief Method to notify an event has been taken out of a session queue */
+void janus_metrics_event_dequeued(void);
+/*! \brief Method to notify some events have been dropped from a full session queue
+ * @param[in] dropped The number of dropped events */
+void janus_metrics_events_dropped(gint dropped);
+///@}
+
+/*! \brief Histogram of the time spent in srtp_protect/srtp_protect_rtcp */
+extern janus_metrics_histogram janus_metrics_srtp_protect;
+/*! \brief Histogram of the time spent in srtp_unprotect/srtp_unprotect_rtcp */
+extern janus_metrics_histogram janus_metrics_srtp_unprotect;
+/*! \brief Histogram of the time long polls waited before returning */
+extern janus_metrics_histogram janus_metrics_longpoll_wait;
+
+
+/** @name Janus metrics export
+ */
+///@{
+/*! \brief Method to append a gauge to a Prometheus text exposition
+ * @param[in] output The GString to append the metric to
+ * @param[in] name The name of the metric
+ * @param[in] help The description of the metric
+ * @param[in] value The current value of the gauge */
+void janus_metrics_print_gauge(GString *output, const char *name, const char *help, gint64 value);
+/*! \brief Method to append a histogram to a Prometheus text exposition
+ * @param[in] output The GString to append the metric to
+ * @param[in] histogram The histogram to export */
+void janus_metrics_print_histogram(GString *output, janus_metrics_histogram *histogram);
+/*! \brief Method to export all the core metrics in the Prometheus text format
+ * \note Metrics that depend on the gateway state (e.g., the number of
+ * sessions) are provided by the caller, as the core owns that state
+ * @param[in] sessions The number of currently active sessions
+ * @returns A string (to be freed with g_free) containing the metrics */
+char *janus_metrics_export(guint sessions);
+///@}
+
+
+#endif
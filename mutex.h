@@ -15,6 +15,8 @@
 
 /*! \brief Janus mutex implementation */
 typedef pthread_mutex_t janus_mutex;
+/*! \brief Janus static mutex initializer */
+#define JANUS_MUTEX_INITIALIZER PTHREAD_MUTEX_INITIALIZER
 /*! \brief Janus mutex initialization */
 #define janus_mutex_init(a) pthread_mutex_init(a,NULL)
 /*! \brief Janus mutex destruction */
@@ -25,7 +25,37 @@
 [<unique room ID>]
 description = This is my awesome room
 sampling_rate = <sampling rate> (e.g., 16000 for wideband mixing)
+record = yes|no (whether the mix should be recorded to a WAV file)
 \endverbatim
+ *
+ * Rooms can also be created and destroyed at runtime, with no need to
+ * restart the gateway, by means of \c create and \c destroy requests:
+ *
+ * \verbatim
+{
+	"request" : "create",
+	"room" : <unique room ID (optional, a random one is picked if missing)>,
+	"description" : "<description (optional)>",
+	"sampling_rate" : <sampling rate (optional, 16000 by default)>,
+	"record" : <true|false (optional)>,
+	"permanent" : <true|false, whether the room should be saved to the configuration file too>,
+	"admin_key" : "<admin_key, if one is configured>"
+}
+
+{
+	"request" : "destroy",
+	"room" : <room ID>,
+	"permanent" : <true|false, whether the room should be removed from the configuration file too>,
+	"admin_key" : "<admin_key, if one is configured>"
+}
+\endverbatim
+ *
+ * A successful request gets a \c created (or \c destroyed ) event with
+ * the room ID, and participants of a destroyed room get a \c destroyed
+ * event as well. If an \c admin_key is set in the \c [general] section
+ * of the configuration file, these requests must provide it. Saving a
+ * room rewrites the configuration file, so any comment in it is lost.
+ * Rooms only have a mixer thread while there are participants in them.
  *
  * \ingroup plugins
  * \ref plugins
@@ -41,6 +71,8 @@ sampling_rate = <sampling rate> (e.g., 16000 for wideband mixing)
 #include "../mutex.h"
 #include "../rtp.h"
 #include "../rtcp.h"
+#include "../codecs.h"
+#include "../writer.h"
 
 
 /* Plugin information */
@@ -66,6 +98,7 @@ void janus_audiobridge_incoming_rtp(janus_pluginession *handle, int video, char
 void janus_audiobridge_incoming_rtcp(janus_pluginession *handle, int video, char *buf, int len);
 void janus_audiobridge_hangup_media(janus_pluginession *handle);
 void janus_audiobridge_destroy_session(janus_pluginession *handle, int *error);
+char *janus_audiobridge_get_metrics(void);
 
 /* Plugin setup */
 static janus_plugin janus_audiobridge_plugin =
@@ -86,6 +119,8 @@ static janus_plugin janus_audiobridge_plugin =
 		.incoming_rtcp = janus_audiobridge_incoming_rtcp,
 		.hangup_media = janus_audiobridge_hangup_media,
 		.destroy_session = janus_audiobridge_destroy_session,
+
+		.get_metrics = janus_audiobridge_get_metrics,
 	}; 
 
 /* Plugin creator */
@@ -103,6 +138,15 @@ static void *janus_audiobridge_handler(void *data);
 static void janus_audiobridge_relay_rtp_packet(gpointer data, gpointer user_data);
 static void *janus_audiobridge_mixer_thread(void *data);
 
+/* Opus settings */		
+#define	BUFFER_SAMPLES	8000
+#define	OPUS_SAMPLES	160
+#define USE_FEC			0
+#define DEFAULT_COMPLEXITY	4
+/* Decoded frames */
+#define PCM_FRAME_SAMPLES	5760	/* Longest Opus frame (120ms at 48kHz) */
+#define MAX_QUEUED_FRAMES	8		/* Jitter we tolerate for each participant (must be a power of 2) */
+
 typedef struct janus_audiobridge_message {
 	janus_pluginession *handle;
 	char *transaction;
@@ -117,12 +161,36 @@ typedef struct janus_audiobridge_room {
 	gchar *room_name;	/* Room description */
 	uint32_t sampling_rate;	/* Sampling rate of the mix (e.g., 16000 for wideband) */
 	gboolean record;
-	FILE *recording;
+	janus_writer *recording;	/* Written by the I/O thread, never by the mixer */
 	gboolean destroy;
+	gboolean retired;	/* Whether the room has been handed to the handler thread to be freed */
 	GHashTable *participants;	/* Map of participants */
+	GThread *mixer;	/* Only running while there are participants in the room */
+	gboolean mixing;
+	volatile gint overruns;	/* Number of times the mixer missed a whole 20ms tick */
 	janus_mutex mutex;
+	struct janus_audiobridge_rtp_relay_packet *frames;	/* Decoded frames ready to be reused */
+	guint frames_allocated;	/* Decoded frames allocated so far for this room */
+	janus_mutex frames_mutex;
 } janus_audiobridge_room;
 GHashTable *rooms;
+static janus_mutex rooms_mutex = JANUS_MUTEX_INITIALIZER;
+/* Destroyed rooms are freed by the handler thread after a few seconds, as
+ * the gateway may still be delivering media for their last participants */
+#define JANUS_AUDIOBRIDGE_GRACE	5
+typedef struct janus_audiobridge_old_room {
+	struct janus_audiobridge_room *room;
+	gint64 retired;
+} janus_audiobridge_old_room;
+static GList *old_rooms = NULL;
+static janus_mutex old_rooms_mutex = JANUS_MUTEX_INITIALIZER;
+
+/* The configuration is kept around, as rooms can be created (and destroyed)
+ * dynamically too, and saved to the configuration file if permanent */
+static janus_config *config = NULL;
+static char *config_file = NULL;
+static char *admin_key = NULL;
+static janus_mutex config_mutex = JANUS_MUTEX_INITIALIZER;
 
 typedef struct janus_audiobridge_session {
 	janus_pluginession *handle;
@@ -135,12 +203,16 @@ GHashTable *sessions;
 
 typedef struct janus_audiobridge_participant {
 	janus_audiobridge_session *session;
-	janus_audiobridge_room *room;	/* Room */
+	janus_audiobridge_room *room;	/* Room (NULL once out of it: the room is only freed a few seconds later) */
 	guint64 user_id;	/* Unique ID in the room */
 	gchar *display;	/* Display name (just for fun) */
 	gboolean audio_active;
 	/* RTP stuff */
-	GQueue *inbuf;
+	struct janus_audiobridge_rtp_relay_packet *inbuf[MAX_QUEUED_FRAMES];	/* Decoded frames waiting to be mixed */
+	volatile gint inbuf_head;	/* Only updated by the mixer, or when draining the ring (room mutex locked) */
+	volatile gint inbuf_tail;	/* Only updated by whoever decodes the incoming RTP */
+	volatile gint decoding;	/* Non-zero while incoming RTP is being decoded and pushed to inbuf */
+	struct janus_audiobridge_rtp_relay_packet *mixing;	/* Frame the mixer took out of inbuf for the current mix (mixer only) */
 	int opus_pt;
 	/* Opus stuff */
 	OpusEncoder *encoder;
@@ -151,8 +223,93 @@ typedef struct janus_audiobridge_participant {
 typedef struct janus_audiobridge_rtp_relay_packet {
 	rtp_header *data;
 	gint length;
+	struct janus_audiobridge_rtp_relay_packet *next;	/* Only used when the frame is in the room pool */
 } janus_audiobridge_rtp_relay_packet;
 
+/* Decoded frames are never freed: they're recycled in a per-room pool
+ * when the mixer is done with them, and allocated (once) only when
+ * the pool is empty. Each participant can only have MAX_QUEUED_FRAMES
+ * waiting to be mixed, so the pool never grows beyond that for each of
+ * the participants in the room */
+static janus_audiobridge_rtp_relay_packet *janus_audiobridge_frame_get(janus_audiobridge_room *audiobridge) {
+	janus_mutex_lock(&audiobridge->frames_mutex);
+	janus_audiobridge_rtp_relay_packet *pkt = audiobridge->frames;
+	if(pkt != NULL)
+		audiobridge->frames = pkt->next;
+	janus_mutex_unlock(&audiobridge->frames_mutex);
+	if(pkt == NULL) {
+		/* The frame and its samples are allocated together */
+		pkt = calloc(1, sizeof(janus_audiobridge_rtp_relay_packet) + PCM_FRAME_SAMPLES*sizeof(opus_int16));
+		if(pkt == NULL) {
+			JANUS_DEBUG("Memory error!\n");
+			return NULL;
+		}
+		pkt->data = (rtp_header *)(pkt+1);
+		janus_mutex_lock(&audiobridge->frames_mutex);
+		audiobridge->frames_allocated++;
+		janus_mutex_unlock(&audiobridge->frames_mutex);
+	}
+	pkt->next = NULL;
+	pkt->length = 0;
+	return pkt;
+}
+
+static void janus_audiobridge_frame_put(janus_audiobridge_room *audiobridge, janus_audiobridge_rtp_relay_packet *pkt) {
+	if(pkt == NULL)
+		return;
+	janus_mutex_lock(&audiobridge->frames_mutex);
+	pkt->next = audiobridge->frames;
+	audiobridge->frames = pkt;
+	janus_mutex_unlock(&audiobridge->frames_mutex);
+}
+
+/* The queue of decoded frames of a participant is a ring with a single
+ * producer (the thread getting RTP from the gateway) and a single
+ * consumer, so no lock is needed to access it: the consumer is the
+ * mixer, or whoever drains the ring when the participant leaves, which
+ * is why both only pop frames with the room mutex locked */
+static gboolean janus_audiobridge_inbuf_full(janus_audiobridge_participant *participant) {
+	return (guint)(g_atomic_int_get(&participant->inbuf_tail) - g_atomic_int_get(&participant->inbuf_head)) >= MAX_QUEUED_FRAMES;
+}
+
+static void janus_audiobridge_inbuf_push(janus_audiobridge_participant *participant, janus_audiobridge_rtp_relay_packet *pkt) {
+	guint tail = g_atomic_int_get(&participant->inbuf_tail);
+	participant->inbuf[tail % MAX_QUEUED_FRAMES] = pkt;
+	g_atomic_int_set(&participant->inbuf_tail, tail+1);
+}
+
+static janus_audiobridge_rtp_relay_packet *janus_audiobridge_inbuf_peek(janus_audiobridge_participant *participant) {
+	guint head = g_atomic_int_get(&participant->inbuf_head);
+	if(head == (guint)g_atomic_int_get(&participant->inbuf_tail))
+		return NULL;
+	return participant->inbuf[head % MAX_QUEUED_FRAMES];
+}
+
+static janus_audiobridge_rtp_relay_packet *janus_audiobridge_inbuf_pop(janus_audiobridge_participant *participant) {
+	janus_audiobridge_rtp_relay_packet *pkt = janus_audiobridge_inbuf_peek(participant);
+	if(pkt != NULL)
+		g_atomic_int_inc(&participant->inbuf_head);
+	return pkt;
+}
+
+/* Helper to give the frames still queued for a participant back to the pool of its room (the room mutex must be locked) */
+static void janus_audiobridge_inbuf_drain(janus_audiobridge_participant *participant, janus_audiobridge_room *audiobridge) {
+	janus_audiobridge_rtp_relay_packet *pkt = NULL;
+	while((pkt = janus_audiobridge_inbuf_pop(participant)) != NULL)
+		janus_audiobridge_frame_put(audiobridge, pkt);
+}
+
+/* Helper to take a participant out of its room (the room mutex must be
+ * locked): we wait for a frame that was being decoded in the meanwhile to
+ * be pushed, as nothing else will be after that, and recycle what's left */
+static void janus_audiobridge_participant_stop(janus_audiobridge_participant *participant, janus_audiobridge_room *audiobridge) {
+	participant->audio_active = 0;
+	participant->room = NULL;
+	while(g_atomic_int_get(&participant->decoding) > 0)
+		g_usleep(100);
+	janus_audiobridge_inbuf_drain(participant, audiobridge);
+}
+
 /* SDP offer/answer template */
 static const char *sdp_template =
 		"v=0\r\n"
@@ -184,11 +341,170 @@ typedef struct wav_header {
 } wav_header;
 
 
-/* Opus settings */		
-#define	BUFFER_SAMPLES	8000
-#define	OPUS_SAMPLES	160
-#define USE_FEC			0
-#define DEFAULT_COMPLEXITY	4
+/* Helper to create a room out of a configuration category, whether it
+ * comes from the configuration file or from a "create" request */
+static janus_audiobridge_room *janus_audiobridge_room_create(janus_config_category *cat) {
+	janus_config_item *desc = janus_config_get_item(cat, "description");
+	janus_config_item *sampling = janus_config_get_item(cat, "sampling_rate");
+	janus_config_item *record = janus_config_get_item(cat, "record");
+	if(sampling == NULL || sampling->value == NULL) {
+		JANUS_DEBUG("Can't add the audio room, missing mandatory information...\n");
+		return NULL;
+	}
+	guint64 room_id = atoll(cat->name);
+	if(room_id == 0) {
+		JANUS_DEBUG("Can't add the audio room, invalid ID %s...\n", cat->name);
+		return NULL;
+	}
+	/* Create the audio bridge room */
+	janus_audiobridge_room *audiobridge = calloc(1, sizeof(janus_audiobridge_room));
+	if(audiobridge == NULL) {
+		JANUS_DEBUG("Memory error!\n");
+		return NULL;
+	}
+	audiobridge->room_id = room_id;
+	char *description = NULL;
+	if(desc != NULL && desc->value != NULL)
+		description = g_strdup(desc->value);
+	else
+		description = g_strdup(cat->name);
+	if(description == NULL) {
+		JANUS_DEBUG("Memory error!\n");
+		free(audiobridge);
+		return NULL;
+	}
+	audiobridge->room_name = description;
+	audiobridge->sampling_rate = atoi(sampling->value);
+	if(audiobridge->sampling_rate != 16000) {
+		JANUS_DEBUG("We currently only support 16kHz (wideband) as a sampling rate for audio rooms, changing %"SCNu32" to 16000...\n", audiobridge->sampling_rate);
+		audiobridge->sampling_rate = 16000;
+	}
+	audiobridge->record = FALSE;
+	if(record && record->value && !strcasecmp(record->value, "yes"))
+		audiobridge->record = TRUE;
+	audiobridge->recording = NULL;
+	audiobridge->destroy = 0;
+	audiobridge->retired = FALSE;
+	audiobridge->participants = g_hash_table_new(NULL, NULL);
+	/* No thread for the mix until someone joins */
+	audiobridge->mixer = NULL;
+	audiobridge->mixing = FALSE;
+	janus_mutex_init(&audiobridge->mutex);
+	audiobridge->frames = NULL;
+	audiobridge->frames_allocated = 0;
+	janus_mutex_init(&audiobridge->frames_mutex);
+	janus_mutex_lock(&rooms_mutex);
+	if(g_hash_table_lookup(rooms, GUINT_TO_POINTER(audiobridge->room_id)) != NULL) {
+		janus_mutex_unlock(&rooms_mutex);
+		JANUS_DEBUG("Can't add the audio room, room %"SCNu64" already exists...\n", audiobridge->room_id);
+		g_hash_table_destroy(audiobridge->participants);
+		janus_mutex_destroy(&audiobridge->mutex);
+		janus_mutex_destroy(&audiobridge->frames_mutex);
+		g_free(audiobridge->room_name);
+		free(audiobridge);
+		return NULL;
+	}
+	g_hash_table_insert(rooms, GUINT_TO_POINTER(audiobridge->room_id), audiobridge);
+	janus_mutex_unlock(&rooms_mutex);
+	JANUS_PRINT("Created audiobridge: %"SCNu64" (%s)\n", audiobridge->room_id, audiobridge->room_name);
+	return audiobridge;
+}
+
+/* Helper to free a room that has been destroyed, once nobody is in it anymore */
+static void janus_audiobridge_room_free(janus_audiobridge_room *audiobridge) {
+	if(audiobridge->recording)
+		janus_writer_close(audiobridge->recording);
+	audiobridge->recording = NULL;
+	g_hash_table_destroy(audiobridge->participants);
+	janus_audiobridge_rtp_relay_packet *pkt = audiobridge->frames, *next = NULL;
+	while(pkt) {
+		next = pkt->next;
+		free(pkt);
+		pkt = next;
+	}
+	janus_mutex_destroy(&audiobridge->mutex);
+	janus_mutex_destroy(&audiobridge->frames_mutex);
+	JANUS_PRINT("Freed audiobridge: %"SCNu64" (%s)\n", audiobridge->room_id, audiobridge->room_name);
+	g_free(audiobridge->room_name);
+	free(audiobridge);
+}
+
+/* Helper to get rid of a room that has been destroyed, once nobody is in
+ * it anymore: it's only freed after a while, as the gateway may still be
+ * delivering RTP for a participant that just left, and so decoding into
+ * frames of this room right now */
+static void janus_audiobridge_room_retire(janus_audiobridge_room *audiobridge) {
+	janus_audiobridge_old_room *old = calloc(1, sizeof(janus_audiobridge_old_room));
+	if(old == NULL) {
+		JANUS_DEBUG("Memory error!\n");
+		return;	/* Better to leak it than risk a crash */
+	}
+	old->room = audiobridge;
+	old->retired = g_get_monotonic_time();
+	janus_mutex_lock(&old_rooms_mutex);
+	old_rooms = g_list_append(old_rooms, old);
+	janus_mutex_unlock(&old_rooms_mutex);
+}
+
+/* Helper to check whether a room can be retired, i.e., it has been destroyed,
+ * its mixer is gone and so is everybody: only returns TRUE once, as who's
+ * leaving last and the "destroy" request may both check (room mutex locked) */
+static gboolean janus_audiobridge_room_can_retire(janus_audiobridge_room *audiobridge) {
+	if(audiobridge->retired || !audiobridge->destroy || audiobridge->mixer != NULL || g_hash_table_size(audiobridge->participants) > 0)
+		return FALSE;
+	audiobridge->retired = TRUE;
+	return TRUE;
+}
+
+/* Helper to free the rooms whose grace period is over (or all of them, when the plugin is destroyed) */
+static void janus_audiobridge_free_retired_rooms(gboolean all) {
+	gint64 now = g_get_monotonic_time();
+	GList *expired = NULL;
+	janus_mutex_lock(&old_rooms_mutex);
+	while(old_rooms) {
+		janus_audiobridge_old_room *old = (janus_audiobridge_old_room *)old_rooms->data;
+		if(!all && now-old->retired < JANUS_AUDIOBRIDGE_GRACE*G_USEC_PER_SEC)
+			break;	/* Rooms are appended as they're retired, so the others are even newer */
+		old_rooms = g_list_delete_link(old_rooms, old_rooms);
+		expired = g_list_prepend(expired, old);
+	}
+	janus_mutex_unlock(&old_rooms_mutex);
+	GList *l = NULL;
+	for(l = expired; l; l = l->next) {
+		janus_audiobridge_old_room *old = (janus_audiobridge_old_room *)l->data;
+		janus_audiobridge_room_free(old->room);
+		free(old);
+	}
+	g_list_free(expired);
+}
+
+/* Helper to start the mixer of a room, if it's not running already (the room mutex must be locked) */
+static void janus_audiobridge_room_start_mixer(janus_audiobridge_room *audiobridge) {
+	if(audiobridge->mixing || audiobridge->destroy)
+		return;
+	if(audiobridge->mixer != NULL) {
+		/* The previous mixer left when the room got empty */
+		g_thread_join(audiobridge->mixer);
+		audiobridge->mixer = NULL;
+	}
+	GError *error = NULL;
+	audiobridge->mixer = g_thread_try_new("audiobridge mixer thread", &janus_audiobridge_mixer_thread, audiobridge, &error);
+	if(error != NULL) {
+		JANUS_DEBUG("Got error %d (%s) trying to launch the mixer thread for room %"SCNu64"...\n",
+			error->code, error->message ? error->message : "??", audiobridge->room_id);
+		audiobridge->mixer = NULL;
+		return;
+	}
+	audiobridge->mixing = TRUE;
+}
+
+/* Helper to check the admin key (if any) of requests creating or destroying rooms */
+static gboolean janus_audiobridge_check_admin_key(json_t *root) {
+	if(admin_key == NULL)
+		return TRUE;
+	json_t *key = json_object_get(root, "admin_key");
+	return key && json_is_string(key) && !strcmp(json_string_value(key), admin_key);
+}
 
 
 /* Plugin implementation */
@@ -206,9 +522,12 @@ int janus_audiobridge_init(janus_callbacks *callback, const char *config_path) {
 	char filename[255];
 	sprintf(filename, "%s/%s.cfg", config_path, JANUS_AUDIOBRIDGE_PACKAGE);
 	JANUS_PRINT("Configuration file: %s\n", filename);
-	janus_config *config = janus_config_parse(filename);
+	config = janus_config_parse(filename);
 	if(config != NULL)
 		janus_config_print(config);
+	else
+		config = janus_config_create(JANUS_AUDIOBRIDGE_PACKAGE);
+	config_file = g_strdup(filename);
 	
 	rooms = g_hash_table_new(NULL, NULL);
 	sessions = g_hash_table_new(NULL, NULL);
@@ -218,59 +537,20 @@ int janus_audiobridge_init(janus_callbacks *callback, const char *config_path) {
 
 	/* Parse configuration to populate the rooms list */
 	if(config != NULL) {
+		janus_config_item *key = janus_config_get_item_drilldown(config, "general", "admin_key");
+		if(key != NULL && key->value != NULL)
+			admin_key = g_strdup(key->value);
 		janus_config_category *cat = janus_config_get_categories(config);
 		while(cat != NULL) {
-			if(cat->name == NULL) {
+			if(cat->name == NULL || !strcasecmp(cat->name, "general")) {
 				cat = cat->next;
 				continue;
 			}
 			JANUS_PRINT("Adding audio room '%s'\n", cat->name);
-			janus_config_item *desc = janus_config_get_item(cat, "description");
-			janus_config_item *sampling = janus_config_get_item(cat, "sampling_rate");
-			janus_config_item *record = janus_config_get_item(cat, "record");
-			if(sampling == NULL || sampling->value == NULL) {
-				JANUS_DEBUG("Can't add the audio room, missing mandatory information...\n");
-				cat = cat->next;
-				continue;
-			}
-			/* Create the audio bridge room */
-			janus_audiobridge_room *audiobridge = calloc(1, sizeof(janus_audiobridge_room));
-			if(audiobridge == NULL) {
-				JANUS_DEBUG("Memory error!\n");
-				continue;
-			}
-			audiobridge->room_id = atoi(cat->name);
-			char *description = NULL;
-			if(desc != NULL && desc->value != NULL)
-				description = g_strdup(desc->value);
-			else
-				description = g_strdup(cat->name);
-			if(description == NULL) {
-				JANUS_DEBUG("Memory error!\n");
-				continue;
-			}
-			audiobridge->room_name = description;
-			audiobridge->sampling_rate = atoi(sampling->value);
-			if(audiobridge->sampling_rate != 16000) {
-				JANUS_DEBUG("We currently only support 16kHz (wideband) as a sampling rate for audio rooms, changing %"SCNu32" to 16000...\n", audiobridge->sampling_rate);
-				audiobridge->sampling_rate = 16000;
-			}
-			audiobridge->record = FALSE;
-			if(record && record->value && !strcasecmp(record->value, "yes"))
-				audiobridge->record = TRUE;
-			audiobridge->recording = NULL;
-			audiobridge->destroy = 0;
-			audiobridge->participants = g_hash_table_new(NULL, NULL);
-			janus_mutex_init(&audiobridge->mutex);
-			g_hash_table_insert(rooms, GUINT_TO_POINTER(audiobridge->room_id), audiobridge);
-			JANUS_PRINT("Created audiobridge: %"SCNu64" (%s)\n", audiobridge->room_id, audiobridge->room_name);
-			/* We need a thread for the mix */
-			g_thread_new("audiobridge mixer thread", &janus_audiobridge_mixer_thread, audiobridge);
+			/* Rooms have no mixer thread until the first participant joins */
+			janus_audiobridge_room_create(cat);
 			cat = cat->next;
 		}
-		/* Done */
-		janus_config_destroy(config);
-		config = NULL;
 	}
 
 	/* Show available rooms */
@@ -306,6 +586,33 @@ void janus_audiobridge_destroy() {
 		g_thread_join(handler_thread);
 	}
 	handler_thread = NULL;
+	/* Wait for the mixers that are still running */
+	janus_mutex_lock(&rooms_mutex);
+	GList *rooms_list = g_hash_table_get_values(rooms);
+	janus_mutex_unlock(&rooms_mutex);
+	GList *r = rooms_list;
+	while(r) {
+		janus_audiobridge_room *audiobridge = (janus_audiobridge_room *)r->data;
+		janus_mutex_lock(&audiobridge->mutex);
+		GThread *mixer = audiobridge->mixer;
+		audiobridge->mixer = NULL;
+		janus_mutex_unlock(&audiobridge->mutex);
+		if(mixer != NULL)
+			g_thread_join(mixer);
+		if(audiobridge->recording)
+			janus_writer_close(audiobridge->recording);
+		audiobridge->recording = NULL;
+		r = r->next;
+	}
+	g_list_free(rooms_list);
+	/* The recordings are closed: the core writes what's left when shutting down */
+	janus_audiobridge_free_retired_rooms(TRUE);
+	janus_config_destroy(config);
+	config = NULL;
+	g_free(config_file);
+	config_file = NULL;
+	g_free(admin_key);
+	admin_key = NULL;
 	/* TODO Actually remove rooms and its participants */
 	g_hash_table_destroy(sessions);
 	g_hash_table_destroy(rooms);
@@ -335,6 +642,37 @@ const char *janus_audiobridge_get_package() {
 	return JANUS_AUDIOBRIDGE_PACKAGE;
 }
 
+char *janus_audiobridge_get_metrics() {
+	if(stopping || !initialized || !rooms)
+		return NULL;
+	GString *output = g_string_new(NULL);
+	g_string_append(output, "# HELP janus_audiobridge_mixer_overruns_total Number of times a room mixer missed its 20ms tick\n");
+	g_string_append(output, "# TYPE janus_audiobridge_mixer_overruns_total counter\n");
+	janus_mutex_lock(&rooms_mutex);
+	GList *rooms_list = g_hash_table_get_values(rooms);
+	GList *r = rooms_list;
+	while(r) {
+		janus_audiobridge_room *audiobridge = (janus_audiobridge_room *)r->data;
+		g_string_append_printf(output, "janus_audiobridge_mixer_overruns_total{room=\"%"SCNu64"\"} %d\n",
+			audiobridge->room_id, g_atomic_int_get(&audiobridge->overruns));
+		r = r->next;
+	}
+	g_string_append(output, "# HELP janus_audiobridge_pcm_frames Number of decoded frames allocated in the pool of each room\n");
+	g_string_append(output, "# TYPE janus_audiobridge_pcm_frames gauge\n");
+	r = rooms_list;
+	while(r) {
+		janus_audiobridge_room *audiobridge = (janus_audiobridge_room *)r->data;
+		janus_mutex_lock(&audiobridge->frames_mutex);
+		guint frames = audiobridge->frames_allocated;
+		janus_mutex_unlock(&audiobridge->frames_mutex);
+		g_string_append_printf(output, "janus_audiobridge_pcm_frames{room=\"%"SCNu64"\"} %u\n", audiobridge->room_id, frames);
+		r = r->next;
+	}
+	janus_mutex_unlock(&rooms_mutex);
+	g_list_free(rooms_list);
+	return g_string_free(output, FALSE);
+}
+
 void janus_audiobridge_create_session(janus_pluginession *handle, int *error) {
 	if(stopping || !initialized) {
 		*error = -1;
@@ -419,29 +757,36 @@ void janus_audiobridge_incoming_rtp(janus_pluginession *handle, int video, char
 	if(!session || session->destroy || session->stopping || !session->participant)
 		return;
 	janus_audiobridge_participant *participant = (janus_audiobridge_participant *)session->participant;
-	if(!participant->audio_active)
+	/* The participant may be leaving right now: if it still had a room, the
+	 * room can't be freed before its grace period is over, so we can use it,
+	 * and janus_audiobridge_participant_stop waits for us to be done with it */
+	g_atomic_int_inc(&participant->decoding);
+	janus_audiobridge_room *audiobridge = participant->room;
+	if(audiobridge == NULL || !participant->audio_active) {
+		g_atomic_int_dec_and_test(&participant->decoding);
 		return;
-	/* Decode frame (Opus -> slinear) */
-	janus_audiobridge_rtp_relay_packet *pkt = calloc(1, sizeof(janus_audiobridge_rtp_relay_packet));
-	if(pkt == NULL) {
-		JANUS_DEBUG("Memory error!\n");
+	}
+	/* If the mixer is lagging behind, drop the frame rather than queueing more */
+	if(janus_audiobridge_inbuf_full(participant)) {
+		g_atomic_int_dec_and_test(&participant->decoding);
 		return;
 	}
-	pkt->data = calloc(BUFFER_SAMPLES, sizeof(opus_int16));
-	if(pkt->data == NULL) {
-		JANUS_DEBUG("Memory error!\n");
-		g_free(pkt);
+	/* Decode frame (Opus -> slinear) */
+	janus_audiobridge_rtp_relay_packet *pkt = janus_audiobridge_frame_get(audiobridge);
+	if(pkt == NULL) {
+		g_atomic_int_dec_and_test(&participant->decoding);
 		return;
 	}
-	pkt->length = opus_decode(participant->decoder, (const unsigned char *)buf+12, len-12, (opus_int16 *)pkt->data, BUFFER_SAMPLES, USE_FEC);
+	pkt->length = opus_decode(participant->decoder, (const unsigned char *)buf+12, len-12, (opus_int16 *)pkt->data, PCM_FRAME_SAMPLES, USE_FEC);
 	if(pkt->length < 0) {
 		JANUS_PRINT("[Opus] Ops! got an error decoding the Opus frame: %d (%s)\n", pkt->length, opus_strerror(pkt->length));
-		g_free(pkt->data);
-		g_free(pkt);
+		janus_audiobridge_frame_put(audiobridge, pkt);
+		g_atomic_int_dec_and_test(&participant->decoding);
 		return;
 	}
 	/* Enqueue the decoded frame */
-	g_queue_push_tail(participant->inbuf, pkt);
+	janus_audiobridge_inbuf_push(participant, pkt);
+	g_atomic_int_dec_and_test(&participant->decoding);
 }
 
 void janus_audiobridge_incoming_rtcp(janus_pluginession *handle, int video, char *buf, int len) {
@@ -464,7 +809,14 @@ void janus_audiobridge_hangup_media(janus_pluginession *handle) {
 	/* Get rid of participant */
 	janus_audiobridge_participant *participant = (janus_audiobridge_participant *)session->participant;
 	janus_audiobridge_room *audiobridge = participant->room;
+	if(audiobridge == NULL)
+		return;
 	janus_mutex_lock(&audiobridge->mutex);
+	if(participant->room != audiobridge) {
+		/* Left in the meanwhile */
+		janus_mutex_unlock(&audiobridge->mutex);
+		return;
+	}
 	json_t *event = json_object();
 	json_object_set(event, "audiobridge", json_string("event"));
 	json_object_set(event, "room", json_integer(audiobridge->room_id));
@@ -486,10 +838,15 @@ void janus_audiobridge_hangup_media(janus_pluginession *handle) {
 	}
 	g_free(leaving_text);
 	g_list_free(participants_list);
-	participant->audio_active = 0;
+	/* Whatever we had queued won't be mixed */
+	janus_audiobridge_participant_stop(participant, audiobridge);
 	session->started = FALSE;
 	session->destroy = 1;
+	/* Was this the last participant of a room that has been destroyed? */
+	gboolean free_room = janus_audiobridge_room_can_retire(audiobridge);
 	janus_mutex_unlock(&audiobridge->mutex);
+	if(free_room)
+		janus_audiobridge_room_retire(audiobridge);
 }
 
 /* Thread to handle incoming messages */
@@ -503,6 +860,7 @@ static void *janus_audiobridge_handler(void *data) {
 	}
 	while(initialized && !stopping) {
 		if(!messages || (msg = g_queue_pop_head(messages)) == NULL) {
+			janus_audiobridge_free_retired_rooms(FALSE);
 			usleep(50000);
 			continue;
 		}
@@ -550,7 +908,9 @@ static void *janus_audiobridge_handler(void *data) {
 				goto error;
 			}
 			guint64 room_id = json_integer_value(room);
+			janus_mutex_lock(&rooms_mutex);
 			janus_audiobridge_room *audiobridge = g_hash_table_lookup(rooms, GUINT_TO_POINTER(room_id));
+			janus_mutex_unlock(&rooms_mutex);
 			if(audiobridge == NULL) {
 				JANUS_DEBUG("No such room (%"SCNu64")\n", room_id);
 				sprintf(error_cause, "No such room (%"SCNu64")", room_id);
@@ -590,7 +950,8 @@ static void *janus_audiobridge_handler(void *data) {
 				goto error;
 			}
 			participant->audio_active = FALSE;
-			participant->inbuf = g_queue_new();
+			participant->inbuf_head = 0;
+			participant->inbuf_tail = 0;
 			participant->opus_pt = 0;
 			JANUS_PRINT("Creating Opus encoder/decoder (sampling rate %d)\n", audiobridge->sampling_rate);
 			/* Opus encoder */
@@ -635,8 +996,21 @@ static void *janus_audiobridge_handler(void *data) {
 
 			/* Done */
 			janus_mutex_lock(&audiobridge->mutex);
+			if(audiobridge->destroy) {
+				/* The room was destroyed in the meanwhile */
+				janus_mutex_unlock(&audiobridge->mutex);
+				opus_encoder_destroy(participant->encoder);
+				opus_decoder_destroy(participant->decoder);
+				g_free(participant->display);
+				g_free(participant);
+				JANUS_DEBUG("No such room (%"SCNu64")\n", room_id);
+				sprintf(error_cause, "No such room (%"SCNu64")", room_id);
+				goto error;
+			}
 			session->participant = participant;
 			g_hash_table_insert(audiobridge->participants, GUINT_TO_POINTER(user_id), participant);
+			/* The first participant gets the mixer going */
+			janus_audiobridge_room_start_mixer(audiobridge);
 			/* Return a list of all available participants (those with an SDP available, that is) */
 			json_t *list = json_array();
 			GList *participants_list = g_hash_table_get_values(audiobridge->participants);
@@ -665,7 +1039,9 @@ static void *janus_audiobridge_handler(void *data) {
 		} else if(!strcasecmp(request_text, "configure")) {
 			/* Handle this participant */
 			janus_audiobridge_participant *participant = (janus_audiobridge_participant *)session->participant;
-			if(participant == NULL || participant->room == NULL) {
+			/* Participants hanging up leave their room from another thread, but we're the only one freeing rooms */
+			janus_audiobridge_room *audiobridge = participant ? participant->room : NULL;
+			if(audiobridge == NULL) {
 				JANUS_DEBUG("Can't configure (not in a room)\n");
 				sprintf(error_cause, "Can't configure (not in a room)");
 				goto error;
@@ -679,20 +1055,9 @@ static void *janus_audiobridge_handler(void *data) {
 			}
 			if(audio) {
 				participant->audio_active = json_is_true(audio);
-				JANUS_PRINT("Setting audio property: %s (room %"SCNu64", user %"SCNu64")\n", participant->audio_active ? "true" : "false", participant->room->room_id, participant->user_id);
-				if(!participant->audio_active) {
-					/* Clear the queued packets waiting to be handled */
-					while(!g_queue_is_empty(participant->inbuf)) {
-						janus_audiobridge_rtp_relay_packet *pkt = g_queue_pop_head(participant->inbuf);
-						if(pkt == NULL)
-							continue;
-						if(pkt->data)
-							g_free(pkt->data);
-						g_free(pkt);
-					}
-				}
+				JANUS_PRINT("Setting audio property: %s (room %"SCNu64", user %"SCNu64")\n", participant->audio_active ? "true" : "false", audiobridge->room_id, participant->user_id);
+				/* If muted, the mixer will get rid of the queued packets waiting to be handled */
 				/* Notify all other participants about the mute/unmute */
-				janus_audiobridge_room *audiobridge = participant->room;
 				janus_mutex_lock(&audiobridge->mutex);
 				json_t *list = json_array();
 				json_t *pl = json_object();
@@ -703,12 +1068,11 @@ static void *janus_audiobridge_handler(void *data) {
 				json_array_append_new(list, pl);
 				json_t *pub = json_object();
 				json_object_set(pub, "audiobridge", json_string("event"));
-				json_object_set(pub, "room", json_integer(participant->room->room_id));
+				json_object_set(pub, "room", json_integer(audiobridge->room_id));
 				json_object_set_new(pub, "participants", list);
 				char *pub_text = json_dumps(pub, JSON_INDENT(3));
-				json_decref(list);
 				json_decref(pub);
-				GList *participants_list = g_hash_table_get_values(participant->room->participants);
+				GList *participants_list = g_hash_table_get_values(audiobridge->participants);
 				GList *ps = participants_list;
 				while(ps) {
 					janus_audiobridge_participant *p = (janus_audiobridge_participant *)ps->data;
@@ -722,28 +1086,38 @@ static void *janus_audiobridge_handler(void *data) {
 				}
 				g_list_free(participants_list);
 				janus_mutex_unlock(&audiobridge->mutex);
+				g_free(pub_text);
 			}
 			/* Done */
 			event = json_object();
 			json_object_set(event, "audiobridge", json_string("event"));
-			json_object_set(event, "room", json_integer(participant->room->room_id));
+			json_object_set(event, "room", json_integer(audiobridge->room_id));
 			json_object_set(event, "result", json_string("ok"));
 		} else if(!strcasecmp(request_text, "leave")) {
 			/* This participant is leaving */
 			janus_audiobridge_participant *participant = (janus_audiobridge_participant *)session->participant;
-			if(participant == NULL || participant->room == NULL) {
+			janus_audiobridge_room *audiobridge = participant ? participant->room : NULL;
+			if(audiobridge != NULL) {
+				janus_mutex_lock(&audiobridge->mutex);
+				if(participant->room != audiobridge) {
+					/* Hung up in the meanwhile */
+					janus_mutex_unlock(&audiobridge->mutex);
+					audiobridge = NULL;
+				}
+			}
+			if(audiobridge == NULL) {
 				JANUS_DEBUG("Can't leave (not in a room)\n");
 				sprintf(error_cause, "Can't leave (not in a room)");
 				goto error;
 			}
 			/* Tell everybody */
-			janus_audiobridge_room *audiobridge = participant->room;
-			janus_mutex_lock(&audiobridge->mutex);
 			event = json_object();
 			json_object_set(event, "audiobridge", json_string("event"));
 			json_object_set(event, "room", json_integer(audiobridge->room_id));
 			json_object_set(event, "leaving", json_integer(participant->user_id));
 			char *leaving_text = json_dumps(event, JSON_INDENT(3));
+			/* Remove the participant right away, so that the mixer stops when the room is empty */
+			g_hash_table_remove(audiobridge->participants, GUINT_TO_POINTER(participant->user_id));
 			GList *participants_list = g_hash_table_get_values(audiobridge->participants);
 			GList *ps = participants_list;
 			while(ps) {
@@ -759,10 +1133,169 @@ static void *janus_audiobridge_handler(void *data) {
 			g_free(leaving_text);
 			g_list_free(participants_list);
 			/* Done */
-			participant->audio_active = 0;
+			janus_audiobridge_participant_stop(participant, audiobridge);
 			session->started = FALSE;
 			session->destroy = 1;
+			gboolean free_room = janus_audiobridge_room_can_retire(audiobridge);
 			janus_mutex_unlock(&audiobridge->mutex);
+			if(free_room)
+				janus_audiobridge_room_retire(audiobridge);
+		} else if(!strcasecmp(request_text, "create")) {
+			/* Create a new room, optionally saving it to the configuration file too */
+			if(!janus_audiobridge_check_admin_key(root)) {
+				JANUS_DEBUG("Unauthorized request (wrong or missing admin_key)\n");
+				sprintf(error_cause, "Unauthorized request (wrong or missing admin_key)");
+				goto error;
+			}
+			json_t *room = json_object_get(root, "room");
+			if(room && !json_is_integer(room)) {
+				JANUS_DEBUG("JSON error: invalid element (room)\n");
+				sprintf(error_cause, "JSON error: invalid element (room)");
+				goto error;
+			}
+			json_t *desc = json_object_get(root, "description");
+			if(desc && !json_is_string(desc)) {
+				JANUS_DEBUG("JSON error: invalid element (description)\n");
+				sprintf(error_cause, "JSON error: invalid element (description)");
+				goto error;
+			}
+			json_t *sampling = json_object_get(root, "sampling_rate");
+			if(sampling && !json_is_integer(sampling)) {
+				JANUS_DEBUG("JSON error: invalid element (sampling_rate)\n");
+				sprintf(error_cause, "JSON error: invalid element (sampling_rate)");
+				goto error;
+			}
+			json_t *record = json_object_get(root, "record");
+			if(record && !json_is_boolean(record)) {
+				JANUS_DEBUG("JSON error: invalid element (record)\n");
+				sprintf(error_cause, "JSON error: invalid element (record)");
+				goto error;
+			}
+			json_t *permanent = json_object_get(root, "permanent");
+			if(permanent && !json_is_boolean(permanent)) {
+				JANUS_DEBUG("JSON error: invalid element (permanent)\n");
+				sprintf(error_cause, "JSON error: invalid element (permanent)");
+				goto error;
+			}
+			guint64 room_id = room ? json_integer_value(room) : 0;
+			if(room_id == 0) {
+				/* Pick a random ID that is not in use */
+				janus_mutex_lock(&rooms_mutex);
+				while(room_id == 0 || g_hash_table_lookup(rooms, GUINT_TO_POINTER(room_id)) != NULL)
+					room_id = g_random_int();
+				janus_mutex_unlock(&rooms_mutex);
+			}
+			/* The room is described as if it came from the configuration file */
+			char room_name[30], value[30];
+			g_snprintf(room_name, sizeof(room_name), "%"SCNu64, room_id);
+			janus_config *room_config = janus_config_create(room_name);
+			if(room_config == NULL) {
+				JANUS_DEBUG("Memory error!\n");
+				sprintf(error_cause, "Memory error");
+				goto error;
+			}
+			janus_config_add_item(room_config, room_name, "description", desc ? json_string_value(desc) : room_name);
+			g_snprintf(value, sizeof(value), "%d", sampling ? (int)json_integer_value(sampling) : 16000);
+			janus_config_add_item(room_config, room_name, "sampling_rate", value);
+			janus_config_add_item(room_config, room_name, "record", (record && json_is_true(record)) ? "yes" : "no");
+			janus_config_category *cat = janus_config_get_category(room_config, room_name);
+			janus_audiobridge_room *audiobridge = cat ? janus_audiobridge_room_create(cat) : NULL;
+			if(audiobridge == NULL) {
+				janus_config_destroy(room_config);
+				JANUS_DEBUG("Error creating room %"SCNu64"\n", room_id);
+				sprintf(error_cause, "Error creating room %"SCNu64" (already exists?)", room_id);
+				goto error;
+			}
+			if(permanent && json_is_true(permanent)) {
+				/* Save the new room to the configuration file as well */
+				janus_mutex_lock(&config_mutex);
+				janus_config_item *item = janus_config_get_items(cat);
+				while(item) {
+					janus_config_add_item(config, room_name, item->name, item->value);
+					item = item->next;
+				}
+				if(janus_config_save(config, config_file) < 0)
+					JANUS_DEBUG("Error saving room %"SCNu64" to the configuration file...\n", room_id);
+				janus_mutex_unlock(&config_mutex);
+			}
+			janus_config_destroy(room_config);
+			event = json_object();
+			json_object_set(event, "audiobridge", json_string("created"));
+			json_object_set(event, "room", json_integer(room_id));
+		} else if(!strcasecmp(request_text, "destroy")) {
+			/* Destroy an existing room, kicking all participants out */
+			if(!janus_audiobridge_check_admin_key(root)) {
+				JANUS_DEBUG("Unauthorized request (wrong or missing admin_key)\n");
+				sprintf(error_cause, "Unauthorized request (wrong or missing admin_key)");
+				goto error;
+			}
+			json_t *room = json_object_get(root, "room");
+			if(!room || !json_is_integer(room)) {
+				JANUS_DEBUG("JSON error: invalid element (room)\n");
+				sprintf(error_cause, "JSON error: invalid element (room)");
+				goto error;
+			}
+			json_t *permanent = json_object_get(root, "permanent");
+			if(permanent && !json_is_boolean(permanent)) {
+				JANUS_DEBUG("JSON error: invalid element (permanent)\n");
+				sprintf(error_cause, "JSON error: invalid element (permanent)");
+				goto error;
+			}
+			guint64 room_id = json_integer_value(room);
+			janus_mutex_lock(&rooms_mutex);
+			janus_audiobridge_room *audiobridge = g_hash_table_lookup(rooms, GUINT_TO_POINTER(room_id));
+			if(audiobridge != NULL)
+				g_hash_table_remove(rooms, GUINT_TO_POINTER(room_id));
+			janus_mutex_unlock(&rooms_mutex);
+			if(audiobridge == NULL) {
+				JANUS_DEBUG("No such room (%"SCNu64")\n", room_id);
+				sprintf(error_cause, "No such room (%"SCNu64")", room_id);
+				goto error;
+			}
+			if(permanent && json_is_true(permanent)) {
+				/* Remove the room from the configuration file as well */
+				char room_name[30];
+				g_snprintf(room_name, sizeof(room_name), "%"SCNu64, room_id);
+				janus_mutex_lock(&config_mutex);
+				if(janus_config_remove_category(config, room_name) == 0 && janus_config_save(config, config_file) < 0)
+					JANUS_DEBUG("Error removing room %"SCNu64" from the configuration file...\n", room_id);
+				janus_mutex_unlock(&config_mutex);
+			}
+			/* Tell everybody the room is gone, and stop the mixer */
+			janus_mutex_lock(&audiobridge->mutex);
+			audiobridge->destroy = 1;
+			json_t *destroyed = json_object();
+			json_object_set(destroyed, "audiobridge", json_string("destroyed"));
+			json_object_set(destroyed, "room", json_integer(room_id));
+			char *destroyed_text = json_dumps(destroyed, JSON_INDENT(3));
+			json_decref(destroyed);
+			GList *participants_list = g_hash_table_get_values(audiobridge->participants);
+			GList *ps = participants_list;
+			while(ps) {
+				janus_audiobridge_participant *p = (janus_audiobridge_participant *)ps->data;
+				JANUS_PRINT("Notifying participant %"SCNu64" (%s)\n", p->user_id, p->display);
+				p->audio_active = 0;
+				p->session->started = FALSE;
+				JANUS_PRINT("  >> %d\n", gateway->push_event(p->session->handle, &janus_audiobridge_plugin, NULL, destroyed_text, NULL, NULL));
+				ps = ps->next;
+			}
+			g_free(destroyed_text);
+			g_list_free(participants_list);
+			GThread *mixer = audiobridge->mixer;
+			janus_mutex_unlock(&audiobridge->mutex);
+			/* Participants hanging up in the meanwhile won't free the room, as the mixer is still set */
+			if(mixer != NULL)
+				g_thread_join(mixer);
+			janus_mutex_lock(&audiobridge->mutex);
+			audiobridge->mixer = NULL;
+			gboolean free_room = janus_audiobridge_room_can_retire(audiobridge);
+			janus_mutex_unlock(&audiobridge->mutex);
+			/* If there's still someone in, the room is retired when the last one hangs up */
+			if(free_room)
+				janus_audiobridge_room_retire(audiobridge);
+			event = json_object();
+			json_object_set(event, "audiobridge", json_string("destroyed"));
+			json_object_set(event, "room", json_integer(room_id));
 		} else {
 			JANUS_DEBUG("Unknown request '%s'\n", request_text);
 			sprintf(error_cause, "Unknown request '%s'", request_text);
@@ -785,26 +1318,32 @@ static void *janus_audiobridge_handler(void *data) {
 				type = "offer";
 			/* Fill the SDP template and use that as our answer */
 			janus_audiobridge_participant *participant = (janus_audiobridge_participant *)session->participant;
+			janus_audiobridge_room *audiobridge = participant ? participant->room : NULL;
+			if(audiobridge == NULL) {
+				g_free(event_text);
+				JANUS_DEBUG("Can't negotiate (not in a room)\n");
+				sprintf(error_cause, "Can't negotiate (not in a room)");
+				goto error;
+			}
 			char sdp[1024];
-			/* What is the Opus payload type? */
+			/* What is the Opus payload type? The gateway parsed the SDP already */
 			participant->opus_pt = 0;
-			char *fmtp = strstr(msg->sdp, "opus/48000");
-			if(fmtp != NULL) {
-				fmtp -= 5;
-				fmtp = strstr(fmtp, ":");
-				if(fmtp)
-					fmtp++;
-				participant->opus_pt = atoi(fmtp);
-			}
+			GList *codecs = gateway->get_codecs(msg->handle, FALSE);
+			if(codecs == NULL)
+				codecs = janus_codecs_parse(msg->sdp, FALSE);
+			janus_codec *opus = janus_codecs_find(codecs, "opus");
+			if(opus != NULL)
+				participant->opus_pt = opus->pt;
+			janus_codecs_free(codecs);
 			JANUS_PRINT("Opus payload type is %d\n", participant->opus_pt);
 			g_sprintf(sdp, sdp_template,
 				g_get_monotonic_time(),			/* We need current time here */
 				g_get_monotonic_time(),			/* We need current time here */
-				participant->room->room_name,	/* Audio bridge name */
+				audiobridge->room_name,			/* Audio bridge name */
 				participant->opus_pt,			/* Opus payload type */
 				participant->opus_pt,			/* Opus payload type */
 				participant->opus_pt, 			/* Opus payload type and room sampling rate */
-				participant->room->sampling_rate);
+				audiobridge->sampling_rate);
 			/* Did the peer negotiate video? */
 			if(strstr(msg->sdp, "m=video") != NULL) {
 				/* If so, reject it */
@@ -818,7 +1357,6 @@ static void *janus_audiobridge_handler(void *data) {
 				/* TODO Failed to negotiate? We should remove this participant */
 			} else {
 				/* Notify all other participants that there's a new boy in town */
-				janus_audiobridge_room *audiobridge = participant->room;
 				janus_mutex_lock(&audiobridge->mutex);
 				json_t *list = json_array();
 				json_t *pl = json_object();
@@ -829,12 +1367,11 @@ static void *janus_audiobridge_handler(void *data) {
 				json_array_append_new(list, pl);
 				json_t *pub = json_object();
 				json_object_set(pub, "audiobridge", json_string("event"));
-				json_object_set(pub, "room", json_integer(participant->room->room_id));
+				json_object_set(pub, "room", json_integer(audiobridge->room_id));
 				json_object_set_new(pub, "participants", list);
 				char *pub_text = json_dumps(pub, JSON_INDENT(3));
-				json_decref(list);
 				json_decref(pub);
-				GList *participants_list = g_hash_table_get_values(participant->room->participants);
+				GList *participants_list = g_hash_table_get_values(audiobridge->participants);
 				GList *ps = participants_list;
 				while(ps) {
 					janus_audiobridge_participant *p = (janus_audiobridge_participant *)ps->data;
@@ -849,6 +1386,7 @@ static void *janus_audiobridge_handler(void *data) {
 				g_list_free(participants_list);
 				session->started = TRUE;
 				janus_mutex_unlock(&audiobridge->mutex);
+				g_free(pub_text);
 			}
 		}
 
@@ -881,11 +1419,11 @@ static void *janus_audiobridge_mixer_thread(void *data) {
 		return NULL;
 	}
 	JANUS_PRINT("Thread is for mixing room %"SCNu64" (%s)...\n", audiobridge->room_id, audiobridge->room_name);
-	/* Do we need to record the mix? */
-	if(audiobridge->record) {
+	/* Do we need to record the mix? (the file is kept open when the mixer stops because the room got empty) */
+	if(audiobridge->record && audiobridge->recording == NULL) {
 		char filename[255];
 		sprintf(filename, "/tmp/janus-audioroom-%"SCNu64".wav", audiobridge->room_id);
-		audiobridge->recording = fopen(filename, "wb");
+		audiobridge->recording = janus_writer_open(filename, FALSE);
 		if(audiobridge->recording == NULL) {
 			JANUS_DEBUG("Recording requested, but could NOT open file %s for writing...\n", filename);
 		} else {
@@ -906,7 +1444,7 @@ static void *janus_audiobridge_mixer_thread(void *data) {
 				{'d', 'a', 't', 'a'},
 				0
 			};
-			if(fwrite(&header, 1, sizeof(header), audiobridge->recording) != sizeof(header)) {
+			if(janus_writer_write(audiobridge->recording, &header, sizeof(header)) < 0) {
 				JANUS_DEBUG("Error writing WAV header...\n");
 			}
 		}
@@ -925,14 +1463,14 @@ static void *janus_audiobridge_mixer_thread(void *data) {
 	time_t passed, d_s, d_us;
 	/* Output buffer */
 	janus_audiobridge_rtp_relay_packet *outpkt = calloc(1, sizeof(janus_audiobridge_rtp_relay_packet));
-	if(outpkt == NULL) {
+	if(outpkt != NULL)
+		outpkt->data = (rtp_header *)calloc(BUFFER_SAMPLES, sizeof(unsigned char));
+	if(outpkt == NULL || outpkt->data == NULL) {
 		JANUS_DEBUG("Memory error!\n");
-		return NULL;
-	}
-	outpkt->data = (rtp_header *)calloc(BUFFER_SAMPLES, sizeof(unsigned char));
-	if(outpkt->data == NULL) {
-		JANUS_DEBUG("Memory error!\n");
-		g_free(outpkt);
+		free(outpkt);
+		janus_mutex_lock(&audiobridge->mutex);
+		audiobridge->mixing = FALSE;
+		janus_mutex_unlock(&audiobridge->mutex);
 		return NULL;
 	}
 	unsigned char *payload = (unsigned char *)outpkt->data;
@@ -942,7 +1480,7 @@ static void *janus_audiobridge_mixer_thread(void *data) {
 	gint32 ts = 0;
 	/* Loop */
 	int i=0;
-	while(!stopping) {	/* FIXME We need a per-mountpoint watchdog as well */
+	while(!stopping && !audiobridge->destroy) {
 		/* See if it's time to prepare a frame */
 		gettimeofday(&now, NULL);
 		d_s = now.tv_sec - before.tv_sec;
@@ -956,6 +1494,10 @@ static void *janus_audiobridge_mixer_thread(void *data) {
 			usleep(1000);
 			continue;
 		}
+		if(passed >= 40000) {
+			/* We're late by at least a whole frame: keep track of it */
+			g_atomic_int_inc(&audiobridge->overruns);
+		}
 		/* Update the reference time */
 		before.tv_usec += 20000;
 		if(before.tv_usec > 1000000) {
@@ -972,41 +1514,58 @@ static void *janus_audiobridge_mixer_thread(void *data) {
 		outpkt->data->ssrc = htonl(1);	/* The gateway will fix this anyway */
 		/* Mix all contributions */
 		janus_mutex_lock(&audiobridge->mutex);
+		if(g_hash_table_size(audiobridge->participants) == 0) {
+			/* Nobody's in: the next participant joining will start a new mixer */
+			audiobridge->mixing = FALSE;
+			janus_mutex_unlock(&audiobridge->mutex);
+			break;
+		}
 		GList *participants_list = g_hash_table_get_values(audiobridge->participants);
-		janus_mutex_unlock(&audiobridge->mutex);
 		for(i=0; i<320; i++)
 			buffer[i] = 0;
+		/* Take the frames to mix out of the rings with the room mutex locked,
+		 * as participants leaving give what's left in theirs back to the pool */
 		GList *ps = participants_list;
 		while(ps) {
 			janus_audiobridge_participant *p = (janus_audiobridge_participant *)ps->data;
-			if(!p->audio_active || g_queue_is_empty(p->inbuf)) {
+			if(p->audio_active) {
+				p->mixing = janus_audiobridge_inbuf_pop(p);
+			} else {
+				/* Muted: recycle whatever was queued before */
+				p->mixing = NULL;
+				janus_audiobridge_inbuf_drain(p, audiobridge);
+			}
+			janus_audiobridge_rtp_relay_packet *pkt = p->mixing;
+			if(pkt == NULL) {
 				ps = ps->next;
 				continue;
 			}
-			janus_audiobridge_rtp_relay_packet *pkt = g_queue_peek_head(p->inbuf);
+			/* Frames are recycled, so only what was decoded this time is valid */
+			int samples = pkt->length < 320 ? pkt->length : 320;
 			curBuffer = (opus_int16 *)pkt->data;
-			for(i=0; i<320; i++)
+			for(i=0; i<samples; i++)
 				buffer[i] += curBuffer[i];
 			ps = ps->next;
 		}
-		/* Are we recording the mix? (only do it if there's someone in, though...) */ 
-		if(audiobridge->recording != NULL && g_list_length(participants_list) > 0) { 
+		janus_mutex_unlock(&audiobridge->mutex);
+		/* Are we recording the mix? */
+		if(audiobridge->recording != NULL) {
 			for(i=0; i<320; i++) { 
 				/* FIXME Smoothen/Normalize instead of truncating? */ 
 				outBuffer[i] = buffer[i]; 
 			} 
-			fwrite(outBuffer, sizeof(opus_int16), 320, audiobridge->recording); 
+			janus_writer_write(audiobridge->recording, outBuffer, 320*sizeof(opus_int16));
 		} 
 		/* Send proper packet to each participant (remove own contribution) */
 		ps = participants_list;
 		while(ps) {
 			janus_audiobridge_participant *p = (janus_audiobridge_participant *)ps->data;
-			janus_audiobridge_rtp_relay_packet *pkt = NULL;
-			if(p->audio_active && !g_queue_is_empty(p->inbuf))
-				pkt = g_queue_pop_head(p->inbuf);
+			janus_audiobridge_rtp_relay_packet *pkt = p->mixing;
+			p->mixing = NULL;
+			int samples = pkt ? (pkt->length < 320 ? pkt->length : 320) : 0;
 			curBuffer = (opus_int16 *)(pkt ? pkt->data : NULL);
 			for(i=0; i<320; i++)
-				sumBuffer[i] = buffer[i] - (curBuffer ? (curBuffer[i]) : 0);
+				sumBuffer[i] = buffer[i] - (i < samples ? curBuffer[i] : 0);
 			for(i=0; i<320; i++)
 				/* FIXME Smoothen/Normalize instead of truncating? */
 				outBuffer[i] = sumBuffer[i];
@@ -1018,17 +1577,14 @@ static void *janus_audiobridge_mixer_thread(void *data) {
 				outpkt->length += 12;	/* Take the RTP header into consideration */
 				janus_audiobridge_relay_rtp_packet(p->session, outpkt);
 			}
-			if(pkt) {
-				if(pkt->data)
-					g_free(pkt->data);
-				g_free(pkt);
-			}
+			/* Done with this frame, it can be reused */
+			janus_audiobridge_frame_put(audiobridge, pkt);
 			ps = ps->next;
 		}
 		g_list_free(participants_list);
 	}
-	if(audiobridge->recording)
-		fclose(audiobridge->recording);
+	free(outpkt->data);
+	free(outpkt);
 	JANUS_PRINT("Leaving mixer thread for room %"SCNu64" (%s)...\n", audiobridge->room_id, audiobridge->room_name);
 	return NULL;
 }
@@ -23,6 +23,20 @@
  * need to fork in the same place. This specific functionality, though, has
  * not been implemented as of yet.
  * 
+ * All sessions share the same SIP stack: a fixed number of sofia-sip
+ * user agents (see the \c sip_threads property in the configuration
+ * file), each with its own event loop thread, are created when the plugin
+ * is initialized, and sessions are spread among them. REGISTERs and
+ * calls use per-session handles on the shared stack, while incoming
+ * INVITEs are dispatched to the session that registered the user they're
+ * addressed to. In the same way, RTP and RTCP packets coming from the SIP
+ * peers of all calls are read by a fixed number of relay threads (see
+ * \c relay_threads ), in batches, rather than by a thread each. The
+ * ports for the media are taken from a configurable range (see
+ * \c rtp_port_range ), while the address of the SIP servers is
+ * resolved in the background when users register, and then cached for
+ * a few minutes (see \c JANUS_SIP_ADDRESS_TTL ).
+ * 
  * \todo Only Asterisk has been tested as a SIP server (which explains why
  * the plugin talks of extensions and not generic SIP URIs), and specifically
  * only basic audio calls have been tested: this plugin needs a lot of work.
@@ -35,6 +49,11 @@
 
 #include <ifaddrs.h>
 #include <net/if.h>
+#include <netdb.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <fcntl.h>
+#include <errno.h>
 
 #include <jansson.h>
 
@@ -42,8 +61,10 @@
 #include <sofia-sip/nua.h>
 #include <sofia-sip/sdp.h>
 #include <sofia-sip/sip_status.h>
+#include <sofia-sip/su_wait.h>
 
 #include "../config.h"
+#include "../mutex.h"
 
 
 /* Plugin information */
@@ -109,6 +130,7 @@ char *string_replace(char *message, char *old, char *new, int *modified);
 
 typedef struct janus_sip_message {
 	janus_pluginession *handle;
+	struct janus_sip_session *session;	/* Referenced until the handler is done with the message */
 	char *transaction;
 	char *message;
 	char *sdp_type;
@@ -131,7 +153,6 @@ typedef enum janus_sip_status {
 
 /* Sofia stuff */
 typedef struct ssip_s ssip_t;
-typedef struct ssip_oper_s ssip_oper_t;
 
 typedef struct janus_sip_account {
 	char *username;
@@ -141,6 +162,14 @@ typedef struct janus_sip_account {
 	int proxy_port;
 } janus_sip_account;
 
+/* A socket of a call, as seen by the relay thread it's assigned to */
+typedef struct janus_sip_relay_socket {
+	struct janus_sip_session *session;
+	int fd;	/* -1 when not (or not anymore) handled by the relay thread */
+	gboolean video;
+	gboolean rtcp;
+} janus_sip_relay_socket;
+
 typedef struct janus_sip_media {
 	int ready:1;
 	int has_audio:1;
@@ -151,18 +180,30 @@ typedef struct janus_sip_media {
 	int video_rtp_fd, video_rtcp_fd;
 	int local_video_rtp_port, remote_video_rtp_port;
 	int local_video_rtcp_port, remote_video_rtcp_port;
+	gboolean relaying;
+	guint relay;
+	janus_sip_relay_socket relay_sockets[4];
 } janus_sip_media;
 
 typedef struct janus_sip_session {
 	janus_pluginession *handle;
 	ssip_t *stack;
+	nua_handle_t *s_nh_r, *s_nh_i;
 	janus_sip_account account;
 	janus_sip_status status;
 	janus_sip_media media;
 	char *callee;
 	gboolean destroy;
+	/* The handle, queued messages and pending teardowns on the stack hold a reference */
+	volatile gint ref;
+	/* Protects the call (s_nh_i, callee, status) and its media sockets, shared by
+	 * the handler, the sofia thread and the gateway threads sending us media */
+	janus_mutex mutex;
 } janus_sip_session;
 GHashTable *sessions;
+/* Sessions indexed by the username they registered, to dispatch incoming INVITEs */
+static GHashTable *identities = NULL;
+static janus_mutex identities_mutex = JANUS_MUTEX_INITIALIZER;
 
 
 #undef SU_ROOT_MAGIC_T
@@ -170,27 +211,83 @@ GHashTable *sessions;
 #undef NUA_MAGIC_T
 #define NUA_MAGIC_T		ssip_t
 #undef NUA_HMAGIC_T
-#define NUA_HMAGIC_T	ssip_oper_t
+#define NUA_HMAGIC_T	janus_sip_session
 
+/* Shared SIP stack: sessions only get their own handles on it */
 struct ssip_s {
+	guint index;
 	su_home_t s_home[1];
 	su_root_t *s_root;
 	nua_t *s_nua;
-	nua_handle_t *s_nh_r, *s_nh_i;
-	janus_sip_session *session;
+	GThread *thread;
 };
+static ssip_t *stacks = NULL;
+static guint stacks_num = 1;
+static volatile gint stacks_next = 0;
 
 
 /* Sofia Event thread */
 gpointer janus_sip_sofia_thread(gpointer user_data);
+/* Session lifetime */
+static void janus_sip_session_ref(janus_sip_session *session);
+static void janus_sip_session_unref(janus_sip_session *session);
+static void janus_sip_session_release(janus_sip_session *session);
+static void janus_sip_session_teardown(su_root_magic_t *magic, su_msg_r msg, su_msg_arg_t *arg);
+static janus_sip_status janus_sip_status_get(janus_sip_session *session);
+static void janus_sip_status_set(janus_sip_session *session, janus_sip_status status);
 /* Sofia callbacks */
 void janus_sip_sofia_callback(nua_event_t event, int status, char const *phrase, nua_t *nua, nua_magic_t *magic, nua_handle_t *nh, nua_hmagic_t *hmagic, sip_t const *sip, tagi_t tags[]);
 /* SDP parsing */
 void janus_sip_sdp_process(janus_sip_session *session, sdp_session_t *sdp);
 /* Media */
-static int janus_sip_allocate_local_ports(janus_sip_session *session);
+static int janus_sip_allocate_local_ports(janus_sip_session *session, gboolean audio, gboolean video);
+static int janus_sip_relay_add(janus_sip_session *session);
+static void janus_sip_relay_sync(guint index);
+static void janus_sip_relay_wake(guint index);
+static void janus_sip_media_reset(janus_sip_session *session);
 static void *janus_sip_relay_thread(void *data);
 
+/* RTP/RTCP from the SIP peers is not read by a thread per call, but by a
+ * fixed number of relay threads: each has an epoll set with the sockets of
+ * the calls assigned to it, and reads packets in batches with recvmmsg */
+#define JANUS_SIP_RELAY_BATCH	32
+#define JANUS_SIP_RTP_BUFSIZE	1500
+typedef struct janus_sip_relay {
+	GThread *thread;
+	int epoll_fd;
+	int wake_fd;	/* eventfd in the epoll set, to wake the thread up (see janus_sip_relay_wake) */
+	guint sockets;
+	janus_mutex mutex;	/* Held while reading from a socket, so that it's never removed under the thread */
+	volatile gint batches;	/* Incremented after each batch (or wakeup), see janus_sip_relay_sync */
+} janus_sip_relay;
+static janus_sip_relay *relay_threads = NULL;
+static guint relay_threads_num = 1;
+
+/* Range local RTP/RTCP ports are picked from: pairs are handed out in
+ * turn, so that a port is only reused once the whole range went by */
+static int rtp_range_min = 10000, rtp_range_max = 60000, rtp_range_next = 0;
+static janus_mutex ports_mutex = JANUS_MUTEX_INITIALIZER;
+
+/* Addresses of the SIP servers (which we send media to), resolved in the
+ * background when someone registers, so that nothing ever blocks on DNS:
+ * once their TTL expires they're resolved again, still using the old one
+ * in the meanwhile (getaddrinfo doesn't tell us the TTL of the records) */
+#define JANUS_SIP_ADDRESS_TTL	300
+#define JANUS_SIP_ADDRESS_RETRY	10
+typedef struct janus_sip_address {
+	char *name;
+	struct in_addr addr;
+	volatile gint resolved;	/* 0 while resolving, 1 if resolved, -1 if resolution failed */
+	gboolean refreshing;	/* Resolving again an expired address, which we keep using meanwhile */
+	gint64 expires;	/* Monotonic time the address should be resolved again at (0 if numeric) */
+} janus_sip_address;
+static GHashTable *addresses = NULL;
+static janus_mutex addresses_mutex = JANUS_MUTEX_INITIALIZER;
+static GThreadPool *resolver = NULL;
+static void janus_sip_address_resolve(gpointer data, gpointer user_data);
+static void janus_sip_address_prefetch(const char *name);
+static int janus_sip_address_lookup(const char *name, struct in_addr *addr);
+
 
 /* Plugin implementation */
 int janus_sip_init(janus_callbacks *callback, const char *config_path) {
@@ -208,9 +305,33 @@ int janus_sip_init(janus_callbacks *callback, const char *config_path) {
 	sprintf(filename, "%s/%s.cfg", config_path, JANUS_SIP_PACKAGE);
 	JANUS_PRINT("Configuration file: %s\n", filename);
 	janus_config *config = janus_config_parse(filename);
-	if(config != NULL)
+	if(config != NULL) {
 		janus_config_print(config);
-	/* This plugin actually has nothing to configure... */
+		/* How many SIP stacks (and event loop threads) should we share among sessions? */
+		janus_config_item *item = janus_config_get_item_drilldown(config, "general", "sip_threads");
+		if(item && item->value && atoi(item->value) > 0)
+			stacks_num = atoi(item->value);
+		/* How many threads should relay the RTP/RTCP packets of the calls? */
+		item = janus_config_get_item_drilldown(config, "general", "relay_threads");
+		if(item && item->value && atoi(item->value) > 0)
+			relay_threads_num = atoi(item->value);
+		/* Which ports can we use for RTP/RTCP? */
+		item = janus_config_get_item_drilldown(config, "general", "rtp_port_range");
+		if(item && item->value) {
+			int min = 0, max = 0;
+			if(sscanf(item->value, "%d-%d", &min, &max) != 2 || min < 1024 || max > 65535 || max-min < 3) {
+				JANUS_DEBUG("Invalid RTP port range (%s), using %d-%d\n", item->value, rtp_range_min, rtp_range_max);
+			} else {
+				rtp_range_min = min;
+				rtp_range_max = max;
+			}
+		}
+	}
+	/* RTP must be on even ports */
+	if(rtp_range_min % 2)
+		rtp_range_min++;
+	rtp_range_next = rtp_range_min + 2*g_random_int_range(0, (rtp_range_max-rtp_range_min+1)/2);
+	JANUS_PRINT("RTP/RTCP ports will be picked in the %d-%d range\n", rtp_range_min, rtp_range_max);
 	janus_config_destroy(config);
 	config = NULL;
 	
@@ -252,13 +373,80 @@ int janus_sip_init(janus_callbacks *callback, const char *config_path) {
 	su_init();
 
 	sessions = g_hash_table_new(NULL, NULL);
+	identities = g_hash_table_new_full(g_str_hash, g_str_equal, (GDestroyNotify)g_free, NULL);
 	messages = g_queue_new();
 	/* This is the callback we'll need to invoke to contact the gateway */
 	gateway = callback;
 
+	/* Start the shared SIP stacks */
+	stacks = calloc(stacks_num, sizeof(ssip_t));
+	if(stacks == NULL) {
+		JANUS_DEBUG("Memory error!\n");
+		return -1;
+	}
+	GError *error = NULL;
+	guint i = 0;
+	for(i=0; i<stacks_num; i++) {
+		stacks[i].index = i;
+		char tname[32];
+		g_snprintf(tname, sizeof(tname), "janus sip stack %u", i);
+		stacks[i].thread = g_thread_try_new(tname, janus_sip_sofia_thread, &stacks[i], &error);
+		if(error != NULL) {
+			JANUS_DEBUG("Got error %d (%s) trying to launch the SIP stack thread...\n", error->code, error->message ? error->message : "??");
+			return -1;
+		}
+	}
+	/* Wait for all the stacks to be up before accepting sessions */
+	gint64 timeout = g_get_monotonic_time() + 2*G_USEC_PER_SEC;
+	for(i=0; i<stacks_num; i++) {
+		while(g_atomic_pointer_get(&stacks[i].s_nua) == NULL && g_get_monotonic_time() < timeout)
+			g_usleep(10000);
+		if(g_atomic_pointer_get(&stacks[i].s_nua) == NULL) {
+			JANUS_DEBUG("Two seconds passed and still no NUA for stack #%u, problems with the thread?\n", i);
+			return -1;
+		}
+	}
+	JANUS_PRINT("Started %u shared SIP stack%s\n", stacks_num, stacks_num == 1 ? "" : "s");
+
+	/* Start the relay threads, and the resolver for the addresses of the SIP servers */
+	addresses = g_hash_table_new(g_str_hash, g_str_equal);
+	resolver = g_thread_pool_new(janus_sip_address_resolve, NULL, 1, FALSE, &error);
+	if(error != NULL) {
+		JANUS_DEBUG("Got error %d (%s) trying to launch the resolver thread...\n", error->code, error->message ? error->message : "??");
+		return -1;
+	}
+	relay_threads = calloc(relay_threads_num, sizeof(janus_sip_relay));
+	if(relay_threads == NULL) {
+		JANUS_DEBUG("Memory error!\n");
+		return -1;
+	}
+	for(i=0; i<relay_threads_num; i++) {
+		relay_threads[i].epoll_fd = epoll_create1(0);
+		if(relay_threads[i].epoll_fd < 0) {
+			JANUS_DEBUG("Error creating epoll set for the relay thread...\n");
+			return -1;
+		}
+		relay_threads[i].wake_fd = eventfd(0, EFD_NONBLOCK);
+		struct epoll_event event;
+		memset(&event, 0, sizeof(event));
+		event.events = EPOLLIN;
+		event.data.ptr = NULL;	/* Not a socket of a call */
+		if(relay_threads[i].wake_fd < 0 || epoll_ctl(relay_threads[i].epoll_fd, EPOLL_CTL_ADD, relay_threads[i].wake_fd, &event) < 0) {
+			JANUS_DEBUG("Error creating the wakeup eventfd for the relay thread...\n");
+			return -1;
+		}
+		janus_mutex_init(&relay_threads[i].mutex);
+		char tname[32];
+		g_snprintf(tname, sizeof(tname), "janus sip relay %u", i);
+		relay_threads[i].thread = g_thread_try_new(tname, janus_sip_relay_thread, &relay_threads[i], &error);
+		if(error != NULL) {
+			JANUS_DEBUG("Got error %d (%s) trying to launch the relay thread...\n", error->code, error->message ? error->message : "??");
+			return -1;
+		}
+	}
+
 	initialized = 1;
 	/* Launch the thread that will handle incoming messages */
-	GError *error = NULL;
 	handler_thread = g_thread_try_new("janus sip handler", janus_sip_handler, NULL, &error);
 	if(error != NULL) {
 		initialized = 0;
@@ -278,10 +466,50 @@ void janus_sip_destroy() {
 		g_thread_join(handler_thread);
 	}
 	handler_thread = NULL;
+	/* Shutdown the shared stacks: this also unregisters and hangs up whatever is still there */
+	guint i = 0;
+	for(i=0; i<stacks_num; i++) {
+		if(stacks[i].s_nua != NULL)
+			nua_shutdown(stacks[i].s_nua);
+	}
+	for(i=0; i<stacks_num; i++) {
+		if(stacks[i].thread != NULL)
+			g_thread_join(stacks[i].thread);
+		stacks[i].thread = NULL;
+	}
+	free(stacks);
+	stacks = NULL;
+	su_deinit();
+	/* Stop relaying and resolving */
+	for(i=0; i<relay_threads_num; i++) {
+		janus_sip_relay_wake(i);
+		if(relay_threads[i].thread != NULL)
+			g_thread_join(relay_threads[i].thread);
+		relay_threads[i].thread = NULL;
+		close(relay_threads[i].wake_fd);
+		close(relay_threads[i].epoll_fd);
+		janus_mutex_destroy(&relay_threads[i].mutex);
+	}
+	free(relay_threads);
+	relay_threads = NULL;
+	g_thread_pool_free(resolver, TRUE, TRUE);
+	resolver = NULL;
+	GHashTableIter iter;
+	gpointer value;
+	g_hash_table_iter_init(&iter, addresses);
+	while(g_hash_table_iter_next(&iter, NULL, &value)) {
+		janus_sip_address *address = (janus_sip_address *)value;
+		g_free(address->name);
+		free(address);
+	}
+	g_hash_table_destroy(addresses);
+	addresses = NULL;
 	/* TODO Actually clean up and remove ongoing sessions */
 	g_hash_table_destroy(sessions);
+	g_hash_table_destroy(identities);
 	g_queue_free(messages);
 	sessions = NULL;
+	identities = NULL;
 	initialized = 0;
 	stopping = 0;
 	JANUS_PRINT("%s destroyed!\n", JANUS_SIP_NAME);
@@ -324,18 +552,10 @@ void janus_sip_create_session(janus_pluginession *handle, int *error) {
 	session->account.sip_port = 0;
 	session->account.proxy_ip = NULL;
 	session->account.proxy_port = 0;
-	session->stack = calloc(1, sizeof(ssip_t));
-	if(session->stack == NULL) {
-		JANUS_DEBUG("Memory error!\n");
-		*error = -2;
-		g_free(session);
-		return;
-	}
-	session->stack->session = session;
-	session->stack->s_nua = NULL;
-	session->stack->s_nh_r = NULL;
-	session->stack->s_nh_i = NULL;
-	session->stack->s_root = NULL;
+	/* Sessions are spread among the shared stacks */
+	session->stack = &stacks[(guint)g_atomic_int_add(&stacks_next, 1) % stacks_num];
+	session->s_nh_r = NULL;
+	session->s_nh_i = NULL;
 	session->callee = NULL;
 	session->media.ready = 0;
 	session->media.has_audio = 0;
@@ -352,7 +572,10 @@ void janus_sip_create_session(janus_pluginession *handle, int *error) {
 	session->media.remote_video_rtp_port = 0;
 	session->media.local_video_rtcp_port = 0;
 	session->media.remote_video_rtcp_port = 0;
-	su_home_init(session->stack->s_home);
+	session->media.relaying = FALSE;
+	session->media.relay = 0;
+	session->ref = 1;
+	janus_mutex_init(&session->mutex);
 	handle->plugin_handle = session;
 
 	return;
@@ -371,19 +594,105 @@ void janus_sip_destroy_session(janus_pluginession *handle, int *error) {
 	}
 	if(session->destroy) {
 		JANUS_PRINT("Session already destroyed...\n");
-		g_free(session);
 		return;
 	}
 	g_hash_table_remove(sessions, handle);
 	janus_sip_hangup_media(handle);
 	JANUS_PRINT("Destroying SIP session (%s)...\n", session->account.username ? session->account.username : "unregistered user");
-	/* Shutdown the NUA */
-	nua_shutdown(session->stack->s_nua);
+	if(session->account.username != NULL) {
+		janus_mutex_lock(&identities_mutex);
+		if(g_hash_table_lookup(identities, session->account.username) == session)
+			g_hash_table_remove(identities, session->account.username);
+		janus_mutex_unlock(&identities_mutex);
+	}
+	/* From now on no new media can be set up for the session */
+	janus_mutex_lock(&session->mutex);
 	session->destroy = TRUE;
-	g_free(session);
+	janus_mutex_unlock(&session->mutex);
+	/* Get rid of our handles and media on the thread of the shared stack: its
+	 * callbacks run there too, so none of them can be using the session meanwhile */
+	janus_sip_session_ref(session);
+	su_msg_r teardown = SU_MSG_R_INIT;
+	if(su_msg_create(teardown, su_root_task(session->stack->s_root), su_root_task(session->stack->s_root),
+			janus_sip_session_teardown, sizeof(janus_sip_session *)) < 0) {
+		JANUS_DEBUG("Couldn't schedule the teardown of the SIP session, doing it here...\n");
+		janus_sip_session_release(session);
+		janus_sip_session_unref(session);
+	} else {
+		memcpy(su_msg_data(teardown), &session, sizeof(janus_sip_session *));
+		if(su_msg_send(teardown) < 0) {
+			JANUS_DEBUG("Couldn't schedule the teardown of the SIP session, doing it here...\n");
+			janus_sip_session_release(session);
+			janus_sip_session_unref(session);
+		}
+	}
+	handle->plugin_handle = NULL;
+	janus_sip_session_unref(session);
 	return;
 }
 
+static void janus_sip_session_ref(janus_sip_session *session) {
+	g_atomic_int_inc(&session->ref);
+}
+
+static void janus_sip_session_unref(janus_sip_session *session) {
+	if(!g_atomic_int_dec_and_test(&session->ref))
+		return;
+	g_free(session->account.username);
+	g_free(session->account.secret);
+	g_free(session->account.proxy_ip);
+	g_free(session->callee);
+	janus_mutex_destroy(&session->mutex);
+	g_free(session);
+}
+
+/* Unbind and destroy the handles of a session (the shared stack takes care of
+ * hanging up and unregistering, and any late event will find no session bound),
+ * stop relaying its media and make sure the relay thread is done with it */
+static void janus_sip_session_release(janus_sip_session *session) {
+	janus_mutex_lock(&session->mutex);
+	gboolean relaying = session->media.relaying;
+	guint relay = session->media.relay;
+	janus_mutex_unlock(&session->mutex);
+	janus_sip_media_reset(session);
+	if(relaying)
+		janus_sip_relay_sync(relay);
+	janus_mutex_lock(&session->mutex);
+	if(session->s_nh_i != NULL) {
+		nua_handle_bind(session->s_nh_i, NULL);
+		nua_handle_destroy(session->s_nh_i);
+		session->s_nh_i = NULL;
+	}
+	if(session->s_nh_r != NULL) {
+		nua_handle_bind(session->s_nh_r, NULL);
+		nua_handle_destroy(session->s_nh_r);
+		session->s_nh_r = NULL;
+	}
+	janus_mutex_unlock(&session->mutex);
+}
+
+/* The call status is changed by both the handler and the sofia thread */
+static janus_sip_status janus_sip_status_get(janus_sip_session *session) {
+	janus_mutex_lock(&session->mutex);
+	janus_sip_status status = session->status;
+	janus_mutex_unlock(&session->mutex);
+	return status;
+}
+
+static void janus_sip_status_set(janus_sip_session *session, janus_sip_status status) {
+	janus_mutex_lock(&session->mutex);
+	session->status = status;
+	janus_mutex_unlock(&session->mutex);
+}
+
+/* Runs on the thread of the stack the session was on */
+static void janus_sip_session_teardown(su_root_magic_t *magic, su_msg_r msg, su_msg_arg_t *arg) {
+	janus_sip_session *session = NULL;
+	memcpy(&session, arg, sizeof(janus_sip_session *));
+	janus_sip_session_release(session);
+	janus_sip_session_unref(session);
+}
+
 void janus_sip_handle_message(janus_pluginession *handle, char *transaction, char *message, char *sdp_type, char *sdp) {
 	if(stopping || !initialized)
 		return;
@@ -393,7 +702,15 @@ void janus_sip_handle_message(janus_pluginession *handle, char *transaction, cha
 		JANUS_DEBUG("Memory error!\n");
 		return;
 	}
+	janus_sip_session *session = (janus_sip_session *)handle->plugin_handle;
+	if(!session) {
+		JANUS_DEBUG("No session associated with this handle...\n");
+		free(msg);
+		return;
+	}
+	janus_sip_session_ref(session);
 	msg->handle = handle;
+	msg->session = session;
 	msg->transaction = transaction ? g_strdup(transaction) : NULL;
 	msg->message = message;
 	msg->sdp_type = sdp_type;
@@ -425,7 +742,8 @@ void janus_sip_incoming_rtp(janus_pluginession *handle, int video, char *buf, in
 			JANUS_DEBUG("No session associated with this handle...\n");
 			return;
 		}
-		/* Forward to our SIP peer */
+		/* Forward to our SIP peer: the lock makes sure the socket isn't being closed meanwhile */
+		janus_mutex_lock(&session->mutex);
 		if(video) {
 			if(session->media.has_video && session->media.video_rtp_fd) {
 				send(session->media.video_rtp_fd, buf, len, 0);
@@ -435,6 +753,7 @@ void janus_sip_incoming_rtp(janus_pluginession *handle, int video, char *buf, in
 				send(session->media.audio_rtp_fd, buf, len, 0);
 			}
 		}
+		janus_mutex_unlock(&session->mutex);
 	}
 }
 
@@ -449,6 +768,7 @@ void janus_sip_incoming_rtcp(janus_pluginession *handle, int video, char *buf, i
 		}
 		/* Forward to our SIP peer */
 		/* TODO Fix SSRCs as the gateway does */
+		janus_mutex_lock(&session->mutex);
 		if(video) {
 			if(session->media.has_video && session->media.video_rtcp_fd) {
 				send(session->media.video_rtcp_fd, buf, len, 0);
@@ -458,6 +778,7 @@ void janus_sip_incoming_rtcp(janus_pluginession *handle, int video, char *buf, i
 				send(session->media.audio_rtcp_fd, buf, len, 0);
 			}
 		}
+		janus_mutex_unlock(&session->mutex);
 	}
 }
 
@@ -478,7 +799,9 @@ void janus_sip_hangup_media(janus_pluginession *handle) {
 		JANUS_DEBUG("Memory error!\n");
 		return;
 	}
+	janus_sip_session_ref(session);
 	msg->handle = handle;
+	msg->session = session;
 	msg->message = "{\"request\":\"hangup\"}";
 	msg->transaction = NULL;
 	msg->sdp_type = NULL;
@@ -500,13 +823,11 @@ static void *janus_sip_handler(void *data) {
 			usleep(50000);
 			continue;
 		}
-		janus_sip_session *session = (janus_sip_session *)msg->handle->plugin_handle;
-		if(!session) {
-			JANUS_DEBUG("No session associated with this handle...\n");
+		janus_sip_session *session = msg->session;
+		if(session->destroy) {
+			janus_sip_session_unref(session);
 			continue;
 		}
-		if(session->destroy)
-			continue;
 		/* Handle request */
 		JANUS_PRINT("Handling message: %s\n", msg->message);
 		if(msg->message == NULL) {
@@ -537,7 +858,7 @@ static void *janus_sip_handler(void *data) {
 		char *sdp_type = NULL, *sdp = NULL;
 		if(!strcasecmp(request_text, "register")) {
 			/* Send a REGISTER */
-			if(session->status > janus_sip_status_unregistered) {
+			if(janus_sip_status_get(session) > janus_sip_status_unregistered) {
 				JANUS_DEBUG("Already registered (%s)\n", session->account.username);
 				sprintf(error_cause, "Already registered (%s)", session->account.username);
 				goto error;
@@ -570,6 +891,20 @@ static void *janus_sip_handler(void *data) {
 				goto error;
 			}
 			int proxyport_value = json_integer_value(proxyport);
+			/* Incoming INVITEs for this user will be dispatched to this session, so
+			 * it can't be registered by another one (nor can it register twice) */
+			janus_mutex_lock(&identities_mutex);
+			janus_sip_session *owner = g_hash_table_lookup(identities, username_text);
+			if(owner != NULL && owner != session) {
+				janus_mutex_unlock(&identities_mutex);
+				JANUS_DEBUG("User %s already registered by another session\n", username_text);
+				sprintf(error_cause, "User %s already registered by another session", username_text);
+				goto error;
+			}
+			if(session->account.username != NULL && g_hash_table_lookup(identities, session->account.username) == session)
+				g_hash_table_remove(identities, session->account.username);
+			g_hash_table_insert(identities, g_strdup(username_text), session);
+			janus_mutex_unlock(&identities_mutex);
 			/* Got the values, try registering now */
 			JANUS_PRINT("Registering user %s (secret %s) @ %s:%d\n",
 				username_text, secret_text, proxyip_text, proxyport_value);
@@ -588,38 +923,29 @@ static void *janus_sip_handler(void *data) {
 				goto error;
 			}
 			session->account.proxy_port = proxyport_value;
-			session->status = janus_sip_status_registering;
-			if(session->stack->s_nua == NULL) {
-				/* Start the thread first */
-				GError *error = NULL;
-				g_thread_try_new("worker", janus_sip_sofia_thread, session, &error);
-				g_assert (!error);
-				long int timeout = 0;
-				while(session->stack->s_nua == NULL) {
-					g_usleep(100000);
-					timeout += 100000;
-					if(timeout >= 2000000) {
-						break;
-					}
-				}
-				if(timeout >= 2000000) {
-					JANUS_PRINT("Two seconds passed and still no NUA, problems with the thread?\n");
-					sprintf(error_cause, "Two seconds passed and still no NUA, problems with the thread?");
-					goto error;
-				}
-			}
-			if(session->stack->s_nh_r == NULL)
-				session->stack->s_nh_r = nua_handle(session->stack->s_nua, session, TAG_END());
-			if(session->stack->s_nh_r == NULL)
-				JANUS_PRINT("NUA Handle for REGISTER still null??\n");
+			/* We'll need the address of the server for the media of our calls */
+			janus_sip_address_prefetch(session->account.proxy_ip);
 			char regto[100];
 			memset(regto, 0, 100);
 			sprintf(regto, "sip:%s@%s:%d", session->account.username, session->account.proxy_ip, session->account.proxy_port);
+			janus_mutex_lock(&session->mutex);
+			if(session->destroy) {
+				janus_mutex_unlock(&session->mutex);
+				JANUS_DEBUG("Session destroyed\n");
+				sprintf(error_cause, "Session destroyed");
+				goto error;
+			}
+			session->status = janus_sip_status_registering;
+			if(session->s_nh_r == NULL)
+				session->s_nh_r = nua_handle(session->stack->s_nua, session, SIPTAG_FROM_STR(regto), TAG_END());
+			janus_mutex_unlock(&session->mutex);
+			if(session->s_nh_r == NULL)
+				JANUS_PRINT("NUA Handle for REGISTER still null??\n");
 			char proxy[100];
 			memset(proxy, 0, 100);
 			sprintf(proxy, "sip:%s:%d", session->account.proxy_ip, session->account.proxy_port);
 			JANUS_PRINT("%s --> %s\n", regto, proxy);
-			nua_register(session->stack->s_nh_r,
+			nua_register(session->s_nh_r,
 				NUTAG_M_DISPLAY(session->account.username),
 				NUTAG_M_USERNAME(session->account.username),
 				SIPTAG_TO_STR(regto),
@@ -629,7 +955,7 @@ static void *janus_sip_handler(void *data) {
 			json_object_set_new(result, "event", json_string("registering"));
 		} else if(!strcasecmp(request_text, "call")) {
 			/* Call another peer */
-			if(session->status >= janus_sip_status_inviting) {
+			if(janus_sip_status_get(session) >= janus_sip_status_inviting) {
 				JANUS_DEBUG("Wrong state (already in a call?)\n");
 				sprintf(error_cause, "Wrong state (already in a call?)");
 				goto error;
@@ -650,15 +976,16 @@ static void *janus_sip_handler(void *data) {
 			JANUS_PRINT("%s is calling %s\n", session->account.username, extension_text);
 			JANUS_PRINT("This is involving a negotiation (%s) as well:\n%s\n", msg->sdp_type, msg->sdp);
 			/* Allocate RTP ports and merge them with the anonymized SDP */
+			gboolean audio = FALSE, video = FALSE;
 			if(strstr(msg->sdp, "m=audio")) {
 				JANUS_PRINT("Going to negotiate audio...\n");
-				session->media.has_audio = 1;	/* FIXME Maybe we need a better way to signal this */
+				audio = TRUE;	/* FIXME Maybe we need a better way to signal this */
 			}
 			if(strstr(msg->sdp, "m=video")) {
 				JANUS_PRINT("Going to negotiate video...\n");
-				session->media.has_video = 1;	/* FIXME Maybe we need a better way to signal this */
+				video = TRUE;	/* FIXME Maybe we need a better way to signal this */
 			}
-			if(janus_sip_allocate_local_ports(session) < 0) {
+			if(janus_sip_allocate_local_ports(session, audio, video) < 0) {
 				JANUS_PRINT("Could not allocate RTP/RTCP ports\n");
 				sprintf(error_cause, "Could not allocate RTP/RTCP ports");
 				goto error;
@@ -697,29 +1024,48 @@ static void *janus_sip_handler(void *data) {
 				sdp = temp;
 			}
 			/* Send INVITE */
-			session->status = janus_sip_status_inviting;
 			char callee[100];
 			memset(callee, 0, 100);
 			sprintf(callee, "sip:%s@%s:%d", extension_text, session->account.proxy_ip, session->account.proxy_port);
-			if(session->stack->s_nh_i == NULL)
-				session->stack->s_nh_i = nua_handle(session->stack->s_nua, session, TAG_END());
-			if(session->stack->s_nh_i == NULL)
+			janus_mutex_lock(&session->mutex);
+			if(session->destroy || session->status >= janus_sip_status_inviting) {
+				/* We got destroyed, or an INVITE came in while we were preparing ours */
+				janus_mutex_unlock(&session->mutex);
+				g_free(sdp);
+				JANUS_DEBUG("Wrong state (already in a call?)\n");
+				sprintf(error_cause, "Wrong state (already in a call?)");
+				goto error;
+			}
+			session->status = janus_sip_status_inviting;
+			if(session->s_nh_i == NULL) {
+				char from[100];
+				memset(from, 0, 100);
+				sprintf(from, "sip:%s@%s:%d", session->account.username, session->account.proxy_ip, session->account.proxy_port);
+				session->s_nh_i = nua_handle(session->stack->s_nua, session, SIPTAG_FROM_STR(from), TAG_END());
+			}
+			if(session->s_nh_i == NULL)
 				JANUS_PRINT("NUA Handle for INVITE still null??\n");
-			nua_invite(session->stack->s_nh_i,
+			nua_invite(session->s_nh_i,
 				SIPTAG_TO_STR(callee),
 				SOATAG_USER_SDP_STR(sdp),
 				TAG_END());
+			g_free(session->callee);
 			session->callee = g_strdup(callee);
+			janus_mutex_unlock(&session->mutex);
 			/* Send an ack back */
 			result = json_object();
 			json_object_set_new(result, "event", json_string("calling"));
 		} else if(!strcasecmp(request_text, "accept")) {
-			if(session->status != janus_sip_status_invited) {
-				JANUS_DEBUG("Wrong state (not invited? state=%d)\n", session->status);
+			janus_mutex_lock(&session->mutex);
+			janus_sip_status status = session->status;
+			gboolean caller = (session->callee != NULL);
+			janus_mutex_unlock(&session->mutex);
+			if(status != janus_sip_status_invited) {
+				JANUS_DEBUG("Wrong state (not invited? state=%d)\n", status);
 				sprintf(error_cause, "Wrong state (not invited?)");
 				goto error;
 			}
-			if(session->callee == NULL) {
+			if(!caller) {
 				JANUS_DEBUG("Wrong state (no caller?)\n");
 				sprintf(error_cause, "Wrong state (no caller?)");
 				goto error;
@@ -731,18 +1077,18 @@ static void *janus_sip_handler(void *data) {
 				goto error;
 			}
 			/* Accept a call from another peer */
-			JANUS_PRINT("We're accepting the call from %s\n", session->callee);
 			JANUS_PRINT("This is involving a negotiation (%s) as well:\n%s\n", msg->sdp_type, msg->sdp);
 			/* Allocate RTP ports and merge them with the anonymized SDP */
+			gboolean audio = FALSE, video = FALSE;
 			if(strstr(msg->sdp, "m=audio")) {
 				JANUS_PRINT("Going to negotiate audio...\n");
-				session->media.has_audio = 1;	/* FIXME Maybe we need a better way to signal this */
+				audio = TRUE;	/* FIXME Maybe we need a better way to signal this */
 			}
 			if(strstr(msg->sdp, "m=video")) {
 				JANUS_PRINT("Going to negotiate video...\n");
-				session->media.has_video = 1;	/* FIXME Maybe we need a better way to signal this */
+				video = TRUE;	/* FIXME Maybe we need a better way to signal this */
 			}
-			if(janus_sip_allocate_local_ports(session) < 0) {
+			if(janus_sip_allocate_local_ports(session, audio, video) < 0) {
 				JANUS_PRINT("Could not allocate RTP/RTCP ports\n");
 				sprintf(error_cause, "Could not allocate RTP/RTCP ports");
 				goto error;
@@ -780,38 +1126,50 @@ static void *janus_sip_handler(void *data) {
 					g_free(sdp);
 				sdp = temp;
 			}
-			/* Send 200 OK */
+			/* Send 200 OK, unless the caller went away in the meanwhile */
+			janus_mutex_lock(&session->mutex);
+			if(session->status != janus_sip_status_invited || session->s_nh_i == NULL || session->callee == NULL) {
+				status = session->status;
+				janus_mutex_unlock(&session->mutex);
+				g_free(sdp);
+				JANUS_DEBUG("Wrong state (not invited anymore? state=%d)\n", status);
+				sprintf(error_cause, "Wrong state (not invited anymore?)");
+				goto error;
+			}
+			JANUS_PRINT("We're accepting the call from %s\n", session->callee);
 			session->status = janus_sip_status_incall;
-			//~ if(session->stack->s_nh_i == NULL)
-				//~ session->stack->s_nh_i = nua_handle(session->stack->s_nua, session, TAG_END());
-			if(session->stack->s_nh_i == NULL)
-				JANUS_PRINT("NUA Handle for 200 OK still null??\n");
-			nua_respond(session->stack->s_nh_i,
+			nua_respond(session->s_nh_i,
 				200, sip_status_phrase(200),
 				SIPTAG_TO_STR(session->callee),
 				SOATAG_USER_SDP_STR(sdp),
 				TAG_END());
+			janus_mutex_unlock(&session->mutex);
 			/* Send an ack back */
 			result = json_object();
 			json_object_set_new(result, "event", json_string("accepted"));
 		} else if(!strcasecmp(request_text, "hangup")) {
 			/* Hangup an ongoing call or reject an incoming one */
+			janus_mutex_lock(&session->mutex);
 			if(session->status < janus_sip_status_inviting || session->status > janus_sip_status_incall) {
-				JANUS_DEBUG("Wrong state (not in a call? state=%d)\n", session->status);
+				janus_sip_status status = session->status;
+				janus_mutex_unlock(&session->mutex);
+				JANUS_DEBUG("Wrong state (not in a call? state=%d)\n", status);
 				sprintf(error_cause, "Wrong state (not in a call?)");
 				goto error;
 			}
-			if(session->callee == NULL) {
+			if(session->callee == NULL || session->s_nh_i == NULL) {
+				janus_mutex_unlock(&session->mutex);
 				JANUS_DEBUG("Wrong state (no callee?)\n");
 				sprintf(error_cause, "Wrong state (no callee?)");
 				goto error;
 			}
 			session->status = janus_sip_status_closing;
-			nua_bye(session->stack->s_nh_i,
+			nua_bye(session->s_nh_i,
 				SIPTAG_TO_STR(session->callee),
 				TAG_END());
 			g_free(session->callee);
 			session->callee = NULL;
+			janus_mutex_unlock(&session->mutex);
 			/* Notify the operation */
 			result = json_object();
 			json_object_set_new(result, "event", json_string("hangingup"));
@@ -835,6 +1193,7 @@ static void *janus_sip_handler(void *data) {
 		JANUS_PRINT("  >> %d\n", gateway->push_event(msg->handle, &janus_sip_plugin, msg->transaction, event_text, sdp_type, sdp));
 		if(sdp)
 			g_free(sdp);
+		janus_sip_session_unref(session);
 		continue;
 		
 error:
@@ -849,6 +1208,7 @@ error:
 			json_decref(event);
 			JANUS_PRINT("Pushing event: %s\n", event_text);
 			JANUS_PRINT("  >> %d\n", gateway->push_event(msg->handle, &janus_sip_plugin, msg->transaction, event_text, NULL, NULL));
+			janus_sip_session_unref(session);
 		}
 	}
 	JANUS_DEBUG("Leaving thread\n");
@@ -859,8 +1219,23 @@ error:
 /* Sofia callbacks */
 void janus_sip_sofia_callback(nua_event_t event, int status, char const *phrase, nua_t *nua, nua_magic_t *magic, nua_handle_t *nh, nua_hmagic_t *hmagic, sip_t const *sip, tagi_t tags[])
 {
-	janus_sip_session *session = (janus_sip_session *)magic;
-	ssip_t *ssip = session->stack;
+	ssip_t *ssip = (ssip_t *)magic;
+	janus_sip_session *session = (janus_sip_session *)hmagic;
+	/* Events about calls and registrations are only meaningful if there's a session bound to the handle */
+	switch(event) {
+		case nua_i_bye:
+		case nua_i_cancel:
+		case nua_r_bye:
+		case nua_r_invite:
+		case nua_r_register:
+			if(session == NULL || session->destroy) {
+				JANUS_PRINT("[%s]: %d %s (no session, ignoring)\n", nua_event_name(event), status, phrase ? phrase : "??");
+				return;
+			}
+			break;
+		default:
+			break;
+	}
     switch (event) {
 	/* Status or Error Indications */
 		case nua_i_active:
@@ -894,7 +1269,8 @@ void janus_sip_sofia_callback(nua_event_t event, int status, char const *phrase,
 		case nua_i_bye: {
 			JANUS_PRINT("[%s]: %d %s\n", nua_event_name(event), status, phrase ? phrase : "??");
 			/* Call ended, notify the browser */
-			session->status = janus_sip_status_registered;	/* FIXME What about a 'closing' state? */
+			janus_sip_status_set(session, janus_sip_status_registered);	/* FIXME What about a 'closing' state? */
+			janus_sip_media_reset(session);
 			char reason[100];
 			memset(reason, 0, 100);
 			sprintf(reason, "%d %s", status, phrase);
@@ -902,7 +1278,9 @@ void janus_sip_sofia_callback(nua_event_t event, int status, char const *phrase,
 			json_object_set(call, "sip", json_string("event"));
 			json_t *calling = json_object();
 			json_object_set_new(calling, "event", json_string("hangup"));
+			janus_mutex_lock(&session->mutex);
 			json_object_set_new(calling, "username", json_string(session->callee));
+			janus_mutex_unlock(&session->mutex);
 			json_object_set_new(calling, "reason", json_string(reason));
 			json_object_set_new(call, "result", calling);
 			char *call_text = json_dumps(call, JSON_INDENT(3));
@@ -914,13 +1292,16 @@ void janus_sip_sofia_callback(nua_event_t event, int status, char const *phrase,
 		case nua_i_cancel: {
 			JANUS_PRINT("[%s]: %d %s\n", nua_event_name(event), status, phrase ? phrase : "??");
 			/* FIXME Check state? */
-			session->status = janus_sip_status_closing;
+			janus_sip_status_set(session, janus_sip_status_closing);
+			janus_sip_media_reset(session);
 			/* Notify the browser */
 			json_t *call = json_object();
 			json_object_set(call, "sip", json_string("event"));
 			json_t *calling = json_object();
 			json_object_set_new(calling, "event", json_string("hangup"));
+			janus_mutex_lock(&session->mutex);
 			json_object_set_new(calling, "username", json_string(session->callee));
+			janus_mutex_unlock(&session->mutex);
 			json_object_set_new(calling, "reason", json_string("Remote cancel"));
 			json_object_set_new(call, "result", calling);
 			char *call_text = json_dumps(call, JSON_INDENT(3));
@@ -941,21 +1322,73 @@ void janus_sip_sofia_callback(nua_event_t event, int status, char const *phrase,
 			break;
 		case nua_i_invite: {
 			JANUS_PRINT("[%s]: %d %s\n", nua_event_name(event), status, phrase ? phrase : "??");
-			sdp_parser_t *parser = sdp_parse(ssip->s_home, sip->sip_payload->pl_data, sip->sip_payload->pl_len, 0);
-			if (!sdp_session(parser)) {
-				JANUS_PRINT("\tError parsing SDP!\n");
-				nua_respond(nh, 488, sip_status_phrase(488), TAG_END());
-				break;
+			/* Keep the session around while we dispatch the call to it */
+			if(session == NULL) {
+				/* New call: which of our users is this for? */
+				const char *user = sip->sip_request ? sip->sip_request->rq_url->url_user : NULL;
+				if(user == NULL && sip->sip_to != NULL)
+					user = sip->sip_to->a_url->url_user;
+				janus_mutex_lock(&identities_mutex);
+				if(user != NULL)
+					session = g_hash_table_lookup(identities, user);
+				if(session != NULL)
+					janus_sip_session_ref(session);
+				janus_mutex_unlock(&identities_mutex);
+				if(session == NULL) {
+					JANUS_PRINT("\tNo session registered as %s\n", user ? user : "??");
+					nua_respond(nh, 404, sip_status_phrase(404), TAG_END());
+					nua_handle_destroy(nh);
+					break;
+				}
+			} else {
+				janus_sip_session_ref(session);
+			}
+			int code = 0;
+			if(sip->sip_payload == NULL) {
+				JANUS_PRINT("\tNo SDP in the INVITE!\n");
+				code = 488;
+			} else {
+				sdp_parser_t *parser = sdp_parse(ssip->s_home, sip->sip_payload->pl_data, sip->sip_payload->pl_len, 0);
+				if (!sdp_session(parser)) {
+					JANUS_PRINT("\tError parsing SDP!\n");
+					code = 488;
+				}
+				sdp_parser_free(parser);
 			}
-			if(session->status >= janus_sip_status_inviting) {
+			janus_mutex_lock(&session->mutex);
+			if(code == 0 && session->destroy) {
+				JANUS_PRINT("\tSession is going away\n");
+				code = 404;
+			} else if(code == 0 && session->status >= janus_sip_status_inviting) {
 				/* Busy */
 				JANUS_PRINT("\tAlready in a call (busy)\n");
-				nua_respond(nh, 486, sip_status_phrase(486), TAG_END());
+				code = 486;
+			}
+			if(code != 0) {
+				gboolean ours = (session->s_nh_i == nh);
+				janus_mutex_unlock(&session->mutex);
+				nua_respond(nh, code, sip_status_phrase(code), TAG_END());
+				if(!ours)
+					nua_handle_destroy(nh);
+				janus_sip_session_unref(session);
 				break;
 			}
+			/* Bind the call to the session, and get rid of the handle of the previous one, if any */
+			if(session->s_nh_i != nh) {
+				nua_handle_bind(nh, session);
+				if(session->s_nh_i != NULL) {
+					nua_handle_bind(session->s_nh_i, NULL);
+					nua_handle_destroy(session->s_nh_i);
+				}
+				session->s_nh_i = nh;
+			}
 			const char *caller = sip->sip_from->a_url->url_user;
-			session->callee = g_strdup(url_as_string(session->stack->s_home, sip->sip_from->a_url));
+			char *from = url_as_string(ssip->s_home, sip->sip_from->a_url);
+			g_free(session->callee);
+			session->callee = g_strdup(from);
+			su_free(ssip->s_home, from);
 			session->status = janus_sip_status_invited;
+			janus_mutex_unlock(&session->mutex);
 			/* Send SDP to the browser */
 			json_t *call = json_object();
 			json_object_set(call, "sip", json_string("event"));
@@ -969,7 +1402,7 @@ void janus_sip_sofia_callback(nua_event_t event, int status, char const *phrase,
 			JANUS_PRINT("  >> %d\n", gateway->push_event(session->handle, &janus_sip_plugin, NULL, call_text, "offer", sip->sip_payload->pl_data));
 			/* Send a Ringing back */
 			nua_respond(nh, 180, sip_status_phrase(180), TAG_END());
-			session->stack->s_nh_i = nh;
+			janus_sip_session_unref(session);
 			break;
 		}
 		case nua_i_message:
@@ -1039,7 +1472,6 @@ void janus_sip_sofia_callback(nua_event_t event, int status, char const *phrase,
 				break;
 			}
 			/* end the event loop. su_root_run() will return */
-			//~ su_root_break(magic->root);
 			su_root_break(ssip->s_root);
 			break;
 		case nua_r_terminate:
@@ -1049,7 +1481,8 @@ void janus_sip_sofia_callback(nua_event_t event, int status, char const *phrase,
 		case nua_r_bye:
 			JANUS_PRINT("[%s]: %d %s\n", nua_event_name(event), status, phrase ? phrase : "??");
 			/* Call ended, notify the browser */
-			session->status = janus_sip_status_registered;
+			janus_sip_status_set(session, janus_sip_status_registered);
+			janus_sip_media_reset(session);
 			char reason[100];
 			memset(reason, 0, 100);
 			sprintf(reason, "%d %s", status, phrase);
@@ -1057,7 +1490,9 @@ void janus_sip_sofia_callback(nua_event_t event, int status, char const *phrase,
 			json_object_set(call, "sip", json_string("event"));
 			json_t *calling = json_object();
 			json_object_set_new(calling, "event", json_string("hangup"));
+			janus_mutex_lock(&session->mutex);
 			json_object_set_new(calling, "username", json_string(session->callee));
+			janus_mutex_unlock(&session->mutex);
 			json_object_set_new(calling, "reason", json_string(reason));
 			json_object_set_new(call, "result", calling);
 			char *call_text = json_dumps(call, JSON_INDENT(3));
@@ -1092,7 +1527,8 @@ void janus_sip_sofia_callback(nua_event_t event, int status, char const *phrase,
 				break;
 			} else if(status >= 400) {
 				/* Something went wrong, notify the browser */
-				session->status = janus_sip_status_registered;
+				janus_sip_status_set(session, janus_sip_status_registered);
+				janus_sip_media_reset(session);
 				char reason[100];
 				memset(reason, 0, 100);
 				sprintf(reason, "%d %s", status, phrase);
@@ -1100,7 +1536,9 @@ void janus_sip_sofia_callback(nua_event_t event, int status, char const *phrase,
 				json_object_set(call, "sip", json_string("event"));
 				json_t *calling = json_object();
 				json_object_set_new(calling, "event", json_string("hangup"));
+				janus_mutex_lock(&session->mutex);
 				json_object_set_new(calling, "username", json_string(session->callee));
+				janus_mutex_unlock(&session->mutex);
 				json_object_set_new(calling, "reason", json_string(reason));
 				json_object_set_new(call, "result", calling);
 				char *call_text = json_dumps(call, JSON_INDENT(3));
@@ -1109,36 +1547,42 @@ void janus_sip_sofia_callback(nua_event_t event, int status, char const *phrase,
 				JANUS_PRINT("  >> %d\n", gateway->push_event(session->handle, &janus_sip_plugin, NULL, call_text, NULL, NULL));
 				break;
 			}
-			ssip_t *ssip = session->stack;
+			if(sip->sip_payload == NULL) {
+				JANUS_PRINT("\tNo SDP in the answer!\n");
+				nua_respond(nh, 488, sip_status_phrase(488), TAG_END());
+				break;
+			}
 			sdp_parser_t *parser = sdp_parse(ssip->s_home, sip->sip_payload->pl_data, sip->sip_payload->pl_len, 0);
 			if (!sdp_session(parser)) {
 				JANUS_PRINT("\tError parsing SDP!\n");
+				sdp_parser_free(parser);
 				nua_respond(nh, 488, sip_status_phrase(488), TAG_END());
 				break;
 			}
 			JANUS_PRINT("Peer accepted our call:\n%s", sip->sip_payload->pl_data);
-			session->status = janus_sip_status_incall;
 			char *fixed_sdp = g_strdup(sip->sip_payload->pl_data);
 			if(fixed_sdp == NULL) {
 				JANUS_DEBUG("Memory error!\n");
+				sdp_parser_free(parser);
 				nua_respond(nh, 500, sip_status_phrase(500), TAG_END());
 				break;
 			}
 			sdp_session_t *sdp = sdp_session(parser);
 			janus_sip_sdp_process(session, sdp);
+			sdp_parser_free(parser);
 			session->media.ready = 1;	/* FIXME Maybe we need a better way to signal this */
-			GError *error = NULL;
-			g_thread_try_new("janus rtp handler", janus_sip_relay_thread, session, &error);
-			if(error) {
-				JANUS_PRINT("Error starting RTP/RTCP thread?\n");
+			if(janus_sip_relay_add(session) < 0) {
+				JANUS_PRINT("Error relaying RTP/RTCP for this call?\n");
 			}
 			/* Send SDP to the browser */
-			session->status = janus_sip_status_incall;
+			janus_sip_status_set(session, janus_sip_status_incall);
 			json_t *call = json_object();
 			json_object_set(call, "sip", json_string("event"));
 			json_t *calling = json_object();
 			json_object_set_new(calling, "event", json_string("accepted"));
+			janus_mutex_lock(&session->mutex);
 			json_object_set_new(calling, "username", json_string(session->callee));
+			janus_mutex_unlock(&session->mutex);
 			json_object_set_new(call, "result", calling);
 			char *call_text = json_dumps(call, JSON_INDENT(3));
 			json_decref(call);
@@ -1167,8 +1611,10 @@ void janus_sip_sofia_callback(nua_event_t event, int status, char const *phrase,
 		case nua_r_register: {
 			JANUS_PRINT("[%s]: %d %s\n", nua_event_name(event), status, phrase ? phrase : "??");
 			if(status == 200) {
+				janus_mutex_lock(&session->mutex);
 				if(session->status < janus_sip_status_registered)
 					session->status = janus_sip_status_registered;
+				janus_mutex_unlock(&session->mutex);
 				JANUS_PRINT("Successfully registered\n");
 				/* Notify the browser */
 				json_t *call = json_object();
@@ -1196,7 +1642,7 @@ void janus_sip_sofia_callback(nua_event_t event, int status, char const *phrase,
 					TAG_END());
 			} else {
 				/* Authentication failed? */
-				session->status = janus_sip_status_failed;
+				janus_sip_status_set(session, janus_sip_status_failed);
 				/* TODO Tell the browser... */
 			}
 			break;
@@ -1268,329 +1714,421 @@ void janus_sip_sdp_process(janus_sip_session *session, sdp_session_t *sdp) {
 	}
 }
 
+/* Helper to bind an RTP/RTCP pair of sockets on the next free ports of the configured range */
+static int janus_sip_bind_port_pair(const char *media, int *rtp_fd, int *rtcp_fd, int *rtp_port, int *rtcp_port) {
+	int attempts = (rtp_range_max-rtp_range_min+1)/2;
+	int yes = 1;	/* For setsockopt() SO_REUSEADDR */
+	struct sockaddr_in address;
+	janus_mutex_lock(&ports_mutex);
+	while(attempts > 0) {
+		attempts--;
+		int port = rtp_range_next;
+		rtp_range_next += 2;
+		if(rtp_range_next+1 > rtp_range_max)
+			rtp_range_next = rtp_range_min;
+		int fd = socket(AF_INET, SOCK_DGRAM, 0);
+		int cfd = socket(AF_INET, SOCK_DGRAM, 0);
+		if(fd < 0 || cfd < 0) {
+			JANUS_DEBUG("Error creating %s sockets...\n", media);
+			if(fd >= 0)
+				close(fd);
+			if(cfd >= 0)
+				close(cfd);
+			break;
+		}
+		setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(int));
+		setsockopt(cfd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(int));
+		memset(&address, 0, sizeof(address));
+		address.sin_family = AF_INET;
+		address.sin_addr.s_addr = INADDR_ANY;
+		address.sin_port = htons(port);
+		if(bind(fd, (struct sockaddr *)(&address), sizeof(struct sockaddr)) < 0) {
+			close(fd);
+			close(cfd);
+			continue;
+		}
+		address.sin_port = htons(port+1);
+		if(bind(cfd, (struct sockaddr *)(&address), sizeof(struct sockaddr)) < 0) {
+			close(fd);
+			close(cfd);
+			continue;
+		}
+		janus_mutex_unlock(&ports_mutex);
+		/* The relay threads read in batches until there's nothing left */
+		fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
+		fcntl(cfd, F_SETFL, fcntl(cfd, F_GETFL, 0) | O_NONBLOCK);
+		JANUS_PRINT("%s RTP/RTCP listeners bound to ports %d/%d\n", media, port, port+1);
+		*rtp_fd = fd;
+		*rtcp_fd = cfd;
+		*rtp_port = port;
+		*rtcp_port = port+1;
+		return 0;
+	}
+	janus_mutex_unlock(&ports_mutex);
+	JANUS_PRINT("No free %s RTP/RTCP ports in the %d-%d range\n", media, rtp_range_min, rtp_range_max);
+	return -1;
+}
+
 /* Bind local RTP/RTCP sockets */
-static int janus_sip_allocate_local_ports(janus_sip_session *session) {
+static int janus_sip_allocate_local_ports(janus_sip_session *session, gboolean audio, gboolean video) {
 	if(session == NULL) {
 		JANUS_PRINT("Invalid session\n");
 		return -1;
 	}
-	//~ /* Reset status */
-	//~ session->media.ready = 0;
-	//~ session->media.has_audio = 0;
-	//~ session->media.audio_rtp_fd = 0;
-	//~ session->media.audio_rtcp_fd= 0;
-	//~ session->media.local_audio_rtp_port = 0;
-	//~ session->media.remote_audio_rtp_port = 0;
-	//~ session->media.local_audio_rtcp_port = 0;
-	//~ session->media.remote_audio_rtcp_port = 0;
-	//~ session->media.has_video = 0;
-	//~ session->media.video_rtp_fd = 0;
-	//~ session->media.video_rtcp_fd= 0;
-	//~ session->media.local_video_rtp_port = 0;
-	//~ session->media.remote_video_rtp_port = 0;
-	//~ session->media.local_video_rtcp_port = 0;
-	//~ session->media.remote_video_rtcp_port = 0;
-	/* Start */
-	int attempts = 100;	/* FIXME Don't retry forever */
-	if(session->media.has_audio) {
+	/* Binding is quick, and this way a session being destroyed can't get new sockets */
+	janus_mutex_lock(&session->mutex);
+	if(session->destroy) {
+		janus_mutex_unlock(&session->mutex);
+		return -1;
+	}
+	if(audio)
+		session->media.has_audio = 1;
+	if(video)
+		session->media.has_video = 1;
+	if(session->media.has_audio && session->media.local_audio_rtp_port == 0) {
 		JANUS_PRINT("Allocating audio ports:\n");
-		struct sockaddr_in audio_rtp_address, audio_rtcp_address;
-		int yes = 1;	/* For setsockopt() SO_REUSEADDR */
-		while(session->media.local_audio_rtp_port == 0 || session->media.local_audio_rtcp_port == 0) {
-			if(attempts == 0)	/* Too many failures */
-				return -1;
-			if(session->media.audio_rtp_fd == 0) {
-				yes = 1;
-				session->media.audio_rtp_fd = socket(AF_INET, SOCK_DGRAM, 0);
-				setsockopt(session->media.audio_rtp_fd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(int));
-			}
-			if(session->media.audio_rtcp_fd == 0) {
-				yes = 1;
-				session->media.audio_rtcp_fd = socket(AF_INET, SOCK_DGRAM, 0);
-				setsockopt(session->media.audio_rtcp_fd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(int));
-			}
-			int rtp_port = g_random_int_range(10000, 60000);	/* FIXME Should this be configurable? */
-			if(rtp_port % 2)
-				rtp_port++;	/* Pick an even port for RTP */
-			audio_rtp_address.sin_family = AF_INET;
-			audio_rtp_address.sin_port = htons(rtp_port);
-			audio_rtp_address.sin_addr.s_addr = INADDR_ANY;
-			if(bind(session->media.audio_rtp_fd, (struct sockaddr *)(&audio_rtp_address), sizeof(struct sockaddr)) < 0) {
-				JANUS_PRINT("Bind failed for audio RTP (port %d), trying a different one...\n", rtp_port);
-				attempts--;
-				continue;
-			}
-			JANUS_PRINT("Audio RTP listener bound to port %d\n", rtp_port);
-			int rtcp_port = rtp_port+1;
-			audio_rtcp_address.sin_family = AF_INET;
-			audio_rtcp_address.sin_port = htons(rtcp_port);
-			audio_rtcp_address.sin_addr.s_addr = INADDR_ANY;
-			if(bind(session->media.audio_rtcp_fd, (struct sockaddr *)(&audio_rtcp_address), sizeof(struct sockaddr)) < 0) {
-				JANUS_PRINT("Bind failed for audio RTCP (port %d), trying a different one...\n", rtcp_port);
-				/* RTP socket is not valid anymore, reset it */
-				close(session->media.audio_rtp_fd);
-				session->media.audio_rtp_fd = 0;
-				attempts--;
-				continue;
-			}
-			JANUS_PRINT("Audio RTCP listener bound to port %d\n", rtcp_port);
-			session->media.local_audio_rtp_port = rtp_port;
-			session->media.local_audio_rtcp_port = rtcp_port;
+		if(janus_sip_bind_port_pair("Audio", &session->media.audio_rtp_fd, &session->media.audio_rtcp_fd,
+				&session->media.local_audio_rtp_port, &session->media.local_audio_rtcp_port) < 0) {
+			janus_mutex_unlock(&session->mutex);
+			return -1;
 		}
 	}
-	if(session->media.has_video) {
+	if(session->media.has_video && session->media.local_video_rtp_port == 0) {
 		JANUS_PRINT("Allocating video ports:\n");
-		struct sockaddr_in video_rtp_address, video_rtcp_address;
-		int yes = 1;	/* For setsockopt() SO_REUSEADDR */
-		while(session->media.local_video_rtp_port == 0 || session->media.local_video_rtcp_port == 0) {
-			if(attempts == 0)	/* Too many failures */
-				return -1;
-			if(session->media.video_rtp_fd == 0) {
-				yes = 1;
-				session->media.video_rtp_fd = socket(AF_INET, SOCK_DGRAM, 0);
-				setsockopt(session->media.video_rtp_fd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(int));
-			}
-			if(session->media.video_rtcp_fd == 0) {
-				yes = 1;
-				session->media.video_rtcp_fd = socket(AF_INET, SOCK_DGRAM, 0);
-				setsockopt(session->media.video_rtcp_fd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(int));
-			}
-			int rtp_port = g_random_int_range(10000, 60000);	/* FIXME Should this be configurable? */
-			if(rtp_port % 2)
-				rtp_port++;	/* Pick an even port for RTP */
-			video_rtp_address.sin_family = AF_INET;
-			video_rtp_address.sin_port = htons(rtp_port);
-			video_rtp_address.sin_addr.s_addr = INADDR_ANY;
-			if(bind(session->media.video_rtp_fd, (struct sockaddr *)(&video_rtp_address), sizeof(struct sockaddr)) < 0) {
-				JANUS_PRINT("Bind failed for video RTP (port %d), trying a different one...\n", rtp_port);
-				attempts--;
-				continue;
-			}
-			JANUS_PRINT("Audio RTP listener bound to port %d\n", rtp_port);
-			int rtcp_port = rtp_port+1;
-			video_rtcp_address.sin_family = AF_INET;
-			video_rtcp_address.sin_port = htons(rtcp_port);
-			video_rtcp_address.sin_addr.s_addr = INADDR_ANY;
-			if(bind(session->media.video_rtcp_fd, (struct sockaddr *)(&video_rtcp_address), sizeof(struct sockaddr)) < 0) {
-				JANUS_PRINT("Bind failed for video RTCP (port %d), trying a different one...\n", rtcp_port);
-				/* RTP socket is not valid anymore, reset it */
-				close(session->media.video_rtp_fd);
-				session->media.video_rtp_fd = 0;
-				attempts--;
-				continue;
-			}
-			JANUS_PRINT("Audio RTCP listener bound to port %d\n", rtcp_port);
-			session->media.local_video_rtp_port = rtp_port;
-			session->media.local_video_rtcp_port = rtcp_port;
+		if(janus_sip_bind_port_pair("Video", &session->media.video_rtp_fd, &session->media.video_rtcp_fd,
+				&session->media.local_video_rtp_port, &session->media.local_video_rtcp_port) < 0) {
+			janus_mutex_unlock(&session->mutex);
+			return -1;
 		}
 	}
+	janus_mutex_unlock(&session->mutex);
 	return 0;
 }
 
-/* Thread to relay RTP/RTCP frames coming from the SIP peer */
-static void *janus_sip_relay_thread(void *data) {
-	janus_sip_session *session = (janus_sip_session *)data;
-	if(!session || !session->account.username || !session->callee)
-		return NULL;
-	JANUS_PRINT("Starting relay thread (%s <--> %s)\n", session->account.username, session->callee);
-	/* Socket stuff */
-	int maxfd = 0;
-	if(session->media.audio_rtp_fd > maxfd)
-		maxfd = session->media.audio_rtp_fd;
-	if(session->media.audio_rtcp_fd > maxfd)
-		maxfd = session->media.audio_rtcp_fd;
-	if(session->media.video_rtp_fd > maxfd)
-		maxfd = session->media.video_rtp_fd;
-	if(session->media.video_rtcp_fd > maxfd)
-		maxfd = session->media.video_rtcp_fd;
-	//~ /* Wait for the remote information */
-	//~ while(!session->media.ready) {
-		//~ 
-	//~ }
-	/* Connect peers (FIXME This pretty much sucks right now) */
-	if(session->media.remote_audio_rtp_port) {
-		struct sockaddr_in server_addr;
-		server_addr.sin_family = AF_INET;
-		if((inet_aton(session->account.proxy_ip, &server_addr.sin_addr)) <= 0) {	/* Not a numeric IP... */
-			struct hostent *host = gethostbyname(session->account.proxy_ip);	/* ...resolve name */
-			if(!host) {
-				JANUS_PRINT("Couldn't get host (%s)\n", session->account.proxy_ip);
-			} else {
-				server_addr.sin_addr = *(struct in_addr *)host->h_addr_list;
-			}
-		}
-		server_addr.sin_port = htons(session->media.remote_audio_rtp_port);
-		memset(&(server_addr.sin_zero), '\0', 8);
-		if(connect(session->media.audio_rtp_fd, (struct sockaddr *)&server_addr, sizeof(struct sockaddr)) == -1) {
-			JANUS_PRINT("Couldn't connect audio RTP? (%s:%d)\n", session->account.proxy_ip, session->media.remote_audio_rtp_port);
-			JANUS_PRINT("  -- %d (%s)\n", errno, strerror(errno));
-		}
+/* Helper to connect the sockets of a call to the SIP peer, and hand them to the least busy relay thread */
+static int janus_sip_relay_add(janus_sip_session *session) {
+	if(session == NULL)
+		return 0;
+	struct in_addr addr;
+	if(janus_sip_address_lookup(session->account.proxy_ip, &addr) < 0) {
+		JANUS_PRINT("Address of %s not available (yet?), can't relay the media\n", session->account.proxy_ip);
+		return -1;
 	}
-	if(session->media.remote_audio_rtcp_port) {
-		struct sockaddr_in server_addr;
-		server_addr.sin_family = AF_INET;
-		if((inet_aton(session->account.proxy_ip, &server_addr.sin_addr)) <= 0) {	/* Not a numeric IP... */
-			struct hostent *host = gethostbyname(session->account.proxy_ip);	/* ...resolve name */
-			if(!host) {
-				JANUS_PRINT("Couldn't get host (%s)\n", session->account.proxy_ip);
-			} else {
-				server_addr.sin_addr = *(struct in_addr *)host->h_addr_list;
-			}
-		}
-		server_addr.sin_port = htons(session->media.remote_audio_rtcp_port);
-		memset(&(server_addr.sin_zero), '\0', 8);
-		if(connect(session->media.audio_rtcp_fd, (struct sockaddr *)&server_addr, sizeof(struct sockaddr)) == -1) {
-			JANUS_PRINT("Couldn't connect audio RTCP? (%s:%d)\n", session->account.proxy_ip, session->media.remote_audio_rtcp_port);
+	/* A session being destroyed must not get its sockets back in a relay thread */
+	janus_mutex_lock(&session->mutex);
+	if(session->destroy || session->media.relaying) {
+		gboolean destroyed = session->destroy;
+		janus_mutex_unlock(&session->mutex);
+		return destroyed ? -1 : 0;
+	}
+	guint i = 0, target = 0;
+	for(i=1; i<relay_threads_num; i++) {
+		if(relay_threads[i].sockets < relay_threads[target].sockets)
+			target = i;
+	}
+	janus_sip_relay *relay = &relay_threads[target];
+	int fds[4] = { session->media.audio_rtp_fd, session->media.audio_rtcp_fd,
+		session->media.video_rtp_fd, session->media.video_rtcp_fd };
+	int ports[4] = { session->media.remote_audio_rtp_port, session->media.remote_audio_rtcp_port,
+		session->media.remote_video_rtp_port, session->media.remote_video_rtcp_port };
+	struct sockaddr_in server_addr;
+	memset(&server_addr, 0, sizeof(server_addr));
+	server_addr.sin_family = AF_INET;
+	server_addr.sin_addr = addr;
+	struct epoll_event event;
+	memset(&event, 0, sizeof(event));
+	event.events = EPOLLIN;
+	janus_mutex_lock(&relay->mutex);
+	for(i=0; i<4; i++) {
+		janus_sip_relay_socket *relay_socket = &session->media.relay_sockets[i];
+		relay_socket->session = session;
+		relay_socket->fd = -1;
+		relay_socket->video = (i > 1);
+		relay_socket->rtcp = (i % 2);
+		if(fds[i] <= 0 || ports[i] == 0)
+			continue;
+		/* Connected sockets: we can just send() what the browser gives us */
+		server_addr.sin_port = htons(ports[i]);
+		if(connect(fds[i], (struct sockaddr *)&server_addr, sizeof(struct sockaddr)) < 0) {
+			JANUS_PRINT("Couldn't connect %s %s? (%s:%d)\n", i > 1 ? "video" : "audio", i % 2 ? "RTCP" : "RTP", session->account.proxy_ip, ports[i]);
 			JANUS_PRINT("  -- %d (%s)\n", errno, strerror(errno));
+			continue;
 		}
-	}
-	if(session->media.remote_video_rtp_port) {
-		struct sockaddr_in server_addr;
-		server_addr.sin_family = AF_INET;
-		if((inet_aton(session->account.proxy_ip, &server_addr.sin_addr)) <= 0) {	/* Not a numeric IP... */
-			struct hostent *host = gethostbyname(session->account.proxy_ip);	/* ...resolve name */
-			if(!host) {
-				JANUS_PRINT("Couldn't get host (%s)\n", session->account.proxy_ip);
-			} else {
-				server_addr.sin_addr = *(struct in_addr *)host->h_addr_list;
-			}
+		event.data.ptr = relay_socket;
+		if(epoll_ctl(relay->epoll_fd, EPOLL_CTL_ADD, fds[i], &event) < 0) {
+			JANUS_PRINT("Couldn't add %s %s socket to the relay thread? %d (%s)\n", i > 1 ? "video" : "audio", i % 2 ? "RTCP" : "RTP", errno, strerror(errno));
+			continue;
 		}
-		server_addr.sin_port = htons(session->media.remote_video_rtp_port);
-		memset(&(server_addr.sin_zero), '\0', 8);
-		if(connect(session->media.video_rtp_fd, (struct sockaddr *)&server_addr, sizeof(struct sockaddr)) == -1) {
-			JANUS_PRINT("Couldn't connect video RTP? (%s:%d)\n", session->account.proxy_ip, session->media.remote_video_rtp_port);
-			JANUS_PRINT("  -- %d (%s)\n", errno, strerror(errno));
+		relay_socket->fd = fds[i];
+		relay->sockets++;
+	}
+	session->media.relay = target;
+	session->media.relaying = TRUE;
+	janus_mutex_unlock(&relay->mutex);
+	JANUS_PRINT("Relaying media (%s <--> %s) on relay thread #%u\n", session->account.username, session->callee, target);
+	janus_mutex_unlock(&session->mutex);
+	return 0;
+}
+
+/* Helper to wait for a relay thread to be done with the events it may have
+ * got for a call before its sockets were removed, which is needed before
+ * freeing the session: the thread is either handling a batch, or waiting
+ * for new events (which it won't get for those sockets anymore), in which
+ * case we wake it up so that we only ever wait for one batch at most */
+static void janus_sip_relay_sync(guint index) {
+	janus_sip_relay *relay = &relay_threads[index];
+	if(relay->thread == NULL)
+		return;
+	gint batches = g_atomic_int_get(&relay->batches);
+	janus_sip_relay_wake(index);
+	while(!stopping && g_atomic_int_get(&relay->batches) == batches)
+		g_usleep(1000);
+}
+
+/* Helper to get a relay thread out of epoll_wait */
+static void janus_sip_relay_wake(guint index) {
+	janus_sip_relay *relay = &relay_threads[index];
+	if(relay->thread == NULL)
+		return;
+	uint64_t one = 1;
+	if(write(relay->wake_fd, &one, sizeof(one)) < 0 && errno != EAGAIN)
+		JANUS_DEBUG("Error waking up relay thread #%u: %d (%s)\n", index, errno, strerror(errno));
+}
+
+/* Helper to stop relaying the media of a call and close its sockets, so that the next call starts from scratch */
+static void janus_sip_media_reset(janus_sip_session *session) {
+	if(session == NULL)
+		return;
+	janus_mutex_lock(&session->mutex);
+	if(session->media.relaying) {
+		janus_sip_relay *relay = &relay_threads[session->media.relay];
+		janus_mutex_lock(&relay->mutex);
+		int i = 0;
+		for(i=0; i<4; i++) {
+			janus_sip_relay_socket *relay_socket = &session->media.relay_sockets[i];
+			if(relay_socket->fd < 0)
+				continue;
+			epoll_ctl(relay->epoll_fd, EPOLL_CTL_DEL, relay_socket->fd, NULL);
+			relay_socket->fd = -1;
+			relay->sockets--;
 		}
+		session->media.relaying = FALSE;
+		janus_mutex_unlock(&relay->mutex);
 	}
-	if(session->media.remote_video_rtcp_port) {
-		struct sockaddr_in server_addr;
-		server_addr.sin_family = AF_INET;
-		if((inet_aton(session->account.proxy_ip, &server_addr.sin_addr)) <= 0) {	/* Not a numeric IP... */
-			struct hostent *host = gethostbyname(session->account.proxy_ip);	/* ...resolve name */
-			if(!host) {
-				JANUS_PRINT("Couldn't get host (%s)\n", session->account.proxy_ip);
-			} else {
-				server_addr.sin_addr = *(struct in_addr *)host->h_addr_list;
+	/* The browser may still be sending us something: forget about the sockets before closing them */
+	int fds[4] = { session->media.audio_rtp_fd, session->media.audio_rtcp_fd,
+		session->media.video_rtp_fd, session->media.video_rtcp_fd };
+	session->media.ready = 0;
+	session->media.has_audio = 0;
+	session->media.audio_rtp_fd = 0;
+	session->media.audio_rtcp_fd = 0;
+	session->media.local_audio_rtp_port = 0;
+	session->media.remote_audio_rtp_port = 0;
+	session->media.local_audio_rtcp_port = 0;
+	session->media.remote_audio_rtcp_port = 0;
+	session->media.has_video = 0;
+	session->media.video_rtp_fd = 0;
+	session->media.video_rtcp_fd = 0;
+	session->media.local_video_rtp_port = 0;
+	session->media.remote_video_rtp_port = 0;
+	session->media.local_video_rtcp_port = 0;
+	session->media.remote_video_rtcp_port = 0;
+	/* Nobody can send on them anymore: only whoever took them out of the session closes them */
+	janus_mutex_unlock(&session->mutex);
+	int i = 0;
+	for(i=0; i<4; i++) {
+		if(fds[i] > 0)
+			close(fds[i]);
+	}
+}
+
+/* Thread to relay RTP/RTCP frames coming from the SIP peers of all the calls assigned to it */
+static void *janus_sip_relay_thread(void *data) {
+	janus_sip_relay *relay = (janus_sip_relay *)data;
+	JANUS_DEBUG("Starting relay thread\n");
+	/* Buffers for a batch of packets, reused for each recvmmsg */
+	char *buffers = calloc(JANUS_SIP_RELAY_BATCH, JANUS_SIP_RTP_BUFSIZE);
+	if(buffers == NULL) {
+		JANUS_DEBUG("Memory error!\n");
+		return NULL;
+	}
+	struct mmsghdr msgs[JANUS_SIP_RELAY_BATCH];
+	struct iovec iovecs[JANUS_SIP_RELAY_BATCH];
+	struct epoll_event events[JANUS_SIP_RELAY_BATCH];
+	int i = 0, j = 0;
+	memset(msgs, 0, sizeof(msgs));
+	for(i=0; i<JANUS_SIP_RELAY_BATCH; i++) {
+		iovecs[i].iov_base = buffers + i*JANUS_SIP_RTP_BUFSIZE;
+		iovecs[i].iov_len = JANUS_SIP_RTP_BUFSIZE;
+		msgs[i].msg_hdr.msg_iov = &iovecs[i];
+		msgs[i].msg_hdr.msg_iovlen = 1;
+	}
+	uint64_t wakeups = 0;
+	while(!stopping) {
+		/* Wait for some data (or for someone to wake us up) */
+		int ready = epoll_wait(relay->epoll_fd, events, JANUS_SIP_RELAY_BATCH, 1000);
+		if(ready < 0) {
+			if(errno == EINTR) {
+				g_atomic_int_inc(&relay->batches);
+				continue;
 			}
+			JANUS_DEBUG("Error waiting for RTP/RTCP packets: %d (%s)\n", errno, strerror(errno));
+			break;
 		}
-		server_addr.sin_port = htons(session->media.remote_video_rtcp_port);
-		memset(&(server_addr.sin_zero), '\0', 8);
-		if(connect(session->media.video_rtcp_fd, (struct sockaddr *)&server_addr, sizeof(struct sockaddr)) == -1) {
-			JANUS_PRINT("Couldn't connect video RTCP? (%s:%d)\n", session->account.proxy_ip, session->media.remote_video_rtcp_port);
-			JANUS_PRINT("  -- %d (%s)\n", errno, strerror(errno));
+		for(i=0; i<ready; i++) {
+			janus_sip_relay_socket *relay_socket = (janus_sip_relay_socket *)events[i].data.ptr;
+			if(relay_socket == NULL) {
+				/* Woken up by janus_sip_relay_sync or janus_sip_destroy */
+				if(read(relay->wake_fd, &wakeups, sizeof(wakeups)) < 0 && errno != EAGAIN)
+					JANUS_DEBUG("Error reading the wakeup eventfd: %d (%s)\n", errno, strerror(errno));
+				continue;
+			}
+			/* Read as many packets as we can in one go: we only need the lock for
+			 * that, as the session itself can't go away before this batch is over */
+			janus_mutex_lock(&relay->mutex);
+			if(relay_socket->fd < 0) {
+				/* Removed in the meanwhile */
+				janus_mutex_unlock(&relay->mutex);
+				continue;
+			}
+			int packets = recvmmsg(relay_socket->fd, msgs, JANUS_SIP_RELAY_BATCH, MSG_DONTWAIT, NULL);
+			janus_pluginession *handle = relay_socket->session->handle;
+			gboolean video = relay_socket->video, rtcp = relay_socket->rtcp;
+			janus_mutex_unlock(&relay->mutex);
+			/* Relay them to the browser */
+			for(j=0; j<packets; j++) {
+				if(rtcp)
+					gateway->relay_rtcp(handle, video, (char *)iovecs[j].iov_base, msgs[j].msg_len);
+				else
+					gateway->relay_rtp(handle, video, (char *)iovecs[j].iov_base, msgs[j].msg_len);
+			}
 		}
+		g_atomic_int_inc(&relay->batches);
 	}
+	free(buffers);
+	JANUS_DEBUG("Leaving relay thread\n");
+	return NULL;
+}
 
-	if(!session->callee) {
-		JANUS_DEBUG("Leaving thread, no callee...\n");
-		return NULL; 
-	}
-	/* Loop */
-	socklen_t addrlen;
-	struct sockaddr_in remote;
-	int resfd = 0, bytes = 0;
-	struct timeval timeout;
-	fd_set readfds;
-	FD_ZERO(&readfds);
-	char buffer[1500];
-	memset(buffer, 0, 1500);
-	while(session->callee) {	/* FIXME We need a per-call watchdog as well */
-		/* Wait for some data */
-		if(session->media.audio_rtp_fd > 0)
-			FD_SET(session->media.audio_rtp_fd, &readfds);
-		if(session->media.audio_rtcp_fd > 0)
-			FD_SET(session->media.audio_rtcp_fd, &readfds);
-		if(session->media.video_rtp_fd > 0)
-			FD_SET(session->media.video_rtp_fd, &readfds);
-		if(session->media.video_rtcp_fd > 0)
-			FD_SET(session->media.video_rtcp_fd, &readfds);
-		timeout.tv_sec = 1;
-		timeout.tv_usec = 0;
-		resfd = select(maxfd+1, &readfds, NULL, NULL, &timeout);
-		if(resfd < 0)
-			break;
-		if(session->media.audio_rtp_fd && FD_ISSET(session->media.audio_rtp_fd, &readfds)) {
-			/* Got something audio (RTP) */
-			addrlen = sizeof(remote);
-			bytes = recvfrom(session->media.audio_rtp_fd, buffer, 1500, 0, (struct sockaddr*)&remote, &addrlen);
-			//~ JANUS_PRINT("************************\nGot %d bytes on the audio RTP channel...\n", bytes);
-			//~ rtp_header_t *rtp = (rtp_header_t *)buffer;
-			//~ JANUS_PRINT(" ... parsed RTP packet (ssrc=%u, pt=%u, seq=%u, ts=%u)...\n",
-				//~ ntohl(rtp->ssrc), rtp->type, ntohs(rtp->seq_number), ntohl(rtp->timestamp));
-			/* Relay to browser */
-			gateway->relay_rtp(session->handle, 0, buffer, bytes);
-			continue;
+/* Resolver thread pool callback: resolves the address of a SIP server */
+static void janus_sip_address_resolve(gpointer data, gpointer user_data) {
+	janus_sip_address *address = (janus_sip_address *)data;
+	struct addrinfo hints, *result = NULL;
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_INET;	/* TODO IPv6! */
+	hints.ai_socktype = SOCK_DGRAM;
+	int res = getaddrinfo(address->name, NULL, &hints, &result);
+	janus_mutex_lock(&addresses_mutex);
+	if(res != 0 || result == NULL) {
+		JANUS_PRINT("Couldn't resolve %s: %s\n", address->name, gai_strerror(res));
+		if(address->refreshing) {
+			/* Better a stale address than none: try again in a bit */
+			address->expires = g_get_monotonic_time() + (gint64)JANUS_SIP_ADDRESS_RETRY*G_USEC_PER_SEC;
+		} else {
+			g_atomic_int_set(&address->resolved, -1);
 		}
-		if(session->media.audio_rtcp_fd && FD_ISSET(session->media.audio_rtcp_fd, &readfds)) {
-			/* Got something audio (RTCP) */
-			addrlen = sizeof(remote);
-			bytes = recvfrom(session->media.audio_rtcp_fd, buffer, 1500, 0, (struct sockaddr*)&remote, &addrlen);
-			//~ JANUS_PRINT("************************\nGot %d bytes on the audio RTCP channel...\n", bytes);
-			//~ rtp_header_t *rtp = (rtp_header_t *)buffer;
-			//~ JANUS_PRINT(" ... parsed RTP packet (ssrc=%u, pt=%u, seq=%u, ts=%u)...\n",
-				//~ ntohl(rtp->ssrc), rtp->type, ntohs(rtp->seq_number), ntohl(rtp->timestamp));
-			/* Relay to browser */
-			gateway->relay_rtcp(session->handle, 0, buffer, bytes);
-			continue;
+	} else {
+		address->addr = ((struct sockaddr_in *)result->ai_addr)->sin_addr;
+		address->expires = g_get_monotonic_time() + (gint64)JANUS_SIP_ADDRESS_TTL*G_USEC_PER_SEC;
+		g_atomic_int_set(&address->resolved, 1);
+		char ip[INET_ADDRSTRLEN];
+		JANUS_PRINT("Resolved %s as %s\n", address->name, inet_ntop(AF_INET, &address->addr, ip, sizeof(ip)) ? ip : "??");
+	}
+	address->refreshing = FALSE;
+	janus_mutex_unlock(&addresses_mutex);
+	if(result != NULL)
+		freeaddrinfo(result);
+}
+
+/* Helper to start resolving the address of a SIP server, unless we already know it (and it didn't expire) or are already resolving it */
+static void janus_sip_address_prefetch(const char *name) {
+	if(name == NULL || addresses == NULL)
+		return;
+	janus_mutex_lock(&addresses_mutex);
+	janus_sip_address *address = g_hash_table_lookup(addresses, name);
+	if(address == NULL) {
+		address = calloc(1, sizeof(janus_sip_address));
+		if(address == NULL) {
+			JANUS_DEBUG("Memory error!\n");
+			janus_mutex_unlock(&addresses_mutex);
+			return;
 		}
-		if(session->media.video_rtp_fd && FD_ISSET(session->media.video_rtp_fd, &readfds)) {
-			/* Got something video (RTP) */
-			addrlen = sizeof(remote);
-			bytes = recvfrom(session->media.video_rtp_fd, buffer, 1500, 0, (struct sockaddr*)&remote, &addrlen);
-			//~ JANUS_PRINT("************************\nGot %d bytes on the video RTP channel...\n", bytes);
-			//~ rtp_header_t *rtp = (rtp_header_t *)buffer;
-			//~ JANUS_PRINT(" ... parsed RTP packet (ssrc=%u, pt=%u, seq=%u, ts=%u)...\n",
-				//~ ntohl(rtp->ssrc), rtp->type, ntohs(rtp->seq_number), ntohl(rtp->timestamp));
-			/* Relay to browser */
-			gateway->relay_rtp(session->handle, 1, buffer, bytes);
-			continue;
+		address->name = g_strdup(name);
+		g_hash_table_insert(addresses, address->name, address);
+		if(inet_aton(name, &address->addr) > 0) {
+			/* Numeric IP, nothing to resolve */
+			address->resolved = 1;
+			janus_mutex_unlock(&addresses_mutex);
+			return;
 		}
-		if(session->media.video_rtcp_fd && FD_ISSET(session->media.video_rtcp_fd, &readfds)) {
-			/* Got something video (RTCP) */
-			addrlen = sizeof(remote);
-			bytes = recvfrom(session->media.video_rtcp_fd, buffer, 1500, 0, (struct sockaddr*)&remote, &addrlen);
-			//~ JANUS_PRINT("************************\nGot %d bytes on the video RTCP channel...\n", bytes);
-			//~ rtp_header_t *rtp = (rtp_header_t *)buffer;
-			//~ JANUS_PRINT(" ... parsed RTP packet (ssrc=%u, pt=%u, seq=%u, ts=%u)...\n",
-				//~ ntohl(rtp->ssrc), rtp->type, ntohs(rtp->seq_number), ntohl(rtp->timestamp));
-			/* Relay to browser */
-			gateway->relay_rtcp(session->handle, 1, buffer, bytes);
-			continue;
+	} else if(g_atomic_int_get(&address->resolved) == 0 || address->refreshing) {
+		/* Still resolving */
+		janus_mutex_unlock(&addresses_mutex);
+		return;
+	} else if(g_atomic_int_get(&address->resolved) == 1) {
+		if(address->expires == 0 || g_get_monotonic_time() < address->expires) {
+			/* Resolved, and still fresh */
+			janus_mutex_unlock(&addresses_mutex);
+			return;
 		}
+		/* Expired: resolve it again, and keep on using the old one until then */
+		address->refreshing = TRUE;
+		janus_mutex_unlock(&addresses_mutex);
+		g_thread_pool_push(resolver, address, NULL);
+		return;
 	}
-	JANUS_PRINT("Leaving relay thread\n");
-	return NULL;
+	/* New name, or the last attempt failed: (try to) resolve it in the background */
+	g_atomic_int_set(&address->resolved, 0);
+	janus_mutex_unlock(&addresses_mutex);
+	g_thread_pool_push(resolver, address, NULL);
 }
 
-/* Sofia Event thread */
+/* Helper to get the cached address of a SIP server: never blocks */
+static int janus_sip_address_lookup(const char *name, struct in_addr *addr) {
+	if(name == NULL || addr == NULL || addresses == NULL)
+		return -1;
+	int res = -1;
+	gboolean expired = FALSE;
+	janus_mutex_lock(&addresses_mutex);
+	janus_sip_address *address = g_hash_table_lookup(addresses, name);
+	if(address != NULL && g_atomic_int_get(&address->resolved) == 1) {
+		*addr = address->addr;
+		res = 0;
+		expired = (address->expires > 0 && !address->refreshing && g_get_monotonic_time() >= address->expires);
+	}
+	janus_mutex_unlock(&addresses_mutex);
+	if(res < 0 || expired) {
+		/* Maybe next time, or refresh it for the next time */
+		janus_sip_address_prefetch(name);
+	}
+	return res;
+}
+
+/* Sofia Event thread (one per shared stack) */
 gpointer janus_sip_sofia_thread(gpointer user_data) {
-	janus_sip_session *session = (janus_sip_session *)user_data;
-	if(session == NULL || session->account.username == NULL || session->stack == NULL)
+	ssip_t *stack = (ssip_t *)user_data;
+	if(stack == NULL)
 		return NULL;
-	JANUS_PRINT("Joining sofia loop thread (%s)...\n", session->account.username);
-	session->stack->s_root = su_root_create(session->stack);
-	char tag_url[100];
-	memset(tag_url, 0, 100);
-	sprintf(tag_url, "sip:%s@0.0.0.0:0", session->account.username);
-	JANUS_PRINT("Setting up sofia stack (%s)\n", tag_url);
-	session->stack->s_nua = nua_create(session->stack->s_root,
+	JANUS_PRINT("Joining sofia loop thread (stack #%u)...\n", stack->index);
+	su_home_init(stack->s_home);
+	stack->s_root = su_root_create(stack);
+	/* Each session sets its own From when creating its handles */
+	nua_t *nua = nua_create(stack->s_root,
 				janus_sip_sofia_callback,
-				session,
-				SIPTAG_FROM_STR(tag_url),
+				stack,
 				NUTAG_URL("sip:0.0.0.0:*;transport=udp"),
 				//~ NUTAG_OUTBOUND("outbound natify use-rport"),	/* To use the same port used in Contact */
-				//~ NUTAG_URL(tag_url),
 				TAG_NULL());
-	nua_set_params(session->stack->s_nua, TAG_NULL());
-	su_root_run(session->stack->s_root);
+	nua_set_params(nua, TAG_NULL());
+	g_atomic_pointer_set(&stack->s_nua, nua);
+	su_root_run(stack->s_root);
 	/* When we get here, we're done */
-	nua_destroy(session->stack->s_nua);
-	su_root_destroy(session->stack->s_root);
-	session->stack->s_root = NULL;
-	su_home_deinit(session->stack->s_home);
-	su_deinit();
-	//~ stop = 1;
-	JANUS_PRINT("Leaving sofia loop thread...\n");
+	nua_destroy(stack->s_nua);
+	stack->s_nua = NULL;
+	su_root_destroy(stack->s_root);
+	stack->s_root = NULL;
+	su_home_deinit(stack->s_home);
+	JANUS_PRINT("Leaving sofia loop thread (stack #%u)...\n", stack->index);
 	return NULL;
 }
 
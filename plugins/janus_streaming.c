@@ -13,11 +13,15 @@
  * -# live streaming of media generated by another tool (shared
  * streaming context for all peers attached to the stream).
  * 
- * For what concerns types 1. and 2., considering the proof of concept
- * nature of the implementation the only pre-recorded media files
- * that the plugins supports right now are raw mu-Law and a-Law files:
- * support is of course planned for other additional widespread formats
- * as well.
+ * For what concerns types 1. and 2., the pre-recorded media files
+ * the plugin supports are raw mu-Law and a-Law files (\c .mulaw and
+ * \c .alaw ), Opus in Ogg files (\c .opus or \c .ogg ), and Opus
+ * and/or VP8 in WebM files (\c .webm ): compressed frames are sent as
+ * they were encoded, with the timing of the container, so no transcoding
+ * is involved. Files are mapped in memory, and parsed, once per mountpoint.
+ * Files streamed on-demand are served by a single thread per mountpoint,
+ * on the same clock for all the listeners: each listener only has its own
+ * position in the file, so that it can start, pause and resume independently.
  * 
  * For what concerns type 3., instead, the plugin is configured
  * to listen on a couple of ports for RTP: this means that the plugin
@@ -48,7 +52,8 @@ type = rtp|live|ondemand
                   (multiple listeners = different streaming contexts)
 id = <unique numeric ID>
 description = This is my awesome stream
-filename = path to the local file to stream (only for live/ondemand)
+filename = path to the local file to stream (only for live/ondemand):
+           .alaw, .mulaw, .opus/.ogg (Opus) or .webm (Opus and/or VP8)
 audio = yes|no (do/don't stream audio)
 video = yes|no (do/don't stream video)
    The following options are only valid for the 'rtp' type:
@@ -58,7 +63,53 @@ audiortpmap = RTP map of the audio codec (e.g., opus/48000/2)
 videoport = local port for receiving video frames (only for rtp)
 videopt = <video RTP payload type> (e.g., 100)
 videortpmap = RTP map of the video codec (e.g., VP8/90000)
+lazy = yes|no (only bind the ports when someone is watching, default=no)
 \endverbatim
+ *
+ * RTP mountpoints don't get a thread each: their sockets are shared by
+ * a fixed number of ingest threads (one by default), which read packets
+ * in batches, and which are only started when they have sockets to read
+ * from. If you have many high bitrate mountpoints, you can use more of
+ * them in a \c [general] section.
+ *
+ * RTP mountpoints are also watched: if nothing is received for a while
+ * (five seconds by default) the mountpoint is marked as inactive, and its
+ * listeners get an event with an \c inactive status; an \c active status
+ * is sent as soon as the source is back. Mountpoints configured as lazy,
+ * instead, don't bind their ports until the first listener arrives, and
+ * close them again when nobody has been watching for as long:
+ *
+ * \verbatim
+[general]
+rtp_threads = <number of threads receiving RTP for the mountpoints>
+rtp_timeout = <seconds without RTP before a mountpoint is inactive>
+\endverbatim
+ *
+ * Live mountpoints streaming VP8 keep all the packets since the latest
+ * keyframe (see gop.h), and replay them to new listeners before the live
+ * stream, so that they can start rendering right away rather than waiting
+ * for the next keyframe (which RTP sources can't be asked for).
+ *
+ * Mountpoints can also be created and destroyed at runtime, with no need
+ * to restart the gateway: a \c create request takes the same settings
+ * as the configuration file (\c type , \c name , \c description ,
+ * \c filename , \c audio , \c video , \c audioport , \c audiopt ,
+ * \c audiortpmap , \c videoport , \c videopt , \c videortpmap and
+ * \c lazy , with booleans and integers as JSON values), an optional
+ * \c id (a random one is picked if missing), and a \c permanent flag to
+ * also save the mountpoint to the configuration file. A \c destroy
+ * request takes the \c id and, again, an optional \c permanent flag:
+ * the listeners of a destroyed mountpoint get a \c stopped status event.
+ * If an \c admin_key is set in the \c [general] section, both requests
+ * must provide it:
+ *
+ * \verbatim
+[general]
+admin_key = <secret needed to create and destroy mountpoints>
+\endverbatim
+ *
+ * Saving a mountpoint rewrites the configuration file, so any comment
+ * in it is lost.
  *
  * \ingroup plugins
  * \ref plugins
@@ -67,10 +118,19 @@ videortpmap = RTP map of the video codec (e.g., VP8/90000)
 #include "plugin.h"
 
 #include <jansson.h>
+#include <opus/opus.h>
 #include <sys/time.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <errno.h>
 
 #include "../config.h"
+#include "../mutex.h"
 #include "../rtp.h"
+#include "../gop.h"
 
 
 /* Plugin information */
@@ -96,6 +156,7 @@ void janus_streaming_incoming_rtp(janus_pluginession *handle, int video, char *b
 void janus_streaming_incoming_rtcp(janus_pluginession *handle, int video, char *buf, int len);
 void janus_streaming_hangup_media(janus_pluginession *handle);
 void janus_streaming_destroy_session(janus_pluginession *handle, int *error);
+char *janus_streaming_get_metrics(void);
 
 /* Plugin setup */
 static janus_plugin janus_streaming_plugin =
@@ -116,6 +177,8 @@ static janus_plugin janus_streaming_plugin =
 		.incoming_rtcp = janus_streaming_incoming_rtcp,
 		.hangup_media = janus_streaming_hangup_media,
 		.destroy_session = janus_streaming_destroy_session,
+
+		.get_metrics = janus_streaming_get_metrics,
 	}; 
 
 /* Plugin creator */
@@ -133,7 +196,7 @@ static void *janus_streaming_handler(void *data);
 static void *janus_streaming_ondemand_thread(void *data);
 static void *janus_streaming_filesource_thread(void *data);
 static void janus_streaming_relay_rtp_packet(gpointer data, gpointer user_data);
-static void *janus_streaming_relay_thread(void *data);
+static void *janus_streaming_ingest_thread(void *data);
 
 typedef enum janus_streaming_type {
 	janus_streaming_type_none = 0,
@@ -147,15 +210,59 @@ typedef enum janus_streaming_source {
 	janus_streaming_source_rtp,
 } janus_streaming_source;
 
+/* Socket an RTP mountpoint receives audio or video on, and the status needed to fix seq and ts */
+typedef struct janus_streaming_rtp_socket {
+	struct janus_streaming_mountpoint *mountpoint;
+	int fd;
+	gint is_video;
+	guint ingest;
+	uint32_t last_ssrc, last_ts, base_ts, base_ts_prev;
+	uint16_t last_seq, base_seq, base_seq_prev;
+	uint32_t ts_step;	/* Timestamp increment of a frame, to move past the last one when the source changes */
+} janus_streaming_rtp_socket;
+
 typedef struct janus_streaming_rtp_source {
 	gint audio_port;
 	gint video_port;
+	janus_streaming_rtp_socket audio;
+	janus_streaming_rtp_socket video;
+	gboolean lazy;	/* Whether the sockets are only bound while there are listeners */
+	gboolean bound;
+	gint64 last_packet;	/* Monotonic time we last received a packet at (watchdog) */
+	gint64 idle_since;	/* Monotonic time the last listener left at (lazy mountpoints) */
+	gboolean notified_active;	/* Whether listeners were last told the source is active or not */
 } janus_streaming_rtp_source;
 
+/* Frame in a file source, ready to be packetized */
+typedef struct janus_streaming_file_frame {
+	const char *data;	/* Points to the mapped file (or to a copy, if the frame was split in the container) */
+	guint32 length;
+	gint64 when;	/* Microseconds since the beginning of the file */
+	guint32 ts;		/* Same, in RTP clock units of the codec */
+	gboolean video;
+} janus_streaming_file_frame;
+
+/* Files are mapped once, parsed in a list of frames, and shared read-only by all listeners */
 typedef struct janus_streaming_file_source {
 	char *filename;
+	const char *data;
+	size_t size;
+	janus_streaming_file_frame *frames;
+	guint frames_num;
+	GList *copies;	/* Frames we had to reassemble, if any */
+	gint64 duration;
+	guint32 audio_rate, video_rate;
+	GThread *thread;
 } janus_streaming_file_source;
 
+/* Where a live mountpoint (or an on-demand listener) is in a file source */
+typedef struct janus_streaming_file_cursor {
+	guint frame;	/* Next frame to send */
+	gint64 start;	/* Monotonic time the current loop of the file started at (0 if not started yet) */
+	uint16_t seq[2];	/* Audio and video */
+	uint32_t ts_base[2];
+} janus_streaming_file_cursor;
+
 typedef struct janus_streaming_codecs {
 	gint audio_pt;
 	char *audio_rtpmap;
@@ -172,9 +279,22 @@ typedef struct janus_streaming_mountpoint {
 	janus_streaming_source streaming_source;
 	void *source;	/* Can differ according to the source type */
 	janus_streaming_codecs codecs;
-	GList *listeners;
+	janus_sdp_template *sdp_template;	/* The SDP we offer listeners, only prepared once */
+	janus_gop *gop;	/* Latest VP8 GOP, replayed to new listeners (live VP8 mountpoints only) */
+	struct janus_streaming_listeners *listeners;	/* Current snapshot of the listeners (read without locking, see below) */
+	janus_mutex listeners_mutex;	/* Serializes the updates of the listeners */
+	volatile gboolean destroyed;	/* Set when the mountpoint is being destroyed, so that its thread (if any) leaves */
 } janus_streaming_mountpoint;
 GHashTable *mountpoints;
+/* Protects the mountpoints table, and the mountpoint sessions point to */
+static janus_mutex mountpoints_mutex = JANUS_MUTEX_INITIALIZER;
+
+/* The configuration is kept around, as mountpoints can be created (and
+ * destroyed) dynamically too, and saved to the configuration file if permanent */
+static janus_config *config = NULL;
+static char *config_file = NULL;
+static char *admin_key = NULL;
+static janus_mutex config_mutex = JANUS_MUTEX_INITIALIZER;
 
 typedef struct janus_streaming_message {
 	janus_pluginession *handle;
@@ -191,9 +311,104 @@ typedef struct janus_streaming_session {
 	gboolean started;
 	gboolean stopping;
 	gboolean destroy;
+	janus_streaming_file_cursor ondemand;	/* Only used by on-demand listeners */
+	janus_gop_copy *replay;	/* Latest GOP, while it's being replayed by the relay thread (gop mutex) */
+	gint64 destroyed;	/* When the session was destroyed (it's only freed a few seconds later) */
 } janus_streaming_session;
 GHashTable *sessions;
 
+/* Listeners of a mountpoint: relay threads go through a contiguous array
+ * without any lock, so the array is never modified once published. When
+ * someone joins or leaves, a new array is published instead, and the old
+ * one is retired: relay threads may still be going through it (and using
+ * the sessions in it), so retired arrays and destroyed sessions are only
+ * freed by the handler thread after a grace period, much longer than it
+ * takes to relay a packet or to send a frame to on-demand listeners */
+typedef struct janus_streaming_listeners {
+	gint64 retired;	/* When the snapshot was replaced by a new one */
+	guint count;
+	janus_streaming_session *sessions[];
+} janus_streaming_listeners;
+#define JANUS_STREAMING_GRACE	5
+static GList *old_listeners = NULL, *old_sessions = NULL;
+static janus_mutex old_mutex = JANUS_MUTEX_INITIALIZER;
+
+/* Helper to get the current snapshot from relay threads: it stays valid
+ * for a while even if it's replaced in the meanwhile, see above */
+static janus_streaming_listeners *janus_streaming_listeners_get(janus_streaming_mountpoint *mountpoint) {
+	return (janus_streaming_listeners *)g_atomic_pointer_get(&mountpoint->listeners);
+}
+
+/* Helper to free a destroyed session */
+static void janus_streaming_session_free(gpointer data) {
+	janus_streaming_session *session = (janus_streaming_session *)data;
+	janus_gop_copy_free(session->replay);
+	g_free(session);
+}
+
+/* Helper to free retired snapshots and destroyed sessions, once their grace period is over (or all of them) */
+static void janus_streaming_free_retired(gboolean all) {
+	gint64 now = g_get_monotonic_time();
+	GList *expired_listeners = NULL, *expired_sessions = NULL;
+	janus_mutex_lock(&old_mutex);
+	/* Both lists are appended to as things are retired, so the oldest come first */
+	while(old_listeners) {
+		janus_streaming_listeners *listeners = (janus_streaming_listeners *)old_listeners->data;
+		if(!all && now-listeners->retired < JANUS_STREAMING_GRACE*G_USEC_PER_SEC)
+			break;
+		old_listeners = g_list_delete_link(old_listeners, old_listeners);
+		expired_listeners = g_list_prepend(expired_listeners, listeners);
+	}
+	while(old_sessions) {
+		janus_streaming_session *session = (janus_streaming_session *)old_sessions->data;
+		if(!all && now-session->destroyed < JANUS_STREAMING_GRACE*G_USEC_PER_SEC)
+			break;
+		old_sessions = g_list_delete_link(old_sessions, old_sessions);
+		expired_sessions = g_list_prepend(expired_sessions, session);
+	}
+	janus_mutex_unlock(&old_mutex);
+	g_list_free_full(expired_listeners, free);
+	g_list_free_full(expired_sessions, janus_streaming_session_free);
+}
+
+/* Helper to add (or remove) a session to (from) the listeners of a mountpoint */
+static void janus_streaming_listeners_update(janus_streaming_mountpoint *mountpoint, janus_streaming_session *session, gboolean add) {
+	janus_mutex_lock(&mountpoint->listeners_mutex);
+	janus_streaming_listeners *old = mountpoint->listeners;
+	guint count = old ? old->count : 0, i = 0;
+	janus_streaming_listeners *listeners = calloc(1, sizeof(janus_streaming_listeners) + (count+1)*sizeof(janus_streaming_session *));
+	if(listeners == NULL) {
+		JANUS_DEBUG("Memory error!\n");
+		janus_mutex_unlock(&mountpoint->listeners_mutex);
+		return;
+	}
+	for(i=0; i<count; i++) {
+		if(old->sessions[i] != session)
+			listeners->sessions[listeners->count++] = old->sessions[i];
+	}
+	if(add)
+		listeners->sessions[listeners->count++] = session;
+	if(listeners->count == 0) {
+		free(listeners);
+		listeners = NULL;
+	}
+	g_atomic_pointer_set(&mountpoint->listeners, listeners);
+	janus_mutex_unlock(&mountpoint->listeners_mutex);
+	if(old != NULL) {
+		/* Relay threads may still be going through the old snapshot */
+		old->retired = g_get_monotonic_time();
+		janus_mutex_lock(&old_mutex);
+		old_listeners = g_list_append(old_listeners, old);
+		janus_mutex_unlock(&old_mutex);
+	}
+}
+
+/* Helper to count the listeners of a mountpoint */
+static guint janus_streaming_listeners_count(janus_streaming_mountpoint *mountpoint) {
+	janus_streaming_listeners *listeners = janus_streaming_listeners_get(mountpoint);
+	return listeners ? listeners->count : 0;
+}
+
 /* Packets we get from gstreamer and relay */
 typedef struct janus_streaming_rtp_relay_packet {
 	rtp_header *data;
@@ -201,6 +416,834 @@ typedef struct janus_streaming_rtp_relay_packet {
 	gint is_video;
 } janus_streaming_rtp_relay_packet;
 
+/* Helper to relay a packet to all the listeners of a mountpoint */
+static void janus_streaming_relay_rtp_listeners(janus_streaming_mountpoint *mountpoint, janus_streaming_rtp_relay_packet *packet) {
+	janus_gop *gop = packet->is_video ? mountpoint->gop : NULL;
+	if(gop != NULL) {
+		/* Keep track of the latest GOP: the lock makes sure the copy new
+		 * listeners get ends right before their first live packet (see setup_media) */
+		janus_mutex_lock(&gop->mutex);
+		janus_gop_add(gop, (char *)packet->data, packet->length);
+	}
+	janus_streaming_listeners *listeners = janus_streaming_listeners_get(mountpoint);
+	if(listeners != NULL) {
+		guint i = 0;
+		for(i=0; i<listeners->count; i++)
+			janus_streaming_relay_rtp_packet(listeners->sessions[i], packet);
+	}
+	if(gop != NULL)
+		janus_mutex_unlock(&gop->mutex);
+}
+
+/* Helper to forget the latest GOP of a mountpoint, when it's not valid anymore (e.g., the source changed) */
+static void janus_streaming_gop_reset(janus_streaming_mountpoint *mountpoint) {
+	if(mountpoint->gop == NULL)
+		return;
+	janus_mutex_lock(&mountpoint->gop->mutex);
+	janus_gop_reset(mountpoint->gop);
+	janus_mutex_unlock(&mountpoint->gop->mutex);
+}
+
+/* Callback to replay the latest GOP of a mountpoint to a new listener (relay thread) */
+static void janus_streaming_gop_send(char *buf, int len, gpointer user_data) {
+	janus_streaming_session *session = (janus_streaming_session *)user_data;
+	if(gateway != NULL)
+		gateway->relay_rtp(session->handle, 1, buf, len);
+}
+
+/* RTP mountpoints are not served by a thread each, but by a fixed number
+ * of ingest threads: each has an epoll set with the sockets of the
+ * mountpoints assigned to it, and reads packets in batches with recvmmsg */
+#define JANUS_STREAMING_INGEST_BATCH	32
+#define JANUS_STREAMING_RTP_BUFSIZE		1500
+/* When an RTP source changes (new SSRC), the first timestamp we send is
+ * one frame after the last one we sent: we assume 20ms audio frames and
+ * 20fps video, what gstreamer sends by default, at the clock rate of the
+ * codec in the rtpmap of the mountpoint */
+#define JANUS_STREAMING_AUDIO_FRAMES	50
+#define JANUS_STREAMING_VIDEO_FRAMES	20
+static guint32 janus_streaming_rtpmap_ts_step(const char *rtpmap, gboolean video) {
+	/* <encoding name>/<clock rate>[/<encoding parameters>] */
+	int rate = 0;
+	const char *slash = rtpmap ? strchr(rtpmap, '/') : NULL;
+	if(slash != NULL)
+		rate = atoi(slash+1);
+	if(rate <= 0)
+		rate = video ? 90000 : 48000;
+	return rate / (video ? JANUS_STREAMING_VIDEO_FRAMES : JANUS_STREAMING_AUDIO_FRAMES);
+}
+
+typedef struct janus_streaming_ingest {
+	GThread *thread;	/* Only started when the first socket is bound */
+	int epoll_fd;
+	guint sockets;
+	janus_mutex mutex;	/* Held while handling a batch, so that sockets are never closed under the thread */
+	volatile gint batches;	/* Incremented after each batch (or timeout), see janus_streaming_ingest_sync */
+} janus_streaming_ingest;
+static janus_streaming_ingest *ingest_threads = NULL;
+static guint ingest_threads_num = 1;
+
+/* How long an RTP mountpoint can go without packets before we consider
+ * the source gone: this is also how long lazy mountpoints keep their
+ * sockets bound after the last listener left */
+#define JANUS_STREAMING_RTP_TIMEOUT		5
+static gint64 rtp_timeout = JANUS_STREAMING_RTP_TIMEOUT*G_USEC_PER_SEC;
+
+/* Helper to bind an RTP mountpoint socket and add it to the epoll set of an ingest thread */
+static int janus_streaming_rtp_socket_bind(janus_streaming_mountpoint *mountpoint, janus_streaming_rtp_socket *rtp_socket, gint port, gint is_video) {
+	rtp_socket->mountpoint = mountpoint;
+	rtp_socket->is_video = is_video;
+	rtp_socket->fd = -1;
+	if(port < 0)
+		return 0;
+	int fd = socket(AF_INET, SOCK_DGRAM, 0);
+	if(fd < 0) {
+		JANUS_DEBUG("[%s] Error creating %s socket...\n", mountpoint->name, is_video ? "video" : "audio");
+		return -1;
+	}
+	int yes = 1;	/* For setsockopt() SO_REUSEADDR */
+	setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(int));
+	fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
+	struct sockaddr_in address;
+	memset(&address, 0, sizeof(address));
+	address.sin_family = AF_INET;
+	address.sin_port = htons(port);
+	address.sin_addr.s_addr = INADDR_ANY;
+	if(bind(fd, (struct sockaddr *)(&address), sizeof(struct sockaddr)) < 0) {
+		JANUS_DEBUG("[%s] Bind failed for %s (port %d)...\n", mountpoint->name, is_video ? "video" : "audio", port);
+		close(fd);
+		return -1;
+	}
+	/* Pick the ingest thread with the fewest sockets, unless the other
+	 * socket of the mountpoint is already on one: a single thread relaying
+	 * for each mountpoint keeps the listeners updates quick */
+	guint i = 0, target = 0;
+	janus_streaming_rtp_source *source = (janus_streaming_rtp_source *)mountpoint->source;
+	if(is_video && source->audio.fd >= 0) {
+		target = source->audio.ingest;
+	} else {
+		for(i=1; i<ingest_threads_num; i++) {
+			if(ingest_threads[i].sockets < ingest_threads[target].sockets)
+				target = i;
+		}
+	}
+	struct epoll_event event;
+	memset(&event, 0, sizeof(event));
+	event.events = EPOLLIN;
+	event.data.ptr = rtp_socket;
+	if(epoll_ctl(ingest_threads[target].epoll_fd, EPOLL_CTL_ADD, fd, &event) < 0) {
+		JANUS_DEBUG("[%s] Error adding %s socket to the ingest thread...\n", mountpoint->name, is_video ? "video" : "audio");
+		close(fd);
+		return -1;
+	}
+	ingest_threads[target].sockets++;
+	rtp_socket->fd = fd;
+	rtp_socket->ingest = target;
+	JANUS_PRINT("[%s] %s listener bound to port %d (ingest thread #%u)\n", mountpoint->name, is_video ? "Video" : "Audio", port, target);
+	if(ingest_threads[target].thread == NULL) {
+		/* First socket for this ingest thread, start it */
+		char tname[32];
+		g_snprintf(tname, sizeof(tname), "streaming ingest %u", target);
+		ingest_threads[target].thread = g_thread_new(tname, &janus_streaming_ingest_thread, &ingest_threads[target]);
+	}
+	return 0;
+}
+
+/* Helper to remove an RTP mountpoint socket from its ingest thread, and close it */
+static void janus_streaming_rtp_socket_unbind(janus_streaming_rtp_socket *rtp_socket) {
+	if(rtp_socket->fd < 0)
+		return;
+	janus_streaming_ingest *ingest = &ingest_threads[rtp_socket->ingest];
+	janus_mutex_lock(&ingest->mutex);
+	epoll_ctl(ingest->epoll_fd, EPOLL_CTL_DEL, rtp_socket->fd, NULL);
+	close(rtp_socket->fd);
+	rtp_socket->fd = -1;
+	ingest->sockets--;
+	janus_mutex_unlock(&ingest->mutex);
+	/* Whatever we get when we're bound again is a new stream */
+	rtp_socket->last_ssrc = 0;
+}
+
+/* Helper to wait for an ingest thread to be done with the events it may
+ * have got for a socket before it was unbound, which is needed before
+ * freeing the socket: the thread is either waiting for new events (and
+ * won't get any for that socket anymore) or handling a batch */
+static void janus_streaming_ingest_sync(guint index) {
+	janus_streaming_ingest *ingest = &ingest_threads[index];
+	if(ingest->thread == NULL)
+		return;
+	janus_mutex_lock(&ingest->mutex);
+	gint batches = g_atomic_int_get(&ingest->batches);
+	janus_mutex_unlock(&ingest->mutex);
+	while(!stopping && g_atomic_int_get(&ingest->batches) == batches)
+		g_usleep(10000);
+}
+
+/* Helpers to bind (and unbind) both sockets of an RTP mountpoint */
+static int janus_streaming_rtp_source_bind(janus_streaming_mountpoint *mountpoint) {
+	janus_streaming_rtp_source *source = (janus_streaming_rtp_source *)mountpoint->source;
+	if(source->bound)
+		return 0;
+	if(janus_streaming_rtp_socket_bind(mountpoint, &source->audio, source->audio_port, 0) < 0 ||
+			janus_streaming_rtp_socket_bind(mountpoint, &source->video, source->video_port, 1) < 0) {
+		janus_streaming_rtp_socket_unbind(&source->audio);
+		return -1;
+	}
+	source->bound = TRUE;
+	source->idle_since = 0;
+	return 0;
+}
+
+static void janus_streaming_rtp_source_unbind(janus_streaming_mountpoint *mountpoint) {
+	janus_streaming_rtp_source *source = (janus_streaming_rtp_source *)mountpoint->source;
+	if(!source->bound)
+		return;
+	janus_streaming_rtp_socket_unbind(&source->audio);
+	janus_streaming_rtp_socket_unbind(&source->video);
+	source->bound = FALSE;
+	mountpoint->active = FALSE;
+	janus_streaming_gop_reset(mountpoint);
+	JANUS_PRINT("[%s] No listeners, sockets closed\n", mountpoint->name);
+}
+
+
+/* File sources: raw a-Law/mu-Law files are sent in 20ms frames (160
+ * samples at 8kHz), while Ogg (Opus) and WebM (Opus and/or VP8) files are
+ * sent as they were encoded, with the timing of the container */
+#define JANUS_STREAMING_FILE_FRAME		160
+#define JANUS_STREAMING_OPUS_PT			111
+#define JANUS_STREAMING_VP8_PT			100
+/* Maximum size of the VP8 payload in a packet, to stay below the MTU */
+#define JANUS_STREAMING_VP8_MAX_PAYLOAD	1200
+
+/* Helper to add a frame to a file source */
+static void janus_streaming_file_add_frame(janus_streaming_file_source *source, const char *data, guint32 length, gint64 when, gboolean video) {
+	if(source->frames_num % 1024 == 0) {
+		janus_streaming_file_frame *frames = realloc(source->frames, (source->frames_num+1024)*sizeof(janus_streaming_file_frame));
+		if(frames == NULL) {
+			JANUS_DEBUG("Memory error!\n");
+			return;
+		}
+		source->frames = frames;
+	}
+	janus_streaming_file_frame *frame = &source->frames[source->frames_num++];
+	frame->data = data;
+	frame->length = length;
+	frame->when = when;
+	frame->ts = when * (video ? source->video_rate : source->audio_rate) / G_USEC_PER_SEC;
+	frame->video = video;
+}
+
+/* Raw a-Law/mu-Law */
+static int janus_streaming_file_parse_raw(janus_streaming_file_source *source) {
+	size_t offset = 0;
+	for(offset = 0; offset + JANUS_STREAMING_FILE_FRAME <= source->size; offset += JANUS_STREAMING_FILE_FRAME)
+		janus_streaming_file_add_frame(source, source->data + offset, JANUS_STREAMING_FILE_FRAME, (offset/JANUS_STREAMING_FILE_FRAME)*20000, FALSE);
+	return 0;
+}
+
+/* Ogg (Opus): packets are extracted from the pages of the first logical stream */
+static int janus_streaming_file_parse_ogg(janus_streaming_file_source *source) {
+	const unsigned char *data = (const unsigned char *)source->data;
+	size_t offset = 0;
+	guint32 serial = 0;
+	guint packets = 0;
+	gint64 samples = 0;
+	GString *split = NULL;	/* Packet continuing on the next page */
+	while(offset + 27 <= source->size) {
+		if(memcmp(data+offset, "OggS", 4)) {
+			JANUS_DEBUG("Invalid Ogg page at offset %zu in %s\n", offset, source->filename);
+			break;
+		}
+		guint32 page_serial = data[offset+14] | (data[offset+15] << 8) | (data[offset+16] << 16) | ((guint32)data[offset+17] << 24);
+		int segments = data[offset+26], i = 0;
+		const unsigned char *lacing = data+offset+27;
+		size_t body = offset + 27 + segments, body_len = 0;
+		if(body > source->size)
+			break;
+		for(i=0; i<segments; i++)
+			body_len += lacing[i];
+		if(body + body_len > source->size)
+			break;
+		if(offset == 0)
+			serial = page_serial;
+		if(page_serial != serial) {
+			/* Not the stream we're interested in */
+			offset = body + body_len;
+			continue;
+		}
+		size_t packet = body, length = 0;
+		for(i=0; i<segments; i++) {
+			length += lacing[i];
+			if(lacing[i] == 255) {
+				if(i == segments-1) {
+					/* The packet continues on the next page */
+					if(split == NULL)
+						split = g_string_new(NULL);
+					g_string_append_len(split, (const char *)data+packet, length);
+				}
+				continue;
+			}
+			const char *frame = (const char *)data+packet;
+			guint32 frame_len = length;
+			if(split != NULL) {
+				/* Reassemble the packet that was split across pages */
+				g_string_append_len(split, frame, length);
+				frame_len = split->len;
+				frame = g_string_free(split, FALSE);
+				source->copies = g_list_prepend(source->copies, (gpointer)frame);
+				split = NULL;
+			}
+			if(packets == 0 && (frame_len < 19 || memcmp(frame, "OpusHead", 8))) {
+				JANUS_DEBUG("%s doesn't contain Opus\n", source->filename);
+				return -1;
+			} else if(packets > 1 && frame_len > 0) {
+				/* Skip OpusTags too, and use the TOC to know how long each packet is */
+				int nb_samples = opus_packet_get_nb_samples((const unsigned char *)frame, frame_len, 48000);
+				if(nb_samples > 0) {
+					janus_streaming_file_add_frame(source, frame, frame_len, samples*G_USEC_PER_SEC/48000, FALSE);
+					samples += nb_samples;
+				}
+			}
+			packets++;
+			packet += length;
+			length = 0;
+		}
+		offset = body + body_len;
+	}
+	if(split != NULL)
+		g_string_free(split, TRUE);
+	source->duration = samples*G_USEC_PER_SEC/48000;
+	return source->frames_num > 0 ? 0 : -1;
+}
+
+/* WebM (Opus and/or VP8): a flat walk of the EBML elements, entering the
+ * master elements we care about and skipping everything else, which works
+ * for live WebM files with elements of unknown size as well */
+#define JANUS_STREAMING_EBML_SEGMENT		0x18538067
+#define JANUS_STREAMING_EBML_INFO			0x1549A966
+#define JANUS_STREAMING_EBML_TIMECODE_SCALE	0x2AD7B1
+#define JANUS_STREAMING_EBML_TRACKS			0x1654AE6B
+#define JANUS_STREAMING_EBML_TRACK_ENTRY	0xAE
+#define JANUS_STREAMING_EBML_TRACK_NUMBER	0xD7
+#define JANUS_STREAMING_EBML_CODEC_ID		0x86
+#define JANUS_STREAMING_EBML_CLUSTER		0x1F43B675
+#define JANUS_STREAMING_EBML_TIMECODE		0xE7
+#define JANUS_STREAMING_EBML_BLOCK_GROUP	0xA0
+#define JANUS_STREAMING_EBML_BLOCK			0xA1
+#define JANUS_STREAMING_EBML_SIMPLE_BLOCK	0xA3
+
+/* Helper to read an EBML variable size integer: returns its length, or 0 on errors */
+static int janus_streaming_ebml_vint(const unsigned char *data, size_t available, guint64 *value, gboolean keep_marker) {
+	if(available == 0 || data[0] == 0)
+		return 0;
+	int len = 1;
+	while(!(data[0] & (0x80 >> (len-1))))
+		len++;
+	if((size_t)len > available)
+		return 0;
+	guint64 v = keep_marker ? data[0] : (data[0] & ((0x80 >> (len-1)) - 1));
+	gboolean unknown = (v == (guint64)((0x80 >> (len-1)) - 1));
+	int i = 0;
+	for(i=1; i<len; i++) {
+		v = (v << 8) | data[i];
+		if(data[i] != 0xFF)
+			unknown = FALSE;
+	}
+	*value = (!keep_marker && unknown) ? G_MAXUINT64 : v;
+	return len;
+}
+
+static guint64 janus_streaming_ebml_uint(const unsigned char *data, guint64 size) {
+	guint64 value = 0, i = 0;
+	for(i=0; i<size && i<8; i++)
+		value = (value << 8) | data[i];
+	return value;
+}
+
+static int janus_streaming_file_parse_webm(janus_streaming_file_source *source, gboolean doaudio, gboolean dovideo) {
+	const unsigned char *data = (const unsigned char *)source->data;
+	size_t offset = 0;
+	guint64 scale = 1000000, cluster = 0;
+	guint64 track_number = 0, audio_track = 0, video_track = 0;
+	const char *track_codec = NULL;
+	guint64 track_codec_len = 0;
+	guint skipped = 0;
+	while(offset < source->size) {
+		guint64 id = 0, size = 0;
+		int len = janus_streaming_ebml_vint(data+offset, source->size-offset, &id, TRUE);
+		if(len == 0)
+			break;
+		int slen = janus_streaming_ebml_vint(data+offset+len, source->size-offset-len, &size, FALSE);
+		if(slen == 0)
+			break;
+		size_t payload = offset + len + slen;
+		if(id == JANUS_STREAMING_EBML_SEGMENT || id == JANUS_STREAMING_EBML_INFO || id == JANUS_STREAMING_EBML_TRACKS ||
+				id == JANUS_STREAMING_EBML_CLUSTER || id == JANUS_STREAMING_EBML_BLOCK_GROUP || id == JANUS_STREAMING_EBML_TRACK_ENTRY) {
+			/* Master element we care about, enter it */
+			if(id == JANUS_STREAMING_EBML_TRACK_ENTRY) {
+				track_number = 0;
+				track_codec = NULL;
+			}
+			offset = payload;
+			continue;
+		}
+		if(size == G_MAXUINT64 || payload + size > source->size)
+			break;
+		const unsigned char *value = data+payload;
+		switch(id) {
+			case JANUS_STREAMING_EBML_TIMECODE_SCALE:
+				scale = janus_streaming_ebml_uint(value, size);
+				break;
+			case JANUS_STREAMING_EBML_TIMECODE:
+				cluster = janus_streaming_ebml_uint(value, size);
+				break;
+			case JANUS_STREAMING_EBML_TRACK_NUMBER:
+				track_number = janus_streaming_ebml_uint(value, size);
+				break;
+			case JANUS_STREAMING_EBML_CODEC_ID:
+				track_codec = (const char *)value;
+				track_codec_len = size;
+				break;
+			case JANUS_STREAMING_EBML_BLOCK:
+			case JANUS_STREAMING_EBML_SIMPLE_BLOCK: {
+				guint64 track = 0;
+				int tlen = janus_streaming_ebml_vint(value, size, &track, FALSE);
+				if(tlen == 0 || size < (guint64)tlen+3)
+					break;
+				gboolean video = (track == video_track);
+				if(!(video && dovideo) && !(track == audio_track && doaudio))
+					break;
+				if(value[tlen+2] & 0x06) {
+					/* Laced frames are not supported */
+					skipped++;
+					break;
+				}
+				gint16 relative = (gint16)((value[tlen] << 8) | value[tlen+1]);
+				gint64 when = ((gint64)cluster + relative) * (gint64)scale / 1000;
+				if(when < 0)
+					when = 0;
+				janus_streaming_file_add_frame(source, (const char *)value+tlen+3, size-tlen-3, when, video);
+				break;
+			}
+			default:
+				break;
+		}
+		if(track_number > 0 && track_codec != NULL) {
+			/* We know everything we need about this track */
+			if(track_codec_len == 5 && !strncmp(track_codec, "V_VP8", 5) && video_track == 0)
+				video_track = track_number;
+			else if(track_codec_len == 6 && !strncmp(track_codec, "A_OPUS", 6) && audio_track == 0)
+				audio_track = track_number;
+			track_number = 0;
+			track_codec = NULL;
+		}
+		offset = payload + size;
+	}
+	if(skipped > 0)
+		JANUS_DEBUG("Skipped %u laced blocks in %s\n", skipped, source->filename);
+	if(doaudio && audio_track == 0)
+		JANUS_DEBUG("No Opus track in %s\n", source->filename);
+	if(dovideo && video_track == 0)
+		JANUS_DEBUG("No VP8 track in %s\n", source->filename);
+	return source->frames_num > 0 ? 0 : -1;
+}
+
+static int janus_streaming_file_frame_compare(const void *a, const void *b) {
+	const janus_streaming_file_frame *f1 = (const janus_streaming_file_frame *)a, *f2 = (const janus_streaming_file_frame *)b;
+	if(f1->when != f2->when)
+		return f1->when < f2->when ? -1 : 1;
+	/* Keep the order of the container for frames with the same time */
+	return f1 < f2 ? -1 : (f1 > f2 ? 1 : 0);
+}
+
+static void janus_streaming_file_source_unmap(janus_streaming_file_source *source) {
+	if(source->data == NULL)
+		return;
+	free(source->frames);
+	source->frames = NULL;
+	source->frames_num = 0;
+	g_list_free_full(source->copies, g_free);
+	source->copies = NULL;
+	munmap((void *)source->data, source->size);
+	source->data = NULL;
+	source->size = 0;
+}
+
+/* Helper to map and parse a file source, which also tells us which codecs to offer */
+static janus_streaming_file_source *janus_streaming_file_source_create(const char *filename, gboolean doaudio, gboolean dovideo, janus_streaming_codecs *codecs) {
+	gboolean raw = strstr(filename, ".alaw") || strstr(filename, ".mulaw");
+	gboolean ogg = g_str_has_suffix(filename, ".opus") || g_str_has_suffix(filename, ".ogg");
+	gboolean webm = g_str_has_suffix(filename, ".webm");
+	if(!raw && !ogg && !webm) {
+		JANUS_DEBUG("Unsupported format (we only support raw mu-Law and a-Law files, Opus in Ogg, and Opus/VP8 in WebM)\n");
+		return NULL;
+	}
+	if(dovideo && !webm) {
+		JANUS_DEBUG("Only WebM files can contain video\n");
+		return NULL;
+	}
+	int fd = open(filename, O_RDONLY);
+	if(fd < 0) {
+		JANUS_DEBUG("Couldn't open %s: %d (%s)\n", filename, errno, strerror(errno));
+		return NULL;
+	}
+	struct stat st;
+	if(fstat(fd, &st) < 0 || st.st_size < JANUS_STREAMING_FILE_FRAME) {
+		JANUS_DEBUG("Invalid file %s (too short?)\n", filename);
+		close(fd);
+		return NULL;
+	}
+	void *data = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	/* The mapping stays valid after the file is closed */
+	close(fd);
+	if(data == MAP_FAILED) {
+		JANUS_DEBUG("Couldn't map %s: %d (%s)\n", filename, errno, strerror(errno));
+		return NULL;
+	}
+	/* Listeners may be anywhere in the file */
+	madvise(data, st.st_size, MADV_WILLNEED);
+	janus_streaming_file_source *source = calloc(1, sizeof(janus_streaming_file_source));
+	if(source == NULL) {
+		JANUS_DEBUG("Memory error!\n");
+		munmap(data, st.st_size);
+		return NULL;
+	}
+	source->filename = g_strdup(filename);
+	source->data = (const char *)data;
+	source->size = st.st_size;
+	source->audio_rate = raw ? 8000 : 48000;
+	source->video_rate = 90000;
+	int res = 0;
+	if(raw) {
+		res = janus_streaming_file_parse_raw(source);
+	} else if(ogg) {
+		res = janus_streaming_file_parse_ogg(source);
+	} else {
+		res = janus_streaming_file_parse_webm(source, doaudio, dovideo);
+	}
+	if(res < 0 || source->frames_num == 0) {
+		JANUS_DEBUG("No frames we can stream in %s\n", filename);
+		janus_streaming_file_source_unmap(source);
+		g_free(source->filename);
+		free(source);
+		return NULL;
+	}
+	/* Frames are sent in order of time */
+	qsort(source->frames, source->frames_num, sizeof(janus_streaming_file_frame), janus_streaming_file_frame_compare);
+	janus_streaming_file_frame *last = &source->frames[source->frames_num-1];
+	if(source->duration < last->when + 20000)
+		source->duration = last->when + 20000;
+	/* Which codecs do we offer? */
+	gboolean has_audio = FALSE, has_video = FALSE;
+	guint i = 0;
+	for(i=0; i<source->frames_num; i++) {
+		if(source->frames[i].video)
+			has_video = TRUE;
+		else
+			has_audio = TRUE;
+	}
+	codecs->audio_pt = -1;
+	codecs->audio_rtpmap = NULL;
+	codecs->video_pt = -1;
+	codecs->video_rtpmap = NULL;
+	if(has_audio) {
+		if(raw) {
+			codecs->audio_pt = strstr(filename, ".alaw") ? 8 : 0;
+			codecs->audio_rtpmap = strstr(filename, ".alaw") ? "PCMA/8000" : "PCMU/8000";
+		} else {
+			codecs->audio_pt = JANUS_STREAMING_OPUS_PT;
+			codecs->audio_rtpmap = "opus/48000/2";
+		}
+	}
+	if(has_video) {
+		codecs->video_pt = JANUS_STREAMING_VP8_PT;
+		codecs->video_rtpmap = "VP8/90000";
+	}
+	JANUS_PRINT("Mapped %s: %u frames, %"SCNi64"ms (audio: %s, video: %s)\n", filename, source->frames_num, source->duration/1000,
+		codecs->audio_rtpmap ? codecs->audio_rtpmap : "none", codecs->video_rtpmap ? codecs->video_rtpmap : "none");
+	return source;
+}
+
+/* Helper to (re)start a file cursor from the beginning */
+static void janus_streaming_file_cursor_reset(janus_streaming_file_cursor *cursor) {
+	cursor->frame = 0;
+	cursor->start = 0;
+	cursor->seq[0] = 1;
+	cursor->seq[1] = 1;
+	cursor->ts_base[0] = 0;
+	cursor->ts_base[1] = 0;
+}
+
+/* Helper to packetize a frame and relay it to a listener (or to all the listeners, if session is NULL) */
+static void janus_streaming_file_send_frame(janus_streaming_mountpoint *mountpoint, janus_streaming_session *session,
+		janus_streaming_file_cursor *cursor, janus_streaming_file_frame *frame) {
+	char buf[RTP_HEADER_SIZE+JANUS_STREAMING_RTP_BUFSIZE];
+	rtp_header *header = (rtp_header *)buf;
+	memset(header, 0, RTP_HEADER_SIZE);
+	header->version = 2;
+	header->ssrc = htonl(1);	/* The gateway will fix this anyway */
+	header->timestamp = htonl(cursor->ts_base[frame->video] + frame->ts);
+	janus_streaming_rtp_relay_packet packet;
+	packet.data = header;
+	packet.is_video = frame->video;
+	if(!frame->video) {
+		/* Audio frames are sent as they are: a truncated frame can't be decoded, so we skip those that don't fit */
+		if(frame->length > JANUS_STREAMING_RTP_BUFSIZE) {
+			JANUS_DEBUG("[%s] Skipping audio frame too large to fit in a packet (%"SCNu32" bytes)\n", mountpoint->name, frame->length);
+			return;
+		}
+		header->type = mountpoint->codecs.audio_pt;
+		header->markerbit = (cursor->seq[0] == 1);
+		header->seq_number = htons(cursor->seq[0]++);
+		memcpy(buf+RTP_HEADER_SIZE, frame->data, frame->length);
+		packet.length = RTP_HEADER_SIZE + frame->length;
+		if(session != NULL)
+			janus_streaming_relay_rtp_packet(session, &packet);
+		else
+			janus_streaming_relay_rtp_listeners(mountpoint, &packet);
+		return;
+	}
+	/* VP8 frames may need more packets (RFC 7741), each with a minimal payload descriptor */
+	header->type = mountpoint->codecs.video_pt;
+	guint32 offset = 0;
+	while(offset < frame->length) {
+		guint32 length = frame->length - offset;
+		if(length > JANUS_STREAMING_VP8_MAX_PAYLOAD)
+			length = JANUS_STREAMING_VP8_MAX_PAYLOAD;
+		buf[RTP_HEADER_SIZE] = (offset == 0) ? 0x10 : 0x00;	/* S bit on the first packet, PID 0 */
+		memcpy(buf+RTP_HEADER_SIZE+1, frame->data+offset, length);
+		offset += length;
+		header->markerbit = (offset == frame->length);	/* Last packet of the frame */
+		header->seq_number = htons(cursor->seq[1]++);
+		packet.length = RTP_HEADER_SIZE + 1 + length;
+		if(session != NULL)
+			janus_streaming_relay_rtp_packet(session, &packet);
+		else
+			janus_streaming_relay_rtp_listeners(mountpoint, &packet);
+	}
+}
+
+/* Helper to send all the frames of a file that are due: returns when the next one will be */
+static gint64 janus_streaming_file_cursor_advance(janus_streaming_mountpoint *mountpoint, janus_streaming_file_source *source,
+		janus_streaming_session *session, janus_streaming_file_cursor *cursor, gint64 now) {
+	if(cursor->start == 0)
+		cursor->start = now;
+	if(now - cursor->start - source->frames[cursor->frame].when > G_USEC_PER_SEC) {
+		/* We're way too late (e.g., the machine was suspended), don't try to catch up */
+		cursor->start = now - source->frames[cursor->frame].when;
+	}
+	while(source->frames[cursor->frame].when <= now - cursor->start) {
+		janus_streaming_file_send_frame(mountpoint, session, cursor, &source->frames[cursor->frame]);
+		cursor->frame++;
+		if(cursor->frame == source->frames_num) {
+			/* FIXME We're doing this forever... should this be configurable? */
+			JANUS_LOG(LOG_VERB, "Rewind! (%s)\n", source->filename);
+			cursor->frame = 0;
+			cursor->start += source->duration;
+			cursor->ts_base[0] += source->duration * source->audio_rate / G_USEC_PER_SEC;
+			cursor->ts_base[1] += source->duration * source->video_rate / G_USEC_PER_SEC;
+		}
+	}
+	return cursor->start + source->frames[cursor->frame].when;
+}
+
+
+/* Helper to add a mountpoint to the table, unless its ID is already taken */
+static int janus_streaming_mountpoint_insert(janus_streaming_mountpoint *mountpoint) {
+	janus_mutex_lock(&mountpoints_mutex);
+	if(g_hash_table_lookup(mountpoints, GINT_TO_POINTER(mountpoint->id)) != NULL) {
+		janus_mutex_unlock(&mountpoints_mutex);
+		JANUS_DEBUG("Can't add stream '%s', ID %"SCNi64" already exists...\n", mountpoint->name, mountpoint->id);
+		return -1;
+	}
+	g_hash_table_insert(mountpoints, GINT_TO_POINTER(mountpoint->id), mountpoint);
+	janus_mutex_unlock(&mountpoints_mutex);
+	return 0;
+}
+
+/* Helper to free a mountpoint that has no sockets, thread or listeners anymore */
+static void janus_streaming_mountpoint_free(janus_streaming_mountpoint *mountpoint) {
+	if(mountpoint->streaming_source == janus_streaming_source_rtp) {
+		/* File sources point to static rtpmaps, RTP sources have a copy */
+		g_free(mountpoint->codecs.audio_rtpmap);
+		g_free(mountpoint->codecs.video_rtpmap);
+		g_free(mountpoint->source);
+	} else if(mountpoint->streaming_source == janus_streaming_source_file) {
+		janus_streaming_file_source *source = (janus_streaming_file_source *)mountpoint->source;
+		janus_streaming_file_source_unmap(source);
+		g_free(source->filename);
+		free(source);
+	}
+	if(mountpoint->sdp_template != NULL && gateway != NULL)
+		gateway->destroy_sdp_template(mountpoint->sdp_template);
+	janus_gop_free(mountpoint->gop);
+	free(mountpoint->listeners);
+	janus_mutex_destroy(&mountpoint->listeners_mutex);
+	g_free(mountpoint->name);
+	g_free(mountpoint->description);
+	free(mountpoint);
+}
+
+/* Helper to create a mountpoint out of a configuration category, whether
+ * it comes from the configuration file or from a "create" request */
+static janus_streaming_mountpoint *janus_streaming_mountpoint_create(janus_config_category *cat) {
+	janus_config_item *type = janus_config_get_item(cat, "type");
+	if(type == NULL || type->value == NULL) {
+		JANUS_PRINT("  -- Invalid type, skipping stream...\n");
+		return NULL;
+	}
+	if(!strcasecmp(type->value, "rtp")) {
+		/* RTP live source (e.g., from gstreamer/ffmpeg/vlc/etc.) */
+		janus_config_item *id = janus_config_get_item(cat, "id");
+		janus_config_item *desc = janus_config_get_item(cat, "description");
+		janus_config_item *audio = janus_config_get_item(cat, "audio");
+		janus_config_item *video = janus_config_get_item(cat, "video");
+		janus_config_item *aport = janus_config_get_item(cat, "audioport");
+		janus_config_item *acodec = janus_config_get_item(cat, "audiopt");
+		janus_config_item *artpmap = janus_config_get_item(cat, "audiortpmap");
+		janus_config_item *vport = janus_config_get_item(cat, "videoport");
+		janus_config_item *vcodec = janus_config_get_item(cat, "videopt");
+		janus_config_item *vrtpmap = janus_config_get_item(cat, "videortpmap");
+		janus_config_item *lazy = janus_config_get_item(cat, "lazy");
+		if(id == NULL || id->value == NULL) {
+			JANUS_DEBUG("Can't add 'rtp' stream, missing mandatory information...\n");
+			return NULL;
+		}
+		gboolean doaudio = audio && audio->value && !strcasecmp(audio->value, "yes");
+		gboolean dovideo = video && video->value && !strcasecmp(video->value, "yes");
+		if(!doaudio && !dovideo) {
+			JANUS_DEBUG("Can't add 'rtp' stream, no audio or video have to be streamed...\n");
+			return NULL;
+		}
+		if(doaudio &&
+				(aport == NULL || aport->value == NULL ||
+				acodec == NULL || acodec->value == NULL ||
+				artpmap == NULL || artpmap->value == NULL)) {
+			JANUS_DEBUG("Can't add 'rtp' stream, missing mandatory information for audio...\n");
+			return NULL;
+		}
+		if(dovideo &&
+				(vport == NULL || vport->value == NULL ||
+				vcodec == NULL || vcodec->value == NULL ||
+				vrtpmap == NULL || vrtpmap->value == NULL)) {
+			JANUS_DEBUG("Can't add 'rtp' stream, missing mandatory information for video...\n");
+			return NULL;
+		}
+		JANUS_PRINT("Audio %s, Video %s\n", doaudio ? "enabled" : "NOT enabled", dovideo ? "enabled" : "NOT enabled");
+		janus_streaming_mountpoint *live_rtp = calloc(1, sizeof(janus_streaming_mountpoint));
+		janus_streaming_rtp_source *live_rtp_source = calloc(1, sizeof(janus_streaming_rtp_source));
+		if(live_rtp == NULL || live_rtp_source == NULL) {
+			JANUS_DEBUG("Memory error!\n");
+			free(live_rtp);
+			free(live_rtp_source);
+			return NULL;
+		}
+		live_rtp->name = g_strdup(cat->name);
+		live_rtp->id = atoi(id->value);
+		if(desc != NULL && desc->value != NULL)
+			live_rtp->description = g_strdup(desc->value);
+		else
+			live_rtp->description = g_strdup(cat->name);
+		live_rtp->active = FALSE;
+		live_rtp->streaming_type = janus_streaming_type_live;
+		live_rtp->streaming_source = janus_streaming_source_rtp;
+		live_rtp_source->audio_port = doaudio ? atoi(aport->value) : -1;
+		live_rtp_source->video_port = dovideo ? atoi(vport->value) : -1;
+		live_rtp_source->lazy = lazy && lazy->value && !strcasecmp(lazy->value, "yes");
+		live_rtp_source->audio.fd = -1;
+		live_rtp_source->video.fd = -1;
+		live_rtp->source = live_rtp_source;
+		live_rtp->codecs.audio_pt = doaudio ? atoi(acodec->value) : -1;
+		live_rtp->codecs.audio_rtpmap = doaudio ? g_strdup(artpmap->value) : NULL;
+		live_rtp->codecs.video_pt = dovideo ? atoi(vcodec->value) : -1;
+		live_rtp->codecs.video_rtpmap = dovideo ? g_strdup(vrtpmap->value) : NULL;
+		live_rtp_source->audio.ts_step = janus_streaming_rtpmap_ts_step(live_rtp->codecs.audio_rtpmap, FALSE);
+		live_rtp_source->video.ts_step = janus_streaming_rtpmap_ts_step(live_rtp->codecs.video_rtpmap, TRUE);
+		if(dovideo && !strncasecmp(vrtpmap->value, "VP8", 3))
+			live_rtp->gop = janus_gop_new();
+		live_rtp->listeners = NULL;
+		janus_mutex_init(&live_rtp->listeners_mutex);
+		if(janus_streaming_mountpoint_insert(live_rtp) < 0) {
+			janus_streaming_mountpoint_free(live_rtp);
+			return NULL;
+		}
+		/* Lazy mountpoints only bind their sockets when the first listener arrives */
+		if(!live_rtp_source->lazy && janus_streaming_rtp_source_bind(live_rtp) < 0) {
+			JANUS_DEBUG("Can't add 'rtp' stream, error binding the sockets...\n");
+			janus_mutex_lock(&mountpoints_mutex);
+			g_hash_table_remove(mountpoints, GINT_TO_POINTER(live_rtp->id));
+			janus_mutex_unlock(&mountpoints_mutex);
+			/* The audio socket may have been bound before the video one failed */
+			janus_streaming_ingest_sync(live_rtp_source->audio.ingest);
+			janus_streaming_mountpoint_free(live_rtp);
+			return NULL;
+		}
+		return live_rtp;
+	} else if(!strcasecmp(type->value, "live") || !strcasecmp(type->value, "ondemand")) {
+		/* File source, streamed live (shared context) or on demand (a context per listener) */
+		gboolean live = !strcasecmp(type->value, "live");
+		janus_config_item *id = janus_config_get_item(cat, "id");
+		janus_config_item *desc = janus_config_get_item(cat, "description");
+		janus_config_item *file = janus_config_get_item(cat, "filename");
+		janus_config_item *audio = janus_config_get_item(cat, "audio");
+		janus_config_item *video = janus_config_get_item(cat, "video");
+		if(id == NULL || id->value == NULL || file == NULL || file->value == NULL) {
+			JANUS_DEBUG("Can't add '%s' stream, missing mandatory information...\n", type->value);
+			return NULL;
+		}
+		gboolean doaudio = audio && audio->value && !strcasecmp(audio->value, "yes");
+		gboolean dovideo = video && video->value && !strcasecmp(video->value, "yes");
+		if(!doaudio && !dovideo) {
+			JANUS_DEBUG("Can't add '%s' stream, no audio or video have to be streamed...\n", type->value);
+			return NULL;
+		}
+		janus_streaming_mountpoint *file_mp = calloc(1, sizeof(janus_streaming_mountpoint));
+		if(file_mp == NULL) {
+			JANUS_DEBUG("Memory error!\n");
+			return NULL;
+		}
+		/* Map and parse the file: this also tells us the codecs */
+		janus_streaming_file_source *file_source = janus_streaming_file_source_create(file->value, doaudio, dovideo, &file_mp->codecs);
+		if(file_source == NULL) {
+			JANUS_DEBUG("Can't add '%s' stream, unsupported or invalid file %s\n", type->value, file->value);
+			free(file_mp);
+			return NULL;
+		}
+		file_mp->name = g_strdup(cat->name);
+		file_mp->id = atoi(id->value);
+		if(desc != NULL && desc->value != NULL)
+			file_mp->description = g_strdup(desc->value);
+		else
+			file_mp->description = g_strdup(cat->name);
+		file_mp->active = FALSE;
+		file_mp->streaming_type = live ? janus_streaming_type_live : janus_streaming_type_on_demand;
+		file_mp->streaming_source = janus_streaming_source_file;
+		file_mp->source = file_source;
+		if(live && file_mp->codecs.video_rtpmap != NULL)
+			file_mp->gop = janus_gop_new();
+		file_mp->listeners = NULL;
+		janus_mutex_init(&file_mp->listeners_mutex);
+		if(janus_streaming_mountpoint_insert(file_mp) < 0) {
+			janus_streaming_mountpoint_free(file_mp);
+			return NULL;
+		}
+		file_source->thread = g_thread_new(file_mp->name,
+			live ? &janus_streaming_filesource_thread : &janus_streaming_ondemand_thread, file_mp);
+		return file_mp;
+	}
+	JANUS_PRINT("  -- Unsupported type '%s', skipping stream...\n", type->value);
+	return NULL;
+}
+
+/* Helper to check the admin key (if any) of requests creating or destroying mountpoints */
+static gboolean janus_streaming_check_admin_key(json_t *root) {
+	if(admin_key == NULL)
+		return TRUE;
+	json_t *key = json_object_get(root, "admin_key");
+	return key && json_is_string(key) && !strcmp(json_string_value(key), admin_key);
+}
+
 
 /* Plugin implementation */
 int janus_streaming_init(janus_callbacks *callback, const char *config_path) {
@@ -217,235 +1260,53 @@ int janus_streaming_init(janus_callbacks *callback, const char *config_path) {
 	char filename[255];
 	sprintf(filename, "%s/%s.cfg", config_path, JANUS_STREAMING_PACKAGE);
 	JANUS_PRINT("Configuration file: %s\n", filename);
-	janus_config *config = janus_config_parse(filename);
+	config = janus_config_parse(filename);
 	if(config != NULL)
 		janus_config_print(config);
+	else
+		config = janus_config_create(JANUS_STREAMING_PACKAGE);
+	config_file = g_strdup(filename);
 	
 	mountpoints = g_hash_table_new(NULL, NULL);
+	/* How many threads should receive RTP for the mountpoints? */
+	if(config != NULL) {
+		janus_config_item *item = janus_config_get_item_drilldown(config, "general", "rtp_threads");
+		if(item && item->value && atoi(item->value) > 0)
+			ingest_threads_num = atoi(item->value);
+		item = janus_config_get_item_drilldown(config, "general", "rtp_timeout");
+		if(item && item->value && atoi(item->value) > 0)
+			rtp_timeout = (gint64)atoi(item->value)*G_USEC_PER_SEC;
+		item = janus_config_get_item_drilldown(config, "general", "admin_key");
+		if(item && item->value)
+			admin_key = g_strdup(item->value);
+	}
+	ingest_threads = calloc(ingest_threads_num, sizeof(janus_streaming_ingest));
+	if(ingest_threads == NULL) {
+		JANUS_DEBUG("Memory error!\n");
+		return -1;
+	}
+	guint i = 0;
+	for(i=0; i<ingest_threads_num; i++) {
+		ingest_threads[i].epoll_fd = epoll_create1(0);
+		if(ingest_threads[i].epoll_fd < 0) {
+			JANUS_DEBUG("Error creating epoll set for the ingest thread...\n");
+			return -1;
+		}
+		janus_mutex_init(&ingest_threads[i].mutex);
+	}
+	JANUS_PRINT("Using %u thread(s) for RTP mountpoints (timeout: %"SCNi64"s)\n", ingest_threads_num, rtp_timeout/G_USEC_PER_SEC);
 	/* Parse configuration to populate the mountpoints */
 	if(config != NULL) {
 		janus_config_category *cat = janus_config_get_categories(config);
 		while(cat != NULL) {
-			if(cat->name == NULL) {
+			if(cat->name == NULL || !strcasecmp(cat->name, "general")) {
 				cat = cat->next;
 				continue;
 			}
 			JANUS_PRINT("Adding stream '%s'\n", cat->name);
-			janus_config_item *type = janus_config_get_item(cat, "type");
-			if(type == NULL || type->value == NULL) {
-				JANUS_PRINT("  -- Invalid type, skipping stream...\n");
-				cat = cat->next;
-				continue;
-			}
-			if(!strcasecmp(type->value, "rtp")) {
-				/* RTP live source (e.g., from gstreamer/ffmpeg/vlc/etc.) */
-				janus_config_item *id = janus_config_get_item(cat, "id");
-				janus_config_item *desc = janus_config_get_item(cat, "description");
-				janus_config_item *audio = janus_config_get_item(cat, "audio");
-				janus_config_item *video = janus_config_get_item(cat, "video");
-				janus_config_item *aport = janus_config_get_item(cat, "audioport");
-				janus_config_item *acodec = janus_config_get_item(cat, "audiopt");
-				janus_config_item *artpmap = janus_config_get_item(cat, "audiortpmap");
-				janus_config_item *vport = janus_config_get_item(cat, "videoport");
-				janus_config_item *vcodec = janus_config_get_item(cat, "videopt");
-				janus_config_item *vrtpmap = janus_config_get_item(cat, "videortpmap");
-				janus_streaming_mountpoint *live_rtp = calloc(1, sizeof(janus_streaming_mountpoint));
-				if(live_rtp == NULL) {
-					JANUS_DEBUG("Memory error!\n");
-					continue;
-				}
-				if(id == NULL || id->value == NULL) {
-					JANUS_DEBUG("Can't add 'rtp' stream, missing mandatory information...\n");
-					cat = cat->next;
-					continue;
-				}
-				gboolean doaudio = audio && audio->value && !strcasecmp(audio->value, "yes");
-				gboolean dovideo = video && video->value && !strcasecmp(video->value, "yes");
-				if(!doaudio && !dovideo) {
-					JANUS_DEBUG("Can't add 'rtp' stream, no audio or video have to be streamed...\n");
-					g_free(live_rtp);
-					cat = cat->next;
-					continue;
-				}
-				if(doaudio &&
-						(aport == NULL || aport->value == NULL ||
-						acodec == NULL || acodec->value == NULL ||
-						artpmap == NULL || artpmap->value == NULL)) {
-					JANUS_DEBUG("Can't add 'rtp' stream, missing mandatory information for audio...\n");
-					cat = cat->next;
-					continue;
-				}
-				if(dovideo &&
-						(vport == NULL || vport->value == NULL ||
-						vcodec == NULL || vcodec->value == NULL ||
-						vrtpmap == NULL || vrtpmap->value == NULL)) {
-					JANUS_DEBUG("Can't add 'rtp' stream, missing mandatory information for video...\n");
-					cat = cat->next;
-					continue;
-				}
-				JANUS_PRINT("Audio %s, Video %s\n", doaudio ? "enabled" : "NOT enabled", dovideo ? "enabled" : "NOT enabled");
-				live_rtp->name = g_strdup(cat->name);
-				live_rtp->id = atoi(id->value);
-				char *description = NULL;
-				if(desc != NULL && desc->value != NULL)
-					description = g_strdup(desc->value);
-				else
-					description = g_strdup(cat->name);
-				live_rtp->description = description;
-				live_rtp->active = FALSE;
-				live_rtp->streaming_type = janus_streaming_type_live;
-				live_rtp->streaming_source = janus_streaming_source_rtp;
-				janus_streaming_rtp_source *live_rtp_source = calloc(1, sizeof(janus_streaming_rtp_source));
-				if(live_rtp->name == NULL || description == NULL || live_rtp_source == NULL) {
-					JANUS_DEBUG("Memory error!\n");
-					if(live_rtp->name)
-						g_free(live_rtp->name);
-					if(description)
-						g_free(description);
-					if(live_rtp_source);
-						g_free(live_rtp_source);
-					g_free(live_rtp);
-					continue;
-				}
-				live_rtp_source->audio_port = doaudio ? atoi(aport->value) : -1;
-				live_rtp_source->video_port = dovideo ? atoi(vport->value) : -1;
-				live_rtp->source = live_rtp_source;
-				live_rtp->codecs.audio_pt = doaudio ? atoi(acodec->value) : -1;
-				live_rtp->codecs.audio_rtpmap = doaudio ? g_strdup(artpmap->value) : NULL;
-				live_rtp->codecs.video_pt = dovideo ? atoi(vcodec->value) : -1;
-				live_rtp->codecs.video_rtpmap = dovideo ? g_strdup(vrtpmap->value) : NULL;
-				live_rtp->listeners = NULL;
-				g_hash_table_insert(mountpoints, GINT_TO_POINTER(live_rtp->id), live_rtp);
-				g_thread_new(live_rtp->name, &janus_streaming_relay_thread, live_rtp);
-			} else if(!strcasecmp(type->value, "live")) {
-				/* a-Law file live source */
-				janus_config_item *id = janus_config_get_item(cat, "id");
-				janus_config_item *desc = janus_config_get_item(cat, "description");
-				janus_config_item *file = janus_config_get_item(cat, "filename");
-				janus_config_item *audio = janus_config_get_item(cat, "audio");
-				janus_config_item *video = janus_config_get_item(cat, "video");
-				if(id == NULL || id->value == NULL || file == NULL || file->value == NULL) {
-					JANUS_DEBUG("Can't add 'live' stream, missing mandatory information...\n");
-					cat = cat->next;
-					continue;
-				}
-				gboolean doaudio = audio && audio->value && !strcasecmp(audio->value, "yes");
-				gboolean dovideo = video && video->value && !strcasecmp(video->value, "yes");
-				/* TODO We should support something more than raw a-Law and mu-Law streams... */
-				if(!doaudio || dovideo) {
-					JANUS_DEBUG("Can't add 'live' stream, we only support audio file streaming right now...\n");
-					cat = cat->next;
-					continue;
-				}
-				if(!strstr(file->value, ".alaw") && !strstr(file->value, ".mulaw")) {
-					JANUS_DEBUG("Can't add 'ondemand' stream, unsupported format (we only support raw mu-Law and a-Law files right now)\n");
-					cat = cat->next;
-					continue;
-				}
-				janus_streaming_mountpoint *live_file = calloc(1, sizeof(janus_streaming_mountpoint));
-				if(live_file == NULL) {
-					JANUS_DEBUG("Memory error!\n");
-					continue;
-				}
-				live_file->name = g_strdup(cat->name);
-				live_file->id = atoi(id->value);
-				char *description = NULL;
-				if(desc != NULL && desc->value != NULL)
-					description = g_strdup(desc->value);
-				else
-					description = g_strdup(cat->name);
-				live_file->description = description;
-				live_file->active = FALSE;
-				live_file->streaming_type = janus_streaming_type_live;
-				live_file->streaming_source = janus_streaming_source_file;
-				janus_streaming_file_source *live_file_source = calloc(1, sizeof(janus_streaming_file_source));
-				if(live_file->name == NULL || description == NULL || live_file_source == NULL) {
-					JANUS_DEBUG("Memory error!\n");
-					if(live_file->name)
-						g_free(live_file->name);
-					if(description)
-						g_free(description);
-					if(live_file_source);
-						g_free(live_file_source);
-					g_free(live_file);
-					continue;
-				}
-				live_file_source->filename = g_strdup(file->value);
-				live_file->source = live_file_source;
-				live_file->codecs.audio_pt = strstr(file->value, ".alaw") ? 8 : 0;
-				live_file->codecs.audio_rtpmap = strstr(file->value, ".alaw") ? "PCMA/8000" : "PCMU/8000";
-				live_file->codecs.video_pt = -1;	/* FIXME We don't support video for this type yet */
-				live_file->codecs.video_rtpmap = NULL;
-				live_file->listeners = NULL;
-				g_hash_table_insert(mountpoints, GINT_TO_POINTER(live_file->id), live_file);
-				g_thread_new(live_file->name, &janus_streaming_filesource_thread, live_file);
-			} else if(!strcasecmp(type->value, "ondemand")) {
-				/* mu-Law file on demand source */
-				janus_config_item *id = janus_config_get_item(cat, "id");
-				janus_config_item *desc = janus_config_get_item(cat, "description");
-				janus_config_item *file = janus_config_get_item(cat, "filename");
-				janus_config_item *audio = janus_config_get_item(cat, "audio");
-				janus_config_item *video = janus_config_get_item(cat, "video");
-				if(id == NULL || id->value == NULL || file == NULL || file->value == NULL) {
-					JANUS_DEBUG("Can't add 'ondemand' stream, missing mandatory information...\n");
-					cat = cat->next;
-					continue;
-				}
-				gboolean doaudio = audio && audio->value && !strcasecmp(audio->value, "yes");
-				gboolean dovideo = video && video->value && !strcasecmp(video->value, "yes");
-				/* TODO We should support something more than raw a-Law and mu-Law streams... */
-				if(!doaudio || dovideo) {
-					JANUS_DEBUG("Can't add 'ondemand' stream, we only support audio file streaming right now...\n");
-					cat = cat->next;
-					continue;
-				}
-				if(!strstr(file->value, ".alaw") && !strstr(file->value, ".mulaw")) {
-					JANUS_DEBUG("Can't add 'ondemand' stream, unsupported format (we only support raw mu-Law and a-Law files right now)\n");
-					cat = cat->next;
-					continue;
-				}
-				janus_streaming_mountpoint *ondemand_file = calloc(1, sizeof(janus_streaming_mountpoint));
-				if(ondemand_file == NULL) {
-					JANUS_DEBUG("Memory error!\n");
-					continue;
-				}
-				ondemand_file->name = g_strdup(cat->name);
-				ondemand_file->id = atoi(id->value);
-				char *description = NULL;
-				if(desc != NULL && desc->value != NULL)
-					description = g_strdup(desc->value);
-				else
-					description = g_strdup(cat->name);
-				ondemand_file->description = description;
-				ondemand_file->active = FALSE;
-				ondemand_file->streaming_type = janus_streaming_type_on_demand;
-				ondemand_file->streaming_source = janus_streaming_source_file;
-				janus_streaming_file_source *ondemand_file_source = calloc(1, sizeof(janus_streaming_file_source));
-				if(ondemand_file->name == NULL || description == NULL || ondemand_file_source == NULL) {
-					JANUS_DEBUG("Memory error!\n");
-					if(ondemand_file->name)
-						g_free(ondemand_file->name);
-					if(description)
-						g_free(description);
-					if(ondemand_file_source);
-						g_free(ondemand_file_source);
-					g_free(ondemand_file);
-					continue;
-				}
-				ondemand_file_source->filename = g_strdup(file->value);
-				ondemand_file->source = ondemand_file_source;
-				ondemand_file->codecs.audio_pt = strstr(file->value, ".alaw") ? 8 : 0;
-				ondemand_file->codecs.audio_rtpmap = strstr(file->value, ".alaw") ? "PCMA/8000" : "PCMU/8000";
-				ondemand_file->codecs.video_pt = -1;	/* FIXME We don't support video for this type yet */
-				ondemand_file->codecs.video_rtpmap = NULL;
-				ondemand_file->listeners = NULL;
-				g_hash_table_insert(mountpoints, GINT_TO_POINTER(ondemand_file->id), ondemand_file);
-			}
+			janus_streaming_mountpoint_create(cat);
 			cat = cat->next;
 		}
-		/* Done */
-		janus_config_destroy(config);
-		config = NULL;
 	}
 	/* Show available mountpoints */
 	GList *mountpoints_list = g_hash_table_get_values(mountpoints);
@@ -486,6 +1347,40 @@ void janus_streaming_destroy() {
 		g_thread_join(handler_thread);
 	}
 	handler_thread = NULL;
+	guint i = 0;
+	for(i=0; i<ingest_threads_num; i++) {
+		if(ingest_threads[i].thread != NULL)
+			g_thread_join(ingest_threads[i].thread);
+		ingest_threads[i].thread = NULL;
+		close(ingest_threads[i].epoll_fd);
+		janus_mutex_destroy(&ingest_threads[i].mutex);
+	}
+	free(ingest_threads);
+	ingest_threads = NULL;
+	/* Wait for the file source threads, and unmap their files */
+	janus_mutex_lock(&mountpoints_mutex);
+	GList *mountpoints_list = g_hash_table_get_values(mountpoints);
+	janus_mutex_unlock(&mountpoints_mutex);
+	GList *m = mountpoints_list;
+	while(m) {
+		janus_streaming_mountpoint *mp = (janus_streaming_mountpoint *)m->data;
+		if(mp->streaming_source == janus_streaming_source_file) {
+			janus_streaming_file_source *source = (janus_streaming_file_source *)mp->source;
+			if(source->thread != NULL)
+				g_thread_join(source->thread);
+			source->thread = NULL;
+			janus_streaming_file_source_unmap(source);
+		}
+		m = m->next;
+	}
+	g_list_free(mountpoints_list);
+	janus_streaming_free_retired(TRUE);
+	janus_config_destroy(config);
+	config = NULL;
+	g_free(config_file);
+	config_file = NULL;
+	g_free(admin_key);
+	admin_key = NULL;
 	/* TODO Actually clean up and remove ongoing sessions (and free the mountpoint resources) */
 	g_hash_table_destroy(mountpoints);
 	g_hash_table_destroy(sessions);
@@ -516,6 +1411,25 @@ const char *janus_streaming_get_package() {
 	return JANUS_STREAMING_PACKAGE;
 }
 
+char *janus_streaming_get_metrics() {
+	if(stopping || !initialized || !mountpoints)
+		return NULL;
+	GString *output = g_string_new(NULL);
+	g_string_append(output, "# HELP janus_streaming_listeners Number of listeners attached to each mountpoint\n");
+	g_string_append(output, "# TYPE janus_streaming_listeners gauge\n");
+	janus_mutex_lock(&mountpoints_mutex);
+	GList *mountpoints_list = g_hash_table_get_values(mountpoints);
+	GList *m = mountpoints_list;
+	while(m) {
+		janus_streaming_mountpoint *mp = (janus_streaming_mountpoint *)m->data;
+		g_string_append_printf(output, "janus_streaming_listeners{mountpoint=\"%"SCNu64"\"} %u\n", mp->id, janus_streaming_listeners_count(mp));
+		m = m->next;
+	}
+	janus_mutex_unlock(&mountpoints_mutex);
+	g_list_free(mountpoints_list);
+	return g_string_free(output, FALSE);
+}
+
 void janus_streaming_create_session(janus_pluginession *handle, int *error) {
 	if(stopping || !initialized) {
 		*error = -1;
@@ -530,6 +1444,7 @@ void janus_streaming_create_session(janus_pluginession *handle, int *error) {
 	session->handle = handle;
 	session->mountpoint = NULL;	/* This will happen later */
 	session->started = FALSE;	/* This will happen later */
+	session->replay = NULL;
 	handle->plugin_handle = session;
 	g_hash_table_insert(sessions, handle, session);
 
@@ -549,12 +1464,19 @@ void janus_streaming_destroy_session(janus_pluginession *handle, int *error) {
 	}
 	JANUS_PRINT("Removing streaming session...\n");
 	/* TODO Actually clean up and remove session */
+	janus_mutex_lock(&mountpoints_mutex);
 	if(session->mountpoint) {
-		session->mountpoint->listeners = g_list_remove_all(session->mountpoint->listeners, session);
+		janus_streaming_listeners_update(session->mountpoint, session, FALSE);
 	}
+	session->mountpoint = NULL;
+	janus_mutex_unlock(&mountpoints_mutex);
 	g_hash_table_remove(sessions, handle);
 	session->destroy = TRUE;
-	g_free(session);
+	/* Relay threads may still have the session in a listeners snapshot */
+	session->destroyed = g_get_monotonic_time();
+	janus_mutex_lock(&old_mutex);
+	old_sessions = g_list_append(old_sessions, session);
+	janus_mutex_unlock(&old_mutex);
 	return;
 }
 
@@ -587,7 +1509,24 @@ void janus_streaming_setup_media(janus_pluginession *handle) {
 	if(session->destroy)
 		return;
 	/* TODO Only start streaming when we get this event */
-	session->started = TRUE;
+	janus_mutex_lock(&mountpoints_mutex);	/* The mountpoint may be destroyed in the meanwhile */
+	janus_streaming_mountpoint *mp = session->mountpoint;
+	if(mp != NULL && mp->gop != NULL) {
+		/* Copy the latest GOP right when the listener joins the live flow
+		 * (no live packet can be relayed meanwhile): the relay thread will
+		 * send it before any live packet, so that the listener doesn't have
+		 * to wait for the next keyframe */
+		janus_mutex_lock(&mp->gop->mutex);
+		janus_gop_copy_free(session->replay);
+		session->replay = janus_gop_copy_new(mp->gop);
+		if(session->replay != NULL)
+			JANUS_LOG(LOG_VERB, "Replaying %u packets of the latest GOP\n", session->replay->count);
+		session->started = TRUE;
+		janus_mutex_unlock(&mp->gop->mutex);
+	} else {
+		session->started = TRUE;
+	}
+	janus_mutex_unlock(&mountpoints_mutex);
 	/* Prepare JSON event */
 	json_t *event = json_object();
 	json_object_set(event, "streaming", json_string("event"));
@@ -638,6 +1577,72 @@ void janus_streaming_hangup_media(janus_pluginession *handle) {
 	g_queue_push_tail(messages, msg);
 }
 
+/* Helper to let all the listeners of a mountpoint know something happened to the source */
+static void janus_streaming_notify_listeners(janus_streaming_mountpoint *mountpoint, const char *status) {
+	json_t *event = json_object();
+	json_object_set_new(event, "streaming", json_string("event"));
+	json_t *result = json_object();
+	json_object_set_new(result, "status", json_string(status));
+	json_object_set_new(result, "id", json_integer(mountpoint->id));
+	json_object_set_new(event, "result", result);
+	char *event_text = json_dumps(event, JSON_INDENT(3));
+	json_decref(event);
+	janus_streaming_listeners *listeners = janus_streaming_listeners_get(mountpoint);
+	if(listeners != NULL) {
+		guint i = 0;
+		for(i=0; i<listeners->count; i++) {
+			janus_streaming_session *session = listeners->sessions[i];
+			if(session->destroy || session->handle == NULL)
+				continue;
+			gateway->push_event(session->handle, &janus_streaming_plugin, NULL, event_text, NULL, NULL);
+		}
+	}
+	g_free(event_text);
+}
+
+/* Watchdog for RTP mountpoints, invoked by the handler thread once per
+ * second: mountpoints that haven't received anything in a while are
+ * marked as inactive (and their listeners notified), and lazy mountpoints
+ * nobody has been watching in a while get their sockets closed */
+static void janus_streaming_watchdog(gint64 now) {
+	/* Mountpoints are only destroyed by the handler thread, so the list stays valid */
+	janus_mutex_lock(&mountpoints_mutex);
+	GList *mountpoints_list = g_hash_table_get_values(mountpoints);
+	janus_mutex_unlock(&mountpoints_mutex);
+	GList *m = mountpoints_list;
+	while(m) {
+		janus_streaming_mountpoint *mp = (janus_streaming_mountpoint *)m->data;
+		m = m->next;
+		if(mp->streaming_source != janus_streaming_source_rtp)
+			continue;
+		janus_streaming_rtp_source *source = (janus_streaming_rtp_source *)mp->source;
+		if(source->lazy && source->bound) {
+			if(janus_streaming_listeners_count(mp) > 0) {
+				source->idle_since = 0;
+			} else if(source->idle_since == 0) {
+				source->idle_since = now;
+			} else if(now - source->idle_since > rtp_timeout) {
+				janus_streaming_rtp_source_unbind(mp);
+			}
+		}
+		gboolean active = mp->active;
+		if(active && now - source->last_packet > rtp_timeout) {
+			/* The ingest thread will mark it as active again as soon as a packet arrives */
+			JANUS_PRINT("[%s] No RTP packets in %"SCNi64" seconds, the source is inactive\n", mp->name, rtp_timeout/G_USEC_PER_SEC);
+			mp->active = FALSE;
+			active = FALSE;
+			janus_streaming_gop_reset(mp);
+		}
+		if(active != source->notified_active) {
+			if(active)
+				JANUS_PRINT("[%s] The source is active\n", mp->name);
+			source->notified_active = active;
+			janus_streaming_notify_listeners(mp, active ? "active" : "inactive");
+		}
+	}
+	g_list_free(mountpoints_list);
+}
+
 /* Thread to handle incoming messages */
 static void *janus_streaming_handler(void *data) {
 	JANUS_DEBUG("Joining thread\n");
@@ -647,7 +1652,14 @@ static void *janus_streaming_handler(void *data) {
 		JANUS_DEBUG("Memory error!\n");
 		return NULL;
 	}
+	gint64 watchdog = g_get_monotonic_time();
 	while(initialized && !stopping) {
+		gint64 now = g_get_monotonic_time();
+		if(now - watchdog >= G_USEC_PER_SEC) {
+			janus_streaming_watchdog(now);
+			janus_streaming_free_retired(FALSE);
+			watchdog = now;
+		}
 		if(!messages || (msg = g_queue_pop_head(messages)) == NULL) {
 			usleep(50000);
 			continue;
@@ -687,11 +1699,13 @@ static void *janus_streaming_handler(void *data) {
 		const char *request_text = json_string_value(request);
 		json_t *result = NULL;
 		char *sdp_type = NULL, *sdp = NULL;
+		janus_sdp_template *sdp_template = NULL;
 		if(!strcasecmp(request_text, "list")) {
 			result = json_object();
 			json_t *list = json_array();
 			JANUS_PRINT("Request for the list of mountpoints\n");
 			/* Return a list of all available mountpoints */
+			janus_mutex_lock(&mountpoints_mutex);
 			GList *mountpoints_list = g_hash_table_get_values(mountpoints);
 			GList *m = mountpoints_list;
 			while(m) {
@@ -700,9 +1714,11 @@ static void *janus_streaming_handler(void *data) {
 				json_object_set_new(ml, "id", json_integer(mp->id));
 				json_object_set_new(ml, "description", json_string(mp->description));
 				json_object_set_new(ml, "type", json_string(mp->streaming_type == janus_streaming_type_live ? "live" : "on demand"));
+				json_object_set_new(ml, "active", mp->active ? json_true() : json_false());
 				json_array_append_new(list, ml);
 				m = m->next;
 			}
+			janus_mutex_unlock(&mountpoints_mutex);
 			json_object_set_new(result, "list", list);
 			g_list_free(mountpoints_list);
 		} else if(!strcasecmp(request_text, "watch")) {
@@ -713,64 +1729,84 @@ static void *janus_streaming_handler(void *data) {
 				goto error;
 			}
 			gint64 id_value = json_integer_value(id);
+			janus_mutex_lock(&mountpoints_mutex);
 			janus_streaming_mountpoint *mp = g_hash_table_lookup(mountpoints, GINT_TO_POINTER(id_value));
+			janus_mutex_unlock(&mountpoints_mutex);
 			if(mp == NULL) {
 				JANUS_PRINT("No such mountpoint/stream %"SCNu64"\n", id_value);
 				sprintf(error_cause, "No such mountpoint/stream %"SCNu64"", id_value);
 				goto error;
 			}
 			JANUS_PRINT("Request to watch mountpoint/stream %"SCNu64"\n", id_value);
+			if(mp->streaming_source == janus_streaming_source_rtp && janus_streaming_rtp_source_bind(mp) < 0) {
+				/* Lazy mountpoint whose ports are not available anymore */
+				JANUS_DEBUG("Error binding the sockets of mountpoint/stream %"SCNu64"\n", id_value);
+				sprintf(error_cause, "Error binding the sockets of mountpoint/stream %"SCNu64"", id_value);
+				goto error;
+			}
 			session->stopping = FALSE;
-			session->mountpoint = mp;
 			if(mp->streaming_type == janus_streaming_type_on_demand) {
-				g_thread_new(session->mountpoint->name, &janus_streaming_ondemand_thread, session);
+				/* On-demand listeners start from the beginning of the file */
+				janus_streaming_file_cursor_reset(&session->ondemand);
 			}
 			/* TODO Check if user is already watching a stream, if the video is active, etc. */
-			mp->listeners = g_list_append(mp->listeners, session);
+			janus_mutex_lock(&mountpoints_mutex);
+			session->mountpoint = mp;
+			janus_streaming_listeners_update(mp, session, TRUE);
+			janus_mutex_unlock(&mountpoints_mutex);
 			sdp_type = "offer";	/* We're always going to do the offer ourselves, never answer */
-			char sdptemp[1024];
-			memset(sdptemp, 0, 1024);
-			gchar buffer[100];
-			memset(buffer, 0, 100);
-			gint64 sessid = g_get_monotonic_time();
-			gint64 version = sessid;	/* FIXME This needs to be increased when it changes, so time should be ok */
-			g_sprintf(buffer,
-				"v=0\r\no=%s %"SCNu64" %"SCNu64" IN IP4 127.0.0.1\r\n",
-					"-", sessid, version);
-			g_strlcat(sdptemp, buffer, 1024);
-			g_strlcat(sdptemp, "s=Streaming Test\r\nt=0 0\r\n", 1024);
-			if(mp->codecs.audio_pt >= 0) {
-				/* Add audio line */
+			/* The SDP is the same for all listeners: we only prepare it once */
+			if(mp->sdp_template == NULL) {
+				char sdptemp[1024];
+				memset(sdptemp, 0, 1024);
+				gchar buffer[100];
+				memset(buffer, 0, 100);
+				gint64 sessid = g_get_monotonic_time();
+				gint64 version = sessid;	/* FIXME This needs to be increased when it changes, so time should be ok */
 				g_sprintf(buffer,
-					"m=audio 1 RTP/SAVPF %d\r\n"
-					"c=IN IP4 1.1.1.1\r\n",
-					mp->codecs.audio_pt);
+					"v=0\r\no=%s %"SCNu64" %"SCNu64" IN IP4 127.0.0.1\r\n",
+						"-", sessid, version);
 				g_strlcat(sdptemp, buffer, 1024);
-				if(mp->codecs.audio_rtpmap) {
+				g_strlcat(sdptemp, "s=Streaming Test\r\nt=0 0\r\n", 1024);
+				if(mp->codecs.audio_pt >= 0) {
+					/* Add audio line */
 					g_sprintf(buffer,
-						"a=rtpmap:%d %s\r\n",
-						mp->codecs.audio_pt, mp->codecs.audio_rtpmap);
+						"m=audio 1 RTP/SAVPF %d\r\n"
+						"c=IN IP4 1.1.1.1\r\n",
+						mp->codecs.audio_pt);
 					g_strlcat(sdptemp, buffer, 1024);
+					if(mp->codecs.audio_rtpmap) {
+						g_sprintf(buffer,
+							"a=rtpmap:%d %s\r\n",
+							mp->codecs.audio_pt, mp->codecs.audio_rtpmap);
+						g_strlcat(sdptemp, buffer, 1024);
+					}
+					g_strlcat(sdptemp, "a=mid:audio\r\na=sendonly\r\n", 1024);
 				}
-				g_strlcat(sdptemp, "a=mid:audio\r\na=sendonly\r\n", 1024);
-			}
-			if(mp->codecs.video_pt >= 0) {
-				/* Add video line */
-				g_sprintf(buffer,
-					"m=video 1 RTP/SAVPF %d\r\n"
-					"c=IN IP4 1.1.1.1\r\n",
-					mp->codecs.video_pt);
-				g_strlcat(sdptemp, buffer, 1024);
-				if(mp->codecs.video_rtpmap) {
+				if(mp->codecs.video_pt >= 0) {
+					/* Add video line */
 					g_sprintf(buffer,
-						"a=rtpmap:%d %s\r\n",
-						mp->codecs.video_pt, mp->codecs.video_rtpmap);
+						"m=video 1 RTP/SAVPF %d\r\n"
+						"c=IN IP4 1.1.1.1\r\n",
+						mp->codecs.video_pt);
 					g_strlcat(sdptemp, buffer, 1024);
+					if(mp->codecs.video_rtpmap) {
+						g_sprintf(buffer,
+							"a=rtpmap:%d %s\r\n",
+							mp->codecs.video_pt, mp->codecs.video_rtpmap);
+						g_strlcat(sdptemp, buffer, 1024);
+					}
+					g_strlcat(sdptemp, "a=mid:video\r\na=sendonly\r\n", 1024);
+				}
+				JANUS_PRINT("Going to offer this SDP:\n%s\n", sdptemp);
+				mp->sdp_template = gateway->create_sdp_template(sdptemp);
+				if(mp->sdp_template == NULL) {
+					JANUS_DEBUG("Error preparing the SDP for mountpoint/stream %"SCNu64"\n", id_value);
+					sprintf(error_cause, "Error preparing the SDP for mountpoint/stream %"SCNu64"", id_value);
+					goto error;
 				}
-				g_strlcat(sdptemp, "a=mid:video\r\na=sendonly\r\n", 1024);
 			}
-			sdp = g_strdup(sdptemp);
-			JANUS_PRINT("Going to offer this SDP:\n%s\n", sdp);
+			sdp_template = mp->sdp_template;
 			result = json_object();
 			json_object_set_new(result, "status", json_string("preparing"));
 		} else if(!strcasecmp(request_text, "start")) {
@@ -789,13 +1825,200 @@ static void *janus_streaming_handler(void *data) {
 			session->started = FALSE;
 			result = json_object();
 			json_object_set_new(result, "status", json_string("stopping"));
+			janus_mutex_lock(&mountpoints_mutex);
 			if(session->mountpoint) {
 				JANUS_PRINT("  -- Removing the session from the mountpoint listeners\n");
-				if(g_list_find(session->mountpoint->listeners, session) != NULL)
-					JANUS_PRINT("  -- -- Found!\n");
-				session->mountpoint->listeners = g_list_remove_all(session->mountpoint->listeners, session);
+				janus_streaming_listeners_update(session->mountpoint, session, FALSE);
 			}
 			session->mountpoint = NULL;
+			janus_mutex_unlock(&mountpoints_mutex);
+		} else if(!strcasecmp(request_text, "create")) {
+			/* Create a new mountpoint, optionally saving it to the configuration file too */
+			if(!janus_streaming_check_admin_key(root)) {
+				JANUS_DEBUG("Unauthorized request (wrong or missing admin_key)\n");
+				sprintf(error_cause, "Unauthorized request (wrong or missing admin_key)");
+				goto error;
+			}
+			json_t *type = json_object_get(root, "type");
+			if(!type || !json_is_string(type)) {
+				JANUS_DEBUG("JSON error: invalid element (type)\n");
+				sprintf(error_cause, "JSON error: invalid element (type)");
+				goto error;
+			}
+			json_t *id = json_object_get(root, "id");
+			if(id && !json_is_integer(id)) {
+				JANUS_DEBUG("JSON error: invalid element (id)\n");
+				sprintf(error_cause, "JSON error: invalid element (id)");
+				goto error;
+			}
+			json_t *name = json_object_get(root, "name");
+			if(name && !json_is_string(name)) {
+				JANUS_DEBUG("JSON error: invalid element (name)\n");
+				sprintf(error_cause, "JSON error: invalid element (name)");
+				goto error;
+			}
+			json_t *permanent = json_object_get(root, "permanent");
+			if(permanent && !json_is_boolean(permanent)) {
+				JANUS_DEBUG("JSON error: invalid element (permanent)\n");
+				sprintf(error_cause, "JSON error: invalid element (permanent)");
+				goto error;
+			}
+			gint64 id_value = id ? json_integer_value(id) : 0;
+			if(id_value == 0) {
+				/* Pick a random ID that is not in use */
+				janus_mutex_lock(&mountpoints_mutex);
+				while(id_value == 0 || g_hash_table_lookup(mountpoints, GINT_TO_POINTER(id_value)) != NULL)
+					id_value = g_random_int_range(1, G_MAXINT32);
+				janus_mutex_unlock(&mountpoints_mutex);
+			}
+			/* The mountpoint is described as if it came from the configuration file */
+			char mp_name[64], value[30];
+			if(name != NULL)
+				g_snprintf(mp_name, sizeof(mp_name), "%s", json_string_value(name));
+			else
+				g_snprintf(mp_name, sizeof(mp_name), "mountpoint-%"SCNi64, id_value);
+			if(strlen(mp_name) == 0 || !strcasecmp(mp_name, "general") || strchr(mp_name, '[') || strchr(mp_name, ']')) {
+				JANUS_DEBUG("Invalid mountpoint name '%s'\n", mp_name);
+				sprintf(error_cause, "Invalid mountpoint name '%s'", mp_name);
+				goto error;
+			}
+			janus_config *mp_config = janus_config_create(mp_name);
+			if(mp_config == NULL) {
+				JANUS_DEBUG("Memory error!\n");
+				sprintf(error_cause, "Memory error");
+				goto error;
+			}
+			janus_config_add_item(mp_config, mp_name, "type", json_string_value(type));
+			g_snprintf(value, sizeof(value), "%"SCNi64, id_value);
+			janus_config_add_item(mp_config, mp_name, "id", value);
+			/* Everything else is copied as it is: the helper will validate it */
+			const char *keys[] = { "description", "filename", "audiortpmap", "videortpmap", NULL };
+			const char *ints[] = { "audioport", "audiopt", "videoport", "videopt", NULL };
+			const char *bools[] = { "audio", "video", "lazy", NULL };
+			int k = 0;
+			for(k=0; keys[k] != NULL; k++) {
+				json_t *item = json_object_get(root, keys[k]);
+				if(item && json_is_string(item))
+					janus_config_add_item(mp_config, mp_name, keys[k], json_string_value(item));
+			}
+			for(k=0; ints[k] != NULL; k++) {
+				json_t *item = json_object_get(root, ints[k]);
+				if(item && json_is_integer(item)) {
+					g_snprintf(value, sizeof(value), "%d", (int)json_integer_value(item));
+					janus_config_add_item(mp_config, mp_name, ints[k], value);
+				}
+			}
+			for(k=0; bools[k] != NULL; k++) {
+				json_t *item = json_object_get(root, bools[k]);
+				if(item && json_is_boolean(item))
+					janus_config_add_item(mp_config, mp_name, bools[k], json_is_true(item) ? "yes" : "no");
+			}
+			janus_config_category *cat = janus_config_get_category(mp_config, mp_name);
+			janus_streaming_mountpoint *mp = NULL;
+			janus_mutex_lock(&config_mutex);
+			/* Names must be unique too, as they're the categories in the configuration file */
+			if(cat != NULL && janus_config_get_category(config, mp_name) == NULL) {
+				JANUS_PRINT("Adding stream '%s'\n", mp_name);
+				mp = janus_streaming_mountpoint_create(cat);
+			}
+			if(mp != NULL && permanent && json_is_true(permanent)) {
+				/* Save the new mountpoint to the configuration file as well */
+				janus_config_item *item = janus_config_get_items(cat);
+				while(item) {
+					janus_config_add_item(config, mp_name, item->name, item->value);
+					item = item->next;
+				}
+				if(janus_config_save(config, config_file) < 0)
+					JANUS_DEBUG("Error saving mountpoint %"SCNi64" to the configuration file...\n", id_value);
+			}
+			janus_mutex_unlock(&config_mutex);
+			janus_config_destroy(mp_config);
+			if(mp == NULL) {
+				JANUS_DEBUG("Error creating mountpoint/stream %"SCNi64" (%s)\n", id_value, mp_name);
+				sprintf(error_cause, "Error creating mountpoint/stream %"SCNi64" (%s): invalid settings, or ID/name already in use", id_value, mp_name);
+				goto error;
+			}
+			result = json_object();
+			json_object_set_new(result, "status", json_string("created"));
+			json_object_set_new(result, "id", json_integer(mp->id));
+			json_object_set_new(result, "name", json_string(mp->name));
+		} else if(!strcasecmp(request_text, "destroy")) {
+			/* Destroy an existing mountpoint, stopping all its listeners */
+			if(!janus_streaming_check_admin_key(root)) {
+				JANUS_DEBUG("Unauthorized request (wrong or missing admin_key)\n");
+				sprintf(error_cause, "Unauthorized request (wrong or missing admin_key)");
+				goto error;
+			}
+			json_t *id = json_object_get(root, "id");
+			if(!id || !json_is_integer(id)) {
+				JANUS_DEBUG("JSON error: invalid element (id)\n");
+				sprintf(error_cause, "JSON error: invalid element (id)");
+				goto error;
+			}
+			json_t *permanent = json_object_get(root, "permanent");
+			if(permanent && !json_is_boolean(permanent)) {
+				JANUS_DEBUG("JSON error: invalid element (permanent)\n");
+				sprintf(error_cause, "JSON error: invalid element (permanent)");
+				goto error;
+			}
+			gint64 id_value = json_integer_value(id);
+			janus_mutex_lock(&mountpoints_mutex);
+			janus_streaming_mountpoint *mp = g_hash_table_lookup(mountpoints, GINT_TO_POINTER(id_value));
+			if(mp != NULL)
+				g_hash_table_remove(mountpoints, GINT_TO_POINTER(id_value));
+			janus_mutex_unlock(&mountpoints_mutex);
+			if(mp == NULL) {
+				JANUS_PRINT("No such mountpoint/stream %"SCNu64"\n", id_value);
+				sprintf(error_cause, "No such mountpoint/stream %"SCNu64"", id_value);
+				goto error;
+			}
+			JANUS_PRINT("Destroying mountpoint/stream %"SCNu64" (%s)\n", id_value, mp->name);
+			/* Tell the listeners, and detach them */
+			janus_streaming_notify_listeners(mp, "stopped");
+			GList *listeners_list = NULL, *l = NULL;
+			janus_streaming_listeners *listeners = janus_streaming_listeners_get(mp);
+			if(listeners != NULL) {
+				guint i = 0;
+				for(i=0; i<listeners->count; i++)
+					listeners_list = g_list_prepend(listeners_list, listeners->sessions[i]);
+			}
+			janus_mutex_lock(&mountpoints_mutex);
+			for(l = listeners_list; l != NULL; l = l->next) {
+				janus_streaming_session *listener = (janus_streaming_session *)l->data;
+				listener->started = FALSE;
+				listener->mountpoint = NULL;
+				janus_streaming_listeners_update(mp, listener, FALSE);
+			}
+			janus_mutex_unlock(&mountpoints_mutex);
+			g_list_free(listeners_list);
+			/* Stop whatever is feeding the mountpoint */
+			mp->destroyed = TRUE;
+			if(mp->streaming_source == janus_streaming_source_rtp) {
+				janus_streaming_rtp_source *source = (janus_streaming_rtp_source *)mp->source;
+				if(source->bound) {
+					janus_streaming_rtp_source_unbind(mp);
+					if(source->audio_port >= 0)
+						janus_streaming_ingest_sync(source->audio.ingest);
+					if(source->video_port >= 0 && (source->audio_port < 0 || source->video.ingest != source->audio.ingest))
+						janus_streaming_ingest_sync(source->video.ingest);
+				}
+			} else if(mp->streaming_source == janus_streaming_source_file) {
+				janus_streaming_file_source *source = (janus_streaming_file_source *)mp->source;
+				if(source->thread != NULL)
+					g_thread_join(source->thread);
+				source->thread = NULL;
+			}
+			if(permanent && json_is_true(permanent)) {
+				/* Remove the mountpoint from the configuration file as well */
+				janus_mutex_lock(&config_mutex);
+				if(janus_config_remove_category(config, mp->name) == 0 && janus_config_save(config, config_file) < 0)
+					JANUS_DEBUG("Error removing mountpoint %"SCNu64" from the configuration file...\n", id_value);
+				janus_mutex_unlock(&config_mutex);
+			}
+			janus_streaming_mountpoint_free(mp);
+			result = json_object();
+			json_object_set_new(result, "status", json_string("destroyed"));
+			json_object_set_new(result, "id", json_integer(id_value));
 		} else {
 			JANUS_PRINT("Unknown request '%s'\n", request_text);
 			sprintf(error_cause, "Unknown request '%s'", request_text);
@@ -818,7 +2041,11 @@ static void *janus_streaming_handler(void *data) {
 		if(result != NULL)
 			json_decref(result);
 		JANUS_PRINT("Pushing event: %s\n", event_text);
-		JANUS_PRINT("  >> %d\n", gateway->push_event(msg->handle, &janus_streaming_plugin, msg->transaction, event_text, sdp_type, sdp));
+		if(sdp_template != NULL) {
+			JANUS_PRINT("  >> %d\n", gateway->push_event_template(msg->handle, &janus_streaming_plugin, msg->transaction, event_text, sdp_type, sdp_template));
+		} else {
+			JANUS_PRINT("  >> %d\n", gateway->push_event(msg->handle, &janus_streaming_plugin, msg->transaction, event_text, sdp_type, sdp));
+		}
 		if(sdp)
 			g_free(sdp);
 		continue;
@@ -841,15 +2068,12 @@ error:
 	return NULL;
 }
 
-/* FIXME Thread to send RTP packets from a file (on demand) */
+/* Thread to send RTP packets from a file (on demand): there's a single
+ * thread per mountpoint, serving all its listeners from the shared mapped
+ * file with the same clock, each from its own position in the file */
 static void *janus_streaming_ondemand_thread(void *data) {
 	JANUS_DEBUG("Filesource (on demand) RTP thread starting...\n");
-	janus_streaming_session *session = (janus_streaming_session *)data;
-	if(!session) {
-		JANUS_DEBUG("Invalid session!\n");
-		return NULL;
-	}
-	janus_streaming_mountpoint *mountpoint = session->mountpoint;
+	janus_streaming_mountpoint *mountpoint = (janus_streaming_mountpoint *)data;
 	if(!mountpoint) {
 		JANUS_DEBUG("Invalid mountpoint!\n");
 		return NULL;
@@ -863,98 +2087,45 @@ static void *janus_streaming_ondemand_thread(void *data) {
 		return NULL;
 	}
 	janus_streaming_file_source *source = mountpoint->source;
-	if(source == NULL || source->filename == NULL) {
+	if(source == NULL || source->frames_num == 0) {
 		JANUS_PRINT("Invalid file source mountpoint!\n");
 		return NULL;
 	}
-	JANUS_PRINT("Opening file source %s...\n", source->filename);
-	FILE *audio = fopen(source->filename, "rb");
-	if(!audio) {
-		JANUS_PRINT("Ooops, audio file missing!\n");
-		return NULL;
-	}
-	JANUS_PRINT("Streaming audio file: %s\n", source->filename);
-	/* Buffer */
-	char *buf = calloc(1024, sizeof(char));
-	if(buf == NULL) {
-		JANUS_DEBUG("Memory error!\n");
-		return NULL;
-	}
-	/* Set up RTP */
-	gint16 seq = 1;
-	gint32 ts = 0;
-	rtp_header *header = (rtp_header *)buf;
-	header->version = 2;
-	header->markerbit = 1;
-	header->type = mountpoint->codecs.audio_pt;
-	header->seq_number = htons(seq);
-	header->timestamp = htonl(ts);
-	header->ssrc = htonl(1);	/* The gateway will fix this anyway */
-	/* Timer */
-	struct timeval now, before;
-	gettimeofday(&before, NULL);
-	now.tv_sec = before.tv_sec;
-	now.tv_usec = before.tv_usec;
-	time_t passed, d_s, d_us;
-	/* Loop */
-	gint read = 0;
-	janus_streaming_rtp_relay_packet packet;
-	while(!stopping && !session->stopping && !session->destroy) {
-		/* See if it's time to prepare a frame */
-		gettimeofday(&now, NULL);
-		d_s = now.tv_sec - before.tv_sec;
-		d_us = now.tv_usec - before.tv_usec;
-		if(d_us < 0) {
-			d_us += 1000000;
-			--d_s;
-		}
-		passed = d_s*1000000 + d_us;
-		if(passed < 18000) {	/* Let's wait about 18ms */
-			usleep(1000);
-			continue;
-		}
-		/* Update the reference time */
-		before.tv_usec += 20000;
-		if(before.tv_usec > 1000000) {
-			before.tv_sec++;
-			before.tv_usec -= 1000000;
-		}
-		/* If not started or paused, wait some more */
-		if(!session->started)
-			continue;
-		/* Read frame from file... */
-		read = fread(buf + RTP_HEADER_SIZE, sizeof(char), 160, audio);
-		if(feof(audio)) {
-			/* FIXME We're doing this forever... should this be configurable? */
-			JANUS_PRINT("Rewind! (%s)\n", source->filename);
-			fseek(audio, 0, SEEK_SET);
-			continue;
+	JANUS_PRINT("Streaming file on demand: %s\n", source->filename);
+	gint64 before = g_get_monotonic_time();
+	while(!stopping && !mountpoint->destroyed) {
+		gint64 now = g_get_monotonic_time();
+		/* Wake up at least every 20ms, to notice new listeners */
+		gint64 next = now + 20000;
+		janus_streaming_listeners *listeners = janus_streaming_listeners_get(mountpoint);
+		if(listeners != NULL) {
+			guint i = 0;
+			for(i=0; i<listeners->count; i++) {
+				janus_streaming_session *session = listeners->sessions[i];
+				janus_streaming_file_cursor *cursor = &session->ondemand;
+				if(!session->started || session->stopping || session->destroy) {
+					/* If not started or paused, the listener stays where it is */
+					if(cursor->start != 0)
+						cursor->start += now - before;
+					continue;
+				}
+				gint64 due = janus_streaming_file_cursor_advance(mountpoint, source, session, cursor, now);
+				if(due < next)
+					next = due;
+			}
+			if(listeners->count > 0 && mountpoint->active == FALSE)
+				mountpoint->active = TRUE;
 		}
-		if(read < 0)
-			break;
-		if(mountpoint->active == FALSE)
-			mountpoint->active = TRUE;
-		//~ JANUS_PRINT(" ... Preparing RTP packet (pt=%u, seq=%u, ts=%u)...\n",
-			//~ header->type, ntohs(header->seq_number), ntohl(header->timestamp));
-		//~ JANUS_PRINT(" ... Read %d bytes from the audio file...\n", read);
-		/* Relay on all sessions */
-		packet.data = header;
-		packet.length = RTP_HEADER_SIZE + read;
-		packet.is_video = 0;
-		janus_streaming_relay_rtp_packet(session, &packet);
-		/* Update header */
-		seq++;
-		header->seq_number = htons(seq);
-		ts += 160;
-		header->timestamp = htonl(ts);
-		header->markerbit = 0;
+		before = now;
+		now = g_get_monotonic_time();
+		if(next > now)
+			g_usleep(next-now);
 	}
-	JANUS_DEBUG("Leaving filesource thread\n");
-	fclose(audio);
+	JANUS_DEBUG("Leaving filesource (on demand) thread\n");
 	return NULL;
 }
 
-/* FIXME Thread to send RTP packets from a file (live) */
+/* Thread to send RTP packets from a file (live): all listeners share the same position in the file */
 static void *janus_streaming_filesource_thread(void *data) {
 	JANUS_DEBUG("Filesource RTP thread starting...\n");
 	janus_streaming_mountpoint *mountpoint = (janus_streaming_mountpoint *)data;
@@ -971,240 +2142,111 @@ static void *janus_streaming_filesource_thread(void *data) {
 		return NULL;
 	}
 	janus_streaming_file_source *source = mountpoint->source;
-	if(source == NULL || source->filename == NULL) {
+	if(source == NULL || source->frames_num == 0) {
 		JANUS_DEBUG("Invalid file source mountpoint!\n");
 		return NULL;
 	}
-	JANUS_PRINT("Opening file source %s...\n", source->filename);
-	FILE *audio = fopen(source->filename, "rb");
-	if(!audio) {
-		JANUS_DEBUG("Ooops, audio file missing!\n");
-		return NULL;
-	}
-	JANUS_PRINT("Streaming audio file: %s\n", source->filename);
-	/* Buffer */
-	char *buf = calloc(1024, sizeof(char));
-	if(buf == NULL) {
-		JANUS_DEBUG("Memory error!\n");
-		return NULL;
-	}
-	/* Set up RTP */
-	gint16 seq = 1;
-	gint32 ts = 0;
-	rtp_header *header = (rtp_header *)buf;
-	header->version = 2;
-	header->markerbit = 1;
-	header->type = mountpoint->codecs.audio_pt;
-	header->seq_number = htons(seq);
-	header->timestamp = htonl(ts);
-	header->ssrc = htonl(1);	/* The gateway will fix this anyway */
-	/* Timer */
-	struct timeval now, before;
-	gettimeofday(&before, NULL);
-	now.tv_sec = before.tv_sec;
-	now.tv_usec = before.tv_usec;
-	time_t passed, d_s, d_us;
-	/* Loop */
-	gint read = 0;
-	janus_streaming_rtp_relay_packet packet;
-	while(!stopping) {	/* FIXME We need a per-mountpoint watchdog as well */
-		/* See if it's time to prepare a frame */
-		gettimeofday(&now, NULL);
-		d_s = now.tv_sec - before.tv_sec;
-		d_us = now.tv_usec - before.tv_usec;
-		if(d_us < 0) {
-			d_us += 1000000;
-			--d_s;
-		}
-		passed = d_s*1000000 + d_us;
-		if(passed < 18000) {	/* Let's wait about 18ms */
-			usleep(1000);
-			continue;
-		}
-		/* Update the reference time */
-		before.tv_usec += 20000;
-		if(before.tv_usec > 1000000) {
-			before.tv_sec++;
-			before.tv_usec -= 1000000;
-		}
-		/* Read frame from file... */
-		read = fread(buf + RTP_HEADER_SIZE, sizeof(char), 160, audio);
-		if(feof(audio)) {
-			/* FIXME We're doing this forever... should this be configurable? */
-			JANUS_PRINT("Rewind! (%s)\n", source->filename);
-			fseek(audio, 0, SEEK_SET);
-			continue;
-		}
-		if(read < 0)
-			break;
-		if(mountpoint->active == FALSE)
-			mountpoint->active = TRUE;
-		// JANUS_PRINT(" ... Preparing RTP packet (pt=%u, seq=%u, ts=%u)...\n",
-			// header->type, ntohs(header->seq_number), ntohl(header->timestamp));
-		// JANUS_PRINT(" ... Read %d bytes from the audio file...\n", read);
-		/* Relay on all sessions */
-		packet.data = header;
-		packet.length = RTP_HEADER_SIZE + read;
-		packet.is_video = 0;
-		g_list_foreach(mountpoint->listeners, janus_streaming_relay_rtp_packet, &packet);
-		/* Update header */
-		seq++;
-		header->seq_number = htons(seq);
-		ts += 160;
-		header->timestamp = htonl(ts);
-		header->markerbit = 0;
+	JANUS_PRINT("Streaming file: %s\n", source->filename);
+	janus_streaming_file_cursor cursor;
+	janus_streaming_file_cursor_reset(&cursor);
+	mountpoint->active = TRUE;
+	while(!stopping && !mountpoint->destroyed) {
+		gint64 now = g_get_monotonic_time();
+		gint64 next = janus_streaming_file_cursor_advance(mountpoint, source, NULL, &cursor, now);
+		/* Don't sleep too long, though, or we'd be slow to notice we need to stop */
+		if(next > now + 100000)
+			next = now + 100000;
+		now = g_get_monotonic_time();
+		if(next > now)
+			g_usleep(next-now);
 	}
 	JANUS_DEBUG("Leaving filesource thread\n");
-	fclose(audio);
 	return NULL;
 }
 
-/* FIXME Test thread to relay RTP frames coming from gstreamer */
-static void *janus_streaming_relay_thread(void *data) {
-	JANUS_DEBUG("Starting relay thread\n");
-	janus_streaming_mountpoint *mountpoint = (janus_streaming_mountpoint *)data;
-	if(!mountpoint) {
-		JANUS_DEBUG("Invalid mountpoint!\n");
-		return NULL;
+/* Helper to fix seq and ts of a packet we received on an RTP mountpoint, and relay it to all the listeners */
+static void janus_streaming_rtp_socket_relay(janus_streaming_rtp_socket *rtp_socket, char *buffer, int bytes) {
+	janus_streaming_mountpoint *mountpoint = rtp_socket->mountpoint;
+	if(bytes < 12)
+		return;
+	if(mountpoint->active == FALSE)
+		mountpoint->active = TRUE;
+	janus_streaming_rtp_relay_packet packet;
+	packet.data = (rtp_header *)buffer;
+	packet.length = bytes;
+	packet.is_video = rtp_socket->is_video;
+	/* Do we have a new stream? */
+	if(ntohl(packet.data->ssrc) != rtp_socket->last_ssrc) {
+		rtp_socket->last_ssrc = ntohl(packet.data->ssrc);
+		JANUS_PRINT("[%s] New %s stream! (ssrc=%u)\n", mountpoint->name, rtp_socket->is_video ? "video" : "audio", rtp_socket->last_ssrc);
+		rtp_socket->base_ts_prev = rtp_socket->last_ts;
+		rtp_socket->base_ts = ntohl(packet.data->timestamp);
+		rtp_socket->base_seq_prev = rtp_socket->last_seq;
+		rtp_socket->base_seq = ntohs(packet.data->seq_number);
+		if(rtp_socket->is_video)
+			janus_streaming_gop_reset(mountpoint);
 	}
-	if(mountpoint->streaming_source != janus_streaming_source_rtp) {
-		JANUS_DEBUG("[%s] Not an RTP source mountpoint!\n", mountpoint->name);
+	rtp_socket->last_ts = (ntohl(packet.data->timestamp)-rtp_socket->base_ts)+rtp_socket->base_ts_prev+rtp_socket->ts_step;
+	packet.data->timestamp = htonl(rtp_socket->last_ts);
+	rtp_socket->last_seq = (ntohs(packet.data->seq_number)-rtp_socket->base_seq)+rtp_socket->base_seq_prev+1;
+	packet.data->seq_number = htons(rtp_socket->last_seq);
+	packet.data->type = rtp_socket->is_video ? mountpoint->codecs.video_pt : mountpoint->codecs.audio_pt;
+	/* Go! Listeners get the packet straight from the receive buffer */
+	janus_streaming_relay_rtp_listeners(mountpoint, &packet);
+}
+
+/* Thread to relay RTP frames coming from gstreamer (or others) for all the mountpoints assigned to it */
+static void *janus_streaming_ingest_thread(void *data) {
+	janus_streaming_ingest *ingest = (janus_streaming_ingest *)data;
+	JANUS_DEBUG("Starting ingest thread (%u sockets)\n", ingest->sockets);
+	/* Buffers for a batch of packets, reused for each recvmmsg */
+	char *buffers = calloc(JANUS_STREAMING_INGEST_BATCH, JANUS_STREAMING_RTP_BUFSIZE);
+	if(buffers == NULL) {
+		JANUS_DEBUG("Memory error!\n");
 		return NULL;
 	}
-	janus_streaming_rtp_source *source = mountpoint->source;
-	if(source == NULL) {
-		JANUS_DEBUG("[%s] Invalid RTP source mountpoint!\n", mountpoint->name);
-		return NULL;
+	struct mmsghdr msgs[JANUS_STREAMING_INGEST_BATCH];
+	struct iovec iovecs[JANUS_STREAMING_INGEST_BATCH];
+	struct epoll_event events[JANUS_STREAMING_INGEST_BATCH];
+	int i = 0, j = 0;
+	memset(msgs, 0, sizeof(msgs));
+	for(i=0; i<JANUS_STREAMING_INGEST_BATCH; i++) {
+		iovecs[i].iov_base = buffers + i*JANUS_STREAMING_RTP_BUFSIZE;
+		iovecs[i].iov_len = JANUS_STREAMING_RTP_BUFSIZE;
+		msgs[i].msg_hdr.msg_iov = &iovecs[i];
+		msgs[i].msg_hdr.msg_iovlen = 1;
 	}
-	gint audio_port = source->audio_port;
-	gint video_port = source->video_port;
-	/* Socket stuff */
-	struct sockaddr_in audio_address, video_address;
-	int audio_fd = 0;
-	if(audio_port >= 0) {
-		audio_fd = socket(AF_INET, SOCK_DGRAM, 0);
-		int yes = 1;	/* For setsockopt() SO_REUSEADDR */
-		setsockopt(audio_fd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(int));
-		audio_address.sin_family = AF_INET;
-		audio_address.sin_port = htons(audio_port);
-		audio_address.sin_addr.s_addr = INADDR_ANY;
-		if(bind(audio_fd, (struct sockaddr *)(&audio_address), sizeof(struct sockaddr)) < 0) {
-			JANUS_DEBUG("[%s] Bind failed for audio (port %d)...\n", mountpoint->name, audio_port);
-			return NULL;
-		}
-		JANUS_PRINT("[%s] Audio listener bound to port %d\n", mountpoint->name, audio_port);
-	}
-	int video_fd = 0;
-	if(video_port >= 0) {
-		video_fd = socket(AF_INET, SOCK_DGRAM, 0);
-		int yes = 1;	/* For setsockopt() SO_REUSEADDR */
-		setsockopt(video_fd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(int));
-		video_address.sin_family = AF_INET;
-		video_address.sin_port = htons(video_port);
-		video_address.sin_addr.s_addr = INADDR_ANY;
-		if(bind(video_fd, (struct sockaddr *)(&video_address), sizeof(struct sockaddr)) < 0) {
-			JANUS_DEBUG("[%s] Bind failed for video (%d)...\n", mountpoint->name, video_port);
-			return NULL;
-		}
-		JANUS_PRINT("[%s] Video listener bound to port %d\n", mountpoint->name, video_port);
-	}
-	int maxfd = (audio_fd > video_fd) ? audio_fd : video_fd;
-	/* Needed to fix seq and ts */
-	uint32_t a_last_ssrc = 0, a_last_ts = 0, a_base_ts = 0, a_base_ts_prev = 0,
-			v_last_ssrc = 0, v_last_ts = 0, v_base_ts = 0, v_base_ts_prev = 0;
-	uint16_t a_last_seq = 0, a_base_seq = 0, a_base_seq_prev = 0,
-			v_last_seq = 0, v_base_seq = 0, v_base_seq_prev = 0;
-	/* Loop */
-	socklen_t addrlen;
-	struct sockaddr_in remote;
-	int resfd = 0, bytes = 0;
-	struct timeval timeout;
-	fd_set readfds;
-	FD_ZERO(&readfds);
-	char buffer[1500];
-	memset(buffer, 0, 1500);
-	janus_streaming_rtp_relay_packet packet;
-	while(!stopping) {	/* FIXME We need a per-mountpoint watchdog as well */
+	while(!stopping) {
 		/* Wait for some data */
-		if(audio_fd > 0)
-			FD_SET(audio_fd, &readfds);
-		if(video_fd > 0)
-			FD_SET(video_fd, &readfds);
-		timeout.tv_sec = 1;
-		timeout.tv_usec = 0;
-		resfd = select(maxfd+1, &readfds, NULL, NULL, &timeout);
-		if(resfd < 0)
-			break;
-		if(audio_fd > 0 && FD_ISSET(audio_fd, &readfds)) {
-			if(mountpoint->active == FALSE)
-				mountpoint->active = TRUE;
-			/* Got something audio */
-			addrlen = sizeof(remote);
-			bytes = recvfrom(audio_fd, buffer, 1500, 0, (struct sockaddr*)&remote, &addrlen);
-			// JANUS_PRINT("************************\nGot %d bytes on the audio channel...\n", bytes);
-			rtp_header *rtp = (rtp_header *)buffer;
-			// JANUS_PRINT(" ... parsed RTP packet (ssrc=%u, pt=%u, seq=%u, ts=%u)...\n",
-				// ntohl(rtp->ssrc), rtp->type, ntohs(rtp->seq_number), ntohl(rtp->timestamp));
-			/* Relay on all sessions */
-			packet.data = rtp;
-			packet.length = bytes;
-			packet.is_video = 0;
-			/* Do we have a new stream? */
-			if(ntohl(packet.data->ssrc) != a_last_ssrc) {
-				a_last_ssrc = ntohl(packet.data->ssrc);
-				JANUS_PRINT("[%s] New audio stream! (ssrc=%u)\n", mountpoint->name, a_last_ssrc);
-				a_base_ts_prev = a_last_ts;
-				a_base_ts = ntohl(packet.data->timestamp);
-				a_base_seq_prev = a_last_seq;
-				a_base_seq = ntohs(packet.data->seq_number);
+		int ready = epoll_wait(ingest->epoll_fd, events, JANUS_STREAMING_INGEST_BATCH, 1000);
+		if(ready < 0) {
+			if(errno == EINTR) {
+				g_atomic_int_inc(&ingest->batches);
+				continue;
 			}
-			a_last_ts = (ntohl(packet.data->timestamp)-a_base_ts)+a_base_ts_prev+960;	/* FIXME We're assuming Opus here... */
-			packet.data->timestamp = htonl(a_last_ts);
-			a_last_seq = (ntohs(packet.data->seq_number)-a_base_seq)+a_base_seq_prev+1;
-			packet.data->seq_number = htons(a_last_seq);
-			// JANUS_PRINT(" ... updated RTP packet (ssrc=%u, pt=%u, seq=%u, ts=%u)...\n",
-				// ntohl(rtp->ssrc), rtp->type, ntohs(rtp->seq_number), ntohl(rtp->timestamp));
-			packet.data->type = mountpoint->codecs.audio_pt;
-			/* Go! */
-			g_list_foreach(mountpoint->listeners, janus_streaming_relay_rtp_packet, &packet);
-			continue;
+			JANUS_DEBUG("Error waiting for RTP packets: %d (%s)\n", errno, strerror(errno));
+			break;
 		}
-		if(video_fd > 0 && FD_ISSET(video_fd, &readfds)) {
-			if(mountpoint->active == FALSE)
-				mountpoint->active = TRUE;
-			/* Got something video */
-			addrlen = sizeof(remote);
-			bytes = recvfrom(video_fd, buffer, 1500, 0, (struct sockaddr*)&remote, &addrlen);
-			//~ JANUS_PRINT("************************\nGot %d bytes on the video channel...\n", bytes);
-			rtp_header *rtp = (rtp_header *)buffer;
-			//~ JANUS_PRINT(" ... parsed RTP packet (ssrc=%u, pt=%u, seq=%u, ts=%u)...\n",
-				//~ ntohl(rtp->ssrc), rtp->type, ntohs(rtp->seq_number), ntohl(rtp->timestamp));
-			/* Relay on all sessions */
-			packet.data = rtp;
-			packet.length = bytes;
-			packet.is_video = 1;
-			/* Do we have a new stream? */
-			if(ntohl(packet.data->ssrc) != v_last_ssrc) {
-				v_last_ssrc = ntohl(packet.data->ssrc);
-				JANUS_PRINT("[%s] New video stream! (ssrc=%u)\n", mountpoint->name, v_last_ssrc);
-				v_base_ts_prev = v_last_ts;
-				v_base_ts = ntohl(packet.data->timestamp);
-				v_base_seq_prev = v_last_seq;
-				v_base_seq = ntohs(packet.data->seq_number);
-			}
-			v_last_ts = (ntohl(packet.data->timestamp)-v_base_ts)+v_base_ts_prev+4500;	/* FIXME We're assuming 15fps here... */
-			packet.data->timestamp = htonl(v_last_ts);
-			v_last_seq = (ntohs(packet.data->seq_number)-v_base_seq)+v_base_seq_prev+1;
-			packet.data->seq_number = htons(v_last_seq);
-			//~ JANUS_PRINT(" ... updated RTP packet (ssrc=%u, pt=%u, seq=%u, ts=%u)...\n",
-				//~ ntohl(rtp->ssrc), rtp->type, ntohs(rtp->seq_number), ntohl(rtp->timestamp));
-			packet.data->type = mountpoint->codecs.video_pt;
-			/* Go! */
-			g_list_foreach(mountpoint->listeners, janus_streaming_relay_rtp_packet, &packet);
-			continue;
+		gint64 now = g_get_monotonic_time();
+		janus_mutex_lock(&ingest->mutex);
+		for(i=0; i<ready; i++) {
+			janus_streaming_rtp_socket *rtp_socket = (janus_streaming_rtp_socket *)events[i].data.ptr;
+			if(rtp_socket->fd < 0)	/* Closed in the meanwhile */
+				continue;
+			/* Read as many packets as we can in one go */
+			int packets = recvmmsg(rtp_socket->fd, msgs, JANUS_STREAMING_INGEST_BATCH, MSG_DONTWAIT, NULL);
+			if(packets <= 0)
+				continue;
+			/* Let the watchdog know the source is still alive */
+			((janus_streaming_rtp_source *)rtp_socket->mountpoint->source)->last_packet = now;
+			for(j=0; j<packets; j++)
+				janus_streaming_rtp_socket_relay(rtp_socket, (char *)iovecs[j].iov_base, msgs[j].msg_len);
 		}
+		janus_mutex_unlock(&ingest->mutex);
+		g_atomic_int_inc(&ingest->batches);
 	}
-	JANUS_DEBUG("Leaving relay thread\n");
+	free(buffers);
+	JANUS_DEBUG("Leaving ingest thread\n");
 	return NULL;
 }
 
@@ -1223,6 +2265,14 @@ static void janus_streaming_relay_rtp_packet(gpointer data, gpointer user_data)
 		// JANUS_DEBUG("Streaming not started yet for this session...\n");
 		return;
 	}
+	if(packet->is_video && session->replay != NULL) {
+		/* Still replaying the latest GOP (see setup_media): we hold the gop mutex here */
+		if(janus_gop_copy_relay(session->replay, (char *)packet->data, packet->length, janus_streaming_gop_send, session)) {
+			janus_gop_copy_free(session->replay);
+			session->replay = NULL;
+		}
+		return;
+	}
 	if(gateway != NULL)	/* FIXME What about RTCP? */
 		gateway->relay_rtp(session->handle, packet->is_video, (char *)packet->data, packet->length);
 	return;
@@ -30,6 +30,7 @@
 
 #include "../config.h"
 #include "../rtcp.h"
+#include "../mutex.h"
 
 
 /* Plugin information */
@@ -107,8 +108,37 @@ typedef struct janus_videocall_session {
 	uint64_t bitrate;
 	struct janus_videocall_session *peer;
 	gboolean destroy;
+	gint64 destroyed;	/* When the session was destroyed (it's only freed a few seconds later) */
 } janus_videocall_session;
 GHashTable *sessions;
+/* Peers are only paired and split with this lock held */
+static janus_mutex peers_mutex = JANUS_MUTEX_INITIALIZER;
+/* Destroyed sessions are freed by the handler thread after a few seconds, as
+ * the peer may still be relaying media to them in the meanwhile */
+#define JANUS_VIDEOCALL_SESSION_GRACE	5
+static GList *old_sessions = NULL;
+static janus_mutex old_sessions_mutex = JANUS_MUTEX_INITIALIZER;
+
+static void janus_videocall_free_destroyed_sessions(gboolean all) {
+	gint64 now = g_get_monotonic_time();
+	GList *expired = NULL;
+	janus_mutex_lock(&old_sessions_mutex);
+	while(old_sessions) {
+		janus_videocall_session *session = (janus_videocall_session *)old_sessions->data;
+		if(!all && now-session->destroyed < JANUS_VIDEOCALL_SESSION_GRACE*G_USEC_PER_SEC)
+			break;	/* Sessions are appended as they're destroyed, so the others are even newer */
+		old_sessions = g_list_delete_link(old_sessions, old_sessions);
+		expired = g_list_prepend(expired, session);
+	}
+	janus_mutex_unlock(&old_sessions_mutex);
+	GList *l = NULL;
+	for(l = expired; l; l = l->next) {
+		janus_videocall_session *session = (janus_videocall_session *)l->data;
+		g_free(session->username);
+		g_free(session);
+	}
+	g_list_free(expired);
+}
 
 
 /* Plugin implementation */
@@ -161,6 +191,7 @@ void janus_videocall_destroy() {
 	}
 	handler_thread = NULL;
 	/* TODO Actually clean up and remove ongoing sessions */
+	janus_videocall_free_destroyed_sessions(TRUE);
 	g_hash_table_destroy(sessions);
 	g_queue_free(messages);
 	sessions = NULL;
@@ -224,17 +255,21 @@ void janus_videocall_destroy_session(janus_pluginession *handle, int *error) {
 	}
 	if(session->destroy) {
 		JANUS_PRINT("Session already destroyed...\n");
-		g_free(session);
 		return;
 	}
 	JANUS_PRINT("Removing user %s session...\n", session->username ? session->username : "'unknown'");
+	/* Split from our peer (if any) before the gateway frees our handle */
 	janus_videocall_hangup_media(handle);
+	janus_mutex_lock(&peers_mutex);
 	session->destroy = TRUE;
-	/* FIXME Actually clean up session */
 	if(session->username != NULL) {
 		JANUS_PRINT("  -- Removed: %d\n", g_hash_table_remove(sessions, (gpointer)session->username));
 	}
-	g_free(session);
+	janus_mutex_unlock(&peers_mutex);
+	session->destroyed = g_get_monotonic_time();
+	janus_mutex_lock(&old_sessions_mutex);
+	old_sessions = g_list_append(old_sessions, session);
+	janus_mutex_unlock(&old_sessions_mutex);
 	return;
 }
 
@@ -323,7 +358,13 @@ void janus_videocall_hangup_media(janus_pluginession *handle) {
 	}
 	if(session->destroy)
 		return;
-	if(session->peer) {
+	janus_mutex_lock(&peers_mutex);
+	janus_videocall_session *peer = session->peer;
+	session->peer = NULL;
+	if(peer != NULL && peer->peer == session)
+		peer->peer = NULL;
+	janus_mutex_unlock(&peers_mutex);
+	if(peer) {
 		/* Send event to our peer too */
 		json_t *call = json_object();
 		json_object_set(call, "videocall", json_string("event"));
@@ -335,9 +376,8 @@ void janus_videocall_hangup_media(janus_pluginession *handle) {
 		char *call_text = json_dumps(call, JSON_INDENT(3));
 		json_decref(call);
 		JANUS_PRINT("Pushing event to peer: %s\n", call_text);
-		JANUS_PRINT("  >> %d\n", gateway->push_event(session->peer->handle, &janus_videocall_plugin, NULL, call_text, NULL, NULL));
+		JANUS_PRINT("  >> %d\n", gateway->push_event(peer->handle, &janus_videocall_plugin, NULL, call_text, NULL, NULL));
 	}
-	session->peer = NULL;
 	/* Reset controls */
 	session->audio_active = TRUE;
 	session->video_active = TRUE;
@@ -354,6 +394,7 @@ static void *janus_videocall_handler(void *data) {
 		return NULL;
 	}
 	while(initialized && !stopping) {
+		janus_videocall_free_destroyed_sessions(FALSE);
 		if(!messages || (msg = g_queue_pop_head(messages)) == NULL) {
 			usleep(50000);
 			continue;
@@ -398,6 +439,7 @@ static void *janus_videocall_handler(void *data) {
 			json_t *list = json_array();
 			JANUS_PRINT("Request for the list of peers\n");
 			/* Return a list of all available mountpoints */
+			janus_mutex_lock(&peers_mutex);
 			GList *peers_list = g_hash_table_get_values(sessions);
 			GList *m = peers_list;
 			while(m) {
@@ -406,6 +448,7 @@ static void *janus_videocall_handler(void *data) {
 					json_array_append_new(list, json_string(user->username));
 				m = m->next;
 			}
+			janus_mutex_unlock(&peers_mutex);
 			json_object_set_new(result, "list", list);
 			g_list_free(peers_list);
 		} else if(!strcasecmp(request_text, "register")) {
@@ -433,7 +476,9 @@ static void *janus_videocall_handler(void *data) {
 				sprintf(error_cause, "Memory error");
 				goto error;
 			}
+			janus_mutex_lock(&peers_mutex);
 			g_hash_table_insert(sessions, (gpointer)session->username, session);
+			janus_mutex_unlock(&peers_mutex);
 			result = json_object();
 			json_object_set_new(result, "event", json_string("registered"));
 			json_object_set_new(result, "username", json_string(username_text));
@@ -451,27 +496,33 @@ static void *janus_videocall_handler(void *data) {
 				goto error;
 			}
 			const char *username_text = json_string_value(username);
+			/* Any SDP to handle? if not, something's wrong */
+			if(!msg->sdp) {
+				JANUS_DEBUG("Missing SDP\n");
+				sprintf(error_cause, "Missing SDP");
+				goto error;
+			}
+			janus_mutex_lock(&peers_mutex);
 			janus_videocall_session *peer = g_hash_table_lookup(sessions, username_text);
-			if(peer == NULL) {
+			if(peer == NULL || peer->destroy) {
+				janus_mutex_unlock(&peers_mutex);
 				JANUS_DEBUG("Username '%s' doesn't exist\n", username_text);
 				sprintf(error_cause, "Username '%s' doesn't exist", username_text);
 				goto error;
 			}
-			if(peer->peer != NULL) {
+			gboolean busy = (peer->peer != NULL);
+			if(!busy) {
+				session->peer = peer;
+				peer->peer = session;
+			}
+			janus_mutex_unlock(&peers_mutex);
+			if(busy) {
 				JANUS_PRINT("%s is busy\n", username_text);
 				result = json_object();
 				json_object_set_new(result, "event", json_string("hangup"));
 				json_object_set_new(result, "username", json_string(session->username));
 				json_object_set_new(result, "reason", json_string("User busy"));
 			} else {
-				/* Any SDP to handle? if not, something's wrong */
-				if(!msg->sdp) {
-					JANUS_DEBUG("Missing SDP\n");
-					sprintf(error_cause, "Missing SDP");
-					goto error;
-				}
-				session->peer = peer;
-				peer->peer = session;
 				JANUS_PRINT("%s is calling %s\n", session->username, session->peer->username);
 				JANUS_PRINT("This is involving a negotiation (%s) as well:\n%s\n", msg->sdp_type, msg->sdp);
 				/* Send SDP to our peer */
@@ -570,10 +621,15 @@ static void *janus_videocall_handler(void *data) {
 				//~ goto error;
 				continue;
 			}
+			janus_mutex_lock(&peers_mutex);
 			janus_videocall_session *peer = session->peer;
-			JANUS_PRINT("%s is hanging up the call with %s\n", session->username, peer->username);
 			session->peer = NULL;
-			peer->peer = NULL;
+			if(peer != NULL && peer->peer == session)
+				peer->peer = NULL;
+			janus_mutex_unlock(&peers_mutex);
+			if(peer == NULL)
+				continue;
+			JANUS_PRINT("%s is hanging up the call with %s\n", session->username, peer->username);
 			/* Notify the success as an hangup message */
 			result = json_object();
 			json_object_set_new(result, "event", json_string("hangup"));
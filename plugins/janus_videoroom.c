@@ -26,6 +26,12 @@
  * only purpose would be to provide a context in which creating the sendonly
  * PeerConnection for the subscription to the active participant.
  * 
+ * Publishers can only use VP8 and Opus, so that their media can be
+ * relayed as it is. The plugin also keeps all the VP8 packets each
+ * publisher sent since its latest keyframe (see gop.h): listeners get
+ * them as soon as they start (or resume) receiving, and so don't need
+ * to wait for the next keyframe before they can render something.
+ * 
  * Rooms to make available are listed in the plugin configuration file.
  * A pre-filled configuration file is provided in \c conf/janus.plugin.videoroom.cfg
  * and includes a demo room for testing.
@@ -40,6 +46,34 @@ publishers = <max number of concurrent senders> (e.g., 6 for a video
              conference or 1 for a webinar)
 bitrate = <max video bitrate for senders> (e.g., 128000)
 \endverbatim
+ *
+ * Rooms can also be created and destroyed at runtime, using any handle
+ * attached to the plugin:
+ *
+ * \verbatim
+{
+	"request" : "create",
+	"room" : <unique room ID (optional, a random one is picked if missing)>,
+	"description" : "<description (optional)>",
+	"publishers" : <max number of concurrent senders (optional)>,
+	"bitrate" : <max video bitrate for senders (optional)>,
+	"permanent" : <true|false, whether the room should be saved to the configuration file too>,
+	"admin_key" : "<admin_key, if one is configured>"
+}
+
+{
+	"request" : "destroy",
+	"room" : <room ID>,
+	"permanent" : <true|false, whether the room should be removed from the configuration file too>,
+	"admin_key" : "<admin_key, if one is configured>"
+}
+\endverbatim
+ *
+ * A successful request gets a \c created (or \c destroyed ) event with
+ * the room ID; publishers and listeners of a destroyed room get a
+ * \c destroyed event too. The \c admin_key is only needed if one is
+ * set in the \c [general] section of the configuration file. Saving a
+ * room rewrites the configuration file, so any comment in it is lost.
  *
  * \ingroup plugins
  * \ref plugins
@@ -50,7 +84,10 @@ bitrate = <max video bitrate for senders> (e.g., 128000)
 #include <jansson.h>
 
 #include "../config.h"
+#include "../rtp.h"
 #include "../rtcp.h"
+#include "../codecs.h"
+#include "../gop.h"
 
 
 /* Plugin information */
@@ -113,6 +150,9 @@ static void *janus_videoroom_handler(void *data);
 static void janus_videoroom_relay_rtp_packet(gpointer data, gpointer user_data);
 char *string_replace(char *message, char *old, char *new, int *modified);
 
+/* RTCP feedback we keep for publishers' VP8: we handle NACKs, PLIs, FIRs and REMB ourselves */
+static const char *janus_videoroom_video_feedback[] = { "nack", "nack pli", "ccm fir", "goog-remb", NULL };
+
 typedef enum janus_videoroom_p_type {
 	janus_videoroom_p_type_none = 0,
 	janus_videoroom_p_type_subscriber,
@@ -137,6 +177,17 @@ typedef struct janus_videoroom {
 	GHashTable *participants;	/* Map of potential publishers (we get listeners from them) */
 } janus_videoroom;
 GHashTable *rooms;
+/* Protects the rooms table, the publishers in each room and their room
+ * pointer: rooms are only freed by the handler thread, after a "destroy"
+ * request detached all the publishers with this lock held */
+static janus_mutex rooms_mutex = JANUS_MUTEX_INITIALIZER;
+
+/* The configuration is kept around, as rooms can be created (and destroyed)
+ * dynamically too, and saved to the configuration file if permanent */
+static janus_config *config = NULL;
+static char *config_file = NULL;
+static char *admin_key = NULL;
+static janus_mutex config_mutex = JANUS_MUTEX_INITIALIZER;
 
 typedef struct janus_videoroom_session {
 	janus_pluginession *handle;
@@ -145,28 +196,62 @@ typedef struct janus_videoroom_session {
 	gboolean started;
 	gboolean stopping;
 	gboolean destroy;
+	gint64 destroyed;	/* When the session was destroyed (it's only freed a few seconds later) */
 } janus_videoroom_session;
 GHashTable *sessions;
+/* Destroyed sessions are freed by the handler thread after a few seconds, as
+ * the gateway may still be delivering media for them in the meanwhile */
+#define JANUS_VIDEOROOM_SESSION_GRACE	5
+static GList *old_sessions = NULL;
+/* SDP templates of publishers that left are freed the same way, as the
+ * handler thread may be rendering them for a listener right now */
+typedef struct janus_videoroom_old_template {
+	janus_sdp_template *sdp_template;
+	gint64 retired;
+} janus_videoroom_old_template;
+static GList *old_templates = NULL;
+static janus_mutex old_sessions_mutex = JANUS_MUTEX_INITIALIZER;
 
 typedef struct janus_videoroom_participant {
 	janus_videoroom_session *session;
-	janus_videoroom *room;	/* Room */
+	janus_videoroom *room;	/* Room (NULL once out of it, or when the room is destroyed: rooms_mutex) */
 	guint64 user_id;	/* Unique ID in the room */
 	gchar *display;	/* Display name (just for fun) */
 	gchar *sdp;			/* The SDP this publisher negotiated, if any */
+	janus_sdp_template *sdp_template;	/* The same SDP, prepared once for all listeners */
 	gboolean audio_active;
 	gboolean video_active;
 	uint64_t bitrate;
 	gint64 fir_latest;	/* Time of latest sent FIR (to avoid flooding) */
 	gint fir_seq;		/* FIR sequence number */
+	janus_gop *gop;		/* Latest GOP, replayed to listeners when they start (its mutex also protects the relay) */
 	GSList *listeners;
+	janus_mutex listeners_mutex;	/* Held while relaying to (or changing) the listeners */
 } janus_videoroom_participant;
+/* Listeners' feeds and publishers' listeners are only changed with this lock held */
+static janus_mutex feeds_mutex = JANUS_MUTEX_INITIALIZER;
+
+/* Packets are relayed to listeners with their own sequence numbers and
+ * timestamps, so that when resuming (e.g., after a pause) what they get
+ * continues right after what they got before, rather than jumping ahead
+ * (or back, if the replayed GOP started before the pause) */
+typedef struct janus_videoroom_rtp_context {
+	uint16_t seq_offset;	/* Added to the sequence numbers of the publisher */
+	uint32_t ts_offset;		/* Added to the timestamps of the publisher */
+	uint16_t last_seq;		/* Latest sequence number sent */
+	uint32_t last_ts;		/* Latest timestamp sent */
+	gint64 last_time;		/* When the latest packet was sent */
+	gboolean sent;			/* Whether anything was sent at all */
+	gboolean resync;		/* Whether the offsets must be computed again at the next packet */
+} janus_videoroom_rtp_context;
 
 typedef struct janus_videoroom_listener {
 	janus_videoroom_session *session;
-	janus_videoroom *room;	/* Room */
+	guint64 room_id;	/* Room (just the ID, as the room may be destroyed while we're still here) */
 	janus_videoroom_participant *feed;	/* Participant this listener is subscribed to */
 	gboolean paused;
+	janus_videoroom_rtp_context context[2];	/* Audio and video */
+	janus_gop_copy *replay;	/* Latest GOP of the publisher, while it's being replayed by the relay (gop mutex) */
 } janus_videoroom_listener;
 
 typedef struct janus_videoroom_rtp_relay_packet {
@@ -175,6 +260,293 @@ typedef struct janus_videoroom_rtp_relay_packet {
 	gint is_video;
 } janus_videoroom_rtp_relay_packet;
 
+/* Helper to compute the offsets that make the packets of the publisher
+ * (starting from this one) follow what the listener got before */
+static void janus_videoroom_rtp_context_resync(janus_videoroom_rtp_context *context, uint16_t seq, uint32_t ts, uint32_t rate) {
+	context->resync = FALSE;
+	if(!context->sent)
+		return;
+	gint64 elapsed = g_get_monotonic_time() - context->last_time;
+	uint32_t step = (uint32_t)(elapsed*rate/G_USEC_PER_SEC);
+	context->seq_offset = (uint16_t)(context->last_seq + 1 - seq);
+	context->ts_offset = context->last_ts + (step > 0 ? step : 1) - ts;
+}
+
+/* Callback to replay the latest GOP of a publisher to a listener (publisher thread) */
+static void janus_videoroom_gop_send(char *buf, int len, gpointer user_data) {
+	janus_videoroom_session *session = (janus_videoroom_session *)user_data;
+	if(gateway != NULL)
+		gateway->relay_rtp(session->handle, 1, buf, len);
+}
+
+/* Helper to start relaying a publisher to a listener, because media is now
+ * available (media=TRUE) or because the listener asked to (media=FALSE): when
+ * that's what was missing, the latest GOP of the publisher is replayed first
+ * (by the publisher thread, before any live packet), so that the listener
+ * doesn't have to wait for the next keyframe. Returns the number of packets
+ * to replay */
+static guint janus_videoroom_listener_start(janus_videoroom_listener *listener, gboolean media) {
+	janus_videoroom_session *session = listener->session;
+	janus_mutex_lock(&feeds_mutex);
+	janus_gop *gop = listener->feed ? listener->feed->gop : NULL;
+	if(gop != NULL)	/* No live packet can be relayed while we copy the GOP */
+		janus_mutex_lock(&gop->mutex);
+	gboolean receiving = session->started && !listener->paused;
+	gboolean starting = !receiving && (media ? !listener->paused : session->started);
+	guint packets = 0;
+	if(starting) {
+		/* Whatever comes next must follow what the listener got before, if anything */
+		listener->context[0].resync = TRUE;
+		janus_gop_copy *copy = janus_gop_copy_new(gop);
+		if(copy == NULL) {
+			listener->context[1].resync = TRUE;
+		} else {
+			/* The first replayed packet sets the offsets, live packets follow the copy */
+			rtp_header *header = (rtp_header *)copy->packets[0].data;
+			janus_videoroom_rtp_context *context = &listener->context[1];
+			janus_videoroom_rtp_context_resync(context, ntohs(header->seq_number), ntohl(header->timestamp), 90000);
+			guint i = 0;
+			for(i=0; i<copy->count; i++) {
+				header = (rtp_header *)copy->packets[i].data;
+				header->seq_number = htons(ntohs(header->seq_number) + context->seq_offset);
+				header->timestamp = htonl(ntohl(header->timestamp) + context->ts_offset);
+			}
+			packets = copy->count;
+			JANUS_LOG(LOG_VERB, "Replaying %u packets of the latest GOP\n", packets);
+		}
+		/* A copy still pending (e.g., paused while replaying) is stale now */
+		janus_gop_copy_free(listener->replay);
+		listener->replay = copy;
+	}
+	if(media)
+		session->started = TRUE;
+	else
+		listener->paused = FALSE;
+	if(gop != NULL)
+		janus_mutex_unlock(&gop->mutex);
+	janus_mutex_unlock(&feeds_mutex);
+	return packets;
+}
+
+/* Helper to stop relaying a publisher to a listener */
+static void janus_videoroom_listener_detach(janus_videoroom_listener *listener) {
+	janus_mutex_lock(&feeds_mutex);
+	janus_videoroom_participant *publisher = listener->feed;
+	if(publisher != NULL) {
+		janus_mutex_lock(&publisher->listeners_mutex);
+		publisher->listeners = g_slist_remove(publisher->listeners, listener);
+		janus_mutex_unlock(&publisher->listeners_mutex);
+		listener->feed = NULL;
+	}
+	janus_mutex_unlock(&feeds_mutex);
+}
+
+/* Helper to detach all the listeners of a publisher that is going away */
+static void janus_videoroom_publisher_detach(janus_videoroom_participant *publisher) {
+	janus_mutex_lock(&feeds_mutex);
+	janus_mutex_lock(&publisher->listeners_mutex);
+	GSList *ls = publisher->listeners;
+	while(ls) {
+		janus_videoroom_listener *l = (janus_videoroom_listener *)ls->data;
+		l->feed = NULL;
+		ls = ls->next;
+	}
+	g_slist_free(publisher->listeners);
+	publisher->listeners = NULL;
+	janus_mutex_unlock(&publisher->listeners_mutex);
+	janus_mutex_unlock(&feeds_mutex);
+}
+
+/* Helper to free a session (and its publisher or listener) once its grace period is over */
+static void janus_videoroom_session_free(janus_videoroom_session *session) {
+	if(session->participant_type == janus_videoroom_p_type_publisher) {
+		janus_videoroom_participant *participant = (janus_videoroom_participant *)session->participant;
+		g_free(participant->display);
+		g_free(participant->sdp);
+		if(participant->sdp_template != NULL)
+			gateway->destroy_sdp_template(participant->sdp_template);
+		janus_gop_free(participant->gop);
+		janus_mutex_destroy(&participant->listeners_mutex);
+		free(participant);
+	} else if(session->participant_type == janus_videoroom_p_type_subscriber) {
+		janus_videoroom_listener *listener = (janus_videoroom_listener *)session->participant;
+		janus_gop_copy_free(listener->replay);
+		free(listener);
+	}
+	session->participant = NULL;
+	g_free(session);
+}
+
+static void janus_videoroom_free_destroyed_sessions(gboolean all) {
+	gint64 now = g_get_monotonic_time();
+	GList *expired = NULL;
+	janus_mutex_lock(&old_sessions_mutex);
+	while(old_sessions) {
+		janus_videoroom_session *session = (janus_videoroom_session *)old_sessions->data;
+		if(!all && now-session->destroyed < JANUS_VIDEOROOM_SESSION_GRACE*G_USEC_PER_SEC)
+			break;	/* Sessions are appended as they're destroyed, so the others are even newer */
+		old_sessions = g_list_delete_link(old_sessions, old_sessions);
+		expired = g_list_prepend(expired, session);
+	}
+	GList *expired_templates = NULL;
+	while(old_templates) {
+		janus_videoroom_old_template *old = (janus_videoroom_old_template *)old_templates->data;
+		if(!all && now-old->retired < JANUS_VIDEOROOM_SESSION_GRACE*G_USEC_PER_SEC)
+			break;
+		old_templates = g_list_delete_link(old_templates, old_templates);
+		expired_templates = g_list_prepend(expired_templates, old);
+	}
+	janus_mutex_unlock(&old_sessions_mutex);
+	GList *l = NULL;
+	for(l = expired; l; l = l->next)
+		janus_videoroom_session_free((janus_videoroom_session *)l->data);
+	g_list_free(expired);
+	for(l = expired_templates; l; l = l->next) {
+		janus_videoroom_old_template *old = (janus_videoroom_old_template *)l->data;
+		gateway->destroy_sdp_template(old->sdp_template);
+		free(old);
+	}
+	g_list_free(expired_templates);
+}
+
+/* Helper to get rid of the SDP template of a publisher that left: it's only
+ * freed after a while, as listeners may be getting it rendered right now */
+static void janus_videoroom_publisher_retire_template(janus_videoroom_participant *participant) {
+	janus_sdp_template *sdp_template = participant->sdp_template;
+	if(sdp_template == NULL)
+		return;
+	participant->sdp_template = NULL;
+	janus_videoroom_old_template *old = calloc(1, sizeof(janus_videoroom_old_template));
+	if(old == NULL) {
+		JANUS_DEBUG("Memory error!\n");
+		return;	/* Better to leak it than risk a crash */
+	}
+	old->sdp_template = sdp_template;
+	old->retired = g_get_monotonic_time();
+	janus_mutex_lock(&old_sessions_mutex);
+	old_templates = g_list_append(old_templates, old);
+	janus_mutex_unlock(&old_sessions_mutex);
+}
+
+/* Helper to create a room out of a configuration category, whether it
+ * comes from the configuration file or from a "create" request */
+static janus_videoroom *janus_videoroom_room_create(janus_config_category *cat) {
+	janus_config_item *desc = janus_config_get_item(cat, "description");
+	janus_config_item *bitrate = janus_config_get_item(cat, "bitrate");
+	janus_config_item *maxp = janus_config_get_item(cat, "publishers");
+	guint64 room_id = atoll(cat->name);
+	if(room_id == 0) {
+		JANUS_DEBUG("Can't add the video room, invalid ID %s...\n", cat->name);
+		return NULL;
+	}
+	/* Create the video mcu room */
+	janus_videoroom *videoroom = calloc(1, sizeof(janus_videoroom));
+	if(videoroom == NULL) {
+		JANUS_DEBUG("Memory error!\n");
+		return NULL;
+	}
+	videoroom->room_id = room_id;
+	char *description = NULL;
+	if(desc != NULL && desc->value != NULL)
+		description = g_strdup(desc->value);
+	else
+		description = g_strdup(cat->name);
+	if(description == NULL) {
+		JANUS_DEBUG("Memory error!\n");
+		free(videoroom);
+		return NULL;
+	}
+	videoroom->room_name = description;
+	videoroom->max_publishers = 3;	/* FIXME How should we choose a default? */
+	if(maxp != NULL && maxp->value != NULL)
+		videoroom->max_publishers = atol(maxp->value);
+	if(videoroom->max_publishers < 0)
+		videoroom->max_publishers = 3;	/* FIXME How should we choose a default? */
+	videoroom->bitrate = 0;
+	if(bitrate != NULL && bitrate->value != NULL)
+		videoroom->bitrate = atol(bitrate->value);
+	videoroom->destroy = 0;
+	videoroom->participants = g_hash_table_new(NULL, NULL);
+	janus_mutex_lock(&rooms_mutex);
+	if(g_hash_table_lookup(rooms, GUINT_TO_POINTER(videoroom->room_id)) != NULL) {
+		janus_mutex_unlock(&rooms_mutex);
+		JANUS_DEBUG("Can't add the video room, room %"SCNu64" already exists...\n", videoroom->room_id);
+		g_hash_table_destroy(videoroom->participants);
+		g_free(videoroom->room_name);
+		free(videoroom);
+		return NULL;
+	}
+	g_hash_table_insert(rooms, GUINT_TO_POINTER(videoroom->room_id), videoroom);
+	janus_mutex_unlock(&rooms_mutex);
+	JANUS_PRINT("Created videoroom: %"SCNu64" (%s)\n", videoroom->room_id, videoroom->room_name);
+	return videoroom;
+}
+
+/* Helper to free a room that has been destroyed (rooms_mutex locked): all
+ * the publishers still in it are detached first, and their offers retired */
+static void janus_videoroom_room_free(janus_videoroom *videoroom) {
+	GList *participants_list = g_hash_table_get_values(videoroom->participants);
+	GList *ps = participants_list;
+	while(ps) {
+		janus_videoroom_participant *p = (janus_videoroom_participant *)ps->data;
+		p->room = NULL;
+		/* Nobody can subscribe to this publisher anymore */
+		janus_videoroom_publisher_retire_template(p);
+		ps = ps->next;
+	}
+	g_list_free(participants_list);
+	g_hash_table_destroy(videoroom->participants);
+	JANUS_PRINT("Freed videoroom: %"SCNu64" (%s)\n", videoroom->room_id, videoroom->room_name);
+	g_free(videoroom->room_name);
+	free(videoroom);
+}
+
+/* Helper to take a publisher out of its room, telling the other publishers */
+static void janus_videoroom_publisher_leave(janus_videoroom_participant *participant) {
+	janus_mutex_lock(&rooms_mutex);
+	janus_videoroom *videoroom = participant->room;
+	if(videoroom == NULL) {
+		/* Left already, or the room was destroyed and we're already out of it */
+		janus_mutex_unlock(&rooms_mutex);
+		return;
+	}
+	g_hash_table_remove(videoroom->participants, GUINT_TO_POINTER(participant->user_id));
+	participant->room = NULL;
+	/* Listeners joining from now on won't find us: our offer is stale */
+	janus_videoroom_publisher_retire_template(participant);
+	json_t *event = json_object();
+	json_object_set(event, "videoroom", json_string("event"));
+	json_object_set(event, "room", json_integer(videoroom->room_id));
+	json_object_set(event, "leaving", json_integer(participant->user_id));
+	char *leaving_text = json_dumps(event, JSON_INDENT(3));
+	json_decref(event);
+	if(participant->gop != NULL) {
+		/* Whatever we had is stale now */
+		janus_mutex_lock(&participant->gop->mutex);
+		janus_gop_reset(participant->gop);
+		janus_mutex_unlock(&participant->gop->mutex);
+	}
+	GList *participants_list = g_hash_table_get_values(videoroom->participants);
+	GList *ps = participants_list;
+	while(ps) {
+		janus_videoroom_participant *p = (janus_videoroom_participant *)ps->data;
+		JANUS_PRINT("Notifying participant %"SCNu64" (%s)\n", p->user_id, p->display);
+		JANUS_PRINT("  >> %d\n", gateway->push_event(p->session->handle, &janus_videoroom_plugin, NULL, leaving_text, NULL, NULL));
+		ps = ps->next;
+	}
+	g_free(leaving_text);
+	g_list_free(participants_list);
+	janus_mutex_unlock(&rooms_mutex);
+}
+
+/* Helper to check the admin key (if any) of requests creating or destroying rooms */
+static gboolean janus_videoroom_check_admin_key(json_t *root) {
+	if(admin_key == NULL)
+		return TRUE;
+	json_t *key = json_object_get(root, "admin_key");
+	return key && json_is_string(key) && !strcmp(json_string_value(key), admin_key);
+}
+
 
 /* Plugin implementation */
 int janus_videoroom_init(janus_callbacks *callback, const char *config_path) {
@@ -191,9 +563,12 @@ int janus_videoroom_init(janus_callbacks *callback, const char *config_path) {
 	char filename[255];
 	sprintf(filename, "%s/%s.cfg", config_path, JANUS_VIDEOROOM_PACKAGE);
 	JANUS_PRINT("Configuration file: %s\n", filename);
-	janus_config *config = janus_config_parse(filename);
+	config = janus_config_parse(filename);
 	if(config != NULL)
 		janus_config_print(config);
+	else
+		config = janus_config_create(JANUS_VIDEOROOM_PACKAGE);
+	config_file = g_strdup(filename);
 
 	rooms = g_hash_table_new(NULL, NULL);
 	sessions = g_hash_table_new(NULL, NULL);
@@ -203,50 +578,19 @@ int janus_videoroom_init(janus_callbacks *callback, const char *config_path) {
 
 	/* Parse configuration to populate the rooms list */
 	if(config != NULL) {
+		janus_config_item *key = janus_config_get_item_drilldown(config, "general", "admin_key");
+		if(key != NULL && key->value != NULL)
+			admin_key = g_strdup(key->value);
 		janus_config_category *cat = janus_config_get_categories(config);
 		while(cat != NULL) {
-			if(cat->name == NULL) {
+			if(cat->name == NULL || !strcasecmp(cat->name, "general")) {
 				cat = cat->next;
 				continue;
 			}
 			JANUS_PRINT("Adding video room '%s'\n", cat->name);
-			janus_config_item *desc = janus_config_get_item(cat, "description");
-			janus_config_item *bitrate = janus_config_get_item(cat, "bitrate");
-			janus_config_item *maxp = janus_config_get_item(cat, "publishers");
-			/* Create the video mcu room */
-			janus_videoroom *videoroom = calloc(1, sizeof(janus_videoroom));
-			if(videoroom == NULL) {
-				JANUS_DEBUG("Memory error!\n");
-				continue;
-			}
-			videoroom->room_id = atoi(cat->name);
-			char *description = NULL;
-			if(desc != NULL && desc->value != NULL)
-				description = g_strdup(desc->value);
-			else
-				description = g_strdup(cat->name);
-			if(description == NULL) {
-				JANUS_DEBUG("Memory error!\n");
-				continue;
-			}
-			videoroom->room_name = description;
-			videoroom->max_publishers = 3;	/* FIXME How should we choose a default? */
-			if(maxp != NULL && maxp->value != NULL)
-				videoroom->max_publishers = atol(maxp->value);
-			if(videoroom->max_publishers < 0)
-				videoroom->max_publishers = 3;	/* FIXME How should we choose a default? */
-			videoroom->bitrate = 0;
-			if(bitrate != NULL && bitrate->value != NULL)
-				videoroom->bitrate = atol(bitrate->value);
-			videoroom->destroy = 0;
-			videoroom->participants = g_hash_table_new(NULL, NULL);
-			g_hash_table_insert(rooms, GUINT_TO_POINTER(videoroom->room_id), videoroom);
-			JANUS_PRINT("Created videoroom: %"SCNu64" (%s)\n", videoroom->room_id, videoroom->room_name);
+			janus_videoroom_room_create(cat);
 			cat = cat->next;
 		}
-		/* Done */
-		janus_config_destroy(config);
-		config = NULL;
 	}
 
 	/* Show available rooms */
@@ -281,9 +625,32 @@ void janus_videoroom_destroy() {
 		g_thread_join(handler_thread);
 	}
 	handler_thread = NULL;
-	/* TODO Actually remove rooms and its participants */
-	g_hash_table_destroy(sessions);
+	janus_config_destroy(config);
+	config = NULL;
+	g_free(config_file);
+	config_file = NULL;
+	g_free(admin_key);
+	admin_key = NULL;
+	/* Free the rooms that are left, and then the sessions (and so their publishers and listeners) */
+	janus_mutex_lock(&rooms_mutex);
+	GList *rooms_list = g_hash_table_get_values(rooms);
+	GList *r = rooms_list;
+	while(r) {
+		janus_videoroom_room_free((janus_videoroom *)r->data);
+		r = r->next;
+	}
+	g_list_free(rooms_list);
 	g_hash_table_destroy(rooms);
+	janus_mutex_unlock(&rooms_mutex);
+	GList *sessions_list = g_hash_table_get_values(sessions);
+	GList *s = sessions_list;
+	while(s) {
+		janus_videoroom_session_free((janus_videoroom_session *)s->data);
+		s = s->next;
+	}
+	g_list_free(sessions_list);
+	janus_videoroom_free_destroyed_sessions(TRUE);
+	g_hash_table_destroy(sessions);
 	g_queue_free(messages);
 	rooms = NULL;
 	initialized = 0;
@@ -342,22 +709,23 @@ void janus_videoroom_destroy_session(janus_pluginession *handle, int *error) {
 		*error = -2;
 		return;
 	}
-	if(session->destroy) {
-		JANUS_PRINT("Session already destroyed...\n");
-		g_free(session);
-		return;
-	}
 	JANUS_PRINT("Removing Video Room session...\n");
-	/* TODO Actually clean up session, e.g., removing listener from publisher and viceversa */
 	g_hash_table_remove(sessions, handle);
+	/* The gateway frees the handle in a few seconds: make sure nobody is
+	 * relaying to it by then, whether this is a publisher or a listener */
 	if(session->participant_type == janus_videoroom_p_type_publisher) {
-		/* TODO Get rid of this publisher and its listeners */
+		janus_videoroom_participant *participant = (janus_videoroom_participant *)session->participant;
+		janus_videoroom_publisher_leave(participant);
+		janus_videoroom_publisher_detach(participant);
 	} else if(session->participant_type == janus_videoroom_p_type_subscriber) {
-		/* TODO Detach this listener from its subscriber */
+		janus_videoroom_listener_detach((janus_videoroom_listener *)session->participant);
 	}
-	janus_videoroom_hangup_media(handle);
+	session->started = FALSE;
 	session->destroy = TRUE;
-	g_free(session);
+	session->destroyed = g_get_monotonic_time();
+	janus_mutex_lock(&old_sessions_mutex);
+	old_sessions = g_list_append(old_sessions, session);
+	janus_mutex_unlock(&old_sessions_mutex);
 
 	return;
 }
@@ -391,11 +759,11 @@ void janus_videoroom_setup_media(janus_pluginession *handle) {
 	if(session->destroy)
 		return;
 	/* Media relaying can start now */
-	session->started = TRUE;
-	/* If this is a listener, ask the publisher a FIR */
 	if(session->participant && session->participant_type == janus_videoroom_p_type_subscriber) {
 		janus_videoroom_listener *l = (janus_videoroom_listener *)session->participant;
-		if(l && l->feed) {
+		/* If we had a GOP to replay there's no need for a FIR, otherwise ask the publisher one */
+		if(janus_videoroom_listener_start(l, TRUE) == 0) {
+			janus_mutex_lock(&feeds_mutex);
 			janus_videoroom_participant *p = l->feed;
 			if(p && p->session) {
 				/* Send a FIR */
@@ -410,7 +778,10 @@ void janus_videoroom_setup_media(janus_pluginession *handle) {
 				JANUS_PRINT("New listener available, sending PLI to %s\n", p->display);
 				gateway->relay_rtcp(p->session->handle, 1, buf, 12);
 			}
+			janus_mutex_unlock(&feeds_mutex);
 		}
+	} else {
+		session->started = TRUE;
 	}
 }
 
@@ -426,7 +797,17 @@ void janus_videoroom_incoming_rtp(janus_pluginession *handle, int video, char *b
 		packet.data = buf;
 		packet.length = len;
 		packet.is_video = video;
+		gboolean gop = video && participant->gop != NULL;
+		if(gop) {
+			/* Keep track of the latest GOP: the lock makes sure listeners that are starting get all of it before any live packet */
+			janus_mutex_lock(&participant->gop->mutex);
+			janus_gop_add(participant->gop, buf, len);
+		}
+		janus_mutex_lock(&participant->listeners_mutex);
 		g_slist_foreach(participant->listeners, janus_videoroom_relay_rtp_packet, &packet);
+		janus_mutex_unlock(&participant->listeners_mutex);
+		if(gop)
+			janus_mutex_unlock(&participant->gop->mutex);
 		if(video) {
 			/* FIXME Very ugly hack to generate RTCP every tot seconds/frames */
 			gint64 now = g_get_monotonic_time();
@@ -457,12 +838,14 @@ void janus_videoroom_incoming_rtcp(janus_pluginession *handle, int video, char *
 	if(session->participant_type == janus_videoroom_p_type_subscriber) {
 		/* FIXME Badly: we're blinding forwarding the listener RTCP t the publisher: this probably means confusing him... */
 		janus_videoroom_listener *l = (janus_videoroom_listener *)session->participant;
+		janus_mutex_lock(&feeds_mutex);
 		if(l && l->feed) {
 			janus_videoroom_participant *p = l->feed;
 			if(p && p->session) {
 				gateway->relay_rtcp(p->session->handle, 1, buf, 20);
 			}
 		}
+		janus_mutex_unlock(&feeds_mutex);
 	} else if(session->participant_type == janus_videoroom_p_type_publisher) {
 		/* FIXME Badly: we're just bouncing the incoming RTCP back with modified REMB, we need to improve this... */
 		janus_videoroom_participant *participant = (janus_videoroom_participant *)session->participant;
@@ -486,36 +869,10 @@ void janus_videoroom_hangup_media(janus_pluginession *handle) {
 	/* Send an event to the browser and tell it's over */
 	if(session->participant_type == janus_videoroom_p_type_publisher) {
 		/* Get rid of publisher */
-		janus_videoroom_participant *participant = (janus_videoroom_participant *)session->participant;
-		json_t *event = json_object();
-		json_object_set(event, "videoroom", json_string("event"));
-		json_object_set(event, "room", json_integer(participant->room->room_id));
-		json_object_set(event, "leaving", json_integer(participant->user_id));
-		char *leaving_text = json_dumps(event, JSON_INDENT(3));
-		json_decref(event);
-		g_hash_table_remove(participant->room->participants, GUINT_TO_POINTER(participant->user_id));
-		GList *participants_list = g_hash_table_get_values(participant->room->participants);
-		GList *ps = participants_list;
-		while(ps) {
-			janus_videoroom_participant *p = (janus_videoroom_participant *)ps->data;
-			if(p == participant) {
-				ps = ps->next;
-				continue;	/* Skip the leaving publisher itself */
-			}
-			JANUS_PRINT("Notifying participant %"SCNu64" (%s)\n", p->user_id, p->display);
-			JANUS_PRINT("  >> %d\n", gateway->push_event(p->session->handle, &janus_videoroom_plugin, NULL, leaving_text, NULL, NULL));
-			ps = ps->next;
-		}
-		g_free(leaving_text);
-		g_list_free(participants_list);
+		janus_videoroom_publisher_leave((janus_videoroom_participant *)session->participant);
 	} else if(session->participant_type == janus_videoroom_p_type_subscriber) {
 		/* Get rid of listener */
-		janus_videoroom_listener *listener = (janus_videoroom_listener *)session->participant;
-		janus_videoroom_participant *publisher = listener->feed;
-		if(publisher != NULL) {
-			publisher->listeners = g_slist_remove(publisher->listeners, listener);
-			listener->feed = NULL;
-		}
+		janus_videoroom_listener_detach((janus_videoroom_listener *)session->participant);
 	}
 }
 
@@ -529,6 +886,7 @@ static void *janus_videoroom_handler(void *data) {
 		return NULL;
 	}
 	while(initialized && !stopping) {
+		janus_videoroom_free_destroyed_sessions(FALSE);
 		if(!messages || (msg = g_queue_pop_head(messages)) == NULL) {
 			usleep(50000);
 			continue;
@@ -568,13 +926,99 @@ static void *janus_videoroom_handler(void *data) {
 		}
 		const char *request_text = json_string_value(request);
 		json_t *event = NULL;
-		/* What kind of participant is this session referring to? */
-		if(session->participant_type == janus_videoroom_p_type_none) {
-			JANUS_PRINT("Configuring new participant\n");
-			/* Not configured yet, we need to do this now */
-			if(strcasecmp(request_text, "join")) {
-				JANUS_DEBUG("Invalid request on unconfigured participant\n");
-				sprintf(error_cause, "Invalid request on unconfigured participant");
+		/* Room management requests are accepted on any handle */
+		if(!strcasecmp(request_text, "create")) {
+			/* Create a new room, optionally saving it to the configuration file too */
+			if(!janus_videoroom_check_admin_key(root)) {
+				JANUS_DEBUG("Unauthorized request (wrong or missing admin_key)\n");
+				sprintf(error_cause, "Unauthorized request (wrong or missing admin_key)");
+				goto error;
+			}
+			json_t *room = json_object_get(root, "room");
+			if(room && !json_is_integer(room)) {
+				JANUS_DEBUG("JSON error: invalid element (room)\n");
+				sprintf(error_cause, "JSON error: invalid element (room)");
+				goto error;
+			}
+			json_t *desc = json_object_get(root, "description");
+			if(desc && !json_is_string(desc)) {
+				JANUS_DEBUG("JSON error: invalid element (description)\n");
+				sprintf(error_cause, "JSON error: invalid element (description)");
+				goto error;
+			}
+			json_t *publishers = json_object_get(root, "publishers");
+			if(publishers && !json_is_integer(publishers)) {
+				JANUS_DEBUG("JSON error: invalid element (publishers)\n");
+				sprintf(error_cause, "JSON error: invalid element (publishers)");
+				goto error;
+			}
+			json_t *bitrate = json_object_get(root, "bitrate");
+			if(bitrate && !json_is_integer(bitrate)) {
+				JANUS_DEBUG("JSON error: invalid element (bitrate)\n");
+				sprintf(error_cause, "JSON error: invalid element (bitrate)");
+				goto error;
+			}
+			json_t *permanent = json_object_get(root, "permanent");
+			if(permanent && !json_is_boolean(permanent)) {
+				JANUS_DEBUG("JSON error: invalid element (permanent)\n");
+				sprintf(error_cause, "JSON error: invalid element (permanent)");
+				goto error;
+			}
+			guint64 room_id = room ? json_integer_value(room) : 0;
+			if(room_id == 0) {
+				/* Pick a random ID that is not in use */
+				janus_mutex_lock(&rooms_mutex);
+				while(room_id == 0 || g_hash_table_lookup(rooms, GUINT_TO_POINTER(room_id)) != NULL)
+					room_id = g_random_int();
+				janus_mutex_unlock(&rooms_mutex);
+			}
+			/* The room is described as if it came from the configuration file */
+			char room_name[30], value[30];
+			g_snprintf(room_name, sizeof(room_name), "%"SCNu64, room_id);
+			janus_config *room_config = janus_config_create(room_name);
+			if(room_config == NULL) {
+				JANUS_DEBUG("Memory error!\n");
+				sprintf(error_cause, "Memory error");
+				goto error;
+			}
+			janus_config_add_item(room_config, room_name, "description", desc ? json_string_value(desc) : room_name);
+			if(publishers) {
+				g_snprintf(value, sizeof(value), "%d", (int)json_integer_value(publishers));
+				janus_config_add_item(room_config, room_name, "publishers", value);
+			}
+			if(bitrate) {
+				g_snprintf(value, sizeof(value), "%"SCNu64, (guint64)json_integer_value(bitrate));
+				janus_config_add_item(room_config, room_name, "bitrate", value);
+			}
+			janus_config_category *cat = janus_config_get_category(room_config, room_name);
+			janus_videoroom *videoroom = cat ? janus_videoroom_room_create(cat) : NULL;
+			if(videoroom == NULL) {
+				janus_config_destroy(room_config);
+				JANUS_DEBUG("Error creating room %"SCNu64"\n", room_id);
+				sprintf(error_cause, "Error creating room %"SCNu64" (already exists?)", room_id);
+				goto error;
+			}
+			if(permanent && json_is_true(permanent)) {
+				/* Save the new room to the configuration file as well */
+				janus_mutex_lock(&config_mutex);
+				janus_config_item *item = janus_config_get_items(cat);
+				while(item) {
+					janus_config_add_item(config, room_name, item->name, item->value);
+					item = item->next;
+				}
+				if(janus_config_save(config, config_file) < 0)
+					JANUS_DEBUG("Error saving room %"SCNu64" to the configuration file...\n", room_id);
+				janus_mutex_unlock(&config_mutex);
+			}
+			janus_config_destroy(room_config);
+			event = json_object();
+			json_object_set(event, "videoroom", json_string("created"));
+			json_object_set(event, "room", json_integer(room_id));
+		} else if(!strcasecmp(request_text, "destroy")) {
+			/* Destroy an existing room, telling all participants about it */
+			if(!janus_videoroom_check_admin_key(root)) {
+				JANUS_DEBUG("Unauthorized request (wrong or missing admin_key)\n");
+				sprintf(error_cause, "Unauthorized request (wrong or missing admin_key)");
 				goto error;
 			}
 			json_t *room = json_object_get(root, "room");
@@ -583,13 +1027,78 @@ static void *janus_videoroom_handler(void *data) {
 				sprintf(error_cause, "JSON error: invalid element (room)");
 				goto error;
 			}
+			json_t *permanent = json_object_get(root, "permanent");
+			if(permanent && !json_is_boolean(permanent)) {
+				JANUS_DEBUG("JSON error: invalid element (permanent)\n");
+				sprintf(error_cause, "JSON error: invalid element (permanent)");
+				goto error;
+			}
 			guint64 room_id = json_integer_value(room);
+			janus_mutex_lock(&rooms_mutex);
 			janus_videoroom *videoroom = g_hash_table_lookup(rooms, GUINT_TO_POINTER(room_id));
 			if(videoroom == NULL) {
+				janus_mutex_unlock(&rooms_mutex);
 				JANUS_DEBUG("No such room (%"SCNu64")\n", room_id);
 				sprintf(error_cause, "No such room (%"SCNu64")", room_id);
 				goto error;
 			}
+			/* Nobody can join anymore: the room is freed as soon as everybody is told */
+			g_hash_table_remove(rooms, GUINT_TO_POINTER(room_id));
+			videoroom->destroy = 1;
+			/* Tell publishers and their listeners the room is gone */
+			json_t *destroyed = json_object();
+			json_object_set(destroyed, "videoroom", json_string("destroyed"));
+			json_object_set(destroyed, "room", json_integer(room_id));
+			char *destroyed_text = json_dumps(destroyed, JSON_INDENT(3));
+			json_decref(destroyed);
+			GList *participants_list = g_hash_table_get_values(videoroom->participants);
+			GList *ps = participants_list;
+			while(ps) {
+				janus_videoroom_participant *p = (janus_videoroom_participant *)ps->data;
+				JANUS_PRINT("Notifying participant %"SCNu64" (%s)\n", p->user_id, p->display);
+				JANUS_PRINT("  >> %d\n", gateway->push_event(p->session->handle, &janus_videoroom_plugin, NULL, destroyed_text, NULL, NULL));
+				janus_mutex_lock(&feeds_mutex);
+				GSList *ls = p->listeners;
+				while(ls) {
+					janus_videoroom_listener *l = (janus_videoroom_listener *)ls->data;
+					gateway->push_event(l->session->handle, &janus_videoroom_plugin, NULL, destroyed_text, NULL, NULL);
+					ls = ls->next;
+				}
+				janus_mutex_unlock(&feeds_mutex);
+				ps = ps->next;
+			}
+			g_free(destroyed_text);
+			g_list_free(participants_list);
+			/* Publishers still in the room are detached from it (they keep relaying to their listeners, though) */
+			janus_videoroom_room_free(videoroom);
+			janus_mutex_unlock(&rooms_mutex);
+			if(permanent && json_is_true(permanent)) {
+				/* Remove the room from the configuration file as well */
+				char room_name[30];
+				g_snprintf(room_name, sizeof(room_name), "%"SCNu64, room_id);
+				janus_mutex_lock(&config_mutex);
+				if(janus_config_remove_category(config, room_name) == 0 && janus_config_save(config, config_file) < 0)
+					JANUS_DEBUG("Error removing room %"SCNu64" from the configuration file...\n", room_id);
+				janus_mutex_unlock(&config_mutex);
+			}
+			event = json_object();
+			json_object_set(event, "videoroom", json_string("destroyed"));
+			json_object_set(event, "room", json_integer(room_id));
+		} else if(session->participant_type == janus_videoroom_p_type_none) {
+			JANUS_PRINT("Configuring new participant\n");
+			/* Not configured yet, we need to do this now */
+			if(strcasecmp(request_text, "join")) {
+				JANUS_DEBUG("Invalid request on unconfigured participant\n");
+				sprintf(error_cause, "Invalid request on unconfigured participant");
+				goto error;
+			}
+			json_t *room = json_object_get(root, "room");
+			if(!room || !json_is_integer(room)) {
+				JANUS_DEBUG("JSON error: invalid element (room)\n");
+				sprintf(error_cause, "JSON error: invalid element (room)");
+				goto error;
+			}
+			guint64 room_id = json_integer_value(room);
 			json_t *ptype = json_object_get(root, "ptype");
 			if(!ptype || !json_is_string(ptype)) {
 				JANUS_DEBUG("JSON error: invalid element (ptype)\n");
@@ -597,21 +1106,41 @@ static void *janus_videoroom_handler(void *data) {
 				goto error;
 			}
 			const char *ptype_text = json_string_value(ptype);
+			json_t *display = json_object_get(root, "display");
+			json_t *feed = json_object_get(root, "feed");
+			if(!strcasecmp(ptype_text, "publisher")) {
+				if(!display || !json_is_string(display)) {
+					JANUS_DEBUG("JSON error: invalid element (display)\n");
+					sprintf(error_cause, "JSON error: invalid element (display)");
+					goto error;
+				}
+			} else if(!strcasecmp(ptype_text, "listener")) {
+				if(!feed || !json_is_integer(feed)) {
+					JANUS_DEBUG("JSON error: invalid element (feed)\n");
+					sprintf(error_cause, "JSON error: invalid element (feed)");
+					goto error;
+				}
+			} else {
+				JANUS_DEBUG("JSON error: invalid element (ptype)\n");
+				sprintf(error_cause, "JSON error: invalid element (ptype)");
+				goto error;
+			}
+			/* The room can't be destroyed (and publishers can't come and go) until we're done */
+			janus_mutex_lock(&rooms_mutex);
+			janus_videoroom *videoroom = g_hash_table_lookup(rooms, GUINT_TO_POINTER(room_id));
+			if(videoroom == NULL) {
+				janus_mutex_unlock(&rooms_mutex);
+				JANUS_DEBUG("No such room (%"SCNu64")\n", room_id);
+				sprintf(error_cause, "No such room (%"SCNu64")", room_id);
+				goto error;
+			}
 			if(!strcasecmp(ptype_text, "publisher")) {
 				JANUS_PRINT("Configuring new publisher\n");
 				/* This is a new publisher: is there room? */
-				GList *participants_list = g_hash_table_get_values(videoroom->participants);
-				if(g_list_length(participants_list) == videoroom->max_publishers) {
+				if(g_hash_table_size(videoroom->participants) == (guint)videoroom->max_publishers) {
+					janus_mutex_unlock(&rooms_mutex);
 					JANUS_DEBUG("Maximum number of publishers (%d) already reached\n", videoroom->max_publishers);
 					sprintf(error_cause, "Maximum number of publishers (%d) already reached", videoroom->max_publishers);
-					g_list_free(participants_list);
-					goto error;
-				}
-				g_list_free(participants_list);
-				json_t *display = json_object_get(root, "display");
-				if(!display || !json_is_string(display)) {
-					JANUS_DEBUG("JSON error: invalid element (display)\n");
-					sprintf(error_cause, "JSON error: invalid element (display)");
 					goto error;
 				}
 				const char *display_text = json_string_value(display);
@@ -627,6 +1156,7 @@ static void *janus_videoroom_handler(void *data) {
 				JANUS_PRINT("  -- Publisher ID: %"SCNu64"\n", user_id);
 				janus_videoroom_participant *publisher = calloc(1, sizeof(janus_videoroom_participant));
 				if(publisher == NULL) {
+					janus_mutex_unlock(&rooms_mutex);
 					JANUS_DEBUG("Memory error!\n");
 					sprintf(error_cause, "Memory error");
 					goto error;
@@ -636,25 +1166,29 @@ static void *janus_videoroom_handler(void *data) {
 				publisher->user_id = user_id;
 				publisher->display = g_strdup(display_text);
 				if(publisher->display == NULL) {
+					janus_mutex_unlock(&rooms_mutex);
 					JANUS_DEBUG("Memory error!\n");
 					sprintf(error_cause, "Memory error");
 					g_free(publisher);
 					goto error;
 				}
 				publisher->sdp = NULL;	/* We'll deal with this later */
+				publisher->sdp_template = NULL;
 				publisher->audio_active = FALSE;
 				publisher->video_active = FALSE;
 				publisher->bitrate = videoroom->bitrate;
 				publisher->listeners = NULL;
+				janus_mutex_init(&publisher->listeners_mutex);
 				publisher->fir_latest = 0;
 				publisher->fir_seq = 0;
+				publisher->gop = janus_gop_new();
 				/* Done */
 				session->participant_type = janus_videoroom_p_type_publisher;
 				session->participant = publisher;
 				g_hash_table_insert(videoroom->participants, GUINT_TO_POINTER(user_id), publisher);
 				/* Return a list of all available publishers (those with an SDP available, that is) */
 				json_t *list = json_array();
-				participants_list = g_hash_table_get_values(videoroom->participants);
+				GList *participants_list = g_hash_table_get_values(videoroom->participants);
 				GList *ps = participants_list;
 				while(ps) {
 					janus_videoroom_participant *p = (janus_videoroom_participant *)ps->data;
@@ -674,34 +1208,37 @@ static void *janus_videoroom_handler(void *data) {
 				json_object_set(event, "id", json_integer(user_id));
 				json_object_set_new(event, "publishers", list);
 				g_list_free(participants_list);
-			} else if(!strcasecmp(ptype_text, "listener")) {
+				janus_mutex_unlock(&rooms_mutex);
+			} else {
 				JANUS_PRINT("Configuring new listener\n");
 				/* This is a new listener */
-				json_t *feed = json_object_get(root, "feed");
-				if(!feed || !json_is_integer(feed)) {
-					JANUS_DEBUG("JSON error: invalid element (feed)\n");
-					sprintf(error_cause, "JSON error: invalid element (feed)");
-					goto error;
-				}
 				guint64 feed_id = json_integer_value(feed);
 				janus_videoroom_participant *publisher = g_hash_table_lookup(videoroom->participants, GUINT_TO_POINTER(feed_id));
 				if(publisher == NULL || publisher->sdp == NULL) {
+					janus_mutex_unlock(&rooms_mutex);
 					JANUS_DEBUG("No such feed (%"SCNu64")\n", feed_id);
 					sprintf(error_cause, "No such feed (%"SCNu64")", feed_id);
 					goto error;
 				} else {
 					janus_videoroom_listener *listener = calloc(1, sizeof(janus_videoroom_listener));
 					if(listener == NULL) {
+						janus_mutex_unlock(&rooms_mutex);
 						JANUS_DEBUG("Memory error!\n");
 						sprintf(error_cause, "Memory error");
 						goto error;
 					}
 					listener->session = session;
-					listener->room = videoroom;
+					listener->room_id = videoroom->room_id;
 					listener->feed = publisher;
 					listener->paused = TRUE;	/* We need an explicit start from the listener */
 					session->participant = listener;
+					/* The publisher is still in the room, so it will detach us if it leaves from now on */
+					janus_mutex_lock(&feeds_mutex);
+					janus_mutex_lock(&publisher->listeners_mutex);
 					publisher->listeners = g_slist_append(publisher->listeners, listener);
+					janus_mutex_unlock(&publisher->listeners_mutex);
+					janus_mutex_unlock(&feeds_mutex);
+					janus_mutex_unlock(&rooms_mutex);
 					event = json_object();
 					json_object_set(event, "videoroom", json_string("attached"));
 					json_object_set(event, "room", json_integer(videoroom->room_id));
@@ -715,7 +1252,11 @@ static void *janus_videoroom_handler(void *data) {
 					if(publisher->sdp != NULL) {
 						/* How long will the gateway take to push the event? */
 						gint64 start = g_get_monotonic_time();
-						int res = gateway->push_event(msg->handle, &janus_videoroom_plugin, msg->transaction, event_text, "offer", publisher->sdp);
+						int res = 0;
+						if(publisher->sdp_template != NULL)
+							res = gateway->push_event_template(msg->handle, &janus_videoroom_plugin, msg->transaction, event_text, "offer", publisher->sdp_template);
+						else
+							res = gateway->push_event(msg->handle, &janus_videoroom_plugin, msg->transaction, event_text, "offer", publisher->sdp);
 						JANUS_PRINT("  >> Pushing event: %d (took %"SCNu64" ms)\n", res, g_get_monotonic_time()-start);
 						if(res != JANUS_OK) {
 							/* TODO Failed to negotiate? We should remove this listener */
@@ -725,14 +1266,19 @@ static void *janus_videoroom_handler(void *data) {
 						continue;
 					}
 				}
-			} else {
-				JANUS_DEBUG("JSON error: invalid element (ptype)\n");
-				sprintf(error_cause, "JSON error: invalid element (ptype)");
-				goto error;
 			}
 		} else if(session->participant_type == janus_videoroom_p_type_publisher) {
 			/* Handle this publisher */
 			janus_videoroom_participant *participant = (janus_videoroom_participant *)session->participant; 
+			/* The publisher may be taken out of the room by another thread (e.g., hanging up) at any time */
+			janus_mutex_lock(&rooms_mutex);
+			guint64 room_id = participant->room ? participant->room->room_id : 0;
+			janus_mutex_unlock(&rooms_mutex);
+			if(room_id == 0) {
+				JANUS_DEBUG("Not in a room anymore (left, or the room has been destroyed)\n");
+				sprintf(error_cause, "Not in a room anymore (left, or the room has been destroyed)");
+				goto error;
+			}
 			if(!strcasecmp(request_text, "configure")) {
 				/* Configure audio/video/bitrate for this publisher */
 				json_t *audio = json_object_get(root, "audio");
@@ -755,42 +1301,28 @@ static void *janus_videoroom_handler(void *data) {
 				}
 				if(audio) {
 					participant->audio_active = json_is_true(audio);
-					JANUS_PRINT("Setting audio property: %s (room %"SCNu64", user %"SCNu64")\n", participant->audio_active ? "true" : "false", participant->room->room_id, participant->user_id);
+					JANUS_PRINT("Setting audio property: %s (room %"SCNu64", user %"SCNu64")\n", participant->audio_active ? "true" : "false", room_id, participant->user_id);
 				}
 				if(video) {
 					participant->video_active = json_is_true(video);
-					JANUS_PRINT("Setting video property: %s (room %"SCNu64", user %"SCNu64")\n", participant->video_active ? "true" : "false", participant->room->room_id, participant->user_id);
+					JANUS_PRINT("Setting video property: %s (room %"SCNu64", user %"SCNu64")\n", participant->video_active ? "true" : "false", room_id, participant->user_id);
 				}
 				if(bitrate) {
 					participant->bitrate = json_integer_value(bitrate);
-					JANUS_PRINT("Setting video bitrate: %"SCNu64" (room %"SCNu64", user %"SCNu64")\n", participant->bitrate, participant->room->room_id, participant->user_id);
+					JANUS_PRINT("Setting video bitrate: %"SCNu64" (room %"SCNu64", user %"SCNu64")\n", participant->bitrate, room_id, participant->user_id);
 				}
 				/* Done */
 				event = json_object();
 				json_object_set(event, "videoroom", json_string("event"));
-				json_object_set(event, "room", json_integer(participant->room->room_id));
+				json_object_set(event, "room", json_integer(room_id));
 				json_object_set(event, "result", json_string("ok"));
 			} else if(!strcasecmp(request_text, "leave")) {
 				/* This publisher is leaving, tell everybody */
 				event = json_object();
 				json_object_set(event, "videoroom", json_string("event"));
-				json_object_set(event, "room", json_integer(participant->room->room_id));
+				json_object_set(event, "room", json_integer(room_id));
 				json_object_set(event, "leaving", json_integer(participant->user_id));
-				char *leaving_text = json_dumps(event, JSON_INDENT(3));
-				GList *participants_list = g_hash_table_get_values(participant->room->participants);
-				GList *ps = participants_list;
-				while(ps) {
-					janus_videoroom_participant *p = (janus_videoroom_participant *)ps->data;
-					if(p == participant) {
-						ps = ps->next;
-						continue;	/* Skip the new publisher itself */
-					}
-					JANUS_PRINT("Notifying participant %"SCNu64" (%s)\n", p->user_id, p->display);
-					JANUS_PRINT("  >> %d\n", gateway->push_event(p->session->handle, &janus_videoroom_plugin, NULL, leaving_text, NULL, NULL));
-					ps = ps->next;
-				}
-				g_free(leaving_text);
-				g_list_free(participants_list);
+				janus_videoroom_publisher_leave(participant);
 				/* Done */
 				participant->audio_active = 0;
 				participant->video_active = 0;
@@ -806,19 +1338,15 @@ static void *janus_videoroom_handler(void *data) {
 			janus_videoroom_listener *listener = (janus_videoroom_listener *)session->participant;
 			if(!strcasecmp(request_text, "start")) {
 				/* Start/restart receiving the publisher streams */
-				listener->paused = FALSE;
+				janus_videoroom_listener_start(listener, FALSE);
 			} else if(!strcasecmp(request_text, "pause")) {
 				/* Stop receiving the publisher streams for a while */
 				listener->paused = TRUE;
 			} else if(!strcasecmp(request_text, "leave")) {
-				janus_videoroom_participant *publisher = listener->feed;
-				if(publisher != NULL) {
-					publisher->listeners = g_slist_remove(publisher->listeners, listener);
-					listener->feed = NULL;
-				}
+				janus_videoroom_listener_detach(listener);
 				event = json_object();
 				json_object_set(event, "videoroom", json_string("event"));
-				json_object_set(event, "room", json_integer(publisher->room->room_id));
+				json_object_set(event, "room", json_integer(listener->room_id));
 				json_object_set(event, "result", json_string("ok"));
 				session->started = FALSE;
 			} else {
@@ -851,6 +1379,17 @@ static void *janus_videoroom_handler(void *data) {
 				goto error;
 			}
 			if(session->participant_type == janus_videoroom_p_type_publisher) {
+				/* Only accept VP8 and Opus from publishers, so that what they send can be relayed as it is to all listeners */
+				char *forced = janus_codecs_force(msg->sdp, TRUE, "VP8", janus_videoroom_video_feedback);
+				if(forced != NULL) {
+					g_free(msg->sdp);
+					msg->sdp = forced;
+				}
+				forced = janus_codecs_force(msg->sdp, FALSE, "opus", NULL);
+				if(forced != NULL) {
+					g_free(msg->sdp);
+					msg->sdp = forced;
+				}
 				/* Negotiate by sending the own publisher SDP back (just to negotiate the same media stuff) */
 				int modified = 0;
 				msg->sdp = string_replace(msg->sdp, "sendrecv", "sendonly", &modified);	/* FIXME In case the browser doesn't set it correctly */
@@ -865,7 +1404,12 @@ static void *janus_videoroom_handler(void *data) {
 					/* TODO Failed to negotiate? We should remove this publisher */
 				} else {
 					/* Store the participant's SDP for interested listeners */
+					g_free(participant->sdp);
 					participant->sdp = g_strdup(msg->sdp);
+					/* All listeners will get the same offer: prepare it only once */
+					if(participant->sdp_template != NULL)
+						gateway->destroy_sdp_template(participant->sdp_template);
+					participant->sdp_template = gateway->create_sdp_template(participant->sdp);
 					/* Notify all other participants that there's a new boy in town */
 					json_t *list = json_array();
 					json_t *pl = json_object();
@@ -874,12 +1418,15 @@ static void *janus_videoroom_handler(void *data) {
 					json_array_append_new(list, pl);
 					json_t *pub = json_object();
 					json_object_set(pub, "videoroom", json_string("event"));
-					json_object_set(event, "room", json_integer(participant->room->room_id));
 					json_object_set_new(pub, "publishers", list);
+					janus_mutex_lock(&rooms_mutex);
+					GList *participants_list = NULL;
+					if(participant->room != NULL) {
+						json_object_set_new(pub, "room", json_integer(participant->room->room_id));
+						participants_list = g_hash_table_get_values(participant->room->participants);
+					}
 					char *pub_text = json_dumps(pub, JSON_INDENT(3));
-					json_decref(list);
 					json_decref(pub);
-					GList *participants_list = g_hash_table_get_values(participant->room->participants);
 					GList *ps = participants_list;
 					while(ps) {
 						janus_videoroom_participant *p = (janus_videoroom_participant *)ps->data;
@@ -892,6 +1439,8 @@ static void *janus_videoroom_handler(void *data) {
 						ps = ps->next;
 					}
 					g_list_free(participants_list);
+					janus_mutex_unlock(&rooms_mutex);
+					g_free(pub_text);
 					/* Let's wait for the setup_media event */
 				}
 			} else if(session->participant_type == janus_videoroom_p_type_subscriber) {
@@ -937,7 +1486,7 @@ error:
 
 static void janus_videoroom_relay_rtp_packet(gpointer data, gpointer user_data) {
 	janus_videoroom_rtp_relay_packet *packet = (janus_videoroom_rtp_relay_packet *)user_data;
-	if(!packet || !packet->data || packet->length < 1) {
+	if(!packet || !packet->data || packet->length < RTP_HEADER_SIZE) {
 		JANUS_PRINT("Invalid packet...\n");
 		return;
 	}
@@ -959,8 +1508,30 @@ static void janus_videoroom_relay_rtp_packet(gpointer data, gpointer user_data)
 		// JANUS_PRINT("Streaming not started yet for this session...\n");
 		return;
 	}
-	if(gateway != NULL)	/* FIXME What about RTCP? */
+	/* Rewrite the packet for this listener (and restore it for the next one) */
+	janus_videoroom_rtp_context *context = &listener->context[packet->is_video ? 1 : 0];
+	rtp_header *header = (rtp_header *)packet->data;
+	uint16_t seq = ntohs(header->seq_number);
+	uint32_t ts = ntohl(header->timestamp);
+	if(context->resync)
+		janus_videoroom_rtp_context_resync(context, seq, ts, packet->is_video ? 90000 : 48000);
+	context->last_seq = seq + context->seq_offset;
+	context->last_ts = ts + context->ts_offset;
+	context->last_time = g_get_monotonic_time();
+	context->sent = TRUE;
+	header->seq_number = htons(context->last_seq);
+	header->timestamp = htonl(context->last_ts);
+	if(packet->is_video && listener->replay != NULL) {
+		/* Still replaying the latest GOP (see listener_start): we hold the gop mutex here */
+		if(janus_gop_copy_relay(listener->replay, packet->data, packet->length, janus_videoroom_gop_send, session)) {
+			janus_gop_copy_free(listener->replay);
+			listener->replay = NULL;
+		}
+	} else if(gateway != NULL) {	/* FIXME What about RTCP? */
 		gateway->relay_rtp(session->handle, packet->is_video, (char *)packet->data, packet->length);
+	}
+	header->seq_number = htons(seq);
+	header->timestamp = htonl(ts);
 	return;
 }
 
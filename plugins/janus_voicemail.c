@@ -32,6 +32,7 @@
 
 #include "../config.h"
 #include "../rtp.h"
+#include "../writer.h"
 
 
 /* Plugin information */
@@ -106,7 +107,7 @@ typedef struct janus_voicemail_session {
 	guint64 recording_id;
 	gint64 start_time;
 	char *filename;
-	FILE *file;
+	janus_writer *file;	/* Written by the I/O thread, never by the media one */
 	ogg_stream_state *stream;
 	int seq;
 	gboolean started;
@@ -403,7 +404,7 @@ void janus_voicemail_hangup_media(janus_pluginession *handle) {
 	session->destroy = 1;
 	/* Close and reset stuff */
 	if(session->file)
-		fclose(session->file);
+		janus_writer_close(session->file);
 	session->file = NULL;
 	if(session->stream)
 		ogg_stream_destroy(session->stream);
@@ -477,7 +478,7 @@ static void *janus_voicemail_handler(void *data) {
 				sprintf(error_cause, "Couldn't initialize Ogg stream state\n");
 				goto error;
 			}
-			session->file = fopen(session->filename, "wb");
+			session->file = janus_writer_open(session->filename, FALSE);
 			if(session->file == NULL) {
 				JANUS_DEBUG("Couldn't open output file\n");
 				sprintf(error_cause, "Couldn't open output file");
@@ -500,7 +501,7 @@ static void *janus_voicemail_handler(void *data) {
 			/* Stop the recording */
 			session->started = FALSE;
 			if(session->file)
-				fclose(session->file);
+				janus_writer_close(session->file);
 			session->file = NULL;
 			if(session->stream)
 				ogg_stream_destroy(session->stream);
@@ -696,20 +697,17 @@ void op_free(ogg_packet *op) {
 /* Write out available ogg pages */
 int ogg_write(janus_voicemail_session *session) {
 	ogg_page page;
-	size_t written;
 
 	if(!session || !session->stream || !session->file) {
 		return -1;
 	}
 
 	while (ogg_stream_pageout(session->stream, &page)) {
-		written = fwrite(page.header, 1, page.header_len, session->file);
-		if(written != (size_t)page.header_len) {
+		if(janus_writer_write(session->file, page.header, page.header_len) < 0) {
 			JANUS_DEBUG("Error writing Ogg page header\n");
 			return -2;
 		}
-		written = fwrite(page.body, 1, page.body_len, session->file);
-		if(written != (size_t)page.body_len) {
+		if(janus_writer_write(session->file, page.body, page.body_len) < 0) {
 			JANUS_DEBUG("Error writing Ogg page body\n");
 			return -3;
 		}
@@ -720,20 +718,17 @@ int ogg_write(janus_voicemail_session *session) {
 /* Flush remaining ogg data */
 int ogg_flush(janus_voicemail_session *session) {
 	ogg_page page;
-	size_t written;
 
 	if(!session || !session->stream || !session->file) {
 		return -1;
 	}
 
 	while (ogg_stream_flush(session->stream, &page)) {
-		written = fwrite(page.header, 1, page.header_len, session->file);
-		if(written != (size_t)page.header_len) {
+		if(janus_writer_write(session->file, page.header, page.header_len) < 0) {
 			JANUS_DEBUG("Error writing Ogg page header\n");
 			return -2;
 		}
-		written = fwrite(page.body, 1, page.body_len, session->file);
-		if(written != (size_t)page.body_len) {
+		if(janus_writer_write(session->file, page.body, page.body_len) < 0) {
 			JANUS_DEBUG("Error writing Ogg page body\n");
 			return -3;
 		}
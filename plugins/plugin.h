@@ -19,7 +19,11 @@
  * important thing is that it MUST be a JSON object, as it will be included
  * as such within the Janus session/handle protocol;
  * - \c relay_rtp(): to send/relay the peer an RTP packet;
- * - \c relay_rtcp(): to send/relay the peer an RTCP message.
+ * - \c relay_rtcp(): to send/relay the peer an RTCP message;
+ * - \c create_sdp_template(), \c push_event_template() and \c destroy_sdp_template():
+ * to offer the same SDP to many peers (e.g., the listeners of a webinar)
+ * without having the gateway process it from scratch every time;
+ * - \c get_codecs(): to get the codecs the gateway negotiated with the peer.
  * 
  * On the other hand, a plugin that wants to register at the gateway
  * needs to implement the \c janus_plugin interface. Besides, as a
@@ -62,7 +66,9 @@ janus_plugin *create(void) {
  * - \c incoming_rtp(): a callback to notify you a peer has sent you a RTP packet;
  * - \c incoming_rtcp(): a callback to notify you a peer has sent you a RTCP message;
  * - \c hangup_media(): a callback to notify you the peer PeerConnection has been closed (e.g., after a DTLS alert);
- * - \c destroy_session(): this method is called by the gateway to destroy a session between you and a peer.
+ * - \c destroy_session(): this method is called by the gateway to destroy a session between you and a peer;
+ * - \c get_metrics(): an optional method the gateway invokes when metrics are
+ * scraped, to which you can reply with your own metrics (Prometheus text format).
  * 
  * The gateway \c janus_callbacks interface is provided to a plugin, together
  * with the path to the configurations files folder, in the \c init() method.
@@ -137,6 +143,7 @@ janus_plugin *create(void) {
 #include <inttypes.h>
 
 #include "../apierror.h"
+#include "../codecs.h"
 #include "../debug.h"
 
 
@@ -146,6 +153,8 @@ typedef struct janus_callbacks janus_callbacks;
 typedef struct janus_plugin janus_plugin;
 /*! \brief Plugin-Gateway session mapping */
 typedef struct janus_pluginession janus_pluginession;
+/*! \brief Pre-rendered SDP a plugin can offer to many peers (opaque to plugins) */
+typedef struct janus_sdp_template janus_sdp_template;
 
 /*! \brief Plugin-Gateway session mapping */
 struct janus_pluginession {
@@ -208,6 +217,11 @@ struct janus_plugin {
 	 * @param[out] error An integer that may contain information about any error */
 	void (* const destroy_session)(janus_pluginession *handle, int *error);
 
+	/*! \brief Optional method to export plugin specific metrics
+	 * \note This is invoked by a web server thread, so it must not block
+	 * @returns A string in the Prometheus text exposition format (will be freed by the gateway with g_free), or NULL */
+	char *(* const get_metrics)(void);
+
 };
 
 /*! \brief Callbacks to contact the gateway */
@@ -234,6 +248,35 @@ struct janus_callbacks {
 	 * @param[in] len The buffer lenght */
 	void (* const relay_rtcp)(janus_pluginession *handle, int video, char *buf, int len);
 
+	/*! \brief Callback to create an SDP template, to offer the same SDP to many peers
+	 * \details The SDP is stripped and pre-rendered only once: pushing it to a
+	 * peer with \c push_event_template() then only needs the peer transport
+	 * information (ports, ICE credentials, candidates) to be filled in
+	 * @param[in] sdp The SDP to use as a template
+	 * @returns A template in case of success, NULL if the SDP is invalid */
+	janus_sdp_template *(* const create_sdp_template)(const char *sdp);
+	/*! \brief Callback to get rid of an SDP template
+	 * \note Make sure no \c push_event_template() call is using the template when you do this
+	 * @param[in] sdp_template The template to destroy */
+	void (* const destroy_sdp_template)(janus_sdp_template *sdp_template);
+	/*! \brief Callback to push events/messages to a peer, with an SDP template to negotiate
+	 * @param[in] handle The plugin/gateway session used for this peer
+	 * @param[in] plugin The plugin instance that is sending the message/event
+	 * @param[in] transaction The transaction identifier this message refers to
+	 * @param[in] message The stringified version of the JSON message
+	 * @param[in] sdp_type The type of the SDP attached to the message/event (offer/answer)
+	 * @param[in] sdp_template The SDP template to attach to the message/event */
+	int (* const push_event_template)(janus_pluginession *handle, janus_plugin *plugin, char *transaction, char *message, char *sdp_type, janus_sdp_template *sdp_template);
+
+	/*! \brief Callback to get the codecs negotiated with a peer, as parsed by the gateway from its SDP
+	 * \note The gateway parses the SDP of a peer before passing it to the
+	 * plugin, so the codecs of an offer or answer are already available when
+	 * \c handle_message() gets it
+	 * @param[in] handle The plugin/gateway session used for this peer
+	 * @param[in] video Whether the codecs of the video (TRUE) or audio (FALSE) stream are needed
+	 * @returns A copy of the list of janus_codec instances, in order of preference (to be freed with janus_codecs_free), or NULL if there are none */
+	GList *(* const get_codecs)(janus_pluginession *handle, int video);
+
 };
 
 /*! \brief The hook that plugins need to implement to be created from the gateway */
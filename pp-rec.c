@@ -0,0 +1,656 @@
+/*! \file    pp-rec.c
+ * \author   Lorenzo Miniero <lorenzo@meetecho.com>
+ * \copyright GNU Affero General Public License v3
+ * \brief    Post-processor for raw RTP recordings (janus-pp-rec)
+ * \details  Implementation of a simple offline tool to convert the raw
+ * RTP recordings made by the gateway (see record.h) to a playable file.
+ * Packets are read from the recording, sorted by (extended) sequence
+ * number, and then muxed, with no transcoding involved, in an Ogg file
+ * (Opus audio) or in a WebM file (Opus audio or VP8 video), depending
+ * on the extension of the target file:
+ *
+\verbatim
+./janus-pp-rec /path/to/source.jrtp /path/to/destination.[opus|ogg|webm]
+\endverbatim
+ *
+ * WebM files are written by a minimal muxer (an EBML header, the segment
+ * information, a single track and clusters of SimpleBlocks), which is
+ * enough for browsers and common players: no cues are added.
+ *
+ * \ingroup core
+ * \ref core
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <ogg/ogg.h>
+
+#include "rtp.h"
+
+
+/* Recordings format (see record.h) */
+#define JANUS_PP_HEADER_SIZE	16
+#define JANUS_PP_PACKET_SIZE	6
+#define JANUS_PP_TRAILER_SIZE	16
+
+/* Codecs we know how to mux */
+typedef enum janus_pp_codec {
+	JANUS_PP_OPUS = 0,
+	JANUS_PP_VP8,
+} janus_pp_codec;
+
+/* A packet in the recording */
+typedef struct janus_pp_packet {
+	/* Extended sequence number */
+	int64_t seq;
+	/* Extended RTP timestamp */
+	int64_t ts;
+	/* Payload (i.e., RTP headers stripped), pointing to the mapped recording */
+	const unsigned char *payload;
+	/* Length of the payload */
+	int length;
+} janus_pp_packet;
+
+
+/* Helpers to read integers in network byte order */
+static uint16_t janus_pp_get16(const unsigned char *buf) {
+	return (buf[0] << 8) | buf[1];
+}
+
+static uint32_t janus_pp_get32(const unsigned char *buf) {
+	return ((uint32_t)buf[0] << 24) | (buf[1] << 16) | (buf[2] << 8) | buf[3];
+}
+
+static uint64_t janus_pp_get64(const unsigned char *buf) {
+	return ((uint64_t)janus_pp_get32(buf) << 32) | janus_pp_get32(buf+4);
+}
+
+/* Helpers to write little endian integers (Ogg/Opus headers) */
+static void janus_pp_le16(unsigned char *buf, int value) {
+	buf[0] = value & 0xFF;
+	buf[1] = (value >> 8) & 0xFF;
+}
+
+static void janus_pp_le32(unsigned char *buf, int value) {
+	janus_pp_le16(buf, value & 0xFFFF);
+	janus_pp_le16(buf+2, (value >> 16) & 0xFFFF);
+}
+
+
+/* Helper to find the payload type and clock rate of a codec in the recording header (e.g., "111 opus/48000/2;0 PCMU/8000") */
+static int janus_pp_find_codec(const char *codecs, const char *name, int *rate, int *channels) {
+	const char *c = codecs;
+	while(c && *c) {
+		int pt = -1, r = 0, ch = 0;
+		char codec[32];
+		int res = sscanf(c, "%d %31[^/]/%d/%d", &pt, codec, &r, &ch);
+		if(res >= 3 && !strcasecmp(codec, name)) {
+			*rate = r;
+			*channels = ch > 0 ? ch : 1;
+			return pt;
+		}
+		c = strchr(c, ';');
+		if(c)
+			c++;
+	}
+	return -1;
+}
+
+/* Helper to get to the payload of an RTP packet */
+static const unsigned char *janus_pp_rtp_payload(const unsigned char *buf, int len, int *plen) {
+	if(len < RTP_HEADER_SIZE)
+		return NULL;
+	rtp_header *rtp = (rtp_header *)buf;
+	int skip = RTP_HEADER_SIZE + rtp->csrccount*4;
+	if(rtp->extension) {
+		if(len < skip+4)
+			return NULL;
+		skip += 4 + janus_pp_get16(buf+skip+2)*4;
+	}
+	int padding = 0;
+	if(rtp->padding && len > 0)
+		padding = buf[len-1];
+	if(len-skip-padding <= 0)
+		return NULL;
+	*plen = len-skip-padding;
+	return buf+skip;
+}
+
+static int janus_pp_packet_compare(const void *a, const void *b) {
+	const janus_pp_packet *p1 = (const janus_pp_packet *)a, *p2 = (const janus_pp_packet *)b;
+	return p1->seq < p2->seq ? -1 : (p1->seq > p2->seq ? 1 : 0);
+}
+
+
+/* Ogg/Opus */
+static void janus_pp_ogg_flush(ogg_stream_state *stream, FILE *file, int force) {
+	ogg_page page;
+	while(force ? ogg_stream_flush(stream, &page) : ogg_stream_pageout(stream, &page)) {
+		fwrite(page.header, 1, page.header_len, file);
+		fwrite(page.body, 1, page.body_len, file);
+	}
+}
+
+static int janus_pp_ogg_opus(janus_pp_packet *packets, int count, int channels, FILE *file) {
+	ogg_stream_state stream;
+	if(ogg_stream_init(&stream, rand()) < 0) {
+		fprintf(stderr, "Couldn't initialize Ogg stream state\n");
+		return -1;
+	}
+	/* OpusHead */
+	unsigned char head[19];
+	memcpy(head, "OpusHead", 8);
+	head[8] = 1;						/* Version */
+	head[9] = channels;					/* Channels */
+	janus_pp_le16(head+10, 0);			/* Pre-skip */
+	janus_pp_le32(head+12, 48000);		/* Original sample rate */
+	janus_pp_le16(head+16, 0);			/* Gain */
+	head[18] = 0;						/* Channel mapping family */
+	ogg_packet op;
+	memset(&op, 0, sizeof(op));
+	op.packet = head;
+	op.bytes = sizeof(head);
+	op.b_o_s = 1;
+	ogg_stream_packetin(&stream, &op);
+	/* OpusTags */
+	const char *vendor = "janus-pp-rec";
+	unsigned char tags[8+4+32+4];
+	memcpy(tags, "OpusTags", 8);
+	janus_pp_le32(tags+8, strlen(vendor));
+	memcpy(tags+12, vendor, strlen(vendor));
+	janus_pp_le32(tags+12+strlen(vendor), 0);
+	op.packet = tags;
+	op.bytes = 12+strlen(vendor)+4;
+	op.b_o_s = 0;
+	op.packetno = 1;
+	ogg_stream_packetin(&stream, &op);
+	janus_pp_ogg_flush(&stream, file, 1);
+	/* Audio packets: the granule position comes from the RTP timestamp (Opus always
+	 * uses 48kHz), and refers to the last sample in the packet (we assume 20ms frames) */
+	int i = 0;
+	for(i=0; i<count; i++) {
+		op.packet = (unsigned char *)packets[i].payload;
+		op.bytes = packets[i].length;
+		op.b_o_s = 0;
+		op.e_o_s = (i == count-1);
+		op.granulepos = packets[i].ts - packets[0].ts + 960;
+		op.packetno = i+2;
+		ogg_stream_packetin(&stream, &op);
+		janus_pp_ogg_flush(&stream, file, 0);
+	}
+	janus_pp_ogg_flush(&stream, file, 1);
+	ogg_stream_clear(&stream);
+	return 0;
+}
+
+
+/* WebM (EBML) */
+#define EBML_HEADER				0x1A45DFA3
+#define EBML_VERSION			0x4286
+#define EBML_READ_VERSION		0x42F7
+#define EBML_MAX_ID_LENGTH		0x42F2
+#define EBML_MAX_SIZE_LENGTH	0x42F3
+#define EBML_DOCTYPE			0x4282
+#define EBML_DOCTYPE_VERSION	0x4287
+#define EBML_DOCTYPE_READ		0x4285
+#define WEBM_SEGMENT			0x18538067
+#define WEBM_INFO				0x1549A966
+#define WEBM_TIMECODE_SCALE		0x2AD7B1
+#define WEBM_MUXING_APP			0x4D80
+#define WEBM_WRITING_APP		0x5741
+#define WEBM_TRACKS				0x1654AE6B
+#define WEBM_TRACK_ENTRY		0xAE
+#define WEBM_TRACK_NUMBER		0xD7
+#define WEBM_TRACK_UID			0x73C5
+#define WEBM_TRACK_TYPE			0x83
+#define WEBM_CODEC_ID			0x86
+#define WEBM_CODEC_PRIVATE		0x63A2
+#define WEBM_VIDEO				0xE0
+#define WEBM_PIXEL_WIDTH		0xB0
+#define WEBM_PIXEL_HEIGHT		0xBA
+#define WEBM_AUDIO				0xE1
+#define WEBM_SAMPLING_FREQUENCY	0xB5
+#define WEBM_CHANNELS			0x9F
+#define WEBM_CLUSTER			0x1F43B675
+#define WEBM_TIMECODE			0xE7
+#define WEBM_SIMPLE_BLOCK		0xA3
+
+/* Growable buffer to serialize EBML elements in */
+typedef struct janus_pp_ebml {
+	unsigned char *data;
+	size_t length, size;
+} janus_pp_ebml;
+
+static void janus_pp_ebml_append(janus_pp_ebml *ebml, const void *data, size_t length) {
+	if(ebml->length + length > ebml->size) {
+		size_t size = ebml->size ? ebml->size : 256;
+		while(size < ebml->length + length)
+			size *= 2;
+		unsigned char *resized = realloc(ebml->data, size);
+		if(resized == NULL) {
+			fprintf(stderr, "Memory error!\n");
+			exit(1);
+		}
+		ebml->data = resized;
+		ebml->size = size;
+	}
+	memcpy(ebml->data + ebml->length, data, length);
+	ebml->length += length;
+}
+
+static void janus_pp_ebml_id(janus_pp_ebml *ebml, uint32_t id) {
+	/* IDs already include their length marker */
+	unsigned char buf[4];
+	int len = id > 0xFFFFFF ? 4 : (id > 0xFFFF ? 3 : (id > 0xFF ? 2 : 1));
+	int i = 0;
+	for(i=0; i<len; i++)
+		buf[i] = (id >> (8*(len-i-1))) & 0xFF;
+	janus_pp_ebml_append(ebml, buf, len);
+}
+
+static void janus_pp_ebml_size(janus_pp_ebml *ebml, uint64_t size) {
+	unsigned char buf[8];
+	int len = 1;
+	while(len < 8 && size >= ((uint64_t)1 << (7*len)) - 1)
+		len++;
+	int i = 0;
+	for(i=0; i<len; i++)
+		buf[i] = (size >> (8*(len-i-1))) & 0xFF;
+	buf[0] |= 0x80 >> (len-1);
+	janus_pp_ebml_append(ebml, buf, len);
+}
+
+static void janus_pp_ebml_unknown_size(janus_pp_ebml *ebml) {
+	unsigned char buf[8] = { 0x01, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF };
+	janus_pp_ebml_append(ebml, buf, sizeof(buf));
+}
+
+static void janus_pp_ebml_uint(janus_pp_ebml *ebml, uint32_t id, uint64_t value) {
+	unsigned char buf[8];
+	int len = 1;
+	while(len < 8 && (value >> (8*len)) > 0)
+		len++;
+	int i = 0;
+	for(i=0; i<len; i++)
+		buf[i] = (value >> (8*(len-i-1))) & 0xFF;
+	janus_pp_ebml_id(ebml, id);
+	janus_pp_ebml_size(ebml, len);
+	janus_pp_ebml_append(ebml, buf, len);
+}
+
+static void janus_pp_ebml_float(janus_pp_ebml *ebml, uint32_t id, double value) {
+	uint64_t bits = 0;
+	memcpy(&bits, &value, sizeof(bits));
+	unsigned char buf[8];
+	int i = 0;
+	for(i=0; i<8; i++)
+		buf[i] = (bits >> (8*(7-i))) & 0xFF;
+	janus_pp_ebml_id(ebml, id);
+	janus_pp_ebml_size(ebml, 8);
+	janus_pp_ebml_append(ebml, buf, 8);
+}
+
+static void janus_pp_ebml_binary(janus_pp_ebml *ebml, uint32_t id, const void *data, size_t length) {
+	janus_pp_ebml_id(ebml, id);
+	janus_pp_ebml_size(ebml, length);
+	janus_pp_ebml_append(ebml, data, length);
+}
+
+static void janus_pp_ebml_string(janus_pp_ebml *ebml, uint32_t id, const char *value) {
+	janus_pp_ebml_binary(ebml, id, value, strlen(value));
+}
+
+static void janus_pp_ebml_master(janus_pp_ebml *ebml, uint32_t id, janus_pp_ebml *child) {
+	janus_pp_ebml_binary(ebml, id, child->data, child->length);
+	free(child->data);
+	memset(child, 0, sizeof(*child));
+}
+
+static void janus_pp_ebml_write(janus_pp_ebml *ebml, FILE *file) {
+	if(ebml->length > 0)
+		fwrite(ebml->data, 1, ebml->length, file);
+	ebml->length = 0;
+}
+
+/* Helper to write a frame as a SimpleBlock, starting a new cluster if needed */
+static void janus_pp_webm_frame(janus_pp_ebml *ebml, FILE *file, int64_t when, int keyframe, int video,
+		const unsigned char *frame, size_t length, int64_t *cluster) {
+	/* Blocks have a 16 bit timecode relative to the cluster: start a new one when needed (or on keyframes, for video) */
+	if(*cluster < 0 || when - *cluster > 30000 || (video && keyframe && when != *cluster)) {
+		*cluster = when;
+		janus_pp_ebml_id(ebml, WEBM_CLUSTER);
+		janus_pp_ebml_unknown_size(ebml);
+		janus_pp_ebml_uint(ebml, WEBM_TIMECODE, when);
+	}
+	unsigned char header[4];
+	int16_t relative = when - *cluster;
+	header[0] = 0x81;	/* Track number 1 */
+	header[1] = (relative >> 8) & 0xFF;
+	header[2] = relative & 0xFF;
+	header[3] = keyframe ? 0x80 : 0x00;
+	janus_pp_ebml_id(ebml, WEBM_SIMPLE_BLOCK);
+	janus_pp_ebml_size(ebml, sizeof(header) + length);
+	janus_pp_ebml_append(ebml, header, sizeof(header));
+	janus_pp_ebml_append(ebml, frame, length);
+	janus_pp_ebml_write(ebml, file);
+}
+
+/* Helper to strip the VP8 payload descriptor (RFC 7741): returns the offset of the VP8 payload, or -1 */
+static int janus_pp_vp8_descriptor(const unsigned char *buf, int len, int *start) {
+	if(len < 1)
+		return -1;
+	int offset = 1;
+	/* X R N S R PID */
+	*start = (buf[0] & 0x10) && ((buf[0] & 0x07) == 0);
+	if(buf[0] & 0x80) {
+		/* I L T K RSV */
+		if(len < 2)
+			return -1;
+		unsigned char ext = buf[1];
+		offset++;
+		if(ext & 0x80) {
+			/* PictureID, one or two bytes */
+			if(len <= offset)
+				return -1;
+			offset += (buf[offset] & 0x80) ? 2 : 1;
+		}
+		if(ext & 0x40)
+			offset++;	/* TL0PICIDX */
+		if(ext & 0x30)
+			offset++;	/* TID/Y/KEYIDX */
+	}
+	return offset < len ? offset : -1;
+}
+
+static int janus_pp_webm(janus_pp_packet *packets, int count, janus_pp_codec codec, int rate, int channels, FILE *file) {
+	int width = 0, height = 0;
+	int i = 0;
+	if(codec == JANUS_PP_VP8) {
+		/* Look for the resolution in the first keyframe */
+		for(i=0; i<count && width == 0; i++) {
+			int start = 0;
+			int offset = janus_pp_vp8_descriptor(packets[i].payload, packets[i].length, &start);
+			if(offset < 0 || !start || packets[i].length-offset < 10)
+				continue;
+			const unsigned char *vp8 = packets[i].payload + offset;
+			if((vp8[0] & 0x01) == 0 && vp8[3] == 0x9d && vp8[4] == 0x01 && vp8[5] == 0x2a) {
+				width = (vp8[6] | (vp8[7] << 8)) & 0x3FFF;
+				height = (vp8[8] | (vp8[9] << 8)) & 0x3FFF;
+			}
+		}
+		if(width == 0) {
+			fprintf(stderr, "No keyframe in the recording, can't mux it\n");
+			return -1;
+		}
+		printf("Video resolution: %dx%d\n", width, height);
+	}
+	janus_pp_ebml ebml, child, grandchild, track;
+	memset(&ebml, 0, sizeof(ebml));
+	memset(&child, 0, sizeof(child));
+	memset(&grandchild, 0, sizeof(grandchild));
+	memset(&track, 0, sizeof(track));
+	/* EBML header */
+	janus_pp_ebml_uint(&child, EBML_VERSION, 1);
+	janus_pp_ebml_uint(&child, EBML_READ_VERSION, 1);
+	janus_pp_ebml_uint(&child, EBML_MAX_ID_LENGTH, 4);
+	janus_pp_ebml_uint(&child, EBML_MAX_SIZE_LENGTH, 8);
+	janus_pp_ebml_string(&child, EBML_DOCTYPE, "webm");
+	janus_pp_ebml_uint(&child, EBML_DOCTYPE_VERSION, 2);
+	janus_pp_ebml_uint(&child, EBML_DOCTYPE_READ, 2);
+	janus_pp_ebml_master(&ebml, EBML_HEADER, &child);
+	/* Segment (of unknown size, we write everything in a single pass) */
+	janus_pp_ebml_id(&ebml, WEBM_SEGMENT);
+	janus_pp_ebml_unknown_size(&ebml);
+	janus_pp_ebml_uint(&child, WEBM_TIMECODE_SCALE, 1000000);	/* Milliseconds */
+	janus_pp_ebml_string(&child, WEBM_MUXING_APP, "janus-pp-rec");
+	janus_pp_ebml_string(&child, WEBM_WRITING_APP, "janus-pp-rec");
+	janus_pp_ebml_master(&ebml, WEBM_INFO, &child);
+	/* A single track */
+	janus_pp_ebml_uint(&track, WEBM_TRACK_NUMBER, 1);
+	janus_pp_ebml_uint(&track, WEBM_TRACK_UID, 1);
+	if(codec == JANUS_PP_VP8) {
+		janus_pp_ebml_uint(&track, WEBM_TRACK_TYPE, 1);
+		janus_pp_ebml_string(&track, WEBM_CODEC_ID, "V_VP8");
+		janus_pp_ebml_uint(&grandchild, WEBM_PIXEL_WIDTH, width);
+		janus_pp_ebml_uint(&grandchild, WEBM_PIXEL_HEIGHT, height);
+		janus_pp_ebml_master(&track, WEBM_VIDEO, &grandchild);
+	} else {
+		janus_pp_ebml_uint(&track, WEBM_TRACK_TYPE, 2);
+		janus_pp_ebml_string(&track, WEBM_CODEC_ID, "A_OPUS");
+		unsigned char head[19];
+		memcpy(head, "OpusHead", 8);
+		head[8] = 1;
+		head[9] = channels;
+		janus_pp_le16(head+10, 0);
+		janus_pp_le32(head+12, 48000);
+		janus_pp_le16(head+16, 0);
+		head[18] = 0;
+		janus_pp_ebml_binary(&track, WEBM_CODEC_PRIVATE, head, sizeof(head));
+		janus_pp_ebml_float(&grandchild, WEBM_SAMPLING_FREQUENCY, 48000.0);
+		janus_pp_ebml_uint(&grandchild, WEBM_CHANNELS, channels);
+		janus_pp_ebml_master(&track, WEBM_AUDIO, &grandchild);
+	}
+	janus_pp_ebml_master(&child, WEBM_TRACK_ENTRY, &track);
+	janus_pp_ebml_master(&ebml, WEBM_TRACKS, &child);
+	janus_pp_ebml_write(&ebml, file);
+	/* Now the frames: timecodes come from the RTP timestamps */
+	int64_t cluster = -1;
+	int frames = 0, dropped = 0;
+	if(codec == JANUS_PP_OPUS) {
+		for(i=0; i<count; i++) {
+			int64_t when = (packets[i].ts - packets[0].ts) * 1000 / rate;
+			janus_pp_webm_frame(&ebml, file, when, 1, 0, packets[i].payload, packets[i].length, &cluster);
+			frames++;
+		}
+	} else {
+		/* Reassemble VP8 frames: a frame starts with a packet with S=1 and PID=0, and ends when the timestamp changes */
+		janus_pp_ebml frame;
+		memset(&frame, 0, sizeof(frame));
+		int64_t frame_ts = -1, expected = -1;
+		int broken = 1, keyframe = 0, waiting_key = 1;
+		for(i=0; i<=count; i++) {
+			int end = (i == count) || (frame_ts >= 0 && packets[i].ts != frame_ts);
+			if(end && frame_ts >= 0) {
+				if(!broken && frame.length > 0 && (!waiting_key || keyframe)) {
+					waiting_key = 0;
+					int64_t when = (frame_ts - packets[0].ts) * 1000 / rate;
+					janus_pp_webm_frame(&ebml, file, when, keyframe, 1, frame.data, frame.length, &cluster);
+					frames++;
+				} else if(frame.length > 0) {
+					dropped++;
+				}
+				frame.length = 0;
+				frame_ts = -1;
+			}
+			if(i == count)
+				break;
+			int start = 0;
+			int offset = janus_pp_vp8_descriptor(packets[i].payload, packets[i].length, &start);
+			if(offset < 0)
+				continue;
+			if(start) {
+				/* New frame */
+				frame.length = 0;
+				frame_ts = packets[i].ts;
+				broken = 0;
+				keyframe = (packets[i].payload[offset] & 0x01) == 0;
+			} else if(frame_ts < 0 || packets[i].seq != expected) {
+				/* We lost the beginning of this frame, or a packet in the middle */
+				broken = 1;
+			}
+			expected = packets[i].seq + 1;
+			if(frame_ts >= 0)
+				janus_pp_ebml_append(&frame, packets[i].payload+offset, packets[i].length-offset);
+		}
+		free(frame.data);
+	}
+	free(ebml.data);
+	printf("Wrote %d frames (%d incomplete frames dropped)\n", frames, dropped);
+	return 0;
+}
+
+
+int main(int argc, char *argv[]) {
+	if(argc != 3) {
+		printf("Usage: %s source.jrtp destination.[opus|ogg|webm]\n", argv[0]);
+		return 1;
+	}
+	const char *source = argv[1], *destination = argv[2];
+	const char *extension = strrchr(destination, '.');
+	int webm = extension && !strcasecmp(extension, ".webm");
+	int ogg = extension && (!strcasecmp(extension, ".ogg") || !strcasecmp(extension, ".opus"));
+	if(!webm && !ogg) {
+		fprintf(stderr, "Unsupported target format %s (only .opus, .ogg and .webm are supported)\n", destination);
+		return 1;
+	}
+	/* Map the recording */
+	int fd = open(source, O_RDONLY);
+	if(fd < 0) {
+		fprintf(stderr, "Couldn't open %s: %d (%s)\n", source, errno, strerror(errno));
+		return 1;
+	}
+	struct stat st;
+	if(fstat(fd, &st) < 0 || st.st_size < JANUS_PP_HEADER_SIZE) {
+		fprintf(stderr, "Invalid recording %s\n", source);
+		close(fd);
+		return 1;
+	}
+	size_t size = st.st_size;
+	const unsigned char *data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if(data == MAP_FAILED) {
+		fprintf(stderr, "Couldn't map %s: %d (%s)\n", source, errno, strerror(errno));
+		return 1;
+	}
+	/* Parse the header */
+	if(memcmp(data, "JRTP", 4) || data[4] != 1) {
+		fprintf(stderr, "%s is not a recording we can handle\n", source);
+		return 1;
+	}
+	int video = data[5];
+	size_t codecs_len = janus_pp_get16(data+6);
+	uint64_t started = janus_pp_get64(data+8);
+	if(JANUS_PP_HEADER_SIZE + codecs_len > size) {
+		fprintf(stderr, "Invalid recording %s\n", source);
+		return 1;
+	}
+	char *codecs = calloc(1, codecs_len+1);
+	memcpy(codecs, data+JANUS_PP_HEADER_SIZE, codecs_len);
+	printf("%s recording, started at %"SCNu64" (codecs: %s)\n", video ? "Video" : "Audio", started, codecs_len ? codecs : "unknown");
+	/* Only the packets are of interest: if there's an index, we stop there, otherwise we scan until the end */
+	size_t end = size;
+	if(size >= JANUS_PP_HEADER_SIZE + codecs_len + JANUS_PP_TRAILER_SIZE &&
+			!memcmp(data + size - JANUS_PP_TRAILER_SIZE, "JIDX", 4)) {
+		uint32_t entries = janus_pp_get32(data + size - JANUS_PP_TRAILER_SIZE + 4);
+		uint64_t index = janus_pp_get64(data + size - JANUS_PP_TRAILER_SIZE + 8);
+		if(index <= size - JANUS_PP_TRAILER_SIZE) {
+			end = index;
+			if(entries > 0)
+				printf("Index: %"SCNu32" entries, last one at %"SCNu32"ms\n", entries, janus_pp_get32(data + size - JANUS_PP_TRAILER_SIZE - 12));
+		}
+	} else {
+		printf("No index, the recording was not closed properly: scanning the whole file\n");
+	}
+	/* Which codec are we muxing? */
+	int rate = 0, channels = 0, pt = -1;
+	janus_pp_codec codec = JANUS_PP_OPUS;
+	if(video) {
+		codec = JANUS_PP_VP8;
+		pt = janus_pp_find_codec(codecs, "VP8", &rate, &channels);
+	} else {
+		pt = janus_pp_find_codec(codecs, "opus", &rate, &channels);
+	}
+	free(codecs);
+	if(pt < 0) {
+		fprintf(stderr, "No %s in the recording, can't mux it\n", video ? "VP8" : "Opus");
+		return 1;
+	}
+	if(codec == JANUS_PP_VP8 && !webm) {
+		fprintf(stderr, "VP8 can only be muxed in WebM\n");
+		return 1;
+	}
+	/* Read the packets */
+	size_t offset = JANUS_PP_HEADER_SIZE + codecs_len;
+	int count = 0, allocated = 1024;
+	janus_pp_packet *packets = malloc(allocated*sizeof(janus_pp_packet));
+	int64_t last_seq = -1, last_ts = -1;
+	while(offset + JANUS_PP_PACKET_SIZE <= end) {
+		int len = janus_pp_get16(data+offset+4);
+		const unsigned char *buf = data + offset + JANUS_PP_PACKET_SIZE;
+		offset += JANUS_PP_PACKET_SIZE + len;
+		if(offset > end) {
+			/* Truncated packet */
+			break;
+		}
+		if(len < RTP_HEADER_SIZE)
+			continue;
+		rtp_header *rtp = (rtp_header *)buf;
+		if(rtp->type != pt)
+			continue;
+		int plen = 0;
+		const unsigned char *payload = janus_pp_rtp_payload(buf, len, &plen);
+		if(payload == NULL)
+			continue;
+		/* Extend sequence numbers and timestamps, to take wrap-arounds into account */
+		uint16_t seq = ntohs(rtp->seq_number);
+		uint32_t ts = ntohl(rtp->timestamp);
+		int64_t ext_seq = last_seq < 0 ? seq : last_seq + (int16_t)(seq - (uint16_t)last_seq);
+		int64_t ext_ts = last_ts < 0 ? ts : last_ts + (int32_t)(ts - (uint32_t)last_ts);
+		last_seq = ext_seq;
+		last_ts = ext_ts;
+		if(count == allocated) {
+			allocated *= 2;
+			janus_pp_packet *resized = realloc(packets, allocated*sizeof(janus_pp_packet));
+			if(resized == NULL) {
+				fprintf(stderr, "Memory error!\n");
+				return 1;
+			}
+			packets = resized;
+		}
+		packets[count].seq = ext_seq;
+		packets[count].ts = ext_ts;
+		packets[count].payload = payload;
+		packets[count].length = plen;
+		count++;
+	}
+	if(count == 0) {
+		fprintf(stderr, "No packets in the recording\n");
+		return 1;
+	}
+	/* Sort by sequence number, getting rid of duplicates (e.g., retransmissions) */
+	qsort(packets, count, sizeof(janus_pp_packet), janus_pp_packet_compare);
+	int i = 0, unique = 1;
+	for(i=1; i<count; i++) {
+		if(packets[i].seq != packets[unique-1].seq)
+			packets[unique++] = packets[i];
+	}
+	printf("%d packets (%d duplicates), %"SCNi64" lost\n", unique, count-unique,
+		packets[unique-1].seq - packets[0].seq + 1 - unique);
+	count = unique;
+	/* Mux */
+	FILE *file = fopen(destination, "wb");
+	if(file == NULL) {
+		fprintf(stderr, "Couldn't open %s: %d (%s)\n", destination, errno, strerror(errno));
+		return 1;
+	}
+	int res = webm ?
+		janus_pp_webm(packets, count, codec, rate, channels, file) :
+		janus_pp_ogg_opus(packets, count, channels, file);
+	fclose(file);
+	free(packets);
+	munmap((void *)data, size);
+	if(res < 0) {
+		unlink(destination);
+		return 1;
+	}
+	printf("Done: %s\n", destination);
+	return 0;
+}
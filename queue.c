@@ -0,0 +1,38 @@
+/*! \file    queue.c
+ * \author   Lorenzo Miniero <lorenzo@meetecho.com>
+ * \copyright GNU Affero General Public License v3
+ * \brief    Bounded queues
+ * \details  Helpers to use a GAsyncQueue as a bounded queue, dropping
+ * the oldest items when the queue is full.
+ *
+ * \ingroup core
+ * \ref core
+ */
+
+#include "queue.h"
+
+
+guint janus_queue_push_bounded(GAsyncQueue *queue, gpointer item, guint max, GDestroyNotify free_item) {
+	if(queue == NULL || item == NULL)
+		return 0;
+	g_async_queue_lock(queue);
+	guint dropped = janus_queue_push_bounded_unlocked(queue, item, max, free_item);
+	g_async_queue_unlock(queue);
+	return dropped;
+}
+
+guint janus_queue_push_bounded_unlocked(GAsyncQueue *queue, gpointer item, guint max, GDestroyNotify free_item) {
+	if(queue == NULL || item == NULL)
+		return 0;
+	guint dropped = 0;
+	while(max > 0 && g_async_queue_length_unlocked(queue) >= (gint)max) {
+		gpointer old = g_async_queue_try_pop_unlocked(queue);
+		if(old == NULL)
+			break;
+		if(free_item != NULL)
+			free_item(old);
+		dropped++;
+	}
+	g_async_queue_push_unlocked(queue, item);
+	return dropped;
+}
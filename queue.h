@@ -0,0 +1,44 @@
+/*! \file    queue.h
+ * \author   Lorenzo Miniero <lorenzo@meetecho.com>
+ * \copyright GNU Affero General Public License v3
+ * \brief    Bounded queues (headers)
+ * \details  Helpers to use a GAsyncQueue as a bounded queue: when a
+ * producer finds the queue full, the oldest items are dropped to make
+ * room for the new one, rather than blocking the producer or letting
+ * the queue grow forever. This is what we want when the consumer may
+ * stall (e.g., a browser that stopped polling for events, or a relay
+ * worker that can't keep up), as the newest items are the most useful.
+ *
+ * \ingroup core
+ * \ref core
+ */
+
+#ifndef _JANUS_QUEUE_H
+#define _JANUS_QUEUE_H
+
+#include <glib.h>
+
+
+/** @name Janus bounded queues
+ */
+///@{
+/*! \brief Method to push an item to a bounded queue, dropping the oldest items if it's full
+ * \note The check and the push are atomic, as they're done with the queue lock held
+ * @param[in] queue The queue to push the item to
+ * @param[in] item The item to push
+ * @param[in] max The maximum number of items in the queue (0 means no limit)
+ * @param[in] free_item The function to free dropped items with, if any
+ * @returns The number of items that were dropped to make room for the new one */
+guint janus_queue_push_bounded(GAsyncQueue *queue, gpointer item, guint max, GDestroyNotify free_item);
+/*! \brief Same as janus_queue_push_bounded, for callers already holding the queue lock
+ * \note Useful when a check must be atomic with the push (e.g., whether the
+ * consumer is still interested in the item), which is done with the lock held too
+ * @param[in] queue The queue to push the item to, locked with g_async_queue_lock
+ * @param[in] item The item to push
+ * @param[in] max The maximum number of items in the queue (0 means no limit)
+ * @param[in] free_item The function to free dropped items with, if any
+ * @returns The number of items that were dropped to make room for the new one */
+guint janus_queue_push_bounded_unlocked(GAsyncQueue *queue, gpointer item, guint max, GDestroyNotify free_item);
+///@}
+
+#endif
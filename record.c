@@ -0,0 +1,173 @@
+/*! \file    record.c
+ * \author   Lorenzo Miniero <lorenzo@meetecho.com>
+ * \copyright GNU Affero General Public License v3
+ * \brief    Raw RTP recorder
+ * \details  Implementation of a simple recorder for the RTP packets
+ * peers send to the gateway. Packets are appended, along with the time
+ * they were received at, to a compact file format with a seekable index
+ * (see record.h for a description of the format), using the asynchronous
+ * writer in writer.h so that recording never blocks the media path.
+ *
+ * \ingroup core
+ * \ref core
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <errno.h>
+#include <arpa/inet.h>
+
+#include "record.h"
+#include "debug.h"
+
+
+static char *recordings_folder = NULL;
+
+
+/* Helpers to serialize integers in network byte order */
+static void janus_recorder_put16(char *buf, guint16 value) {
+	guint16 net = htons(value);
+	memcpy(buf, &net, sizeof(net));
+}
+
+static void janus_recorder_put32(char *buf, guint32 value) {
+	guint32 net = htonl(value);
+	memcpy(buf, &net, sizeof(net));
+}
+
+static void janus_recorder_put64(char *buf, guint64 value) {
+	janus_recorder_put32(buf, (guint32)(value >> 32));
+	janus_recorder_put32(buf+4, (guint32)(value & 0xFFFFFFFF));
+}
+
+
+gint janus_recorder_init(const char *folder) {
+	if(folder != NULL) {
+		if(g_mkdir_with_parents(folder, 0755) < 0) {
+			JANUS_DEBUG("Couldn't create the recordings folder %s: %d (%s)\n", folder, errno, strerror(errno));
+			return -1;
+		}
+		recordings_folder = g_strdup(folder);
+		if(recordings_folder == NULL) {
+			JANUS_DEBUG("Memory error!\n");
+			return -1;
+		}
+	}
+	JANUS_PRINT("Recordings %s\n", recordings_folder ? "enabled" : "disabled");
+	if(recordings_folder != NULL)
+		JANUS_PRINT("  -- Recordings will be saved in %s\n", recordings_folder);
+	return 0;
+}
+
+void janus_recorder_deinit(void) {
+	/* Make sure whatever is still pending gets written */
+	janus_writer_deinit();
+	g_free(recordings_folder);
+	recordings_folder = NULL;
+}
+
+gboolean janus_recorder_is_enabled(void) {
+	return recordings_folder != NULL;
+}
+
+
+janus_recorder *janus_recorder_create(const char *filename, gboolean video, const char *codecs) {
+	if(recordings_folder == NULL || filename == NULL)
+		return NULL;
+	size_t codecs_len = codecs ? strlen(codecs) : 0;
+	if(codecs_len > 0xFFFF)
+		codecs_len = 0xFFFF;
+	janus_recorder *recorder = calloc(1, sizeof(janus_recorder));
+	if(recorder == NULL) {
+		JANUS_DEBUG("Memory error!\n");
+		return NULL;
+	}
+	recorder->filename = g_strdup_printf("%s/%s", recordings_folder, filename);
+	recorder->video = video;
+	recorder->file = janus_writer_open(recorder->filename, TRUE);
+	if(recorder->file == NULL) {
+		JANUS_DEBUG("Couldn't start the %s recording %s\n", video ? "video" : "audio", recorder->filename);
+		g_free(recorder->filename);
+		free(recorder);
+		return NULL;
+	}
+	recorder->created = g_get_monotonic_time();
+	recorder->packets = 0;
+	recorder->index = g_array_new(FALSE, FALSE, sizeof(janus_recorder_index));
+	janus_mutex_init(&recorder->mutex);
+	/* Write the header */
+	char header[JANUS_RECORDER_HEADER_SIZE];
+	memcpy(header, "JRTP", 4);
+	header[4] = JANUS_RECORDER_VERSION;
+	header[5] = video ? 1 : 0;
+	janus_recorder_put16(header+6, codecs_len);
+	janus_recorder_put64(header+8, g_get_real_time());
+	janus_writer_write(recorder->file, header, sizeof(header));
+	if(codecs_len > 0)
+		janus_writer_write(recorder->file, codecs, codecs_len);
+	recorder->offset = sizeof(header) + codecs_len;
+	JANUS_PRINT("Started %s recording %s (%s)\n", video ? "video" : "audio", recorder->filename, codecs ? codecs : "unknown codecs");
+	return recorder;
+}
+
+gint janus_recorder_save_frame(janus_recorder *recorder, const char *buf, int len) {
+	if(recorder == NULL || buf == NULL || len < 12 || len > 0xFFFF)
+		return -1;
+	guint32 when = (g_get_monotonic_time() - recorder->created)/1000;
+	char header[JANUS_RECORDER_PACKET_SIZE];
+	janus_recorder_put32(header, when);
+	janus_recorder_put16(header+4, len);
+	janus_mutex_lock(&recorder->mutex);
+	if(recorder->file == NULL) {
+		janus_mutex_unlock(&recorder->mutex);
+		return -1;
+	}
+	/* Is it time to add an entry to the index? */
+	if(recorder->index->len == 0 ||
+			when >= g_array_index(recorder->index, janus_recorder_index, recorder->index->len-1).when + JANUS_RECORDER_INDEX_INTERVAL) {
+		janus_recorder_index entry = { .when = when, .offset = recorder->offset };
+		g_array_append_val(recorder->index, entry);
+	}
+	if(janus_writer_write(recorder->file, header, sizeof(header)) < 0 ||
+			janus_writer_write(recorder->file, buf, len) < 0) {
+		janus_mutex_unlock(&recorder->mutex);
+		return -1;
+	}
+	recorder->offset += sizeof(header) + len;
+	recorder->packets++;
+	janus_mutex_unlock(&recorder->mutex);
+	return 0;
+}
+
+void janus_recorder_close(janus_recorder *recorder) {
+	if(recorder == NULL)
+		return;
+	janus_mutex_lock(&recorder->mutex);
+	if(recorder->file != NULL) {
+		/* Append the index and the trailer */
+		guint64 index_offset = recorder->offset;
+		guint i = 0;
+		char entry[JANUS_RECORDER_INDEX_SIZE];
+		for(i=0; i<recorder->index->len; i++) {
+			janus_recorder_index *index = &g_array_index(recorder->index, janus_recorder_index, i);
+			janus_recorder_put32(entry, index->when);
+			janus_recorder_put64(entry+4, index->offset);
+			janus_writer_write(recorder->file, entry, sizeof(entry));
+		}
+		char trailer[JANUS_RECORDER_TRAILER_SIZE];
+		memcpy(trailer, "JIDX", 4);
+		janus_recorder_put32(trailer+4, recorder->index->len);
+		janus_recorder_put64(trailer+8, index_offset);
+		janus_writer_write(recorder->file, trailer, sizeof(trailer));
+		janus_writer_close(recorder->file);
+		recorder->file = NULL;
+		JANUS_PRINT("Closed %s recording %s (%"SCNu64" packets)\n", recorder->video ? "video" : "audio", recorder->filename, recorder->packets);
+	}
+	janus_mutex_unlock(&recorder->mutex);
+	g_array_free(recorder->index, TRUE);
+	g_free(recorder->filename);
+	janus_mutex_destroy(&recorder->mutex);
+	free(recorder);
+}
@@ -0,0 +1,127 @@
+/*! \file    record.h
+ * \author   Lorenzo Miniero <lorenzo@meetecho.com>
+ * \copyright GNU Affero General Public License v3
+ * \brief    Raw RTP recorder (headers)
+ * \details  Implementation of a simple recorder for the RTP packets
+ * peers send to the gateway. Packets are saved as they are (after SRTP
+ * has been removed), no transcoding or depacketization involved, along
+ * with the time they were received at: recording a stream only costs
+ * sequential writes, which are handled by the asynchronous writer in
+ * writer.h, and so never stall the thread handling the media. The
+ * resulting files can then be converted offline to a playable format
+ * (e.g., WebM or Ogg) with the \c janus-pp-rec tool.
+ *
+ * Recordings use a compact, append-only format, where all integers are
+ * in network byte order:
+ *
+ * - a header: \c "JRTP" , the format version (1 byte), the media type
+ * (1 byte, 0 for audio and 1 for video), the length of the codecs
+ * description (2 bytes), the wall clock time the recording started at
+ * (8 bytes, microseconds since the Epoch), and then the codecs
+ * description itself, e.g., \c "111 opus/48000/2" ;
+ * - a sequence of packets, each preceded by the milliseconds since the
+ * start of the recording (4 bytes) and the length of the packet (2 bytes);
+ * - when the recording is closed, an index with an entry (4 bytes for
+ * the time, 8 bytes for the offset of the packet in the file) every
+ * \c JANUS_RECORDER_INDEX_INTERVAL milliseconds, followed by a trailer:
+ * \c "JIDX" , the number of entries in the index (4 bytes) and the offset
+ * of the index in the file (8 bytes).
+ *
+ * A file missing the trailer (e.g., because the gateway crashed) is
+ * still valid: tools just need to scan it packet by packet.
+ *
+ * \ingroup core
+ * \ref core
+ */
+
+#ifndef _JANUS_RECORD_H
+#define _JANUS_RECORD_H
+
+#include <glib.h>
+
+#include "mutex.h"
+#include "writer.h"
+
+
+/*! \brief Version of the recordings format */
+#define JANUS_RECORDER_VERSION			1
+/*! \brief Size of the recordings header (magic, version, media, codecs length, start time) */
+#define JANUS_RECORDER_HEADER_SIZE		16
+/*! \brief Size of the header preceding each packet (time, length) */
+#define JANUS_RECORDER_PACKET_SIZE		6
+/*! \brief Size of an index entry (time, offset) */
+#define JANUS_RECORDER_INDEX_SIZE		12
+/*! \brief Size of the trailer (magic, index entries, index offset) */
+#define JANUS_RECORDER_TRAILER_SIZE		16
+/*! \brief How often (in milliseconds) a packet should be added to the index */
+#define JANUS_RECORDER_INDEX_INTERVAL	1000
+
+/*! \brief Entry of the index of a recording */
+typedef struct janus_recorder_index {
+	/*! \brief Milliseconds since the start of the recording */
+	guint32 when;
+	/*! \brief Offset of the packet in the file */
+	guint64 offset;
+} janus_recorder_index;
+
+/*! \brief Recording of a stream */
+typedef struct janus_recorder {
+	/*! \brief Path of the recording */
+	char *filename;
+	/*! \brief Whether this is a video (TRUE) or audio (FALSE) recording */
+	gboolean video;
+	/*! \brief File the packets are written to */
+	janus_writer *file;
+	/*! \brief Monotonic time the recording was started at */
+	gint64 created;
+	/*! \brief Bytes written so far (i.e., offset of the next packet) */
+	guint64 offset;
+	/*! \brief Number of packets written so far */
+	guint64 packets;
+	/*! \brief Index of the recording (array of janus_recorder_index) */
+	GArray *index;
+	/*! \brief Mutex to lock/unlock the recording */
+	janus_mutex mutex;
+} janus_recorder;
+
+
+/** @name Janus recorder setup
+ */
+///@{
+/*! \brief Recorder initialization
+ * @param[in] folder Folder to save recordings to, or NULL to disable recordings
+ * @returns 0 in case of success, a negative integer on errors */
+gint janus_recorder_init(const char *folder);
+/*! \brief Recorder deinitialization (pending recordings are written out) */
+void janus_recorder_deinit(void);
+/*! \brief Method to check whether recordings are enabled
+ * @returns TRUE if a recordings folder was configured, FALSE otherwise */
+gboolean janus_recorder_is_enabled(void);
+///@}
+
+
+/** @name Janus recorder methods
+ */
+///@{
+/*! \brief Method to start a new recording
+ * \note This is the only call that accesses the disk, and so it should
+ * not be invoked by threads handling media
+ * @param[in] filename Name of the file, relative to the recordings folder
+ * @param[in] video Whether this is a video (TRUE) or audio (FALSE) recording
+ * @param[in] codecs Description of the codecs in the stream (e.g., "100 VP8/90000"), if known
+ * @returns A new janus_recorder instance in case of success, NULL otherwise (or if recordings are disabled) */
+janus_recorder *janus_recorder_create(const char *filename, gboolean video, const char *codecs);
+/*! \brief Method to save an RTP packet to a recording (never blocks on disk I/O)
+ * @param[in] recorder The recording to update
+ * @param[in] buf The RTP packet (unencrypted)
+ * @param[in] len The length of the packet
+ * @returns 0 in case of success, a negative integer otherwise */
+gint janus_recorder_save_frame(janus_recorder *recorder, const char *buf, int len);
+/*! \brief Method to close a recording: the index and the trailer are
+ * appended, and the recording is freed
+ * @param[in] recorder The recording to close */
+void janus_recorder_close(janus_recorder *recorder);
+///@}
+
+
+#endif
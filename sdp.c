@@ -8,7 +8,9 @@
  * DTLS/ICE/transport related information is removed, only leaving the
  * relevant information in place. SDP coming from plugins is stripped/anonymized
  * as well, and merged with the proper DTLS/ICE/transport information before
- * it is sent to the peers.
+ * it is sent to the peers. While parsing is done by Sofia-SDP, both the
+ * stripped and the merged SDPs are written directly in a single pass in
+ * dynamically growing buffers, so there's no limit on their size.
  * 
  * \ingroup protocols
  * \ref protocols
@@ -81,6 +83,48 @@ janus_sdp *janus_sdp_preparse(const char *jsep_sdp, int *audio, int *video) {
 	return sdp;
 }
 
+/* Helper to fill the codec table of a stream out of a parsed m-line */
+static GList *janus_sdp_parse_codecs(janus_ice_handle *handle, sdp_media_t *m) {
+	GList *codecs = NULL;
+	sdp_rtpmap_t *rm = NULL;
+	for(rm = m->m_rtpmaps; rm; rm = rm->rm_next) {
+		janus_codec *codec = janus_codec_new(rm->rm_pt, rm->rm_encoding, rm->rm_rate, rm->rm_params ? atoi(rm->rm_params) : 0);
+		if(codec == NULL)
+			continue;
+		janus_codec_set_fmtp(codec, rm->rm_fmtp);
+		codecs = g_list_append(codecs, codec);
+	}
+	sdp_attribute_t *a = m->m_attributes;
+	while(a) {
+		if(a->a_name && a->a_value && !strcasecmp(a->a_name, "rtcp-fb")) {
+			/* <payload type>|* <feedback> */
+			const char *fb = strchr(a->a_value, ' ');
+			if(fb != NULL) {
+				while(*fb == ' ')
+					fb++;
+				int pt = (*a->a_value == '*') ? -1 : atoi(a->a_value);
+				GList *c = codecs;
+				while(c) {
+					janus_codec *codec = (janus_codec *)c->data;
+					if(pt < 0 || codec->pt == pt)
+						janus_codec_add_feedback(codec, fb);
+					c = c->next;
+				}
+			}
+		}
+		a = a->a_next;
+	}
+	GList *c = codecs;
+	while(c) {
+		janus_codec *codec = (janus_codec *)c->data;
+		JANUS_LOG(LOG_VERB, "[%"SCNu64"]   -- %d: %s/%d%s%s (%d RTCP feedback)\n", handle->handle_id,
+			codec->pt, codec->name, codec->rate, codec->fmtp ? ", " : "", codec->fmtp ? codec->fmtp : "",
+			g_list_length(codec->rtcp_fb));
+		c = c->next;
+	}
+	return codecs;
+}
+
 /* Parse SDP */
 int janus_sdp_parse(janus_ice_handle *handle, janus_sdp *sdp) {
 	if(!handle || !sdp)
@@ -211,6 +255,14 @@ int janus_sdp_parse(janus_ice_handle *handle, janus_sdp *sdp) {
 			rfingerprint = NULL;
 			return -2;
 		}
+		/* Keep track of the codecs the peer negotiated */
+		if(stream != NULL) {
+			GList *codecs = janus_sdp_parse_codecs(handle, m);
+			janus_mutex_lock(&handle->mutex);
+			janus_codecs_free(stream->codecs);
+			stream->codecs = codecs;
+			janus_mutex_unlock(&handle->mutex);
+		}
 		handle->remote_hashing = g_strdup(rhashing);
 		handle->remote_fingerprint = g_strdup(rfingerprint);
 		/* Now look for candidates and codec info */
@@ -316,403 +368,412 @@ int janus_sdp_parse(janus_ice_handle *handle, janus_sdp *sdp) {
 	return 0;	/* FIXME Handle errors better */
 }
 
+/* Attributes we handle ourselves: the plugins don't need them */
+static const char *janus_sdp_stripped_attributes[] = {
+	"ice-ufrag", "ice-pwd", "ice-options", "crypto", "fingerprint", "setup",
+	"connection", "group", "msid-semantic", "rtcp", "rtcp-mux", "candidate",
+	"ssrc", "extmap",	/* TODO Actually implement RTP extensions */
+	NULL
+};
+
+static gboolean janus_sdp_is_stripped(const char *name) {
+	if(name == NULL)
+		return TRUE;
+	const char **s = NULL;
+	for(s = janus_sdp_stripped_attributes; *s; s++) {
+		if(!strcasecmp(name, *s))
+			return TRUE;
+	}
+	return FALSE;
+}
+
+/* Helpers to write the pieces of an SDP: buffers grow as needed, so there's no size limit */
+static void janus_sdp_write_attributes(GString *sdp, sdp_attribute_t *a, gboolean strip) {
+	for(; a; a = a->a_next) {
+		if(strip && janus_sdp_is_stripped(a->a_name))
+			continue;
+		if(a->a_value == NULL)
+			g_string_append_printf(sdp, "a=%s\r\n", a->a_name);
+		else
+			g_string_append_printf(sdp, "a=%s:%s\r\n", a->a_name, a->a_value);
+	}
+}
+
+static void janus_sdp_write_bandwidth(GString *sdp, sdp_bandwidth_t *b) {
+	if(b == NULL)
+		return;
+	g_string_append_printf(sdp, "b=%s:%lu\r\n",	/* FIXME Are we doing this correctly? */
+		b->b_modifier_name ? b->b_modifier_name : "AS", b->b_value);
+}
+
+static void janus_sdp_write_direction(GString *sdp, sdp_mode_t mode) {
+	switch(mode) {
+		case sdp_inactive:
+			g_string_append(sdp, "a=inactive\r\n");
+			break;
+		case sdp_sendonly:
+			g_string_append(sdp, "a=sendonly\r\n");
+			break;
+		case sdp_recvonly:
+			g_string_append(sdp, "a=recvonly\r\n");
+			break;
+		case sdp_sendrecv:
+		default:
+			g_string_append(sdp, "a=sendrecv\r\n");
+			break;
+	}
+}
+
+static void janus_sdp_write_formats(GString *sdp, sdp_media_t *m) {
+	if(m->m_rtpmaps) {
+		sdp_rtpmap_t *r = NULL;
+		for(r = m->m_rtpmaps; r; r = r->rm_next)
+			g_string_append_printf(sdp, " %u", r->rm_pt);
+	} else if(m->m_format) {
+		sdp_list_t *fmt = NULL;
+		for(fmt = m->m_format; fmt; fmt = fmt->l_next)
+			g_string_append_printf(sdp, " %s", fmt->l_text);
+	} else {
+		g_string_append(sdp, " 0");	/* FIXME Won't work apparently */
+	}
+	g_string_append(sdp, "\r\n");
+}
+
+static void janus_sdp_write_rtpmaps(GString *sdp, sdp_media_t *m) {
+	sdp_rtpmap_t *rm = NULL;
+	for(rm = m->m_rtpmaps; rm; rm = rm->rm_next) {
+		g_string_append_printf(sdp, "a=rtpmap:%u %s/%lu%s%s\r\n",
+			rm->rm_pt, rm->rm_encoding, rm->rm_rate,
+			rm->rm_params ? "/" : "",
+			rm->rm_params ? rm->rm_params : "");
+	}
+	for(rm = m->m_rtpmaps; rm; rm = rm->rm_next) {
+		if(rm->rm_fmtp)
+			g_string_append_printf(sdp, "a=fmtp:%u %s\r\n", rm->rm_pt, rm->rm_fmtp);
+	}
+}
+
 char *janus_sdp_anonymize(const char *sdp) {
 	if(sdp == NULL)
 		return NULL;
-	//~ su_home_t home[1] = { SU_HOME_INIT(home) };
 	sdp_session_t *anon = NULL;
 	sdp_parser_t *parser = sdp_parse(home, sdp, strlen(sdp), 0);
 	if(!(anon = sdp_session(parser))) {
 		JANUS_DEBUG("Error parsing/merging SDP: %s\n", sdp_parsing_error(parser));
+		sdp_parser_free(parser);
 		return NULL;
 	}
-		//~ /* o= */
-	//~ if(anon->sdp_origin && anon->sdp_origin->o_username) {
-		//~ free(anon->sdp_origin->o_username);
-		//~ anon->sdp_origin->o_username = strdup("JANUS");
-	//~ }
-		/* c= */
-	if(anon->sdp_connection && anon->sdp_connection->c_address) {
-		//~ free(anon->sdp_connection->c_address);
-		anon->sdp_connection->c_address = strdup("1.1.1.1");
+	/* We write the stripped SDP ourselves in a single pass, rather than
+	 * modifying the parsed session and printing it with Sofia-SDP */
+	GString *stripped = g_string_sized_new(strlen(sdp));
+	g_string_append(stripped, "v=0\r\n");
+		/* o= (the address of the peer is scrubbed, as in c= lines) */
+	if(anon->sdp_origin) {
+		g_string_append_printf(stripped, "o=%s %"SCNu64" %"SCNu64" IN IP4 127.0.0.1\r\n",
+			anon->sdp_origin->o_username ? anon->sdp_origin->o_username : "-",
+			(guint64)anon->sdp_origin->o_id, (guint64)anon->sdp_origin->o_version);
 	}
+		/* s= */
+	g_string_append_printf(stripped, "s=%s\r\n", anon->sdp_subject ? anon->sdp_subject : "-");
+		/* c= */
+	if(anon->sdp_connection)
+		g_string_append(stripped, "c=IN IP4 1.1.1.1\r\n");
+		/* b= */
+	janus_sdp_write_bandwidth(stripped, anon->sdp_bandwidths);
+		/* t= */
+	g_string_append_printf(stripped, "t=%lu %lu\r\n",
+		anon->sdp_time ? anon->sdp_time->t_start : 0, anon->sdp_time ? anon->sdp_time->t_stop : 0);
 		/* a= */
-	if(anon->sdp_attributes) {
-		/* FIXME These are attributes we handle ourselves, the plugins don't need them */
-		while(sdp_attribute_find(anon->sdp_attributes, "ice-ufrag"))
-			sdp_attribute_remove(&anon->sdp_attributes, "ice-ufrag");
-		while(sdp_attribute_find(anon->sdp_attributes, "ice-pwd"))
-			sdp_attribute_remove(&anon->sdp_attributes, "ice-pwd");
-		while(sdp_attribute_find(anon->sdp_attributes, "ice-options"))
-			sdp_attribute_remove(&anon->sdp_attributes, "ice-options");
-		while(sdp_attribute_find(anon->sdp_attributes, "fingerprint"))
-			sdp_attribute_remove(&anon->sdp_attributes, "fingerprint");
-		while(sdp_attribute_find(anon->sdp_attributes, "group"))
-			sdp_attribute_remove(&anon->sdp_attributes, "group");
-		while(sdp_attribute_find(anon->sdp_attributes, "msid-semantic"))
-			sdp_attribute_remove(&anon->sdp_attributes, "msid-semantic");
-	}
+	janus_sdp_write_attributes(stripped, anon->sdp_attributes, TRUE);
 		/* m= */
-	int a_sendrecv = 0, v_sendrecv = 0;
-	if(anon->sdp_media) {
-		int audio = 0, video = 0;
-		sdp_media_t *m = anon->sdp_media;
-		while(m) {
-			if(m->m_type == sdp_media_audio) {
-				audio++;
-				m->m_port = audio == 1 ? 1 : 0;
-			} else if(m->m_type == sdp_media_video) {
-				video++;
-				m->m_port = audio == 1 ? 1 : 0;
-			} else {
-				m->m_port = 0;
-			}
-				/* c= */
-			if(m->m_connections) {
-				sdp_connection_t *c = m->m_connections;
-				while(c) {
-					if(c->c_address) {
-						//~ free(c->c_address);
-						c->c_address = strdup("1.1.1.1");
-					}
-					c = c->c_next;
-				}
-			}
-				/* a= */
-			if(m->m_attributes) {
-				/* FIXME These are attributes we handle ourselves, the plugins don't need them */
-				while(sdp_attribute_find(m->m_attributes, "ice-ufrag"))
-					sdp_attribute_remove(&m->m_attributes, "ice-ufrag");
-				while(sdp_attribute_find(m->m_attributes, "ice-pwd"))
-					sdp_attribute_remove(&m->m_attributes, "ice-pwd");
-				while(sdp_attribute_find(m->m_attributes, "ice-options"))
-					sdp_attribute_remove(&m->m_attributes, "ice-options");
-				while(sdp_attribute_find(m->m_attributes, "crypto"))
-					sdp_attribute_remove(&m->m_attributes, "crypto");
-				while(sdp_attribute_find(m->m_attributes, "fingerprint"))
-					sdp_attribute_remove(&m->m_attributes, "fingerprint");
-				while(sdp_attribute_find(m->m_attributes, "setup"))
-					sdp_attribute_remove(&m->m_attributes, "setup");
-				while(sdp_attribute_find(m->m_attributes, "connection"))
-					sdp_attribute_remove(&m->m_attributes, "connection");
-				while(sdp_attribute_find(m->m_attributes, "group"))
-					sdp_attribute_remove(&m->m_attributes, "group");
-				while(sdp_attribute_find(m->m_attributes, "msid-semantic"))
-					sdp_attribute_remove(&m->m_attributes, "msid-semantic");
-				while(sdp_attribute_find(m->m_attributes, "rtcp"))
-					sdp_attribute_remove(&m->m_attributes, "rtcp");
-				while(sdp_attribute_find(m->m_attributes, "rtcp-mux"))
-					sdp_attribute_remove(&m->m_attributes, "rtcp-mux");
-				while(sdp_attribute_find(m->m_attributes, "candidate"))
-					sdp_attribute_remove(&m->m_attributes, "candidate");
-				while(sdp_attribute_find(m->m_attributes, "ssrc"))
-					sdp_attribute_remove(&m->m_attributes, "ssrc");
-				while(sdp_attribute_find(m->m_attributes, "extmap"))	/* TODO Actually implement RTP extensions */
-					sdp_attribute_remove(&m->m_attributes, "extmap");
-			}
-			/* FIXME sendrecv hack: sofia-sdp doesn't print sendrecv, but we want it to */
-			if(m->m_mode == sdp_sendrecv) {
-				m->m_mode = sdp_inactive;
-				if(m->m_type == sdp_media_audio)
-					a_sendrecv = 1;
-				else if(m->m_type == sdp_media_video)
-					v_sendrecv = 1;
-			}
-			m = m->m_next;
-		}
-	}
-	char buf[BUFSIZE];
-	sdp_printer_t *printer = sdp_print(home, anon, buf, BUFSIZE, 0);
-	if(sdp_message(printer)) {
-		int retval = sdp_message_size(printer);
-		sdp_printer_free(printer);
-		/* FIXME Take care of the sendrecv hack */
-		if(a_sendrecv || v_sendrecv) {
-			char *replace = strstr(buf, "a=inactive");
-			while(replace != NULL) {
-				memcpy(replace, "a=sendrecv", strlen("a=sendrecv"));
-				replace++;
-				replace = strstr(replace, "a=inactive");
-			}
+	int audio = 0, video = 0;
+	sdp_media_t *m = NULL;
+	for(m = anon->sdp_media; m; m = m->m_next) {
+		int port = 0;
+		if(m->m_type == sdp_media_audio) {
+			audio++;
+			port = audio == 1 ? 1 : 0;
+		} else if(m->m_type == sdp_media_video) {
+			video++;
+			port = video == 1 ? 1 : 0;
 		}
-		JANUS_PRINT(" -------------------------------------------\n");
-		JANUS_PRINT("  >> Anonymized (%zu --> %d bytes)\n", strlen(sdp), retval);
-		JANUS_PRINT(" -------------------------------------------\n");
-		JANUS_PRINT("%s\n", buf);
-		return g_strdup(buf);
-	} else {
-		JANUS_DEBUG("Error anonymizing SDP: %s\n", sdp_printing_error(printer));
-		return NULL;
+		g_string_append_printf(stripped, "m=%s %d %s", m->m_type_name, port, m->m_proto_name);
+		janus_sdp_write_formats(stripped, m);
+			/* c= */
+		if(m->m_connections)
+			g_string_append(stripped, "c=IN IP4 1.1.1.1\r\n");
+			/* b= */
+		janus_sdp_write_bandwidth(stripped, m->m_bandwidths);
+			/* a= */
+		janus_sdp_write_rtpmaps(stripped, m);
+		janus_sdp_write_direction(stripped, m->m_mode);
+		janus_sdp_write_attributes(stripped, m->m_attributes, TRUE);
 	}
+	sdp_parser_free(parser);
+	JANUS_PRINT(" -------------------------------------------\n");
+	JANUS_PRINT("  >> Anonymized (%zu --> %zu bytes)\n", strlen(sdp), stripped->len);
+	JANUS_PRINT(" -------------------------------------------\n");
+	JANUS_LOG(LOG_VERB, "%s\n", stripped->str);
+	return g_string_free(stripped, FALSE);
 }
 
-char *janus_sdp_merge(janus_ice_handle *handle, const char *origsdp) {
-	if(handle == NULL || origsdp == NULL)
-		return NULL;
-	//~ su_home_t home[1] = { SU_HOME_INIT(home) };
+/* SDP templates: everything that doesn't depend on the handle is rendered only once */
+typedef struct janus_sdp_template_mline {
+	/* Media type */
+	sdp_media_e type;
+	/* Whole m-line, if it's one we don't support (rejected no matter what) */
+	char *rejected;
+	/* Formats (ending the m-line), bandwidth, connection and direction */
+	char *formats;
+	/* rtpmap and fmtp attributes */
+	char *rtpmaps;
+	/* Any other media attribute */
+	char *attributes;
+} janus_sdp_template_mline;
+
+static void janus_sdp_template_mline_free(gpointer data) {
+	janus_sdp_template_mline *mline = (janus_sdp_template_mline *)data;
+	if(mline == NULL)
+		return;
+	g_free(mline->rejected);
+	g_free(mline->formats);
+	g_free(mline->rtpmaps);
+	g_free(mline->attributes);
+	g_free(mline);
+}
+
+/* Create a template out of an already stripped SDP */
+static janus_sdp_template *janus_sdp_template_create_stripped(const char *stripped) {
 	sdp_session_t *anon = NULL;
-	sdp_parser_t *parser = sdp_parse(home, origsdp, strlen(origsdp), 0);
+	sdp_parser_t *parser = sdp_parse(home, stripped, strlen(stripped), 0);
 	if(!(anon = sdp_session(parser))) {
-		JANUS_DEBUG("[%"SCNu64"] Error parsing/merging SDP: %s\n", handle->handle_id, sdp_parsing_error(parser));
+		JANUS_DEBUG("Error parsing/merging SDP: %s\n", sdp_parsing_error(parser));
+		sdp_parser_free(parser);
 		return NULL;
 	}
-	/* Prepare SDP to merge */
-	gchar buffer[200];
-	memset(buffer, 0, 200);
-	char *sdp = (char*)calloc(BUFSIZE, sizeof(char));
-	if(sdp == NULL) {
+	janus_sdp_template *sdp_template = calloc(1, sizeof(janus_sdp_template));
+	if(sdp_template == NULL) {
 		JANUS_DEBUG("Memory error!\n");
+		sdp_parser_free(parser);
 		return NULL;
 	}
-	sdp[0] = '\0';
-	/* Version v= */
-	g_strlcat(sdp,
-		"v=0\r\n", BUFSIZE);
-	/* Origin o= */
+	/* Origin o=: written when rendering, as the version changes every time */
 	if(anon->sdp_origin) {
-		g_sprintf(buffer,
-			"o=%s %"SCNu64" %"SCNu64" IN IP4 127.0.0.1\r\n",	/* FIXME Should we fix the address? */
-				anon->sdp_origin->o_username ? anon->sdp_origin->o_username : "-",
-				anon->sdp_origin->o_id, anon->sdp_origin->o_version);
-		g_strlcat(sdp, buffer, BUFSIZE);
+		sdp_template->username = g_strdup(anon->sdp_origin->o_username ? anon->sdp_origin->o_username : "-");
+		sdp_template->sessid = anon->sdp_origin->o_id;
+		sdp_template->version = anon->sdp_origin->o_version;
 	} else {
-		gint64 sessid = g_get_monotonic_time();
-		gint64 version = sessid;	/* FIXME This needs to be increased when it changes, so time should be ok */
-		g_sprintf(buffer,
-			"o=%s %"SCNi64" %"SCNi64" IN IP4 127.0.0.1\r\n",	/* FIXME Should we fix the address? */
-				"-", sessid, version);
-		g_strlcat(sdp, buffer, BUFSIZE);
+		sdp_template->username = g_strdup("-");
+		sdp_template->sessid = g_get_monotonic_time();
+		sdp_template->version = sdp_template->sessid;
 	}
+	/* Session level */
+	GString *sdp = g_string_sized_new(512);
 	/* Session name s= */
-	g_sprintf(buffer,
+	g_string_append_printf(sdp,
 		"s=%s\r\n", anon->sdp_subject ? anon->sdp_subject : "Meetecho Janus");
-	g_strlcat(sdp, buffer, BUFSIZE);
 	/* Timing t= */
-	g_sprintf(buffer,
+	g_string_append_printf(sdp,
 		"t=%lu %lu\r\n", anon->sdp_time ? anon->sdp_time->t_start : 0, anon->sdp_time ? anon->sdp_time->t_stop : 0);
-	g_strlcat(sdp, buffer, BUFSIZE);
-	/* Any global bandwidth? */
-	//~ if(anon->sdp_bandwidths) {
-		//~ g_sprintf(buffer,
-			//~ "b=%s:%"SCNu64"\r\n",
-				//~ anon->sdp_bandwidths->b_modifier_name ? anon->sdp_bandwidths->b_modifier_name : "AS",
-				//~ anon->sdp_bandwidths->b_value);
-		//~ g_strlcat(sdp, buffer, BUFSIZE);
-	//~ }
 	/* msid-semantic: add new global attribute */
-	g_strlcat(sdp,
-		"a=msid-semantic: WMS janus\r\n",
-		BUFSIZE);
-	//~ /* Connection c= (global) */
-	//~ if(anon->sdp_connection) {
-		//~ g_sprintf(buffer,
-			//~ "c=IN IP4 %s\r\n", janus_get_local_ip());
-		//~ g_strlcat(sdp, buffer, BUFSIZE);
-	//~ }
+	g_string_append(sdp,
+		"a=msid-semantic: WMS janus\r\n");
 	/* DTLS fingerprint a= (global) */
-	g_sprintf(buffer,
+	g_string_append_printf(sdp,
 		"a=fingerprint:sha-256 %s\r\n", janus_dtls_get_local_fingerprint());
-	g_strlcat(sdp, buffer, BUFSIZE);
 	/* Copy other global attributes, if any */
-	if(anon->sdp_attributes) {
-		sdp_attribute_t *a = anon->sdp_attributes;
-		while(a) {
-			if(a->a_value == NULL) {
-				g_sprintf(buffer,
-					"a=%s\r\n", a->a_name);
-				g_strlcat(sdp, buffer, BUFSIZE);
-			} else {
-				g_sprintf(buffer,
-					"a=%s:%s\r\n", a->a_name, a->a_value);
-				g_strlcat(sdp, buffer, BUFSIZE);
-			}
-			a = a->a_next;
+	janus_sdp_write_attributes(sdp, anon->sdp_attributes, FALSE);
+	sdp_template->header = g_string_free(sdp, FALSE);
+	/* Media lines now */
+	sdp_media_t *m = NULL;
+	for(m = anon->sdp_media; m; m = m->m_next) {
+		janus_sdp_template_mline *mline = calloc(1, sizeof(janus_sdp_template_mline));
+		if(mline == NULL) {
+			JANUS_DEBUG("Memory error!\n");
+			sdp_parser_free(parser);
+			janus_sdp_template_free(sdp_template);
+			return NULL;
 		}
+		mline->type = m->m_type;
+		sdp_template->mlines = g_list_append(sdp_template->mlines, mline);
+		if(m->m_type == sdp_media_audio) {
+			sdp_template->audio++;
+		} else if(m->m_type == sdp_media_video) {
+			sdp_template->video++;
+		} else {
+			mline->rejected = g_strdup_printf("m=%s 0 %s 0\r\n", m->m_type_name, m->m_proto_name);
+			continue;
+		}
+		/* Formats, bandwidth, connection and direction */
+		if(!m->m_rtpmaps) {
+			JANUS_PRINT("No RTP maps?? trying formats...\n");
+			if(!m->m_format)
+				JANUS_DEBUG("No formats either?? this sucks!\n");
+		}
+		sdp = g_string_new(NULL);
+		janus_sdp_write_formats(sdp, m);
+		janus_sdp_write_bandwidth(sdp, m->m_bandwidths);
+		g_string_append_printf(sdp,
+			"c=IN IP4 %s\r\n", janus_get_local_ip());
+		janus_sdp_write_direction(sdp, m->m_mode);
+		mline->formats = g_string_free(sdp, FALSE);
+		/* RTP maps */
+		sdp = g_string_new(NULL);
+		janus_sdp_write_rtpmaps(sdp, m);
+		mline->rtpmaps = g_string_free(sdp, FALSE);
+		/* Other media attributes, if any */
+		sdp = g_string_new(NULL);
+		janus_sdp_write_attributes(sdp, m->m_attributes, FALSE);
+		mline->attributes = g_string_free(sdp, FALSE);
 	}
+	sdp_parser_free(parser);
+	return sdp_template;
+}
+
+janus_sdp_template *janus_sdp_template_create(const char *sdp) {
+	if(sdp == NULL)
+		return NULL;
+	char *stripped = janus_sdp_anonymize(sdp);
+	if(stripped == NULL)
+		return NULL;
+	janus_sdp_template *sdp_template = janus_sdp_template_create_stripped(stripped);
+	g_free(stripped);
+	return sdp_template;
+}
+
+void janus_sdp_template_free(janus_sdp_template *sdp_template) {
+	if(sdp_template == NULL)
+		return;
+	g_free(sdp_template->username);
+	g_free(sdp_template->header);
+	g_list_free_full(sdp_template->mlines, janus_sdp_template_mline_free);
+	free(sdp_template);
+}
+
+char *janus_sdp_template_render(janus_ice_handle *handle, janus_sdp_template *sdp_template) {
+	if(handle == NULL || sdp_template == NULL)
+		return NULL;
+	/* Candidates alone can take quite some room */
+	GString *sdp = g_string_sized_new(strlen(sdp_template->header) + 2048);
+	g_string_append(sdp, sdp_template->header);
+	/* Streams, agent and candidates may be replaced by a renegotiation in the meanwhile */
+	janus_mutex_lock(&handle->mutex);
 	/* Media lines now */
-	if(anon->sdp_media) {
-		int audio = 0, video = 0;
-		sdp_media_t *m = anon->sdp_media;
-		janus_ice_stream *stream = NULL;
-		while(m) {
-			if(m->m_type == sdp_media_audio) {
-				audio++;
-				if(audio > 1 || !handle->audio_id) {
-					JANUS_DEBUG("[%"SCNu64"] Skipping audio line (we have %d audio lines, and the id is %d)\n", handle->handle_id, audio, handle->audio_id);
-					g_strlcat(sdp, "m=audio 0 RTP/SAVPF 0\r\n", BUFSIZE);
-					m = m->m_next;
-					continue;
-				}
-				/* Audio */
-				stream = g_hash_table_lookup(handle->streams, GUINT_TO_POINTER(handle->audio_id));
-				if(stream == NULL) {
-					JANUS_DEBUG("[%"SCNu64"] Skipping audio line (invalid stream %d)\n", handle->handle_id, handle->audio_id);
-					g_strlcat(sdp, "m=audio 0 RTP/SAVPF 0\r\n", BUFSIZE);
-					m = m->m_next;
-					continue;
-				}
-				g_strlcat(sdp, "m=audio ARTPP RTP/SAVPF", BUFSIZE);
-			} else if(m->m_type == sdp_media_video) {
-				video++;
-				if(video > 1 || !handle->video_id) {
-					JANUS_DEBUG("[%"SCNu64"] Skipping video line (we have %d video lines, and the id is %d)\n", handle->handle_id, video, handle->video_id);
-					g_strlcat(sdp, "m=video 0 RTP/SAVPF 0\r\n", BUFSIZE);
-					m = m->m_next;
-					continue;
-				}
-				/* Video */
-				stream = g_hash_table_lookup(handle->streams, GUINT_TO_POINTER(handle->video_id));
-				if(stream == NULL) {
-					JANUS_DEBUG("[%"SCNu64"] Skipping video line (invalid stream %d)\n", handle->handle_id, handle->audio_id);
-					g_strlcat(sdp, "m=video 0 RTP/SAVPF 0\r\n", BUFSIZE);
-					m = m->m_next;
-					continue;
-				}
-				g_strlcat(sdp, "m=video VRTPP RTP/SAVPF", BUFSIZE);
-			} else {
-				JANUS_DEBUG("[%"SCNu64"] Skipping unsupported media line...\n", handle->handle_id);
-				g_sprintf(buffer,
-					"m=%s 0 %s 0\r\n",
-					m->m_type_name, m->m_proto_name);
-				g_strlcat(sdp, buffer, BUFSIZE);
-				m = m->m_next;
+	int audio = 0, video = 0;
+	janus_ice_stream *stream = NULL;
+	GList *l = NULL;
+	for(l = sdp_template->mlines; l; l = l->next) {
+		janus_sdp_template_mline *m = (janus_sdp_template_mline *)l->data;
+		if(m->type == sdp_media_audio) {
+			audio++;
+			if(audio > 1 || !handle->audio_id) {
+				JANUS_DEBUG("[%"SCNu64"] Skipping audio line (we have %d audio lines, and the id is %d)\n", handle->handle_id, audio, handle->audio_id);
+				g_string_append(sdp, "m=audio 0 RTP/SAVPF 0\r\n");
 				continue;
 			}
-			/* Add formats now */
-			if(!m->m_rtpmaps) {
-				JANUS_PRINT("[%"SCNu64"] No RTP maps?? trying formats...\n", handle->handle_id);
-				if(!m->m_format) {
-					JANUS_DEBUG("[%"SCNu64"] No formats either?? this sucks!\n", handle->handle_id);
-					g_strlcat(sdp, " 0", BUFSIZE);	/* FIXME Won't work apparently */
-				} else {
-					sdp_list_t *fmt = m->m_format;
-					while(fmt) {
-						g_sprintf(buffer, " %s", fmt->l_text);
-						g_strlcat(sdp, buffer, BUFSIZE);
-						fmt = fmt->l_next;
-					}
-				}
-			} else {
-				sdp_rtpmap_t *r = m->m_rtpmaps;
-				while(r) {
-					g_sprintf(buffer, " %d", r->rm_pt);
-					g_strlcat(sdp, buffer, BUFSIZE);
-					r = r->rm_next;
-				}
-			}
-			g_strlcat(sdp, "\r\n", BUFSIZE);
-			/* Any bandwidth? */
-			if(m->m_bandwidths) {
-				g_sprintf(buffer,
-					"b=%s:%lu\r\n",	/* FIXME Are we doing this correctly? */
-						m->m_bandwidths->b_modifier_name ? m->m_bandwidths->b_modifier_name : "AS",
-						m->m_bandwidths->b_value);
-				g_strlcat(sdp, buffer, BUFSIZE);
-			}
-			/* Media connection c= */
-			//~ if(m->m_connections) {
-				g_sprintf(buffer,
-					"c=IN IP4 %s\r\n", janus_get_local_ip());
-				g_strlcat(sdp, buffer, BUFSIZE);
-			//~ }
-			/* What is the direction? */
-			switch(m->m_mode) {
-				case sdp_inactive:
-					g_strlcat(sdp, "a=inactive\r\n", BUFSIZE);
-					break;
-				case sdp_sendonly:
-					g_strlcat(sdp, "a=sendonly\r\n", BUFSIZE);
-					break;
-				case sdp_recvonly:
-					g_strlcat(sdp, "a=recvonly\r\n", BUFSIZE);
-					break;
-				case sdp_sendrecv:
-				default:
-					g_strlcat(sdp, "a=sendrecv\r\n", BUFSIZE);
-					break;
-			}
-			/* RTCP */
-			g_sprintf(buffer, "a=rtcp:%s IN IP4 %s\r\n",
-				m->m_type == sdp_media_audio ? "ARTCP" : "VRTCP", janus_get_local_ip());
-			g_strlcat(sdp, buffer, BUFSIZE);
-			/* RTP maps */
-			if(m->m_rtpmaps) {
-				sdp_rtpmap_t *rm = NULL;
-				for(rm = m->m_rtpmaps; rm; rm = rm->rm_next) {
-					g_sprintf(buffer, "a=rtpmap:%u %s/%lu%s%s\r\n",
-						rm->rm_pt, rm->rm_encoding, rm->rm_rate,
-						rm->rm_params ? "/" : "", 
-						rm->rm_params ? rm->rm_params : "");
-					g_strlcat(sdp, buffer, BUFSIZE);
-				}
-				for(rm = m->m_rtpmaps; rm; rm = rm->rm_next) {
-					if(rm->rm_fmtp) {
-						g_sprintf(buffer, "a=fmtp:%u %s\r\n", rm->rm_pt, rm->rm_fmtp);
-						g_strlcat(sdp, buffer, BUFSIZE);
-					}
-				}
+			/* Audio */
+			stream = g_hash_table_lookup(handle->streams, GUINT_TO_POINTER(handle->audio_id));
+			if(stream == NULL) {
+				JANUS_DEBUG("[%"SCNu64"] Skipping audio line (invalid stream %d)\n", handle->handle_id, handle->audio_id);
+				g_string_append(sdp, "m=audio 0 RTP/SAVPF 0\r\n");
+				continue;
 			}
-			/* ICE ufrag and pwd, DTLS setup and connection a= */
-			gchar *ufrag = NULL;
-			gchar *password = NULL;
-			nice_agent_get_local_credentials(handle->agent, stream->stream_id, &ufrag, &password);
-			memset(buffer, 0, 100);
-			g_sprintf(buffer,
-				"a=ice-ufrag:%s\r\n"
-				"a=ice-pwd:%s\r\n"
-				"a=setup:%s\r\n"
-				"a=connection:new\r\n",
-					ufrag, password,
-					janus_get_dtls_srtp_role(stream->dtls_role));
-			g_strlcat(sdp, buffer, BUFSIZE);
-			/* Copy existing media attributes, if any */
-			if(m->m_attributes) {
-				sdp_attribute_t *a = m->m_attributes;
-				while(a) {
-					if(a->a_value == NULL) {
-						g_sprintf(buffer,
-							"a=%s\r\n", a->a_name);
-						g_strlcat(sdp, buffer, BUFSIZE);
-					} else {
-						g_sprintf(buffer,
-							"a=%s:%s\r\n", a->a_name, a->a_value);
-						g_strlcat(sdp, buffer, BUFSIZE);
-					}
-					a = a->a_next;
-				}
+		} else if(m->type == sdp_media_video) {
+			video++;
+			if(video > 1 || !handle->video_id) {
+				JANUS_DEBUG("[%"SCNu64"] Skipping video line (we have %d video lines, and the id is %d)\n", handle->handle_id, video, handle->video_id);
+				g_string_append(sdp, "m=video 0 RTP/SAVPF 0\r\n");
+				continue;
 			}
-			/* Add last attributes, rtcp and ssrc (msid) */
-			if(m->m_type == sdp_media_audio) {
-				g_sprintf(buffer,
-					//~ "a=rtcp:ARTCP IN IP4 %s\r\n"
-					"a=ssrc:%i cname:janusaudio\r\n"
-					"a=ssrc:%i msid:janus janusa0\r\n"
-					"a=ssrc:%i mslabel:janus\r\n"
-					"a=ssrc:%i label:janusa0\r\n",
-						//~ janus_get_local_ip(),
-						stream->ssrc, stream->ssrc, stream->ssrc, stream->ssrc);
-				g_strlcat(sdp, buffer, BUFSIZE);
-			} else if(m->m_type == sdp_media_video) {
-				g_sprintf(buffer,
-					//~ "a=rtcp:VRTCP IN IP4 %s\r\n"
-					"a=ssrc:%i cname:janusvideo\r\n"
-					"a=ssrc:%i msid:janus janusv0\r\n"
-					"a=ssrc:%i mslabel:janus\r\n"
-					"a=ssrc:%i label:janusv0\r\n",
-						//~ janus_get_local_ip(),
-						stream->ssrc, stream->ssrc, stream->ssrc, stream->ssrc);
-				g_strlcat(sdp, buffer, BUFSIZE);
+			/* Video */
+			stream = g_hash_table_lookup(handle->streams, GUINT_TO_POINTER(handle->video_id));
+			if(stream == NULL) {
+				JANUS_DEBUG("[%"SCNu64"] Skipping video line (invalid stream %d)\n", handle->handle_id, handle->video_id);
+				g_string_append(sdp, "m=video 0 RTP/SAVPF 0\r\n");
+				continue;
 			}
-			/* And now the candidates */
-			janus_ice_setup_candidate(handle, sdp, stream->stream_id, 1);
-			janus_ice_setup_candidate(handle, sdp, stream->stream_id, 2);
-			/* Next */
-			m = m->m_next;
+		} else {
+			JANUS_DEBUG("[%"SCNu64"] Skipping unsupported media line...\n", handle->handle_id);
+			g_string_append(sdp, m->rejected);
+			continue;
+		}
+		/* The ports are the ones of the first local candidates */
+		g_string_append_printf(sdp, "m=%s %u RTP/SAVPF", m->type == sdp_media_audio ? "audio" : "video",
+			janus_ice_get_local_port(handle, stream->stream_id, 1));
+		g_string_append(sdp, m->formats);
+		/* RTCP */
+		g_string_append_printf(sdp, "a=rtcp:%u IN IP4 %s\r\n",
+			janus_ice_get_local_port(handle, stream->stream_id, 2), janus_get_local_ip());
+		/* RTP maps */
+		g_string_append(sdp, m->rtpmaps);
+		/* ICE ufrag and pwd, DTLS setup and connection a= */
+		gchar *ufrag = NULL;
+		gchar *password = NULL;
+		nice_agent_get_local_credentials(handle->agent, stream->stream_id, &ufrag, &password);
+		g_string_append_printf(sdp,
+			"a=ice-ufrag:%s\r\n"
+			"a=ice-pwd:%s\r\n"
+			"a=setup:%s\r\n"
+			"a=connection:new\r\n",
+				ufrag, password,
+				janus_get_dtls_srtp_role(stream->dtls_role));
+		g_free(ufrag);
+		g_free(password);
+		/* Copy existing media attributes, if any */
+		g_string_append(sdp, m->attributes);
+		/* Add last attributes, rtcp and ssrc (msid) */
+		if(m->type == sdp_media_audio) {
+			g_string_append_printf(sdp,
+				"a=ssrc:%i cname:janusaudio\r\n"
+				"a=ssrc:%i msid:janus janusa0\r\n"
+				"a=ssrc:%i mslabel:janus\r\n"
+				"a=ssrc:%i label:janusa0\r\n",
+					stream->ssrc, stream->ssrc, stream->ssrc, stream->ssrc);
+		} else {
+			g_string_append_printf(sdp,
+				"a=ssrc:%i cname:janusvideo\r\n"
+				"a=ssrc:%i msid:janus janusv0\r\n"
+				"a=ssrc:%i mslabel:janus\r\n"
+				"a=ssrc:%i label:janusv0\r\n",
+					stream->ssrc, stream->ssrc, stream->ssrc, stream->ssrc);
 		}
+		/* And now the candidates */
+		janus_ice_setup_candidate(handle, sdp, stream->stream_id, 1);
+		janus_ice_setup_candidate(handle, sdp, stream->stream_id, 2);
 	}
+	/* The version in o= must grow every time the SDP we send changes, and only then */
+	guint64 version = sdp_template->version;
+	if(handle->local_sdp != NULL) {
+		version = handle->local_sdp_version;
+		if(strcmp(handle->local_sdp, sdp->str))
+			version = MAX(version+1, sdp_template->version);
+		g_free(handle->local_sdp);
+	}
+	handle->local_sdp = g_strdup(sdp->str);
+	handle->local_sdp_version = version;
+	janus_mutex_unlock(&handle->mutex);
+	gchar *origin = g_strdup_printf(
+		"v=0\r\n"
+		"o=%s %"SCNu64" %"SCNu64" IN IP4 127.0.0.1\r\n",
+			sdp_template->username, sdp_template->sessid, version);
+	g_string_prepend(sdp, origin);
+	g_free(origin);
 	JANUS_PRINT(" -------------------------------------------\n");
-	JANUS_PRINT("  >> Merged (%zu --> %zu bytes)\n", strlen(origsdp), strlen(sdp));
+	JANUS_PRINT("  >> Merged (%zu bytes)\n", sdp->len);
 	JANUS_PRINT(" -------------------------------------------\n");
-	JANUS_PRINT("%s\n", sdp);
+	JANUS_LOG(LOG_VERB, "%s\n", sdp->str);
+	return g_string_free(sdp, FALSE);
+}
+
+char *janus_sdp_merge(janus_ice_handle *handle, const char *origsdp) {
+	if(handle == NULL || origsdp == NULL)
+		return NULL;
+	janus_sdp_template *sdp_template = janus_sdp_template_create_stripped(origsdp);
+	if(sdp_template == NULL) {
+		JANUS_DEBUG("[%"SCNu64"] Error parsing/merging SDP\n", handle->handle_id);
+		return NULL;
+	}
+	char *sdp = janus_sdp_template_render(handle, sdp_template);
+	janus_sdp_template_free(sdp_template);
 	return sdp;
 }
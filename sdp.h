@@ -84,4 +84,48 @@ char *janus_sdp_anonymize(const char *sdp);
 char *janus_sdp_merge(janus_ice_handle *session, const char *sdp);
 ///@}
 
+
+/** @name Janus SDP templates
+ * \details Plugins offering the same SDP to many peers (e.g., all the
+ * listeners of a Streaming mountpoint or of a VideoRoom publisher) can
+ * register it as a template once: the SDP is stripped and pre-rendered
+ * right away, so that for each peer only the ports, ICE credentials,
+ * DTLS role, SSRCs and candidates have to be filled in.
+ */
+///@{
+/*! \brief Pre-rendered SDP */
+struct janus_sdp_template {
+	/*! \brief Number of audio m-lines */
+	int audio;
+	/*! \brief Number of video m-lines */
+	int video;
+	/*! \brief Username in the o= line */
+	char *username;
+	/*! \brief Session ID in the o= line */
+	guint64 sessid;
+	/*! \brief Session version in the o= line of the original SDP */
+	guint64 version;
+	/*! \brief Pre-rendered session level part (after the o= line) */
+	char *header;
+	/*! \brief Pre-rendered parts of each m-line */
+	GList *mlines;
+};
+
+/*! \brief Method to create a new template out of a plugin SDP
+ * @param[in] sdp The SDP as originated by the plugin
+ * @returns A template in case of success, NULL if the SDP is invalid */
+janus_sdp_template *janus_sdp_template_create(const char *sdp);
+/*! \brief Method to free a template
+ * \note Templates can be rendered by several threads at the same time, but
+ * it's up to the owner to make sure none of them is using it when freeing it
+ * @param[in] sdp_template The template to free */
+void janus_sdp_template_free(janus_sdp_template *sdp_template);
+/*! \brief Method to render a template for a specific handle, adding the right transport information
+ * \note The o= version only grows when what we render for the handle changes
+ * @param[in] session The ICE session this session description is related to
+ * @param[in] sdp_template The template to render
+ * @returns A string containing the full session description in case of success, NULL otherwise */
+char *janus_sdp_template_render(janus_ice_handle *session, janus_sdp_template *sdp_template);
+///@}
+
 #endif
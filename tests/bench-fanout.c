@@ -0,0 +1,166 @@
+/*! \file    bench-fanout.c
+ * \author   Lorenzo Miniero <lorenzo@meetecho.com>
+ * \copyright GNU Affero General Public License v3
+ * \brief    RTP fan-out benchmark
+ * \details  Simulates a publisher whose packets are relayed to many
+ * listeners, each with its own SRTP session, as a VideoRoom does. With
+ * no relay workers the publisher thread protects every copy itself, as
+ * the gateway does when rtp_workers is 0; otherwise the copies are handed
+ * to the workers through bounded queues, each listener always going
+ * through the same worker, as janus_ice_relay_rtp does. The benchmark
+ * reports how many protected packets per second are produced with
+ * different numbers of workers, and how many were dropped by the queues.
+ * Nothing is actually sent on the network.
+ *
+ * Usage: bench-fanout [listeners [packets]]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../janus.h"
+#include "../queue.h"
+#include "../rtp.h"
+#include "../debug.h"
+
+
+#define PACKET_SIZE	1200
+#define QUEUE_MAX	8192
+
+typedef struct fanout_listener {
+	srtp_t srtp;
+} fanout_listener;
+
+typedef struct fanout_packet {
+	fanout_listener *listener;
+	int len;
+	char data[];
+} fanout_packet;
+static fanout_packet fanout_exit;
+
+static volatile gint pending = 0, dropped = 0, errors = 0;
+
+static void fanout_protect(fanout_listener *listener, char *buf, int len) {
+	if(srtp_protect(listener->srtp, buf, &len) != err_status_ok)
+		g_atomic_int_inc(&errors);
+}
+
+static void fanout_packet_drop(gpointer data) {
+	g_atomic_int_inc(&dropped);
+	g_atomic_int_add(&pending, -1);
+	free(data);
+}
+
+static gpointer fanout_worker(gpointer data) {
+	GAsyncQueue *queue = (GAsyncQueue *)data;
+	fanout_packet *packet = NULL;
+	while((packet = g_async_queue_pop(queue)) != &fanout_exit) {
+		fanout_protect(packet->listener, packet->data, packet->len);
+		g_atomic_int_add(&pending, -1);
+		free(packet);
+	}
+	return NULL;
+}
+
+/* Relays packets to all listeners with the given number of workers, returns 0 if everything went fine */
+static int fanout_run(fanout_listener *listeners, int num, int packets, int workers) {
+	GThread **threads = NULL;
+	GAsyncQueue **queues = NULL;
+	int i = 0, l = 0;
+	if(workers > 0) {
+		threads = calloc(workers, sizeof(GThread *));
+		queues = calloc(workers, sizeof(GAsyncQueue *));
+		for(i=0; i<workers; i++) {
+			queues[i] = g_async_queue_new();
+			threads[i] = g_thread_new("fanout worker", fanout_worker, queues[i]);
+		}
+	}
+	pending = 0;
+	dropped = 0;
+	errors = 0;
+	char buf[PACKET_SIZE+SRTP_MAX_TRAILER_LEN];
+	memset(buf, 0, sizeof(buf));
+	rtp_header *header = (rtp_header *)buf;
+	header->version = 2;
+	header->type = 100;
+	gint64 start = g_get_monotonic_time();
+	for(i=0; i<packets; i++) {
+		for(l=0; l<num; l++) {
+			/* Each listener has its own SSRC, as the gateway rewrites it */
+			header->seq_number = htons(i & 0xFFFF);
+			header->timestamp = htonl(i*3000);
+			header->ssrc = htonl(l+1);
+			if(workers < 1) {
+				char sbuf[PACKET_SIZE+SRTP_MAX_TRAILER_LEN];
+				memcpy(sbuf, buf, PACKET_SIZE);
+				fanout_protect(&listeners[l], sbuf, PACKET_SIZE);
+				continue;
+			}
+			fanout_packet *packet = malloc(sizeof(fanout_packet)+PACKET_SIZE+SRTP_MAX_TRAILER_LEN);
+			packet->listener = &listeners[l];
+			packet->len = PACKET_SIZE;
+			memcpy(packet->data, buf, PACKET_SIZE);
+			g_atomic_int_inc(&pending);
+			janus_queue_push_bounded(queues[l % workers], packet, QUEUE_MAX, fanout_packet_drop);
+		}
+	}
+	while(g_atomic_int_get(&pending) > 0)
+		g_usleep(100);
+	gint64 elapsed = g_get_monotonic_time()-start;
+	for(i=0; i<workers; i++) {
+		g_async_queue_push(queues[i], &fanout_exit);
+		g_thread_join(threads[i]);
+		g_async_queue_unref(queues[i]);
+	}
+	free(threads);
+	free(queues);
+	int sent = packets*num-dropped;
+	printf("%2d workers: %8.0f packets/s, %d dropped\n", workers,
+		elapsed > 0 ? (double)sent*G_USEC_PER_SEC/elapsed : 0, dropped);
+	if(errors > 0) {
+		printf("%d packets could not be protected\n", errors);
+		return -1;
+	}
+	return 0;
+}
+
+int main(int argc, char *argv[]) {
+	int num = argc > 1 ? atoi(argv[1]) : 100;
+	int packets = argc > 2 ? atoi(argv[2]) : 2000;
+	if(num < 1 || packets < 1) {
+		printf("Usage: %s [listeners [packets]]\n", argv[0]);
+		exit(1);
+	}
+	if(srtp_init() != err_status_ok) {
+		JANUS_DEBUG("Ops, error setting up libsrtp?\n");
+		exit(1);
+	}
+	/* One outbound SRTP session per listener, with its own random key */
+	fanout_listener *listeners = calloc(num, sizeof(fanout_listener));
+	int i = 0, k = 0;
+	for(i=0; i<num; i++) {
+		srtp_policy_t policy;
+		memset(&policy, 0, sizeof(policy));
+		janus_dtls_srtp_set_crypto_policy(&policy, SRTP_AES128_CM_SHA1_80);
+		unsigned char key[64];
+		for(k=0; k<policy.rtp.cipher_key_len && k<64; k++)
+			key[k] = g_random_int_range(0, 256);
+		policy.ssrc.type = ssrc_any_outbound;
+		policy.key = key;
+		policy.next = NULL;
+		if(srtp_create(&listeners[i].srtp, &policy) != err_status_ok) {
+			JANUS_DEBUG("Error creating the SRTP session of listener %d\n", i);
+			exit(1);
+		}
+	}
+	printf("%d listeners, %d packets of %d bytes each\n", num, packets, PACKET_SIZE);
+	int res = 0, workers = 0;
+	int max = g_get_num_processors();
+	for(workers=0; workers<=max; workers = workers ? workers*2 : 1)
+		res |= fanout_run(listeners, num, packets, workers);
+	for(i=0; i<num; i++)
+		srtp_dealloc(listeners[i].srtp);
+	free(listeners);
+	exit(res == 0 ? 0 : 1);
+}
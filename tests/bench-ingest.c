@@ -0,0 +1,128 @@
+/*! \file    bench-ingest.c
+ * \author   Lorenzo Miniero <lorenzo@meetecho.com>
+ * \copyright GNU Affero General Public License v3
+ * \brief    RTP ingest benchmark
+ * \details  Compares the two ways of reading RTP packets from a UDP socket
+ * the Streaming plugin has used: one recvfrom per packet, and recvmmsg
+ * batches of up to 32 packets (as the ingest threads do now). A sender
+ * thread blasts packets of the size gstreamer typically sends to a
+ * loopback socket, while the receiver reads them and counts how many it
+ * got, how many system calls it took, and how long. Packets lost on the
+ * way (the receive buffer overflowing) are reported too, as that's what
+ * happens when an ingest thread can't keep up.
+ *
+ * Usage: bench-ingest [packets [size]]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include <glib.h>
+
+
+#define BATCH		32
+#define BUFSIZE		1500
+
+static int packets = 0, size = 0;
+static struct sockaddr_in address;
+static volatile gint sending = 0;
+
+static gpointer ingest_sender(gpointer data) {
+	int fd = socket(AF_INET, SOCK_DGRAM, 0);
+	char buf[BUFSIZE];
+	memset(buf, 0, sizeof(buf));
+	buf[0] = 0x80;	/* RTP version 2 */
+	int i = 0;
+	for(i=0; i<packets; i++) {
+		while(sendto(fd, buf, size, 0, (struct sockaddr *)&address, sizeof(address)) < 0 && errno == ENOBUFS)
+			g_thread_yield();
+	}
+	close(fd);
+	g_atomic_int_set(&sending, 0);
+	return NULL;
+}
+
+/* Receives until the sender is done and the socket is drained, using recvmmsg if batch is TRUE */
+static void ingest_run(gboolean batch) {
+	int fd = socket(AF_INET, SOCK_DGRAM, 0);
+	memset(&address, 0, sizeof(address));
+	address.sin_family = AF_INET;
+	address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	address.sin_port = 0;
+	socklen_t len = sizeof(address);
+	if(fd < 0 || bind(fd, (struct sockaddr *)&address, sizeof(address)) < 0 ||
+			getsockname(fd, (struct sockaddr *)&address, &len) < 0) {
+		printf("Error creating the receiving socket: %s\n", strerror(errno));
+		exit(1);
+	}
+	char *buffers = calloc(BATCH, BUFSIZE);
+	struct mmsghdr msgs[BATCH];
+	struct iovec iovecs[BATCH];
+	memset(msgs, 0, sizeof(msgs));
+	int i = 0;
+	for(i=0; i<BATCH; i++) {
+		iovecs[i].iov_base = buffers + i*BUFSIZE;
+		iovecs[i].iov_len = BUFSIZE;
+		msgs[i].msg_hdr.msg_iov = &iovecs[i];
+		msgs[i].msg_hdr.msg_iovlen = 1;
+	}
+	guint64 received = 0, calls = 0, bytes = 0;
+	g_atomic_int_set(&sending, 1);
+	gint64 start = g_get_monotonic_time();
+	GThread *sender = g_thread_new("ingest sender", ingest_sender, NULL);
+	struct pollfd pfd = { .fd = fd, .events = POLLIN };
+	while(1) {
+		/* Once the sender is done, give the last packets a little time to show up */
+		int ready = poll(&pfd, 1, g_atomic_int_get(&sending) ? 100 : 10);
+		if(ready <= 0) {
+			if(!g_atomic_int_get(&sending))
+				break;
+			continue;
+		}
+		if(batch) {
+			int got = recvmmsg(fd, msgs, BATCH, MSG_DONTWAIT, NULL);
+			calls++;
+			if(got <= 0)
+				continue;
+			for(i=0; i<got; i++)
+				bytes += msgs[i].msg_len;
+			received += got;
+		} else {
+			struct sockaddr_in remote;
+			socklen_t addrlen = sizeof(remote);
+			int got = recvfrom(fd, buffers, BUFSIZE, MSG_DONTWAIT, (struct sockaddr *)&remote, &addrlen);
+			calls++;
+			if(got <= 0)
+				continue;
+			bytes += got;
+			received++;
+		}
+	}
+	gint64 elapsed = g_get_monotonic_time()-start;
+	g_thread_join(sender);
+	close(fd);
+	free(buffers);
+	printf("%-8s %8"G_GUINT64_FORMAT" packets (%5.1f%% lost), %8"G_GUINT64_FORMAT" calls, %9.0f packets/s, %7.1f Mbps\n",
+		batch ? "recvmmsg" : "recvfrom", received, 100.0*(packets-(double)received)/packets, calls,
+		(double)received*G_USEC_PER_SEC/elapsed, (double)bytes*8/elapsed);
+}
+
+int main(int argc, char *argv[]) {
+	packets = argc > 1 ? atoi(argv[1]) : 500000;
+	size = argc > 2 ? atoi(argv[2]) : 1200;
+	if(packets < 1 || size < 12 || size > BUFSIZE) {
+		printf("Usage: %s [packets [size]]\n", argv[0]);
+		exit(1);
+	}
+	printf("%d packets of %d bytes on loopback\n", packets, size);
+	ingest_run(FALSE);
+	ingest_run(TRUE);
+	exit(0);
+}
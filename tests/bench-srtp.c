@@ -0,0 +1,128 @@
+/*! \file    bench-srtp.c
+ * \author   Lorenzo Miniero <lorenzo@meetecho.com>
+ * \copyright GNU Affero General Public License v3
+ * \brief    SRTP protect/unprotect benchmark
+ * \details  Measures how long protecting and unprotecting an RTP packet
+ * takes for each of the DTLS-SRTP profiles the gateway can negotiate,
+ * using the same crypto policies the DTLS code sets up after a handshake.
+ * Every packet is protected by an outbound session and unprotected by an
+ * inbound one with the same random key, and the payload is checked to
+ * survive the round trip, so this doubles as a sanity check of the
+ * policies: relaying a packet costs one unprotect and one protect per
+ * listener, which is what these numbers are for.
+ *
+ * Usage: bench-srtp [packets [size]]
+ *
+ * \note The AES-GCM profiles are only measured when both the gateway and
+ * this benchmark are built with HAVE_SRTP_AESGCM (see the Makefile).
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../janus.h"
+#include "../rtp.h"
+#include "../debug.h"
+
+
+static int bench_srtp(const char *name, unsigned long profile, int packets, int size) {
+	srtp_policy_t out_policy, in_policy;
+	memset(&out_policy, 0, sizeof(out_policy));
+	memset(&in_policy, 0, sizeof(in_policy));
+	janus_dtls_srtp_set_crypto_policy(&out_policy, profile);
+	janus_dtls_srtp_set_crypto_policy(&in_policy, profile);
+	/* The key length (master key and salt) depends on the profile */
+	int key_len = out_policy.rtp.cipher_key_len;
+	unsigned char *key = malloc(key_len);
+	int i = 0;
+	for(i=0; i<key_len; i++)
+		key[i] = g_random_int_range(0, 256);
+	out_policy.ssrc.type = ssrc_any_outbound;
+	out_policy.key = key;
+	out_policy.next = NULL;
+	in_policy.ssrc.type = ssrc_any_inbound;
+	in_policy.key = key;
+	in_policy.next = NULL;
+	/* The first outbound session is only used to time protecting alone,
+	 * the second one feeds the inbound session for the round trip */
+	srtp_t only = NULL, out = NULL, in = NULL;
+	if(srtp_create(&only, &out_policy) != err_status_ok ||
+			srtp_create(&out, &out_policy) != err_status_ok ||
+			srtp_create(&in, &in_policy) != err_status_ok) {
+		printf("%-24s could not create the SRTP sessions\n", name);
+		free(key);
+		return -1;
+	}
+	/* Prepare a reference packet */
+	char *reference = malloc(size);
+	char *buffer = malloc(size+SRTP_MAX_TRAILER_LEN);
+	for(i=0; i<size; i++)
+		reference[i] = g_random_int_range(0, 256);
+	rtp_header *header = (rtp_header *)reference;
+	header->version = 2;
+	header->padding = 0;
+	header->extension = 0;
+	header->csrccount = 0;
+	header->markerbit = 0;
+	header->type = 100;
+	header->ssrc = htonl(0x12345678);
+	/* Protect only */
+	int errors = 0, len = 0;
+	gint64 start = g_get_monotonic_time();
+	for(i=0; i<packets; i++) {
+		header->seq_number = htons(i & 0xFFFF);
+		header->timestamp = htonl(i*3000);
+		memcpy(buffer, reference, size);
+		len = size;
+		if(srtp_protect(only, buffer, &len) != err_status_ok)
+			errors++;
+	}
+	gint64 protect = g_get_monotonic_time()-start;
+	/* Protect and unprotect, checking the packet survived */
+	start = g_get_monotonic_time();
+	for(i=0; i<packets; i++) {
+		header->seq_number = htons(i & 0xFFFF);
+		header->timestamp = htonl(i*3000);
+		memcpy(buffer, reference, size);
+		len = size;
+		if(srtp_protect(out, buffer, &len) != err_status_ok ||
+				srtp_unprotect(in, buffer, &len) != err_status_ok ||
+				len != size || memcmp(buffer, reference, size))
+			errors++;
+	}
+	gint64 unprotect = g_get_monotonic_time()-start-protect;
+	srtp_dealloc(only);
+	srtp_dealloc(out);
+	srtp_dealloc(in);
+	free(reference);
+	free(buffer);
+	free(key);
+	if(errors > 0) {
+		printf("%-24s %d/%d packets didn't survive the round trip\n", name, errors, packets);
+		return -1;
+	}
+	printf("%-24s protect %6.0f ns/packet, unprotect %6.0f ns/packet\n", name,
+		(double)protect*1000/packets, (double)unprotect*1000/packets);
+	return 0;
+}
+
+int main(int argc, char *argv[]) {
+	int packets = argc > 1 ? atoi(argv[1]) : 200000;
+	int size = argc > 2 ? atoi(argv[2]) : 1200;
+	if(packets < 1 || size < 12 || size > BUFSIZE-SRTP_MAX_TRAILER_LEN) {
+		printf("Usage: %s [packets [size]]\n", argv[0]);
+		exit(1);
+	}
+	if(srtp_init() != err_status_ok) {
+		JANUS_DEBUG("Ops, error setting up libsrtp?\n");
+		exit(1);
+	}
+	printf("%d packets of %d bytes\n", packets, size);
+	int res = bench_srtp("AES128_CM_SHA1_80", SRTP_AES128_CM_SHA1_80, packets, size);
+#if defined(HAVE_SRTP_AESGCM) && defined(SRTP_AEAD_AES_256_GCM)
+	res |= bench_srtp("AEAD_AES_128_GCM", SRTP_AEAD_AES_128_GCM, packets, size);
+	res |= bench_srtp("AEAD_AES_256_GCM", SRTP_AEAD_AES_256_GCM, packets, size);
+#endif
+	exit(res == 0 ? 0 : 1);
+}
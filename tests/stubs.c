@@ -0,0 +1,34 @@
+/*! \file    stubs.c
+ * \author   Lorenzo Miniero <lorenzo@meetecho.com>
+ * \copyright GNU Affero General Public License v3
+ * \brief    Stubs of the core for tests and benchmarks
+ * \details  Tests and benchmarks link parts of the core (e.g., the DTLS
+ * code) as they are: these are the few calls those parts make into the
+ * rest of the core. DTLS stacks and SDPs are never attached to actual
+ * handles here, so none of them is expected to be invoked.
+ */
+
+#include "../janus.h"
+
+
+gint janus_is_stopping(void) {
+	return 0;
+}
+
+void janus_ice_dtls_handshake_done(janus_ice_handle *handle, janus_ice_component *component) {
+}
+
+gint nice_agent_send(NiceAgent *agent, guint stream_id, guint component_id, guint len, const gchar *buf) {
+	return -1;
+}
+
+gchar *janus_get_local_ip(void) {
+	return "127.0.0.1";
+}
+
+void janus_ice_setup_candidate(janus_ice_handle *handle, GString *sdp, guint stream_id, guint component_id) {
+}
+
+guint16 janus_ice_get_local_port(janus_ice_handle *handle, guint stream_id, guint component_id) {
+	return 0;
+}
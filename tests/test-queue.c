@@ -0,0 +1,120 @@
+/*! \file    test-queue.c
+ * \author   Lorenzo Miniero <lorenzo@meetecho.com>
+ * \copyright GNU Affero General Public License v3
+ * \brief    Stress test for the bounded queues
+ * \details  Several producers push numbered items to a bounded queue as
+ * fast as they can, while a single consumer pops them (as long polls do
+ * with session events, and relay workers with packets). The test checks
+ * that the bound is honoured, that no item is lost (each one is either
+ * popped or dropped, exactly once), and that the items of each producer
+ * are popped in the order they were pushed.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "../queue.h"
+
+
+#define PRODUCERS	8
+#define ITEMS		200000
+#define MAX_ITEMS	500
+
+typedef struct test_item {
+	guint producer;
+	guint seq;
+} test_item;
+
+static GAsyncQueue *queue = NULL;
+static guint max_items = 0;
+static volatile gint dropped = 0, freed = 0, producing = 0;
+
+static void test_item_free(gpointer data) {
+	g_atomic_int_inc(&freed);
+	g_free(data);
+}
+
+static gpointer test_producer(gpointer data) {
+	guint producer = GPOINTER_TO_UINT(data), i = 0;
+	for(i = 0; i < ITEMS; i++) {
+		test_item *item = g_malloc(sizeof(test_item));
+		item->producer = producer;
+		item->seq = i;
+		guint d = janus_queue_push_bounded(queue, item, max_items, test_item_free);
+		if(d > 0)
+			g_atomic_int_add(&dropped, d);
+	}
+	g_atomic_int_add(&producing, -1);
+	return NULL;
+}
+
+/* Runs the producers against a consumer, returns 0 if everything went fine */
+static int test_run(guint max) {
+	queue = g_async_queue_new();
+	max_items = max;
+	dropped = 0;
+	freed = 0;
+	producing = PRODUCERS;
+	gint64 start = g_get_monotonic_time();
+	GThread *producers[PRODUCERS];
+	guint i = 0;
+	for(i = 0; i < PRODUCERS; i++)
+		producers[i] = g_thread_new("producer", test_producer, GUINT_TO_POINTER(i));
+	gint next[PRODUCERS];
+	for(i = 0; i < PRODUCERS; i++)
+		next[i] = 0;
+	guint popped = 0, errors = 0;
+	gint longest = 0;
+	while(TRUE) {
+		gint length = g_async_queue_length(queue);
+		if(length > longest)
+			longest = length;
+		test_item *item = g_async_queue_timeout_pop(queue, 10000);
+		if(item == NULL) {
+			if(g_atomic_int_get(&producing) == 0 && g_async_queue_length(queue) == 0)
+				break;
+			continue;
+		}
+		popped++;
+		if(item->producer >= PRODUCERS || (gint)item->seq < next[item->producer]) {
+			if(errors++ < 10)
+				printf("  Item %u of producer %u out of order (expected %d or later)\n", item->seq, item->producer, next[item->producer]);
+		} else {
+			next[item->producer] = item->seq+1;
+		}
+		g_free(item);
+	}
+	for(i = 0; i < PRODUCERS; i++)
+		g_thread_join(producers[i]);
+	gint64 elapsed = g_get_monotonic_time()-start;
+	g_async_queue_unref(queue);
+	queue = NULL;
+	printf("  max=%u: %u pushed, %u popped, %d dropped, longest queue %d (%"G_GINT64_FORMAT" items/s)\n",
+		max, PRODUCERS*ITEMS, popped, dropped, longest, elapsed > 0 ? (gint64)PRODUCERS*ITEMS*G_USEC_PER_SEC/elapsed : 0);
+	if(popped+dropped != PRODUCERS*ITEMS) {
+		printf("  Lost %d items\n", (gint)(PRODUCERS*ITEMS-popped-dropped));
+		errors++;
+	}
+	if(freed != dropped) {
+		printf("  %d items dropped but %d freed\n", dropped, freed);
+		errors++;
+	}
+	if(max > 0 && longest > (gint)max) {
+		printf("  Queue grew to %d items (max %u)\n", longest, max);
+		errors++;
+	}
+	if(max == 0 && dropped > 0) {
+		printf("  Items dropped from an unbounded queue\n");
+		errors++;
+	}
+	return errors ? -1 : 0;
+}
+
+int main(int argc, char *argv[]) {
+	int res = 0;
+	res |= test_run(MAX_ITEMS);
+	res |= test_run(1);
+	res |= test_run(0);
+	printf("%s\n", res == 0 ? "OK" : "FAILED");
+	return res == 0 ? 0 : 1;
+}
@@ -0,0 +1,212 @@
+/*! \file    test-sdp.c
+ * \author   Lorenzo Miniero <lorenzo@meetecho.com>
+ * \copyright GNU Affero General Public License v3
+ * \brief    Tests for the SDP anonymizer
+ * \details  Checks that janus_sdp_anonymize strips what we handle ourselves
+ * (ICE, DTLS, candidates) and scrubs the addresses of the peer, that big
+ * SDPs (many candidates and codecs) are not truncated, and that malformed
+ * SDPs are rejected rather than crashing, by feeding it a few thousands
+ * random mutations of a valid one. It also prints how many offers per
+ * second are anonymized, to keep an eye on the negotiation cost.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "../janus.h"
+#include "../sdp.h"
+#include "../codecs.h"
+#include "../debug.h"
+
+
+#define FUZZ_ROUNDS		5000
+#define BENCH_ROUNDS	20000
+
+static const char *offer =
+	"v=0\r\n"
+	"o=- 4611731400430051336 2 IN IP4 192.168.1.23\r\n"
+	"s=-\r\n"
+	"t=0 0\r\n"
+	"a=group:BUNDLE audio video\r\n"
+	"a=msid-semantic: WMS stream\r\n"
+	"m=audio 54321 RTP/SAVPF 111 0\r\n"
+	"c=IN IP4 192.168.1.23\r\n"
+	"a=rtcp:54322 IN IP4 192.168.1.23\r\n"
+	"a=candidate:1 1 udp 2122260223 192.168.1.23 54321 typ host generation 0\r\n"
+	"a=candidate:2 1 udp 1686052607 203.0.113.7 54321 typ srflx raddr 192.168.1.23 rport 54321 generation 0\r\n"
+	"a=ice-ufrag:abcdEFGH\r\n"
+	"a=ice-pwd:abcdefghijklmnopqrstuvwx\r\n"
+	"a=fingerprint:sha-256 AA:BB:CC:DD:EE:FF:00:11:22:33:44:55:66:77:88:99:AA:BB:CC:DD:EE:FF:00:11:22:33:44:55:66:77:88:99\r\n"
+	"a=setup:actpass\r\n"
+	"a=mid:audio\r\n"
+	"a=sendrecv\r\n"
+	"a=rtcp-mux\r\n"
+	"a=rtpmap:111 opus/48000/2\r\n"
+	"a=fmtp:111 minptime=10\r\n"
+	"a=rtpmap:0 PCMU/8000\r\n"
+	"a=ssrc:1234 cname:secret\r\n"
+	"m=video 54323 RTP/SAVPF 100\r\n"
+	"c=IN IP4 192.168.1.23\r\n"
+	"a=candidate:1 1 udp 2122260223 192.168.1.23 54323 typ host generation 0\r\n"
+	"a=ice-ufrag:abcdEFGH\r\n"
+	"a=ice-pwd:abcdefghijklmnopqrstuvwx\r\n"
+	"a=mid:video\r\n"
+	"a=recvonly\r\n"
+	"a=rtpmap:100 VP8/90000\r\n"
+	"a=rtcp-fb:100 nack\r\n";
+
+static int failures = 0;
+
+#define test_check(cond, ...) \
+	do { \
+		if(!(cond)) { \
+			printf("FAILED (%s:%d): ", __FILE__, __LINE__); \
+			printf(__VA_ARGS__); \
+			printf("\n"); \
+			failures++; \
+		} \
+	} while(0)
+
+static void test_anonymize(void) {
+	char *stripped = janus_sdp_anonymize(offer);
+	test_check(stripped != NULL, "valid offer rejected");
+	if(stripped == NULL)
+		return;
+	/* None of the addresses of the peer, nor what we take care of ourselves, should be left */
+	const char *leaks[] = { "192.168.1.23", "203.0.113.7", "54321", "54323",
+		"a=candidate", "a=ice-", "a=fingerprint", "a=setup", "a=ssrc", "a=rtcp:", "a=group", NULL };
+	const char **leak = NULL;
+	for(leak = leaks; *leak; leak++)
+		test_check(strstr(stripped, *leak) == NULL, "'%s' left in the stripped SDP", *leak);
+	const char *kept[] = { "o=- 4611731400430051336 2 IN IP4 127.0.0.1\r\n", "m=audio 1 RTP/SAVPF 111 0\r\n",
+		"m=video 1 RTP/SAVPF 100\r\n", "a=rtpmap:111 opus/48000/2\r\n", "a=fmtp:111 minptime=10\r\n",
+		"a=recvonly\r\n", "a=rtcp-fb:100 nack\r\n", "a=mid:video\r\n", NULL };
+	const char **k = NULL;
+	for(k = kept; *k; k++)
+		test_check(strstr(stripped, *k) != NULL, "'%.*s' missing in the stripped SDP", (int)strlen(*k)-2, *k);
+	g_free(stripped);
+}
+
+static void test_big(void) {
+	/* Way more than the BUFSIZE bytes we used to be limited to */
+	GString *big = g_string_new("v=0\r\no=- 1 1 IN IP4 10.0.0.1\r\ns=-\r\nt=0 0\r\nm=video 9 RTP/SAVPF");
+	int pt = 0;
+	for(pt = 96; pt < 128; pt++)
+		g_string_append_printf(big, " %d", pt);
+	g_string_append(big, "\r\nc=IN IP4 10.0.0.1\r\n");
+	int i = 0;
+	for(i = 0; i < 200; i++)
+		g_string_append_printf(big, "a=candidate:%d 1 udp 2122260223 10.0.%d.%d %d typ host generation 0\r\n",
+			i, i/250, i%250+1, 10000+i);
+	for(pt = 96; pt < 128; pt++)
+		g_string_append_printf(big, "a=rtpmap:%d VP8/90000\r\na=rtcp-fb:%d nack pli\r\n", pt, pt);
+	char *stripped = janus_sdp_anonymize(big->str);
+	test_check(stripped != NULL, "big offer (%zu bytes) rejected", big->len);
+	if(stripped != NULL) {
+		test_check(strstr(stripped, "a=rtpmap:127 VP8/90000\r\n") != NULL, "big offer truncated");
+		test_check(strstr(stripped, "a=rtcp-fb:127 nack pli\r\n") != NULL, "big offer truncated");
+		test_check(strstr(stripped, "10.0.") == NULL, "addresses left in the big offer");
+		g_free(stripped);
+	}
+	g_string_free(big, TRUE);
+}
+
+static void test_force_feedback(void) {
+	/* A feedback type with no parameters keeps it with any of them */
+	const char *allowed[] = { "nack", "ccm fir", NULL };
+	char *forced = janus_codecs_force(offer, TRUE, "VP8", allowed);
+	test_check(forced != NULL, "VP8 not found in the offer");
+	if(forced == NULL)
+		return;
+	test_check(strstr(forced, "a=rtcp-fb:100 nack\r\n") != NULL, "'nack' dropped");
+	g_free(forced);
+	const char *sdp = "v=0\r\no=- 1 1 IN IP4 10.0.0.1\r\ns=-\r\nt=0 0\r\nm=video 9 RTP/SAVPF 100\r\n"
+		"a=rtpmap:100 VP8/90000\r\na=rtcp-fb:100 nack pli\r\na=rtcp-fb:100 ccm fir\r\n"
+		"a=rtcp-fb:100 ccm tmmbr\r\na=rtcp-fb:100 nackx\r\na=rtcp-fb:100 goog-remb\r\n";
+	forced = janus_codecs_force(sdp, TRUE, "VP8", allowed);
+	test_check(forced != NULL, "VP8 not found");
+	if(forced == NULL)
+		return;
+	test_check(strstr(forced, "a=rtcp-fb:100 nack pli\r\n") != NULL, "'nack pli' dropped");
+	test_check(strstr(forced, "a=rtcp-fb:100 ccm fir\r\n") != NULL, "'ccm fir' dropped");
+	test_check(strstr(forced, "ccm tmmbr") == NULL, "'ccm tmmbr' kept");
+	test_check(strstr(forced, "nackx") == NULL, "'nackx' kept");
+	test_check(strstr(forced, "goog-remb") == NULL, "'goog-remb' kept");
+	g_free(forced);
+}
+
+/* Random mutations of a valid SDP: the anonymizer can reject them, but
+ * must never crash, and whatever it accepts must still be scrubbed */
+static void test_fuzz(void) {
+	GRand *rand = g_rand_new_with_seed(42);
+	size_t len = strlen(offer);
+	int i = 0, accepted = 0;
+	for(i = 0; i < FUZZ_ROUNDS; i++) {
+		char *fuzzed = g_strdup(offer);
+		int changes = g_rand_int_range(rand, 1, 8), c = 0;
+		size_t fuzzed_len = len;
+		for(c = 0; c < changes; c++) {
+			size_t pos = g_rand_int_range(rand, 0, fuzzed_len);
+			switch(g_rand_int_range(rand, 0, 4)) {
+				case 0:
+					/* Truncate */
+					fuzzed[pos] = '\0';
+					fuzzed_len = pos > 0 ? pos : 1;
+					break;
+				case 1:
+					/* Random byte */
+					fuzzed[pos] = g_rand_int_range(rand, 1, 256);
+					break;
+				case 2:
+					/* Break a line */
+					fuzzed[pos] = g_rand_boolean(rand) ? '\n' : '\r';
+					break;
+				case 3:
+				default:
+					/* Mess with a number */
+					fuzzed[pos] = g_rand_boolean(rand) ? '9' : '-';
+					break;
+			}
+			if(fuzzed[0] == '\0')
+				break;
+		}
+		char *stripped = janus_sdp_anonymize(fuzzed);
+		if(stripped != NULL) {
+			accepted++;
+			test_check(strstr(stripped, "a=candidate") == NULL, "candidates left in fuzzed SDP #%d", i);
+			g_free(stripped);
+		}
+		g_free(fuzzed);
+	}
+	g_rand_free(rand);
+	printf("  %d fuzzed SDPs, %d accepted\n", FUZZ_ROUNDS, accepted);
+}
+
+static void test_throughput(void) {
+	gint64 start = g_get_monotonic_time();
+	int i = 0;
+	for(i = 0; i < BENCH_ROUNDS; i++)
+		g_free(janus_sdp_anonymize(offer));
+	gint64 elapsed = g_get_monotonic_time()-start;
+	printf("  %d offers anonymized (%.0f offers/s)\n", BENCH_ROUNDS,
+		elapsed > 0 ? (double)BENCH_ROUNDS*G_USEC_PER_SEC/elapsed : 0);
+}
+
+int main(int argc, char *argv[]) {
+	/* The anonymizer prints what it does, and complains about fuzzed SDPs: keep it quiet */
+	janus_log_level = LOG_ERR;
+	if(janus_sdp_init() < 0)
+		exit(1);
+	test_anonymize();
+	test_big();
+	test_force_feedback();
+	test_fuzz();
+	test_throughput();
+	janus_sdp_deinit();
+	if(failures > 0) {
+		printf("%d checks failed\n", failures);
+		exit(1);
+	}
+	printf("OK\n");
+	exit(0);
+}
@@ -0,0 +1,164 @@
+/*! \file    trace.c
+ * \author   Lorenzo Miniero <lorenzo@meetecho.com>
+ * \copyright GNU Affero General Public License v3
+ * \brief    Setup tracing
+ * \details  Implementation of a lightweight tracing facility, meant to
+ * help figure out where the time needed to setup a PeerConnection goes
+ * (long polls, plugins, candidates gathering, ICE checks, DTLS handshake).
+ * Each handle can have its own trace, a small ring of events stamped
+ * with g_get_monotonic_time(): the trace can be retrieved as JSON by
+ * sending a \c trace request to the handle, and can optionally be saved
+ * in the Chrome trace event format (to be opened in \c chrome://tracing )
+ * when the handle is detached.
+ *
+ * \ingroup core
+ * \ref core
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+
+#include "trace.h"
+#include "debug.h"
+
+
+static gboolean trace_enabled = FALSE;
+static char *trace_chrome_folder = NULL;
+
+static const char *janus_trace_phase_names[] = {
+	"message_received",
+	"plugin_message",
+	"plugin_message_done",
+	"gathering_done",
+	"component_ready",
+	"dtls_done",
+};
+const char *janus_trace_phase_name(janus_trace_phase phase) {
+	if(phase < JANUS_TRACE_MESSAGE_RECEIVED || phase > JANUS_TRACE_DTLS_DONE)
+		return NULL;
+	return janus_trace_phase_names[phase];
+}
+
+
+gint janus_trace_init(gboolean enabled, const char *chrome_folder) {
+	trace_enabled = enabled;
+	if(trace_enabled && chrome_folder != NULL) {
+		trace_chrome_folder = g_strdup(chrome_folder);
+		if(trace_chrome_folder == NULL) {
+			JANUS_DEBUG("Memory error!\n");
+			return -1;
+		}
+	}
+	JANUS_PRINT("Handles tracing %s\n", trace_enabled ? "enabled" : "disabled");
+	if(trace_chrome_folder != NULL)
+		JANUS_PRINT("  -- Chrome traces will be saved in %s\n", trace_chrome_folder);
+	return 0;
+}
+
+void janus_trace_deinit(void) {
+	trace_enabled = FALSE;
+	g_free(trace_chrome_folder);
+	trace_chrome_folder = NULL;
+}
+
+
+janus_trace *janus_trace_create(void) {
+	if(!trace_enabled)
+		return NULL;
+	janus_trace *trace = calloc(1, sizeof(janus_trace));
+	if(trace == NULL) {
+		JANUS_DEBUG("Memory error!\n");
+		return NULL;
+	}
+	trace->created = g_get_monotonic_time();
+	trace->count = 0;
+	janus_mutex_init(&trace->mutex);
+	return trace;
+}
+
+void janus_trace_destroy(janus_trace *trace) {
+	if(trace == NULL)
+		return;
+	janus_mutex_destroy(&trace->mutex);
+	free(trace);
+}
+
+void janus_trace_mark(janus_trace *trace, janus_trace_phase phase, guint stream_id, guint component_id) {
+	if(trace == NULL)
+		return;
+	gint64 now = g_get_monotonic_time();
+	janus_mutex_lock(&trace->mutex);
+	janus_trace_event *event = &trace->events[trace->count % JANUS_TRACE_EVENTS];
+	event->when = now;
+	event->phase = phase;
+	event->stream_id = stream_id;
+	event->component_id = component_id;
+	trace->count++;
+	janus_mutex_unlock(&trace->mutex);
+}
+
+json_t *janus_trace_to_json(janus_trace *trace) {
+	json_t *events = json_array();
+	if(trace == NULL)
+		return events;
+	janus_mutex_lock(&trace->mutex);
+	guint first = trace->count > JANUS_TRACE_EVENTS ? trace->count - JANUS_TRACE_EVENTS : 0;
+	guint i = 0;
+	for(i=first; i<trace->count; i++) {
+		janus_trace_event *event = &trace->events[i % JANUS_TRACE_EVENTS];
+		json_t *item = json_object();
+		json_object_set_new(item, "phase", json_string(janus_trace_phase_name(event->phase)));
+		json_object_set_new(item, "time", json_integer(event->when - trace->created));
+		if(event->stream_id > 0)
+			json_object_set_new(item, "stream", json_integer(event->stream_id));
+		if(event->component_id > 0)
+			json_object_set_new(item, "component", json_integer(event->component_id));
+		json_array_append_new(events, item);
+	}
+	janus_mutex_unlock(&trace->mutex);
+	return events;
+}
+
+gint janus_trace_save_chrome(janus_trace *trace, guint64 session_id, guint64 handle_id) {
+	if(trace == NULL || trace_chrome_folder == NULL)
+		return 0;
+	char filename[255];
+	g_snprintf(filename, sizeof(filename), "%s/janus-trace-%"SCNu64"-%"SCNu64".json", trace_chrome_folder, session_id, handle_id);
+	/* Chrome trace event format: instant events, sessions as processes and handles as threads */
+	json_t *root = json_object();
+	json_t *events = json_array();
+	janus_mutex_lock(&trace->mutex);
+	guint first = trace->count > JANUS_TRACE_EVENTS ? trace->count - JANUS_TRACE_EVENTS : 0;
+	guint i = 0;
+	for(i=first; i<trace->count; i++) {
+		janus_trace_event *event = &trace->events[i % JANUS_TRACE_EVENTS];
+		json_t *item = json_object();
+		json_object_set_new(item, "name", json_string(janus_trace_phase_name(event->phase)));
+		json_object_set_new(item, "cat", json_string("janus"));
+		json_object_set_new(item, "ph", json_string("i"));
+		json_object_set_new(item, "s", json_string("t"));
+		json_object_set_new(item, "ts", json_integer(event->when));
+		json_object_set_new(item, "pid", json_integer(session_id));
+		json_object_set_new(item, "tid", json_integer(handle_id));
+		if(event->stream_id > 0 || event->component_id > 0) {
+			json_t *args = json_object();
+			json_object_set_new(args, "stream", json_integer(event->stream_id));
+			json_object_set_new(args, "component", json_integer(event->component_id));
+			json_object_set_new(item, "args", args);
+		}
+		json_array_append_new(events, item);
+	}
+	janus_mutex_unlock(&trace->mutex);
+	json_object_set_new(root, "traceEvents", events);
+	json_object_set_new(root, "displayTimeUnit", json_string("ms"));
+	int res = json_dump_file(root, filename, JSON_INDENT(1));
+	json_decref(root);
+	if(res < 0) {
+		JANUS_DEBUG("[%"SCNu64"] Error saving trace to %s\n", handle_id, filename);
+		return -1;
+	}
+	JANUS_PRINT("[%"SCNu64"] Trace saved to %s\n", handle_id, filename);
+	return 0;
+}
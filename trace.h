@@ -0,0 +1,122 @@
+/*! \file    trace.h
+ * \author   Lorenzo Miniero <lorenzo@meetecho.com>
+ * \copyright GNU Affero General Public License v3
+ * \brief    Setup tracing (headers)
+ * \details  Implementation of a lightweight tracing facility, meant to
+ * help figure out where the time needed to setup a PeerConnection goes
+ * (long polls, plugins, candidates gathering, ICE checks, DTLS handshake).
+ * Each handle can have its own trace, a small ring of events stamped
+ * with g_get_monotonic_time(): the trace can be retrieved as JSON by
+ * sending a \c trace request to the handle, and can optionally be saved
+ * in the Chrome trace event format (to be opened in \c chrome://tracing )
+ * when the handle is detached. When tracing is disabled in the
+ * configuration, handles have no trace at all and marking a phase is a
+ * simple NULL check.
+ *
+ * \ingroup core
+ * \ref core
+ */
+
+#ifndef _JANUS_TRACE_H
+#define _JANUS_TRACE_H
+
+#include <glib.h>
+#include <jansson.h>
+
+#include "mutex.h"
+
+
+/*! \brief Number of events a trace can contain before older ones are overwritten */
+#define JANUS_TRACE_EVENTS	64
+
+/*! \brief Setup phases that can be traced */
+typedef enum janus_trace_phase {
+	/*! \brief A message for the handle was received by the web server */
+	JANUS_TRACE_MESSAGE_RECEIVED = 0,
+	/*! \brief The message has been handed to the plugin (handle_message) */
+	JANUS_TRACE_PLUGIN_MESSAGE,
+	/*! \brief The plugin handle_message method returned */
+	JANUS_TRACE_PLUGIN_MESSAGE_DONE,
+	/*! \brief Candidates gathering was completed for a plugin SDP (janus_handle_sdp) */
+	JANUS_TRACE_GATHERING_DONE,
+	/*! \brief An ICE component became ready */
+	JANUS_TRACE_COMPONENT_READY,
+	/*! \brief The DTLS handshake for a component was completed */
+	JANUS_TRACE_DTLS_DONE,
+} janus_trace_phase;
+
+/*! \brief Helper method to get a string representation of a trace phase
+ * @param[in] phase The trace phase
+ * @returns A string representation of the phase */
+const char *janus_trace_phase_name(janus_trace_phase phase);
+
+
+/*! \brief Traced event */
+typedef struct janus_trace_event {
+	/*! \brief Monotonic time of the event, in microseconds */
+	gint64 when;
+	/*! \brief Phase this event refers to */
+	janus_trace_phase phase;
+	/*! \brief libnice stream ID this event refers to, if any (0 otherwise) */
+	guint stream_id;
+	/*! \brief libnice component ID this event refers to, if any (0 otherwise) */
+	guint component_id;
+} janus_trace_event;
+
+/*! \brief Per-handle trace */
+typedef struct janus_trace {
+	/*! \brief Monotonic time the trace was created (i.e., the handle was attached) */
+	gint64 created;
+	/*! \brief Ring of events */
+	janus_trace_event events[JANUS_TRACE_EVENTS];
+	/*! \brief Number of events traced so far (the ring only keeps the last JANUS_TRACE_EVENTS) */
+	guint count;
+	/*! \brief Mutex to lock/unlock the trace */
+	janus_mutex mutex;
+} janus_trace;
+
+
+/** @name Janus tracing setup
+ */
+///@{
+/*! \brief Tracing initialization
+ * @param[in] enabled Whether handles should be traced at all
+ * @param[in] chrome_folder Folder to save Chrome traces to when handles are detached, if any
+ * @returns 0 in case of success, a negative integer on errors */
+gint janus_trace_init(gboolean enabled, const char *chrome_folder);
+/*! \brief Tracing deinitialization */
+void janus_trace_deinit(void);
+///@}
+
+
+/** @name Janus tracing methods
+ */
+///@{
+/*! \brief Method to create a new trace
+ * @returns A new trace if tracing is enabled, NULL otherwise */
+janus_trace *janus_trace_create(void);
+/*! \brief Method to destroy a trace
+ * @param[in] trace The trace to destroy */
+void janus_trace_destroy(janus_trace *trace);
+/*! \brief Method to mark a phase in a trace
+ * \note Passing a NULL trace (e.g., because tracing is disabled) is allowed, and does nothing
+ * @param[in] trace The trace to update
+ * @param[in] phase The phase to mark
+ * @param[in] stream_id The libnice stream ID the phase refers to, if any (0 otherwise)
+ * @param[in] component_id The libnice component ID the phase refers to, if any (0 otherwise) */
+void janus_trace_mark(janus_trace *trace, janus_trace_phase phase, guint stream_id, guint component_id);
+/*! \brief Method to get a JSON representation of a trace
+ * \note Times are relative to the creation of the trace, in microseconds
+ * @param[in] trace The trace to convert
+ * @returns A JSON array of events (to be decref-ed by the caller) */
+json_t *janus_trace_to_json(janus_trace *trace);
+/*! \brief Method to save a trace in the Chrome trace event format, if a folder was configured
+ * @param[in] trace The trace to save
+ * @param[in] session_id The session the handle belongs to (used as pid)
+ * @param[in] handle_id The handle the trace belongs to (used as tid, and for the file name)
+ * @returns 0 in case of success (or if there was nothing to do), a negative integer on errors */
+gint janus_trace_save_chrome(janus_trace *trace, guint64 session_id, guint64 handle_id);
+///@}
+
+
+#endif
@@ -0,0 +1,370 @@
+/*! \file    writer.c
+ * \author   Lorenzo Miniero <lorenzo@meetecho.com>
+ * \copyright GNU Affero General Public License v3
+ * \brief    Asynchronous file writer
+ * \details  Implementation of a simple asynchronous file writer, meant to
+ * keep threads handling media from ever doing disk I/O when recording.
+ * Data is coalesced in large aligned blocks, which are handed to a
+ * dedicated I/O thread through a lock-free ring buffer (the same kind
+ * of ring the buffered logger uses).
+ *
+ * \ingroup core
+ * \ref core
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "writer.h"
+#include "debug.h"
+
+
+/* Ring buffer: must be a power of 2 */
+#define JANUS_WRITER_SLOTS		1024
+/* Alignment of blocks (for O_DIRECT) */
+#define JANUS_WRITER_ALIGNMENT	4096
+
+typedef struct janus_writer_slot {
+	/* Sequence number, used to know whether the slot is free or ready (see Vyukov's bounded queue) */
+	volatile gint sequence;
+	/* File the block belongs to */
+	janus_writer *writer;
+	/* Block to write, if any */
+	janus_writer_block *block;
+	/* Whether the file should be closed after this block */
+	gboolean close;
+} janus_writer_slot;
+
+static janus_writer_slot *slots = NULL;
+static volatile gint tail = 0;	/* Producers (any thread) */
+static gint head = 0;			/* Consumer (I/O thread) */
+static volatile gint producers = 0;	/* Threads that may be queueing something right now */
+static volatile gint running = 0, stopping = 0;
+static GThread *writer_thread = NULL;
+static janus_mutex writer_mutex = JANUS_MUTEX_INITIALIZER;
+
+
+static janus_writer_block *janus_writer_block_new(void) {
+	janus_writer_block *block = calloc(1, sizeof(janus_writer_block));
+	if(block == NULL)
+		return NULL;
+	if(posix_memalign((void **)&block->data, JANUS_WRITER_ALIGNMENT, JANUS_WRITER_BLOCK_SIZE) != 0) {
+		free(block);
+		return NULL;
+	}
+	block->length = 0;
+	return block;
+}
+
+static void janus_writer_block_free(janus_writer_block *block) {
+	if(block == NULL)
+		return;
+	free(block->data);
+	free(block);
+}
+
+
+/* Helper to write a whole block to a file (I/O thread only) */
+static void janus_writer_flush_block(janus_writer *writer, janus_writer_block *block) {
+	if(writer->fd < 0 || block == NULL || block->length == 0)
+		return;
+	if(writer->direct && (block->length % JANUS_WRITER_ALIGNMENT) != 0) {
+		/* O_DIRECT needs aligned sizes: this is the last block, write it normally */
+		fcntl(writer->fd, F_SETFL, fcntl(writer->fd, F_GETFL) & ~O_DIRECT);
+		writer->direct = FALSE;
+	}
+	size_t offset = 0;
+	while(offset < block->length) {
+		ssize_t res = write(writer->fd, block->data+offset, block->length-offset);
+		if(res < 0) {
+			if(errno == EINTR)
+				continue;
+			JANUS_DEBUG("Error writing to %s: %d (%s)\n", writer->filename, errno, strerror(errno));
+			close(writer->fd);
+			writer->fd = -1;
+			return;
+		}
+		offset += res;
+	}
+}
+
+/* Helper to close a file and free the writer (I/O thread only) */
+static void janus_writer_finalize(janus_writer *writer) {
+	if(writer->fd >= 0) {
+		fdatasync(writer->fd);
+		close(writer->fd);
+	}
+	if(writer->damaged) {
+		JANUS_DEBUG("Closed %s, which is truncated (the disk couldn't keep up)\n", writer->filename);
+	} else {
+		JANUS_LOG(LOG_VERB, "Closed %s (%"SCNu64" bytes)\n", writer->filename, writer->written);
+	}
+	if(writer->pending != NULL)
+		g_queue_free(writer->pending);
+	janus_mutex_destroy(&writer->mutex);
+	g_free(writer->filename);
+	free(writer);
+}
+
+/* Helper to consume the next slot of the ring, if ready (I/O thread only) */
+static gboolean janus_writer_consume(void) {
+	janus_writer_slot *slot = &slots[head & (JANUS_WRITER_SLOTS-1)];
+	if(g_atomic_int_get(&slot->sequence) != head+1)
+		return FALSE;
+	janus_writer *writer = slot->writer;
+	janus_writer_block *block = slot->block;
+	gboolean close_file = slot->close;
+	/* Make the slot available again */
+	g_atomic_int_set(&slot->sequence, head+JANUS_WRITER_SLOTS);
+	head++;
+	janus_writer_flush_block(writer, block);
+	janus_writer_block_free(block);
+	if(close_file)
+		janus_writer_finalize(writer);
+	return TRUE;
+}
+
+/* Helper to hand a block (and/or a close request) to the I/O thread */
+static gboolean janus_writer_queue(janus_writer *writer, janus_writer_block *block, gboolean close_file, gboolean wait) {
+	/* Let janus_writer_deinit know we're here before checking whether the
+	 * I/O thread is running: it waits for us before stopping the thread
+	 * and consuming what's left, so nothing we queue can get lost */
+	g_atomic_int_inc(&producers);
+	if(!g_atomic_int_get(&running)) {
+		g_atomic_int_dec_and_test(&producers);
+		/* No I/O thread (anymore?), just write synchronously */
+		janus_mutex_lock(&writer_mutex);
+		janus_writer_flush_block(writer, block);
+		janus_writer_block_free(block);
+		if(close_file)
+			janus_writer_finalize(writer);
+		janus_mutex_unlock(&writer_mutex);
+		return TRUE;
+	}
+	janus_writer_slot *slot = NULL;
+	gint position = g_atomic_int_get(&tail);
+	while(TRUE) {
+		slot = &slots[position & (JANUS_WRITER_SLOTS-1)];
+		gint diff = g_atomic_int_get(&slot->sequence) - position;
+		if(diff == 0) {
+			if(g_atomic_int_compare_and_exchange(&tail, position, position+1))
+				break;
+		} else if(diff < 0) {
+			/* The ring is full */
+			if(!wait) {
+				g_atomic_int_dec_and_test(&producers);
+				return FALSE;
+			}
+			g_usleep(1000);
+		}
+		position = g_atomic_int_get(&tail);
+	}
+	slot->writer = writer;
+	slot->block = block;
+	slot->close = close_file;
+	/* Done: let the I/O thread know the slot is ready */
+	g_atomic_int_set(&slot->sequence, position+1);
+	g_atomic_int_dec_and_test(&producers);
+	return TRUE;
+}
+
+
+/* Thread writing the blocks out */
+static void *janus_writer_thread(void *data) {
+	while(TRUE) {
+		if(!janus_writer_consume()) {
+			/* Nothing to write */
+			if(g_atomic_int_get(&stopping))
+				break;
+			g_usleep(5000);
+		}
+	}
+	return NULL;
+}
+
+
+/* Helper to start the I/O thread, if needed */
+static gint janus_writer_start(void) {
+	janus_mutex_lock(&writer_mutex);
+	if(writer_thread != NULL) {
+		janus_mutex_unlock(&writer_mutex);
+		return 0;
+	}
+	if(slots == NULL)
+		slots = calloc(JANUS_WRITER_SLOTS, sizeof(janus_writer_slot));
+	if(slots == NULL) {
+		janus_mutex_unlock(&writer_mutex);
+		JANUS_DEBUG("Memory error!\n");
+		return -1;
+	}
+	int i = 0;
+	for(i=0; i<JANUS_WRITER_SLOTS; i++)
+		slots[i].sequence = i;
+	head = 0;
+	tail = 0;
+	g_atomic_int_set(&stopping, 0);
+	GError *error = NULL;
+	writer_thread = g_thread_try_new("janus writer", janus_writer_thread, NULL, &error);
+	if(error != NULL) {
+		writer_thread = NULL;
+		janus_mutex_unlock(&writer_mutex);
+		JANUS_DEBUG("Got error %d (%s) trying to launch the writer thread...\n", error->code, error->message ? error->message : "??");
+		return -1;
+	}
+	/* Set with the lock held, so that janus_writer_deinit can't miss it */
+	g_atomic_int_set(&running, 1);
+	janus_mutex_unlock(&writer_mutex);
+	return 0;
+}
+
+void janus_writer_deinit(void) {
+	janus_mutex_lock(&writer_mutex);
+	if(writer_thread != NULL) {
+		/* Blocks will be written synchronously from now on */
+		g_atomic_int_set(&running, 0);
+		/* Wait for whoever was already queueing something (the thread is
+		 * still consuming, so those waiting for room will get it) */
+		while(g_atomic_int_get(&producers) > 0)
+			g_usleep(1000);
+		/* The thread only stops when there's nothing left to write */
+		g_atomic_int_set(&stopping, 1);
+		g_thread_join(writer_thread);
+		writer_thread = NULL;
+		/* Anything queued after the thread last checked */
+		while(janus_writer_consume());
+	}
+	janus_mutex_unlock(&writer_mutex);
+}
+
+
+janus_writer *janus_writer_open(const char *filename, gboolean direct) {
+	if(filename == NULL)
+		return NULL;
+	if(janus_writer_start() < 0)
+		return NULL;
+	int flags = O_WRONLY | O_CREAT | O_TRUNC;
+	int fd = open(filename, direct ? (flags | O_DIRECT) : flags, 0644);
+	if(fd < 0 && direct) {
+		/* Not all file systems support O_DIRECT */
+		JANUS_LOG(LOG_VERB, "Couldn't open %s with O_DIRECT, falling back to buffered writes\n", filename);
+		direct = FALSE;
+		fd = open(filename, flags, 0644);
+	}
+	if(fd < 0) {
+		JANUS_DEBUG("Couldn't open %s: %d (%s)\n", filename, errno, strerror(errno));
+		return NULL;
+	}
+	janus_writer *writer = calloc(1, sizeof(janus_writer));
+	if(writer == NULL) {
+		JANUS_DEBUG("Memory error!\n");
+		close(fd);
+		return NULL;
+	}
+	writer->filename = g_strdup(filename);
+	writer->fd = fd;
+	writer->direct = direct;
+	writer->block = NULL;
+	writer->pending = g_queue_new();
+	writer->damaged = FALSE;
+	writer->written = 0;
+	writer->closed = FALSE;
+	janus_mutex_init(&writer->mutex);
+	return writer;
+}
+
+/* Helper to hand the I/O thread the full blocks it had no room for, in order (writer mutex locked) */
+static void janus_writer_queue_pending(janus_writer *writer, gboolean wait) {
+	janus_writer_block *block = NULL;
+	while((block = g_queue_peek_head(writer->pending)) != NULL) {
+		if(!janus_writer_queue(writer, block, FALSE, wait))
+			return;
+		g_queue_pop_head(writer->pending);
+	}
+}
+
+/* Helper to give up on a file the I/O thread can't keep up with (writer mutex locked) */
+static void janus_writer_damage(janus_writer *writer) {
+	writer->damaged = TRUE;
+	janus_writer_block *block = NULL;
+	while((block = g_queue_pop_head(writer->pending)) != NULL) {
+		writer->written -= block->length;
+		janus_writer_block_free(block);
+	}
+	if(writer->block != NULL) {
+		writer->written -= writer->block->length;
+		janus_writer_block_free(writer->block);
+		writer->block = NULL;
+	}
+	JANUS_DEBUG("Recording %s is lagging too far behind (disk too slow?), truncating it at %"SCNu64" bytes\n",
+		writer->filename, writer->written);
+}
+
+gint janus_writer_write(janus_writer *writer, const void *data, size_t length) {
+	if(writer == NULL || data == NULL)
+		return -1;
+	const char *buffer = (const char *)data;
+	janus_mutex_lock(&writer->mutex);
+	if(writer->closed || writer->damaged) {
+		janus_mutex_unlock(&writer->mutex);
+		return -1;
+	}
+	/* Blocks we couldn't queue before go first */
+	janus_writer_queue_pending(writer, FALSE);
+	while(length > 0) {
+		if(writer->block == NULL) {
+			writer->block = janus_writer_block_new();
+			if(writer->block == NULL) {
+				janus_mutex_unlock(&writer->mutex);
+				JANUS_DEBUG("Memory error!\n");
+				return -1;
+			}
+		}
+		janus_writer_block *block = writer->block;
+		size_t room = JANUS_WRITER_BLOCK_SIZE - block->length;
+		size_t bytes = length < room ? length : room;
+		memcpy(block->data+block->length, buffer, bytes);
+		block->length += bytes;
+		writer->written += bytes;
+		buffer += bytes;
+		length -= bytes;
+		if(block->length == JANUS_WRITER_BLOCK_SIZE) {
+			/* Full block, hand it to the I/O thread (or keep it, if it has no room for it yet) */
+			writer->block = NULL;
+			if(g_queue_is_empty(writer->pending) && janus_writer_queue(writer, block, FALSE, FALSE))
+				continue;
+			g_queue_push_tail(writer->pending, block);
+			if(g_queue_get_length(writer->pending) > JANUS_WRITER_MAX_PENDING) {
+				/* Writing a file with holes in it is worse than truncating it */
+				janus_writer_damage(writer);
+				janus_mutex_unlock(&writer->mutex);
+				return -1;
+			}
+		}
+	}
+	janus_mutex_unlock(&writer->mutex);
+	return 0;
+}
+
+void janus_writer_close(janus_writer *writer) {
+	if(writer == NULL)
+		return;
+	janus_mutex_lock(&writer->mutex);
+	if(writer->closed) {
+		janus_mutex_unlock(&writer->mutex);
+		return;
+	}
+	writer->closed = TRUE;
+	/* Closing is not media critical, so we can wait for room for what's left */
+	janus_writer_queue_pending(writer, TRUE);
+	janus_writer_block *block = writer->block;
+	writer->block = NULL;
+	janus_mutex_unlock(&writer->mutex);
+	/* The close request must not get lost, so we wait for room if needed */
+	janus_writer_queue(writer, block, TRUE, TRUE);
+}
@@ -0,0 +1,101 @@
+/*! \file    writer.h
+ * \author   Lorenzo Miniero <lorenzo@meetecho.com>
+ * \copyright GNU Affero General Public License v3
+ * \brief    Asynchronous file writer (headers)
+ * \details  Implementation of a simple asynchronous file writer, meant to
+ * keep threads handling media from ever doing disk I/O when recording.
+ * Data is appended by the caller to a large aligned block owned by the
+ * file: when the block is full (or the file is closed) the block is
+ * handed to a dedicated I/O thread through a lock-free ring buffer, and
+ * the I/O thread takes care of writing it out, optionally bypassing the
+ * page cache (O_DIRECT). If the ring is full, blocks are kept by the file
+ * and queued again at the next write rather than waiting for room to be
+ * available, as a stalled disk should never stall media: if too many
+ * pile up, the file is marked as damaged, and what's been written so far
+ * is all it will contain. Files are synced to disk (fdatasync) by the
+ * I/O thread when they're closed.
+ * After the I/O thread has been stopped (e.g., when shutting down) blocks
+ * are written synchronously instead.
+ *
+ * \note Plugins use this code as well, through the symbols the gateway
+ * exports: there's a single I/O thread for the core and all plugins,
+ * started when the first file is opened and stopped by the core when
+ * shutting down (after the plugins have been closed), which is why
+ * plugins must never call janus_writer_deinit themselves.
+ *
+ * \ingroup core
+ * \ref core
+ */
+
+#ifndef _JANUS_WRITER_H
+#define _JANUS_WRITER_H
+
+#include <glib.h>
+
+#include "mutex.h"
+
+
+/*! \brief Size of the blocks data is coalesced in before being written */
+#define JANUS_WRITER_BLOCK_SIZE		65536
+/*! \brief Maximum number of full blocks a file can keep while the I/O thread can't take them */
+#define JANUS_WRITER_MAX_PENDING	32
+
+/*! \brief Block of data waiting to be written */
+typedef struct janus_writer_block {
+	/*! \brief Data (aligned, so that it can be written with O_DIRECT) */
+	char *data;
+	/*! \brief Bytes of data in the block */
+	size_t length;
+} janus_writer_block;
+
+/*! \brief File written asynchronously */
+typedef struct janus_writer {
+	/*! \brief Name of the file */
+	char *filename;
+	/*! \brief File descriptor (only used by the I/O thread) */
+	int fd;
+	/*! \brief Whether the file was opened with O_DIRECT */
+	gboolean direct;
+	/*! \brief Block currently being filled by the caller */
+	janus_writer_block *block;
+	/*! \brief Full blocks the I/O thread had no room for yet, in order */
+	GQueue *pending;
+	/*! \brief Whether blocks had to be given up on, and so the file is truncated */
+	gboolean damaged;
+	/*! \brief Bytes the caller appended so far */
+	guint64 written;
+	/*! \brief Whether the file has been closed by the caller */
+	gboolean closed;
+	/*! \brief Mutex to lock/unlock the block being filled */
+	janus_mutex mutex;
+} janus_writer;
+
+
+/** @name Janus asynchronous file writer
+ */
+///@{
+/*! \brief Method to open a file for writing (the file is truncated)
+ * \note The file is opened by the caller, so that errors can be reported
+ * immediately: this is the only call that accesses the disk, and so it
+ * should not be invoked by threads handling media
+ * @param[in] filename Path of the file to write
+ * @param[in] direct Whether writes should bypass the page cache (O_DIRECT), if the file system supports it
+ * @returns A new janus_writer instance in case of success, NULL otherwise */
+janus_writer *janus_writer_open(const char *filename, gboolean direct);
+/*! \brief Method to append data to a file (never blocks on disk I/O)
+ * @param[in] writer The file to write to
+ * @param[in] data The data to write
+ * @param[in] length The number of bytes to write
+ * @returns 0 in case of success, a negative integer otherwise (e.g., if the file is damaged) */
+gint janus_writer_write(janus_writer *writer, const void *data, size_t length);
+/*! \brief Method to close a file: pending data is written (and synced to
+ * disk) by the I/O thread, which then frees the writer
+ * \note The writer must not be used by the caller after this call
+ * @param[in] writer The file to close */
+void janus_writer_close(janus_writer *writer);
+/*! \brief Method to write all pending data and stop the I/O thread, if it was started */
+void janus_writer_deinit(void);
+///@}
+
+
+#endif